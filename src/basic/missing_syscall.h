@@ -520,3 +520,35 @@ static inline int missing_move_mount(
 
 #  define move_mount missing_move_mount
 #endif
+
+/* ======================================================================= */
+
+#if !HAVE_IO_URING_SETUP
+struct io_uring_params;
+
+static inline int missing_io_uring_setup(unsigned entries, struct io_uring_params *p) {
+#  if defined __NR_io_uring_setup && __NR_io_uring_setup >= 0
+        return syscall(__NR_io_uring_setup, entries, p);
+#  else
+        errno = ENOSYS;
+        return -1;
+#  endif
+}
+
+#  define io_uring_setup missing_io_uring_setup
+#endif
+
+/* ======================================================================= */
+
+#if !HAVE_IO_URING_ENTER
+static inline int missing_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+#  if defined __NR_io_uring_enter && __NR_io_uring_enter >= 0
+        return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+#  else
+        errno = ENOSYS;
+        return -1;
+#  endif
+}
+
+#  define io_uring_enter missing_io_uring_enter
+#endif
@@ -0,0 +1,141 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+
+/*
+ * Hierarchical Timer Wheel
+ * Orders nodes by a 64bit key, e.g. a time in µs, and allows access to the node with the smallest key.
+ * Keys are bucketed into slots on several levels, where the slots of level 0 are one tick wide, and those
+ * of each further level are as wide as all of the level below. Which level a key goes into is determined
+ * by the highest digit in which its tick differs from the base, hence insertion and removal are O(1),
+ * except that the slots of level 0 are kept sorted, as they need to be searched for the smallest key. Only
+ * keys that fall into the same tick are compared. When the nodes with the smallest keys are on a higher
+ * level, the base is moved to the beginning of their slot, and they are distributed over the levels below
+ * it. Since a node can only move down, this is O(1) amortized too.
+ *
+ * The base never moves past a queued key, hence all slots before the one of the base are empty, on every
+ * level. Keys before the base can still be queued later on. They go into the slot of the base on level 0,
+ * which is always looked at first.
+ */
+
+#include "alloc-util.h"
+#include "timer-wheel.h"
+#include "util.h"
+
+#define LEVEL_SHIFT(level) ((level) * TIMER_WHEEL_SLOT_BITS)
+#define DIGIT(tick, level) ((unsigned) ((tick) >> LEVEL_SHIFT(level)) & (TIMER_WHEEL_SLOTS - 1))
+
+TimerWheel *timer_wheel_new(void) {
+        return new0(TimerWheel, 1);
+}
+
+TimerWheel *timer_wheel_free(TimerWheel *w) {
+        /* The nodes are owned by the caller */
+        return mfree(w);
+}
+
+static unsigned slot_of(TimerWheel *w, uint64_t key) {
+        uint64_t tick = key >> TIMER_WHEEL_TICK_BITS;
+        unsigned level;
+
+        if (tick <= w->base)
+                return DIGIT(w->base, 0);
+
+        level = u64log2(tick ^ w->base) / TIMER_WHEEL_SLOT_BITS;
+        return level * TIMER_WHEEL_SLOTS + DIGIT(tick, level);
+}
+
+static void link_node(TimerWheel *w, TimerWheelNode *n) {
+        unsigned slot;
+
+        slot = slot_of(w, n->key);
+
+        if (slot < TIMER_WHEEL_SLOTS) {
+                TimerWheelNode *i, *prev = NULL;
+
+                /* Sorted, but equal keys are prepended, so that queueing many of them is cheap */
+                for (i = w->slots[slot]; i && i->key < n->key; i = i->nodes_next)
+                        prev = i;
+
+                LIST_INSERT_AFTER(nodes, w->slots[slot], prev, n);
+        } else
+                LIST_PREPEND(nodes, w->slots[slot], n);
+
+        w->occupied[slot / TIMER_WHEEL_SLOTS] |= UINT64_C(1) << (slot % TIMER_WHEEL_SLOTS);
+        n->position = slot + 1;
+}
+
+static void unlink_node(TimerWheel *w, TimerWheelNode *n) {
+        unsigned slot;
+
+        assert(n->position > 0);
+
+        slot = n->position - 1;
+
+        LIST_REMOVE(nodes, w->slots[slot], n);
+        if (!w->slots[slot])
+                w->occupied[slot / TIMER_WHEEL_SLOTS] &= ~(UINT64_C(1) << (slot % TIMER_WHEEL_SLOTS));
+
+        n->position = 0;
+}
+
+void timer_wheel_put(TimerWheel *w, TimerWheelNode *n, uint64_t key) {
+        assert(w);
+        assert(n);
+
+        if (n->position > 0) {
+                if (n->key == key)
+                        return;
+
+                unlink_node(w, n);
+        } else
+                w->n_nodes++;
+
+        n->key = key;
+        link_node(w, n);
+}
+
+void timer_wheel_remove(TimerWheel *w, TimerWheelNode *n) {
+        assert(n);
+
+        if (!w || n->position == 0)
+                return;
+
+        unlink_node(w, n);
+        w->n_nodes--;
+}
+
+TimerWheelNode *timer_wheel_peek(TimerWheel *w) {
+        if (!w || w->n_nodes == 0)
+                return NULL;
+
+        for (;;) {
+                TimerWheelNode *list;
+                unsigned level, slot;
+                uint64_t m = 0;
+
+                for (level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+                        m = w->occupied[level] & (UINT64_MAX << DIGIT(w->base, level));
+                        if (m != 0)
+                                break;
+                }
+                assert(m != 0);
+
+                slot = __builtin_ctzll(m);
+                if (level == 0)
+                        return w->slots[slot];
+
+                /* Move the base to the beginning of the slot, and distribute its nodes over the levels below */
+                w->base &= ~((UINT64_C(1) << LEVEL_SHIFT(level + 1)) - 1);
+                w->base |= (uint64_t) slot << LEVEL_SHIFT(level);
+
+                slot += level * TIMER_WHEEL_SLOTS;
+                list = TAKE_PTR(w->slots[slot]);
+                w->occupied[level] &= ~(UINT64_C(1) << (slot % TIMER_WHEEL_SLOTS));
+
+                while (list) {
+                        TimerWheelNode *n = list;
+
+                        LIST_REMOVE(nodes, list, n);
+                        link_node(w, n);
+                }
+        }
+}
@@ -0,0 +1,43 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+#pragma once
+
+#include <inttypes.h>
+#include <stddef.h>
+
+#include "list.h"
+#include "macro.h"
+
+/* Level 0 has one slot per tick, each further level has slots that are TIMER_WHEEL_SLOTS times as wide, and
+ * TIMER_WHEEL_LEVELS levels cover the whole 64bit range of keys. */
+#define TIMER_WHEEL_TICK_BITS 10U
+#define TIMER_WHEEL_SLOT_BITS 6U
+#define TIMER_WHEEL_SLOTS (1U << TIMER_WHEEL_SLOT_BITS)
+#define TIMER_WHEEL_LEVELS ((64U - TIMER_WHEEL_TICK_BITS + TIMER_WHEEL_SLOT_BITS - 1) / TIMER_WHEEL_SLOT_BITS)
+
+typedef struct TimerWheelNode TimerWheelNode;
+
+/* Embedded into the objects that are queued, all zeroes means not queued */
+struct TimerWheelNode {
+        uint64_t key;
+        unsigned position; /* slot + 1, or 0 if not queued */
+        LIST_FIELDS(TimerWheelNode, nodes);
+};
+
+typedef struct TimerWheel {
+        uint64_t base; /* the tick level 0 starts at */
+        size_t n_nodes;
+        uint64_t occupied[TIMER_WHEEL_LEVELS];
+        LIST_HEAD(TimerWheelNode, slots[TIMER_WHEEL_LEVELS * TIMER_WHEEL_SLOTS]);
+} TimerWheel;
+
+TimerWheel *timer_wheel_new(void);
+TimerWheel *timer_wheel_free(TimerWheel *w);
+DEFINE_TRIVIAL_CLEANUP_FUNC(TimerWheel*, timer_wheel_free);
+
+void timer_wheel_put(TimerWheel *w, TimerWheelNode *n, uint64_t key);
+void timer_wheel_remove(TimerWheel *w, TimerWheelNode *n);
+TimerWheelNode *timer_wheel_peek(TimerWheel *w);
+
+static inline size_t timer_wheel_size(TimerWheel *w) {
+        return w ? w->n_nodes : 0;
+}
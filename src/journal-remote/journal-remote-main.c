@@ -15,6 +15,7 @@
 #include "main-func.h"
 #include "memory-util.h"
 #include "parse-argument.h"
+#include "parse-util.h"
 #include "pretty-print.h"
 #include "process-util.h"
 #include "rlimit-util.h"
@@ -37,6 +38,7 @@ static const char* arg_listen_https = NULL;
 static char** arg_files = NULL; /* Do not free this. */
 static bool arg_compress = true;
 static bool arg_seal = false;
+static unsigned arg_threads = 1;
 static int http_socket = -1, https_socket = -1;
 static char** arg_gnutls_log = NULL;
 
@@ -149,7 +151,7 @@ static int dispatch_http_event(sd_event_source *event,
                                uint32_t revents,
                                void *userdata);
 
-static int request_meta(void **connection_cls, int fd, char *hostname) {
+static int request_meta(void **connection_cls, int fd, char *hostname, bool binary) {
         RemoteSource *source;
         Writer *writer;
         int r;
@@ -169,6 +171,16 @@ static int request_meta(void **connection_cls, int fd, char *hostname) {
                 return log_oom();
         }
 
+        if (binary) {
+                r = journal_importer_set_binary(&source->importer);
+                if (r < 0) {
+                        source->importer.name = NULL; /* still owned by the caller */
+                        source_free(source);
+                        return log_warning_errno(r, "Failed to set up binary format for source %s: %m",
+                                                 hostname);
+                }
+        }
+
         log_debug("Added RemoteSource as connection metadata %p", source);
 
         *connection_cls = source;
@@ -211,8 +223,12 @@ static int process_http_upload(
 
                 r = journal_importer_push_data(&source->importer,
                                                upload_data, *upload_data_size);
-                if (r < 0)
+                if (r == -ENOMEM)
                         return mhd_respond_oom(connection);
+                if (r < 0)
+                        /* Corrupted or oversized compressed data */
+                        return mhd_respondf(connection, r, MHD_HTTP_BAD_REQUEST,
+                                            "Failed to process data: %m");
 
                 *upload_data_size = 0;
         } else
@@ -268,7 +284,7 @@ static mhd_result request_handler(
         const char *header;
         int r, code, fd;
         _cleanup_free_ char *hostname = NULL;
-        bool chunked = false;
+        bool chunked = false, binary = false;
 
         assert(connection);
         assert(connection_cls);
@@ -289,9 +305,18 @@ static mhd_result request_handler(
                 return mhd_respond(connection, MHD_HTTP_NOT_FOUND, "Not found.");
 
         header = MHD_lookup_connection_value(connection, MHD_HEADER_KIND, "Content-Type");
-        if (!header || !streq(header, "application/vnd.fdo.journal"))
+#if HAVE_ZSTD
+        binary = streq_ptr(header, JOURNAL_BINARY_CONTENT_TYPE);
+#endif
+        if (!binary && !streq_ptr(header, "application/vnd.fdo.journal"))
                 return mhd_respond(connection, MHD_HTTP_UNSUPPORTED_MEDIA_TYPE,
-                                   "Content-Type: application/vnd.fdo.journal is required.");
+#if HAVE_ZSTD
+                                   "Content-Type: application/vnd.fdo.journal or "
+                                   JOURNAL_BINARY_CONTENT_TYPE " is required."
+#else
+                                   "Content-Type: application/vnd.fdo.journal is required."
+#endif
+                                   );
 
         header = MHD_lookup_connection_value(connection, MHD_HEADER_KIND, "Transfer-Encoding");
         if (header) {
@@ -351,7 +376,7 @@ static mhd_result request_handler(
 
         assert(hostname);
 
-        r = request_meta(connection_cls, fd, hostname);
+        r = request_meta(connection_cls, fd, hostname, binary);
         if (r == -ENOMEM)
                 return respond_oom(connection);
         else if (r < 0)
@@ -361,6 +386,46 @@ static mhd_result request_handler(
         return MHD_YES;
 }
 
+static int setup_microhttpd_events(RemoteServer *s, MHDDaemonWrapper *d) {
+        const union MHD_DaemonInfo *info;
+        int r, epoll_fd;
+
+        assert(s);
+        assert(d);
+
+        info = MHD_get_daemon_info(d->daemon, MHD_DAEMON_INFO_EPOLL_FD_LINUX_ONLY);
+        if (!info)
+                return log_error_errno(SYNTHETIC_ERRNO(EOPNOTSUPP),
+                                       "µhttp returned NULL daemon info");
+
+        epoll_fd = info->listen_fd;
+        if (epoll_fd < 0)
+                return log_error_errno(SYNTHETIC_ERRNO(EUCLEAN),
+                                       "µhttp epoll fd is invalid");
+
+        r = sd_event_add_io(s->events, &d->io_event,
+                            epoll_fd, EPOLLIN,
+                            dispatch_http_event, d);
+        if (r < 0)
+                return log_error_errno(r, "Failed to add event callback: %m");
+
+        r = sd_event_source_set_description(d->io_event, "io_event");
+        if (r < 0)
+                return log_error_errno(r, "Failed to set source name: %m");
+
+        r = sd_event_add_time(s->events, &d->timer_event,
+                              CLOCK_MONOTONIC, UINT64_MAX, 0,
+                              null_timer_event_handler, d);
+        if (r < 0)
+                return log_error_errno(r, "Failed to add timer_event: %m");
+
+        r = sd_event_source_set_description(d->timer_event, "timer_event");
+        if (r < 0)
+                return log_error_errno(r, "Failed to set source name: %m");
+
+        return 0;
+}
+
 static int setup_microhttpd_server(RemoteServer *s,
                                    int fd,
                                    const char *key,
@@ -375,6 +440,7 @@ static int setup_microhttpd_server(RemoteServer *s,
                 { MHD_OPTION_END},
                 { MHD_OPTION_END},
                 { MHD_OPTION_END},
+                { MHD_OPTION_END},
                 { MHD_OPTION_END}};
         int opts_pos = 4;
         int flags =
@@ -383,9 +449,8 @@ static int setup_microhttpd_server(RemoteServer *s,
                 MHD_USE_EPOLL |
                 MHD_USE_ITC;
 
-        const union MHD_DaemonInfo *info;
-        int r, epoll_fd;
         MHDDaemonWrapper *d;
+        int r;
 
         assert(fd >= 0);
 
@@ -422,7 +487,15 @@ static int setup_microhttpd_server(RemoteServer *s,
                                 {MHD_OPTION_HTTPS_MEM_TRUST, 0, (char*) trust};
         }
 
-        d = new(MHDDaemonWrapper, 1);
+        if (s->n_workers > 0) {
+                /* Let µhttpd run its own pool of threads, instead of the event loop */
+                opts[opts_pos++] = (struct MHD_OptionItem)
+                        {MHD_OPTION_THREAD_POOL_SIZE, (intptr_t) s->n_workers};
+
+                flags |= MHD_USE_INTERNAL_POLLING_THREAD;
+        }
+
+        d = new0(MHDDaemonWrapper, 1);
         if (!d)
                 return log_oom();
 
@@ -442,46 +515,10 @@ static int setup_microhttpd_server(RemoteServer *s,
         log_debug("Started MHD %s daemon on fd:%d (wrapper @ %p)",
                   key ? "HTTPS" : "HTTP", fd, d);
 
-        info = MHD_get_daemon_info(d->daemon, MHD_DAEMON_INFO_EPOLL_FD_LINUX_ONLY);
-        if (!info) {
-                log_error("µhttp returned NULL daemon info");
-                r = -EOPNOTSUPP;
-                goto error;
-        }
-
-        epoll_fd = info->listen_fd;
-        if (epoll_fd < 0) {
-                log_error("µhttp epoll fd is invalid");
-                r = -EUCLEAN;
-                goto error;
-        }
-
-        r = sd_event_add_io(s->events, &d->io_event,
-                            epoll_fd, EPOLLIN,
-                            dispatch_http_event, d);
-        if (r < 0) {
-                log_error_errno(r, "Failed to add event callback: %m");
-                goto error;
-        }
-
-        r = sd_event_source_set_description(d->io_event, "io_event");
-        if (r < 0) {
-                log_error_errno(r, "Failed to set source name: %m");
-                goto error;
-        }
-
-        r = sd_event_add_time(s->events, &d->timer_event,
-                              CLOCK_MONOTONIC, UINT64_MAX, 0,
-                              null_timer_event_handler, d);
-        if (r < 0) {
-                log_error_errno(r, "Failed to add timer_event: %m");
-                goto error;
-        }
-
-        r = sd_event_source_set_description(d->timer_event, "timer_event");
-        if (r < 0) {
-                log_error_errno(r, "Failed to set source name: %m");
-                goto error;
+        if (s->n_workers == 0) {
+                r = setup_microhttpd_events(s, d);
+                if (r < 0)
+                        goto error;
         }
 
         r = hashmap_ensure_put(&s->daemons, &uint64_hash_ops, &d->fd, d);
@@ -498,6 +535,8 @@ static int setup_microhttpd_server(RemoteServer *s,
         return 0;
 
 error:
+        sd_event_source_unref(d->io_event);
+        sd_event_source_unref(d->timer_event);
         MHD_stop_daemon(d->daemon);
         free(d->daemon);
         free(d);
@@ -600,6 +639,12 @@ static int create_remoteserver(
         if (r < 0)
                 return r;
 
+        if (arg_threads > 1) {
+                r = journal_remote_server_start_workers(s, arg_threads);
+                if (r < 0)
+                        return r;
+        }
+
         r = setup_signals(s);
         if (r < 0)
                 return log_error_errno(r, "Failed to set up signals: %m");
@@ -801,6 +846,7 @@ static int help(void) {
                "     --gnutls-log=CATEGORY...\n"
                "                            Specify a list of gnutls logging categories\n"
                "     --split-mode=none|host How many output files to create\n"
+               "     --threads=N            Number of threads to process sources with\n"
                "\nNote: file descriptors from sd_listen_fds() will be consumed, too.\n"
                "\nSee the %s for details.\n",
                program_invocation_short_name,
@@ -824,6 +870,7 @@ static int parse_argv(int argc, char *argv[]) {
                 ARG_CERT,
                 ARG_TRUST,
                 ARG_GNUTLS_LOG,
+                ARG_THREADS,
         };
 
         static const struct option options[] = {
@@ -842,6 +889,7 @@ static int parse_argv(int argc, char *argv[]) {
                 { "cert",         required_argument, NULL, ARG_CERT         },
                 { "trust",        required_argument, NULL, ARG_TRUST        },
                 { "gnutls-log",   required_argument, NULL, ARG_GNUTLS_LOG   },
+                { "threads",      required_argument, NULL, ARG_THREADS      },
                 {}
         };
 
@@ -977,6 +1025,15 @@ static int parse_argv(int argc, char *argv[]) {
                                 return r;
                         break;
 
+                case ARG_THREADS:
+                        r = safe_atou(optarg, &arg_threads);
+                        if (r < 0)
+                                return log_error_errno(r, "Failed to parse --threads= argument: %s", optarg);
+                        if (arg_threads == 0)
+                                return log_error_errno(SYNTHETIC_ERRNO(EINVAL),
+                                                       "Number of threads must be positive.");
+                        break;
+
                 case ARG_GNUTLS_LOG:
 #if HAVE_GNUTLS
                         for (const char* p = optarg;;) {
@@ -5,15 +5,22 @@
 
 #include "journal-importer.h"
 #include "journal-remote-write.h"
+#include "list.h"
 
-typedef struct RemoteSource {
+typedef struct RemoteSource RemoteSource;
+
+struct RemoteSource {
         JournalImporter importer;
 
         Writer *writer;
 
         sd_event_source *event;
         sd_event_source *buffer_event;
-} RemoteSource;
+
+        /* While a worker thread processes the source, and the result when it hands it back */
+        LIST_FIELDS(RemoteSource, queue);
+        int result;
+};
 
 RemoteSource* source_new(int fd, bool passive_fd, char *name, Writer *writer);
 void source_free(RemoteSource *source);
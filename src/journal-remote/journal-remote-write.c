@@ -28,6 +28,8 @@ Writer* writer_new(RemoteServer *server) {
         if (!w->mmap)
                 return mfree(w);
 
+        assert_se(pthread_mutex_init(&w->lock, NULL) == 0);
+
         w->n_ref = 1;
         w->server = server;
 
@@ -43,30 +45,84 @@ static Writer* writer_free(Writer *w) {
                 journal_file_close(w->journal);
         }
 
-        if (w->server && w->hashmap_key)
-                hashmap_remove(w->server->writers, w->hashmap_key);
-
         free(w->hashmap_key);
 
         if (w->mmap)
                 mmap_cache_unref(w->mmap);
 
+        (void) pthread_mutex_destroy(&w->lock);
+
         return mfree(w);
 }
 
-DEFINE_TRIVIAL_REF_UNREF_FUNC(Writer, writer, writer_free);
+/* Writers are looked up and released from the worker threads and µhttpd's threads too, hence the reference
+ * counter is protected by the same lock as the server's hashmap of writers. When the last reference is
+ * dropped, the file is closed without the lock held, but the writer stays in the hashmap marked busy until
+ * then, so that nobody opens the same file again in the meantime. */
 
-int writer_write(Writer *w,
-                 struct iovec_wrapper *iovw,
-                 dual_timestamp *ts,
-                 sd_id128_t *boot_id,
-                 bool compress,
-                 bool seal) {
-        int r;
+Writer* writer_ref(Writer *w) {
+        if (!w)
+                return NULL;
 
-        assert(w);
-        assert(iovw);
-        assert(iovw->count > 0);
+        if (w->server)
+                assert_se(pthread_mutex_lock(&w->server->writers_lock) == 0);
+
+        assert(w->n_ref > 0);
+        w->n_ref++;
+
+        if (w->server)
+                assert_se(pthread_mutex_unlock(&w->server->writers_lock) == 0);
+
+        return w;
+}
+
+Writer* writer_unref(Writer *w) {
+        RemoteServer *s;
+
+        if (!w)
+                return NULL;
+
+        s = w->server;
+        if (!s) {
+                assert(w->n_ref > 0);
+                if (--w->n_ref == 0)
+                        writer_free(w);
+
+                return NULL;
+        }
+
+        assert_se(pthread_mutex_lock(&s->writers_lock) == 0);
+
+        assert(w->n_ref > 0);
+        if (--w->n_ref > 0) {
+                assert_se(pthread_mutex_unlock(&s->writers_lock) == 0);
+                return NULL;
+        }
+
+        w->busy = true;
+        assert_se(pthread_mutex_unlock(&s->writers_lock) == 0);
+
+        if (w->journal) {
+                log_debug("Closing journal file %s.", w->journal->path);
+                w->journal = journal_file_close(w->journal);
+        }
+
+        assert_se(pthread_mutex_lock(&s->writers_lock) == 0);
+        assert_se(hashmap_remove_value(s->writers, w->key, w));
+        assert_se(pthread_cond_broadcast(&s->writers_cond) == 0);
+        assert_se(pthread_mutex_unlock(&s->writers_lock) == 0);
+
+        return writer_free(w);
+}
+
+static int writer_write_locked(
+                Writer *w,
+                struct iovec_wrapper *iovw,
+                dual_timestamp *ts,
+                sd_id128_t *boot_id,
+                bool compress,
+                bool seal) {
+        int r;
 
         if (journal_file_rotate_suggested(w->journal, 0)) {
                 log_info("%s: Journal header limits reached or header out-of-date, rotating",
@@ -81,7 +137,7 @@ int writer_write(Writer *w,
                                       &w->seqnum, NULL, NULL);
         if (r >= 0) {
                 if (w->server)
-                        w->server->event_count += 1;
+                        __sync_fetch_and_add(&w->server->event_count, 1);
                 return 0;
         } else if (r == -EBADMSG)
                 return r;
@@ -101,6 +157,25 @@ int writer_write(Writer *w,
                 return r;
 
         if (w->server)
-                w->server->event_count += 1;
+                __sync_fetch_and_add(&w->server->event_count, 1);
         return 0;
 }
+
+int writer_write(Writer *w,
+                 struct iovec_wrapper *iovw,
+                 dual_timestamp *ts,
+                 sd_id128_t *boot_id,
+                 bool compress,
+                 bool seal) {
+        int r;
+
+        assert(w);
+        assert(iovw);
+        assert(iovw->count > 0);
+
+        assert_se(pthread_mutex_lock(&w->lock) == 0);
+        r = writer_write_locked(w, iovw, ts, boot_id, compress, seal);
+        assert_se(pthread_mutex_unlock(&w->lock) == 0);
+
+        return r;
+}
@@ -1,6 +1,8 @@
 /* SPDX-License-Identifier: LGPL-2.1-or-later */
 #pragma once
 
+#include <pthread.h>
+
 #include "journal-file.h"
 #include "journal-importer.h"
 
@@ -13,10 +15,16 @@ typedef struct Writer {
         MMapCache *mmap;
         RemoteServer *server;
         char *hashmap_key;
+        const void *key;        /* The key in the server's hashmap of writers, hashmap_key or a static string */
 
         uint64_t seqnum;
 
+        /* Serializes writes, and picks the worker thread that processes the sources writing here */
+        pthread_mutex_t lock;
+        size_t shard;
+
         unsigned n_ref;
+        bool busy;      /* The journal file is being opened or closed, without the server's writers_lock held */
 } Writer;
 
 Writer* writer_new(RemoteServer* server);
@@ -2,7 +2,10 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdlib.h>
+#include <sys/eventfd.h>
 #include <sys/prctl.h>
 #include <stdint.h>
 
@@ -28,6 +31,9 @@
 
 #define REMOTE_JOURNAL_PATH "/var/log/journal/remote"
 
+/* How many entries a worker takes from one source before it moves on to the next one */
+#define WORKER_ENTRIES_MAX 1024U
+
 #define filename_escape(s) xescape((s), "/ ")
 
 static int open_output(RemoteServer *s, Writer *w, const char* host) {
@@ -113,31 +119,70 @@ int journal_remote_get_writer(RemoteServer *s, const char *host, Writer **writer
                 assert_not_reached();
         }
 
-        w = hashmap_get(s->writers, key);
-        if (w)
-                writer_ref(w);
-        else {
-                w = writer_new(s);
-                if (!w)
-                        return log_oom();
+        assert_se(pthread_mutex_lock(&s->writers_lock) == 0);
+
+        /* If another thread is opening or closing the file right now, wait until it is done */
+        for (;;) {
+                w = hashmap_get(s->writers, key);
+                if (!w || !w->busy)
+                        break;
+
+                assert_se(pthread_cond_wait(&s->writers_cond, &s->writers_lock) == 0);
+        }
+
+        if (w) {
+                /* We hold the lock already, hence not writer_ref() */
+                w->n_ref++;
+                assert_se(pthread_mutex_unlock(&s->writers_lock) == 0);
+
+                *writer = TAKE_PTR(w);
+                return 0;
+        }
 
-                if (s->split_mode == JOURNAL_WRITE_SPLIT_HOST) {
-                        w->hashmap_key = strdup(key);
-                        if (!w->hashmap_key)
-                                return log_oom();
+        /* The server is only set once the writer is in the hashmap, so that dropping it on failure does not
+         * take the lock again */
+        w = writer_new(NULL);
+        if (!w) {
+                assert_se(pthread_mutex_unlock(&s->writers_lock) == 0);
+                return log_oom();
+        }
+
+        if (s->split_mode == JOURNAL_WRITE_SPLIT_HOST) {
+                w->hashmap_key = strdup(key);
+                if (!w->hashmap_key) {
+                        assert_se(pthread_mutex_unlock(&s->writers_lock) == 0);
+                        return log_oom();
                 }
+        }
 
-                r = open_output(s, w, host);
-                if (r < 0)
-                        return r;
+        w->key = w->hashmap_key ?: key;
 
-                r = hashmap_put(s->writers, w->hashmap_key ?: key, w);
-                if (r < 0)
-                        return r;
+        r = hashmap_put(s->writers, w->key, w);
+        if (r < 0) {
+                assert_se(pthread_mutex_unlock(&s->writers_lock) == 0);
+                return r;
         }
 
-        *writer = TAKE_PTR(w);
+        /* Other threads asking for the same writer wait until the file is open, see above */
+        w->busy = true;
+        assert_se(pthread_mutex_unlock(&s->writers_lock) == 0);
 
+        r = open_output(s, w, host);
+
+        assert_se(pthread_mutex_lock(&s->writers_lock) == 0);
+        w->busy = false;
+        if (r < 0)
+                assert_se(hashmap_remove_value(s->writers, w->key, w));
+        else {
+                w->server = s;
+                w->shard = s->n_writers_created++;
+        }
+        assert_se(pthread_cond_broadcast(&s->writers_cond) == 0);
+        assert_se(pthread_mutex_unlock(&s->writers_lock) == 0);
+        if (r < 0)
+                return r;
+
+        *writer = TAKE_PTR(w);
         return 0;
 }
 
@@ -312,6 +357,11 @@ int journal_remote_server_init(
         assert(journal_remote_server_global == NULL);
         journal_remote_server_global = s;
 
+        assert_se(pthread_mutex_init(&s->writers_lock, NULL) == 0);
+        assert_se(pthread_cond_init(&s->writers_cond, NULL) == 0);
+        assert_se(pthread_mutex_init(&s->done_lock, NULL) == 0);
+        s->done_fd = -1;
+
         s->split_mode = split_mode;
         s->compress = compress;
         s->seal = seal;
@@ -345,6 +395,35 @@ static void MHDDaemonWrapper_free(MHDDaemonWrapper *d) {
 }
 #endif
 
+static void stop_workers(RemoteServer *s) {
+        assert(s);
+
+        for (size_t i = 0; i < s->n_workers; i++) {
+                RemoteWorker *w = s->workers + i;
+
+                assert_se(pthread_mutex_lock(&w->lock) == 0);
+                w->stop = true;
+                assert_se(pthread_cond_signal(&w->cond) == 0);
+                assert_se(pthread_mutex_unlock(&w->lock) == 0);
+        }
+
+        for (size_t i = 0; i < s->n_workers; i++) {
+                RemoteWorker *w = s->workers + i;
+
+                (void) pthread_join(w->thread, NULL);
+                (void) pthread_cond_destroy(&w->cond);
+                (void) pthread_mutex_destroy(&w->lock);
+        }
+
+        /* The sources that were queued or handed back are still in s->sources, and freed with those */
+        s->workers = mfree(s->workers);
+        s->n_workers = 0;
+        s->done = NULL;
+
+        s->done_event = sd_event_source_unref(s->done_event);
+        s->done_fd = safe_close(s->done_fd);
+}
+
 void journal_remote_server_destroy(RemoteServer *s) {
         size_t i;
 
@@ -352,6 +431,9 @@ void journal_remote_server_destroy(RemoteServer *s) {
         hashmap_free_with_destructor(s->daemons, MHDDaemonWrapper_free);
 #endif
 
+        if (s->workers)
+                stop_workers(s);
+
         for (i = 0; i < MALLOC_ELEMENTSOF(s->sources); i++)
                 remove_source(s, i);
         free(s->sources);
@@ -359,6 +441,10 @@ void journal_remote_server_destroy(RemoteServer *s) {
         writer_unref(s->_single_writer);
         hashmap_free(s->writers);
 
+        (void) pthread_cond_destroy(&s->writers_cond);
+        (void) pthread_mutex_destroy(&s->writers_lock);
+        (void) pthread_mutex_destroy(&s->done_lock);
+
         sd_event_source_unref(s->sigterm_event);
         sd_event_source_unref(s->sigint_event);
         sd_event_source_unref(s->listen_event);
@@ -374,24 +460,15 @@ void journal_remote_server_destroy(RemoteServer *s) {
  **********************************************************************
  **********************************************************************/
 
-int journal_remote_handle_raw_source(
-                sd_event_source *event,
-                int fd,
-                uint32_t revents,
-                RemoteServer *s) {
-
-        RemoteSource *source;
+/* Returns 1 if there might be more data pending, 0 if data is currently exhausted, negative if the source
+ * is done with and shall be removed. Only touches the source and its writer, so that it may be called from
+ * the worker threads. */
+static int process_raw_source(RemoteSource *source, bool compress, bool seal) {
         int r;
 
-        /* Returns 1 if there might be more data pending,
-         * 0 if data is currently exhausted, negative on error.
-         */
-
-        assert(fd >= 0 && fd < (ssize_t) MALLOC_ELEMENTSOF(s->sources));
-        source = s->sources[fd];
-        assert(source->importer.fd == fd);
+        assert(source);
 
-        r = process_source(source, s->compress, s->seal);
+        r = process_source(source, compress, seal);
         if (journal_importer_eof(&source->importer)) {
                 size_t remaining;
 
@@ -401,9 +478,7 @@ int journal_remote_handle_raw_source(
                 remaining = journal_importer_bytes_remaining(&source->importer);
                 if (remaining > 0)
                         log_notice("Premature EOF. %zu bytes lost.", remaining);
-                remove_source(s, source->importer.fd);
-                log_debug("%zu active sources remaining", s->active);
-                return 0;
+                return -EPIPE;
         } else if (r == -E2BIG) {
                 log_notice("Entry with too many fields, skipped");
                 return 1;
@@ -412,12 +487,188 @@ int journal_remote_handle_raw_source(
                 return 1;
         } else if (r == -EAGAIN) {
                 return 0;
-        } else if (r < 0) {
-                log_debug_errno(r, "Closing connection: %m");
+        } else if (r < 0)
+                return log_debug_errno(r, "Closing connection: %m");
+        else
+                return 1;
+}
+
+int journal_remote_handle_raw_source(
+                sd_event_source *event,
+                int fd,
+                uint32_t revents,
+                RemoteServer *s) {
+
+        RemoteSource *source;
+        int r;
+
+        /* Returns 1 if there might be more data pending,
+         * 0 if data is currently exhausted, negative on error.
+         */
+
+        assert(fd >= 0 && fd < (ssize_t) MALLOC_ELEMENTSOF(s->sources));
+        source = s->sources[fd];
+        assert(source->importer.fd == fd);
+
+        r = process_raw_source(source, s->compress, s->seal);
+        if (r < 0) {
                 remove_source(s, fd);
+                log_debug("%zu active sources remaining", s->active);
                 return 0;
-        } else
-                return 1;
+        }
+
+        return r;
+}
+
+/**********************************************************************
+ **********************************************************************
+ **********************************************************************/
+
+static void worker_enqueue(RemoteWorker *w, RemoteSource *source) {
+        assert(w);
+        assert(source);
+
+        assert_se(pthread_mutex_lock(&w->lock) == 0);
+        LIST_APPEND(queue, w->queue, source);
+        assert_se(pthread_cond_signal(&w->cond) == 0);
+        assert_se(pthread_mutex_unlock(&w->lock) == 0);
+}
+
+static void* worker_thread(void *p) {
+        RemoteWorker *w = p;
+        RemoteServer *s;
+
+        assert(w);
+        s = w->server;
+
+        for (;;) {
+                RemoteSource *source;
+                int r = 1;
+
+                assert_se(pthread_mutex_lock(&w->lock) == 0);
+                while (!w->queue && !w->stop)
+                        assert_se(pthread_cond_wait(&w->cond, &w->lock) == 0);
+
+                if (w->stop) {
+                        assert_se(pthread_mutex_unlock(&w->lock) == 0);
+                        break;
+                }
+
+                source = w->queue;
+                LIST_REMOVE(queue, w->queue, source);
+                assert_se(pthread_mutex_unlock(&w->lock) == 0);
+
+                for (unsigned n = 0; n < WORKER_ENTRIES_MAX && r == 1; n++)
+                        r = process_raw_source(source, s->compress, s->seal);
+
+                if (r == 1) {
+                        /* There's more, but let the other sources have their turn first */
+                        worker_enqueue(w, source);
+                        continue;
+                }
+
+                /* Hand the source back to the main thread, which removes it or watches it again */
+                source->result = r;
+
+                assert_se(pthread_mutex_lock(&s->done_lock) == 0);
+                LIST_PREPEND(queue, s->done, source);
+                assert_se(pthread_mutex_unlock(&s->done_lock) == 0);
+
+                (void) eventfd_write(s->done_fd, 1);
+        }
+
+        return NULL;
+}
+
+static int dispatch_done_event(sd_event_source *event,
+                               int fd,
+                               uint32_t revents,
+                               void *userdata) {
+        RemoteServer *s = userdata;
+        RemoteSource *done;
+        eventfd_t x;
+        int r;
+
+        assert(s);
+
+        (void) eventfd_read(fd, &x);
+
+        assert_se(pthread_mutex_lock(&s->done_lock) == 0);
+        done = TAKE_PTR(s->done);
+        assert_se(pthread_mutex_unlock(&s->done_lock) == 0);
+
+        while (done) {
+                RemoteSource *source = done;
+
+                LIST_REMOVE(queue, done, source);
+
+                if (source->result >= 0) {
+                        r = sd_event_source_set_enabled(source->event, SD_EVENT_ON);
+                        if (r >= 0)
+                                continue;
+
+                        log_error_errno(r, "Failed to enable event source for fd:%d: %m", source->importer.fd);
+                }
+
+                remove_source(s, source->importer.fd);
+                log_debug("%zu active sources remaining", s->active);
+        }
+
+        return 0;
+}
+
+int journal_remote_server_start_workers(RemoteServer *s, size_t n_workers) {
+        sigset_t ss, saved_ss;
+        int r;
+
+        assert(s);
+        assert(!s->workers);
+        assert(n_workers > 0);
+
+        s->workers = new0(RemoteWorker, n_workers);
+        if (!s->workers)
+                return log_oom();
+
+        s->done_fd = eventfd(0, EFD_CLOEXEC|EFD_NONBLOCK);
+        if (s->done_fd < 0)
+                return log_error_errno(errno, "Failed to create eventfd: %m");
+
+        r = sd_event_add_io(s->events, &s->done_event,
+                            s->done_fd, EPOLLIN,
+                            dispatch_done_event, s);
+        if (r < 0)
+                return log_error_errno(r, "Failed to add event source for workers: %m");
+
+        (void) sd_event_source_set_description(s->done_event, "worker-done");
+
+        /* Leave all signals to the main thread */
+        assert_se(sigfillset(&ss) >= 0);
+        r = pthread_sigmask(SIG_BLOCK, &ss, &saved_ss);
+        if (r > 0)
+                return log_error_errno(r, "Failed to block signals: %m");
+
+        for (; s->n_workers < n_workers; s->n_workers++) {
+                RemoteWorker *w = s->workers + s->n_workers;
+
+                w->server = s;
+                assert_se(pthread_mutex_init(&w->lock, NULL) == 0);
+                assert_se(pthread_cond_init(&w->cond, NULL) == 0);
+
+                r = pthread_create(&w->thread, NULL, worker_thread, w);
+                if (r > 0) {
+                        (void) pthread_cond_destroy(&w->cond);
+                        (void) pthread_mutex_destroy(&w->lock);
+                        break;
+                }
+        }
+
+        (void) pthread_sigmask(SIG_SETMASK, &saved_ss, NULL);
+
+        if (r > 0)
+                return log_error_errno(r, "Failed to start worker thread: %m");
+
+        log_debug("Started %zu worker threads.", s->n_workers);
+        return 0;
 }
 
 static int dispatch_raw_source_until_block(sd_event_source *event,
@@ -443,12 +694,23 @@ static int dispatch_raw_source_event(sd_event_source *event,
                                      uint32_t revents,
                                      void *userdata) {
         RemoteSource *source = userdata;
+        RemoteServer *s = journal_remote_server_global;
         int r;
 
         assert(source->event);
         assert(source->buffer_event);
 
-        r = journal_remote_handle_raw_source(event, fd, EPOLLIN, journal_remote_server_global);
+        if (s->n_workers > 0) {
+                /* Stop watching the source until the worker that owns its writer has drained it */
+                r = sd_event_source_set_enabled(event, SD_EVENT_OFF);
+                if (r < 0)
+                        return log_error_errno(r, "Failed to disable event source for fd:%d: %m", fd);
+
+                worker_enqueue(s->workers + source->writer->shard % s->n_workers, source);
+                return 1;
+        }
+
+        r = journal_remote_handle_raw_source(event, fd, EPOLLIN, s);
         if (r == 1)
                 /* Might have more data. We need to rerun the handler
                  * until we are sure the buffer is exhausted. */
@@ -1,9 +1,12 @@
 /* SPDX-License-Identifier: LGPL-2.1-or-later */
 #pragma once
 
+#include <pthread.h>
+
 #include "sd-event.h"
 
 #include "hashmap.h"
+#include "list.h"
 #include "journal-remote-parse.h"
 #include "journal-remote-write.h"
 
@@ -21,6 +24,18 @@ struct MHDDaemonWrapper {
 };
 #endif
 
+typedef struct RemoteWorker RemoteWorker;
+
+struct RemoteWorker {
+        RemoteServer *server;
+        pthread_t thread;
+
+        pthread_mutex_t lock;
+        pthread_cond_t cond;
+        LIST_HEAD(RemoteSource, queue);        /* sources with data pending */
+        bool stop;
+};
+
 struct RemoteServer {
         RemoteSource **sources;
         size_t active;
@@ -28,10 +43,22 @@ struct RemoteServer {
         sd_event *events;
         sd_event_source *sigterm_event, *sigint_event, *listen_event;
 
+        pthread_mutex_t writers_lock;          /* protects 'writers' and the reference counters of the writers */
+        pthread_cond_t writers_cond;           /* signalled when a writer is done opening or closing its file */
         Hashmap *writers;
         Writer *_single_writer;
+        size_t n_writers_created;
         uint64_t event_count;
 
+        /* If there are workers, raw sources are processed in those threads. Each writer belongs to one
+         * worker, which processes all sources writing to it, so that the writers do not contend. */
+        RemoteWorker *workers;
+        size_t n_workers;
+        pthread_mutex_t done_lock;
+        LIST_HEAD(RemoteSource, done);         /* sources handed back to the main thread */
+        int done_fd;
+        sd_event_source *done_event;
+
 #if HAVE_MICROHTTPD
         Hashmap *daemons;
 #endif
@@ -51,6 +78,8 @@ int journal_remote_server_init(
                 bool compress,
                 bool seal);
 
+int journal_remote_server_start_workers(RemoteServer *s, size_t n_workers);
+
 int journal_remote_get_writer(RemoteServer *s, const char *host, Writer **writer);
 
 int journal_remote_add_source(RemoteServer *s, int fd, char* name, bool own_name);
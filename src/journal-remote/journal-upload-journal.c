@@ -250,6 +250,111 @@ static void check_update_watchdog(Uploader *u) {
         }
 }
 
+static int encode_entry(Uploader *u) {
+        dual_timestamp ts;
+        sd_id128_t boot_id;
+        const void *data;
+        size_t length;
+        int r;
+
+        assert(u);
+
+        u->current_cursor = mfree(u->current_cursor);
+
+        r = sd_journal_get_cursor(u->journal, &u->current_cursor);
+        if (r < 0)
+                return log_error_errno(r, "Failed to get cursor: %m");
+
+        r = sd_journal_get_realtime_usec(u->journal, &ts.realtime);
+        if (r < 0)
+                return log_error_errno(r, "Failed to get realtime timestamp: %m");
+
+        r = sd_journal_get_monotonic_usec(u->journal, &ts.monotonic, &boot_id);
+        if (r < 0)
+                return log_error_errno(r, "Failed to get monotonic timestamp: %m");
+
+        r = journal_binary_encoder_begin_entry(u->encoder, &ts, boot_id);
+        if (r < 0)
+                return log_error_errno(r, "Failed to encode entry: %m");
+
+        /* Unlike in the export format, _BOOT_ID= is sent as a field like any other. The data is only valid
+         * until the next field is enumerated, hence it is copied right away. */
+        SD_JOURNAL_FOREACH_DATA(u->journal, data, length) {
+                r = journal_binary_encoder_add_field(u->encoder, data, length);
+                if (r < 0)
+                        return log_error_errno(r, "Failed to encode field: %m");
+        }
+
+        r = journal_binary_encoder_end_entry(u->encoder);
+        if (r < 0)
+                return log_error_errno(r, "Failed to encode entry: %m");
+
+        u->entries_sent++;
+        return 0;
+}
+
+static size_t journal_input_callback_binary(void *buf, size_t size, Uploader *u) {
+        size_t filled = 0;
+        int r;
+
+        assert(u);
+
+        while (filled < size) {
+                size_t n;
+
+                n = journal_binary_encoder_read(u->encoder, (uint8_t*) buf + filled, size - filled);
+                if (n > 0) {
+                        filled += n;
+                        continue;
+                }
+
+                /* Everything was handed out, continue with the next entry. The compressor may well swallow
+                 * a few entries before it produces any output. */
+                if (u->encoder_done) {
+                        u->uploading = false;
+                        break;
+                }
+
+                if (u->entry_state == ENTRY_DONE) {
+                        r = sd_journal_next(u->journal);
+                        if (r < 0) {
+                                log_error_errno(r, "Failed to move to next entry in journal: %m");
+                                return CURL_READFUNC_ABORT;
+                        }
+                        if (r == 0) {
+                                if (u->input_event)
+                                        log_debug("No more entries, waiting for journal.");
+                                else {
+                                        log_info("No more entries, closing journal.");
+                                        close_journal_input(u);
+                                }
+
+                                r = journal_binary_encoder_end(u->encoder);
+                                if (r < 0) {
+                                        log_error_errno(r, "Failed to finish compressed stream: %m");
+                                        return CURL_READFUNC_ABORT;
+                                }
+
+                                u->encoder_done = true;
+                                continue;
+                        }
+
+                        u->entry_state = ENTRY_CURSOR;
+                }
+
+                r = encode_entry(u);
+                if (r < 0)
+                        return CURL_READFUNC_ABORT;
+
+                u->entry_state = ENTRY_DONE;
+
+                log_debug("Entry %zu (%s) has been uploaded.",
+                          u->entries_sent, u->current_cursor);
+        }
+
+        return filled;
+}
+
 static size_t journal_input_callback(void *buf, size_t size, size_t nmemb, void *userp) {
         Uploader *u = userp;
         int r;
@@ -262,6 +367,9 @@ static size_t journal_input_callback(void *buf, size_t size, size_t nmemb, void
 
         check_update_watchdog(u);
 
+        if (u->binary)
+                return journal_input_callback_binary(buf, size * nmemb, u);
+
         j = u->journal;
 
         while (j && filled < size * nmemb) {
@@ -331,6 +439,16 @@ static int process_journal_input(Uploader *u, int skip) {
 
         /* have data */
         u->entry_state = ENTRY_CURSOR;
+
+        if (u->binary) {
+                /* Each upload is a stream of its own */
+                r = journal_binary_encoder_reset(u->encoder);
+                if (r < 0)
+                        return log_error_errno(r, "Failed to reset encoder: %m");
+
+                u->encoder_done = false;
+        }
+
         return start_upload(u, journal_input_callback, u);
 }
 
@@ -17,6 +17,7 @@
 #include "fileio.h"
 #include "format-util.h"
 #include "glob-util.h"
+#include "journal-importer.h"
 #include "journal-upload.h"
 #include "log.h"
 #include "main-func.h"
@@ -187,7 +188,8 @@ int start_upload(Uploader *u,
                 _cleanup_(curl_slist_free_allp) struct curl_slist *h = NULL;
                 struct curl_slist *l;
 
-                h = curl_slist_append(NULL, "Content-Type: application/vnd.fdo.journal");
+                h = curl_slist_append(NULL, u->binary ? "Content-Type: " JOURNAL_BINARY_CONTENT_TYPE
+                                                      : "Content-Type: application/vnd.fdo.journal");
                 if (!h)
                         return log_oom();
 
@@ -229,20 +231,6 @@ int start_upload(Uploader *u,
                 easy_setopt(curl, CURLOPT_WRITEFUNCTION, output_callback,
                             LOG_ERR, return -EXFULL);
 
-                easy_setopt(curl, CURLOPT_WRITEDATA, data,
-                            LOG_ERR, return -EXFULL);
-
-                /* set where to read from */
-                easy_setopt(curl, CURLOPT_READFUNCTION, input_callback,
-                            LOG_ERR, return -EXFULL);
-
-                easy_setopt(curl, CURLOPT_READDATA, data,
-                            LOG_ERR, return -EXFULL);
-
-                /* use our special own mime type and chunked transfer */
-                easy_setopt(curl, CURLOPT_HTTPHEADER, u->header,
-                            LOG_ERR, return -EXFULL);
-
                 if (DEBUG_LOGGING)
                         /* enable verbose for easier tracing */
                         easy_setopt(curl, CURLOPT_VERBOSE, 1L, LOG_WARNING, );
@@ -278,6 +266,21 @@ int start_upload(Uploader *u,
                 u->answer = 0;
         }
 
+        /* The input and the format may change between uploads, hence these are always set */
+        easy_setopt(u->easy, CURLOPT_WRITEDATA, data,
+                    LOG_ERR, return -EXFULL);
+
+        /* set where to read from */
+        easy_setopt(u->easy, CURLOPT_READFUNCTION, input_callback,
+                    LOG_ERR, return -EXFULL);
+
+        easy_setopt(u->easy, CURLOPT_READDATA, data,
+                    LOG_ERR, return -EXFULL);
+
+        /* use our special own mime type and chunked transfer */
+        easy_setopt(u->easy, CURLOPT_HTTPHEADER, u->header,
+                    LOG_ERR, return -EXFULL);
+
         /* upload to this place */
         code = curl_easy_setopt(u->easy, CURLOPT_URL, u->url);
         if (code)
@@ -469,6 +472,7 @@ static void destroy_uploader(Uploader *u) {
         curl_easy_cleanup(u->easy);
         curl_slist_free_all(u->header);
         free(u->answer);
+        journal_binary_encoder_free(u->encoder);
 
         free(u->last_cursor);
         free(u->current_cursor);
@@ -485,11 +489,11 @@ static void destroy_uploader(Uploader *u) {
         sd_event_unref(u->events);
 }
 
-static int perform_upload(Uploader *u) {
+static int perform_request(Uploader *u, long *ret_status) {
         CURLcode code;
-        long status;
 
         assert(u);
+        assert(ret_status);
 
         u->watchdog_timestamp = now(CLOCK_MONOTONIC);
         code = curl_easy_perform(u->easy);
@@ -503,12 +507,77 @@ static int perform_upload(Uploader *u) {
                 return -EIO;
         }
 
-        code = curl_easy_getinfo(u->easy, CURLINFO_RESPONSE_CODE, &status);
+        code = curl_easy_getinfo(u->easy, CURLINFO_RESPONSE_CODE, ret_status);
         if (code)
                 return log_error_errno(SYNTHETIC_ERRNO(EUCLEAN),
                                        "Failed to retrieve response code: %s",
                                        curl_easy_strerror(code));
 
+        return 0;
+}
+
+static size_t empty_input_callback(void *buf, size_t size, size_t nmemb, void *userp) {
+        Uploader *u = userp;
+
+        assert(u);
+
+        u->uploading = false;
+        return 0;
+}
+
+static int negotiate_format(Uploader *u) {
+        long status;
+        int r;
+
+        assert(u);
+
+        /* Offer the binary format with an upload without any entries first. Servers that do not know it
+         * refuse the content type right away, and then we stick to the export format. */
+        r = journal_binary_encoder_new(&u->encoder);
+        if (r == -EOPNOTSUPP)
+                return 0;
+        if (r < 0)
+                return log_error_errno(r, "Failed to allocate encoder: %m");
+
+        u->binary = true;
+
+        r = start_upload(u, empty_input_callback, u);
+        if (r < 0)
+                return r;
+
+        r = perform_request(u, &status);
+        if (r < 0)
+                return r;
+
+        if (status == 415) {
+                log_info("%s does not accept the binary format, using the export format.", u->url);
+
+                u->binary = false;
+                u->encoder = journal_binary_encoder_free(u->encoder);
+
+                curl_slist_free_all(u->header);
+                u->header = NULL;
+                return 0;
+        }
+        if (status < 200 || status >= 300)
+                return log_error_errno(SYNTHETIC_ERRNO(EIO),
+                                       "Upload to %s failed with code %ld: %s",
+                                       u->url, status, strna(u->answer));
+
+        log_debug("Using the binary format for uploads to %s.", u->url);
+        return 0;
+}
+
+static int perform_upload(Uploader *u) {
+        long status;
+        int r;
+
+        assert(u);
+
+        r = perform_request(u, &status);
+        if (r < 0)
+                return r;
+
         if (status >= 300)
                 return log_error_errno(SYNTHETIC_ERRNO(EIO),
                                        "Upload to %s failed with code %ld: %s",
@@ -856,6 +925,10 @@ static int run(int argc, char **argv) {
         use_journal = optind >= argc;
         if (use_journal) {
                 sd_journal *j;
+                r = negotiate_format(&u);
+                if (r < 0)
+                        return r;
+
                 r = open_journal(&j);
                 if (r < 0)
                         return r;
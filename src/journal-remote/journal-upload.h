@@ -7,6 +7,7 @@
 #include "sd-event.h"
 #include "sd-journal.h"
 
+#include "journal-binary-encoder.h"
 #include "time-util.h"
 
 typedef enum {
@@ -47,6 +48,11 @@ typedef struct Uploader {
         const void *field_data;
         size_t field_pos, field_length;
 
+        /* binary format, if the server accepts it */
+        bool binary;
+        JournalBinaryEncoder *encoder;
+        bool encoder_done;
+
         /* general metrics */
         const char *state_file;
 
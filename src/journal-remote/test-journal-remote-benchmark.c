@@ -0,0 +1,155 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+
+#include <pthread.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "sd-id128.h"
+
+#include "alloc-util.h"
+#include "fd-util.h"
+#include "fileio.h"
+#include "io-util.h"
+#include "journal-remote.h"
+#include "log.h"
+#include "parse-util.h"
+#include "rm-rf.h"
+#include "stdio-util.h"
+#include "string-util.h"
+#include "tests.h"
+#include "tmpfile-util.h"
+
+/* Sends entries in the export format to journal-remote over a local socket pair per host, once with all
+ * sources processed in the main thread and once with a pool of worker threads, and reports the throughput
+ * of both.
+ *
+ * Usage: test-journal-remote-benchmark [ENTRIES [HOSTS [THREADS]]] */
+
+static unsigned arg_entries = 20000;  /* per host */
+static unsigned arg_hosts = 16;
+static unsigned arg_threads = 4;
+
+#define ENTRIES_PER_WRITE 64U
+
+typedef struct Feeder {
+        int *fds;
+        sd_id128_t boot_id;
+} Feeder;
+
+static void* feeder_thread(void *p) {
+        Feeder *f = p;
+        _cleanup_free_ char *buf = NULL;
+        size_t size = 0;
+
+        for (unsigned i = 0; i < arg_entries; i += ENTRIES_PER_WRITE)
+                for (unsigned h = 0; h < arg_hosts; h++) {
+                        _cleanup_fclose_ FILE *m = NULL;
+
+                        m = open_memstream_unlocked(&buf, &size);
+                        assert_se(m);
+
+                        for (unsigned j = i; j < MIN(i + ENTRIES_PER_WRITE, arg_entries); j++)
+                                fprintf(m,
+                                        "__REALTIME_TIMESTAMP=%" PRIu64 "\n"
+                                        "__MONOTONIC_TIMESTAMP=%" PRIu64 "\n"
+                                        "_BOOT_ID=" SD_ID128_FORMAT_STR "\n"
+                                        "_HOSTNAME=host-%u\n"
+                                        "_TRANSPORT=journal\n"
+                                        "_SYSTEMD_UNIT=benchmark%u.service\n"
+                                        "PRIORITY=%u\n"
+                                        "MESSAGE=Benchmark message %u\n"
+                                        "\n",
+                                        now(CLOCK_REALTIME), now(CLOCK_MONOTONIC),
+                                        SD_ID128_FORMAT_VAL(f->boot_id),
+                                        h, j % 16, j % 8, j);
+
+                        assert_se(fflush_and_check(m) >= 0);
+                        m = safe_fclose(m);
+
+                        assert_se(loop_write(f->fds[h], buf, size, false) >= 0);
+                        buf = mfree(buf);
+                }
+
+        for (unsigned h = 0; h < arg_hosts; h++)
+                f->fds[h] = safe_close(f->fds[h]);
+
+        return NULL;
+}
+
+static void benchmark(unsigned n_threads) {
+        _cleanup_(rm_rf_physical_and_freep) char *t = NULL;
+        _cleanup_free_ int *fds = NULL;
+        RemoteServer s = {};
+        Feeder feeder = {};
+        pthread_t thread;
+        usec_t begin, elapsed;
+        uint64_t n;
+
+        assert_se(mkdtemp_malloc(access("/dev/shm", W_OK) >= 0 ? "/dev/shm/journal-remote-XXXXXX" : "/var/tmp/journal-remote-XXXXXX", &t) >= 0);
+
+        assert_se(journal_remote_server_init(&s, t, JOURNAL_WRITE_SPLIT_HOST, true, false) >= 0);
+        if (n_threads > 1)
+                assert_se(journal_remote_server_start_workers(&s, n_threads) >= 0);
+
+        fds = new(int, arg_hosts);
+        assert_se(fds);
+
+        for (unsigned h = 0; h < arg_hosts; h++) {
+                char name[STRLEN("host-") + DECIMAL_STR_MAX(unsigned)];
+                int pair[2];
+
+                assert_se(socketpair(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC|SOCK_NONBLOCK, 0, pair) >= 0);
+                assert_se(fd_nonblock(pair[1], false) >= 0);
+
+                xsprintf(name, "host-%u", h);
+                assert_se(journal_remote_add_source(&s, pair[0], name, false) > 0);
+                fds[h] = pair[1];
+        }
+
+        feeder = (Feeder) {
+                .fds = fds,
+        };
+        assert_se(sd_id128_get_boot(&feeder.boot_id) >= 0);
+
+        begin = now(CLOCK_MONOTONIC);
+
+        assert_se(pthread_create(&thread, NULL, feeder_thread, &feeder) == 0);
+
+        while (s.active > 0)
+                assert_se(sd_event_run(s.events, UINT64_MAX) >= 0);
+
+        elapsed = MAX(usec_sub_unsigned(now(CLOCK_MONOTONIC), begin), (usec_t) 1);
+
+        assert_se(pthread_join(thread, NULL) == 0);
+
+        n = s.event_count;
+        assert_se(n == (uint64_t) arg_entries * arg_hosts);
+
+        journal_remote_server_destroy(&s);
+
+        printf("%2u thread%s %" PRIu64 " entries from %u hosts in %s, %" PRIu64 " entries/s\n",
+               n_threads, n_threads == 1 ? ": " : "s:",
+               n, arg_hosts, FORMAT_TIMESPAN(elapsed, USEC_PER_MSEC),
+               n * USEC_PER_SEC / elapsed);
+}
+
+int main(int argc, char *argv[]) {
+        test_setup_logging(LOG_INFO);
+
+        if (argc > 1)
+                assert_se(safe_atou(argv[1], &arg_entries) >= 0);
+        if (argc > 2)
+                assert_se(safe_atou(argv[2], &arg_hosts) >= 0 && arg_hosts > 0);
+        if (argc > 3)
+                assert_se(safe_atou(argv[3], &arg_threads) >= 0 && arg_threads > 0);
+
+        /* journal_file_open requires a valid machine id */
+        if (access("/etc/machine-id", F_OK) != 0)
+                return log_tests_skipped("/etc/machine-id not found");
+
+        benchmark(1);
+        if (arg_threads > 1)
+                benchmark(arg_threads);
+
+        return 0;
+}
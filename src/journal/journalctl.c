@@ -39,6 +39,7 @@
 #include "hostname-util.h"
 #include "id128-print.h"
 #include "io-util.h"
+#include "journal-columnar.h"
 #include "journal-def.h"
 #include "journal-internal.h"
 #include "journal-util.h"
@@ -566,7 +567,7 @@ static int parse_argv(int argc, char *argv[]) {
                         if (arg_output < 0)
                                 return log_error_errno(arg_output, "Unknown output format '%s'.", optarg);
 
-                        if (IN_SET(arg_output, OUTPUT_EXPORT, OUTPUT_JSON, OUTPUT_JSON_PRETTY, OUTPUT_JSON_SSE, OUTPUT_JSON_SEQ, OUTPUT_CAT))
+                        if (IN_SET(arg_output, OUTPUT_EXPORT, OUTPUT_JSON, OUTPUT_JSON_PRETTY, OUTPUT_JSON_SSE, OUTPUT_JSON_SEQ, OUTPUT_CAT, OUTPUT_COLUMNAR))
                                 arg_quiet = true;
 
                         break;
@@ -1999,14 +2000,17 @@ static int verify(sd_journal *j) {
 
         ORDERED_HASHMAP_FOREACH(f, j->files) {
                 int k;
-                usec_t first = 0, validated = 0, last = 0;
+                usec_t first = 0, validated = 0, last = 0, start, elapsed;
+                uint64_t size;
 
 #if HAVE_GCRYPT
                 if (!arg_verify_key && JOURNAL_HEADER_SEALED(f->header))
                         log_notice("Journal file %s has sealing enabled but verification key has not been passed using --verify-key=.", f->path);
 #endif
 
+                start = now(CLOCK_MONOTONIC);
                 k = journal_file_verify(f, arg_verify_key, &first, &validated, &last, true);
+                elapsed = MAX(usec_sub_unsigned(now(CLOCK_MONOTONIC), start), (usec_t) 1);
                 if (k == -EINVAL)
                         /* If the key was invalid give up right-away. */
                         return k;
@@ -2014,7 +2018,13 @@ static int verify(sd_journal *j) {
                         r = log_warning_errno(k, "FAIL: %s (%m)", f->path);
                 else {
                         char a[FORMAT_TIMESTAMP_MAX], b[FORMAT_TIMESTAMP_MAX];
-                        log_info("PASS: %s", f->path);
+
+                        size = (uint64_t) f->last_stat.st_size;
+                        log_info("PASS: %s (%s in %s, %s/s)",
+                                 f->path,
+                                 FORMAT_BYTES(size),
+                                 FORMAT_TIMESPAN(elapsed, USEC_PER_MSEC),
+                                 FORMAT_BYTES(size * USEC_PER_SEC / elapsed));
 
                         if (arg_verify_key && JOURNAL_HEADER_SEALED(f->header)) {
                                 if (validated > 0) {
@@ -2121,6 +2131,7 @@ int main(int argc, char *argv[]) {
         bool previous_boot_id_valid = false, first_line = true, ellipsized = false, need_seek = false;
         bool use_cursor = false, after_cursor = false;
         _cleanup_(sd_journal_closep) sd_journal *j = NULL;
+        _cleanup_(columnar_writer_freep) ColumnarWriter *columnar = NULL;
         sd_id128_t previous_boot_id;
         int n_shown = 0, r, poll_fd = -1;
 
@@ -2603,6 +2614,15 @@ int main(int argc, char *argv[]) {
                 }
         }
 
+        if (arg_output == OUTPUT_COLUMNAR) {
+                /* Entries are collected into batches, rather than written out one by one */
+                r = columnar_writer_new(stdout, arg_output_fields, &columnar);
+                if (r < 0) {
+                        log_error_errno(r, "Failed to allocate columnar writer: %m");
+                        goto finish;
+                }
+        }
+
         for (;;) {
                 while (arg_lines < 0 || n_shown < arg_lines || (arg_follow && !first_line)) {
                         int flags;
@@ -2720,8 +2740,11 @@ int main(int argc, char *argv[]) {
                                 arg_utc * OUTPUT_UTC |
                                 arg_no_hostname * OUTPUT_NO_HOSTNAME;
 
-                        r = show_journal_entry(stdout, j, arg_output, 0, flags,
-                                               arg_output_fields, highlight, &ellipsized);
+                        if (columnar)
+                                r = columnar_writer_add_entry(columnar, j);
+                        else
+                                r = show_journal_entry(stdout, j, arg_output, 0, flags,
+                                                       arg_output_fields, highlight, &ellipsized);
                         need_seek = true;
                         if (r == -EADDRNOTAVAIL)
                                 break;
@@ -2745,6 +2768,12 @@ int main(int argc, char *argv[]) {
                         }
                 }
 
+                if (columnar) {
+                        r = columnar_writer_flush(columnar);
+                        if (r < 0)
+                                goto finish;
+                }
+
                 if (!arg_follow) {
                         if (n_shown == 0 && !arg_quiet)
                                 printf("-- No entries --\n");
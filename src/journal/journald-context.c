@@ -14,10 +14,12 @@
 #include "io-util.h"
 #include "journal-util.h"
 #include "journald-context.h"
+#include "missing_syscall.h"
 #include "parse-util.h"
 #include "path-util.h"
 #include "process-util.h"
 #include "procfs-util.h"
+#include "stdio-util.h"
 #include "string-util.h"
 #include "syslog-util.h"
 #include "unaligned.h"
@@ -48,6 +50,22 @@
  *    stream connection. This should improve cases where a service process logs immediately before exiting and we
  *    previously had trouble associating the log message with the service.
  *
+ * The metadata is kept at two levels: everything that is derived from the cgroup of a client (the unit, slice,
+ * session, invocation ID, log level, extra fields and rate limit settings of the unit) is stored in a CgroupContext,
+ * which is indexed by the cgroup path and shared between all clients in the same cgroup. It is refreshed at most once
+ * per refresh interval, no matter how many clients log from the cgroup, and when a client is seen in a different
+ * cgroup it simply switches to the CgroupContext of that one. This means that a new PID in a unit we already know
+ * costs a single read of its cgroup path on top of the per-process data below, instead of a dozen reads.
+ *
+ * The per-process data (comm, exe, cmdline, capabilities, audit session) is only read when a message of the client is
+ * actually written to the journal, i.e. not for messages dropped by rate limiting or the unit's log level. If the
+ * kernel supports it, we keep a pidfd for each cached PID: as long as the process behind it is alive, the PID cannot
+ * have been recycled, which makes the PID reuse heuristics below unnecessary for such entries.
+ *
+ * The metadata of a client is formatted as journal fields only once, and is then reused for every message of the
+ * client until the metadata is refreshed. The same goes for the hashes of these fields for the journal file we
+ * write to.
+ *
  * NB: With and without the metadata cache: the implicitly added entry metadata in the journal (with the exception of
  *     UID/PID/GID and SELinux label) must be understood as possibly slightly out of sync (i.e. sometimes slightly older
  *     and sometimes slightly newer than what was current at the log event).
@@ -101,6 +119,172 @@ static int client_context_compare(const void *a, const void *b) {
         return CMP(x->pid, y->pid);
 }
 
+static void cgroup_context_reset(Server *s, CgroupContext *g) {
+        assert(s);
+        assert(g);
+
+        /* Resets the data that is not derived from the cgroup path, but read from /run/systemd/units/ */
+
+        g->timestamp = USEC_INFINITY;
+
+        g->invocation_id = SD_ID128_NULL;
+
+        g->extra_fields_iovec = mfree(g->extra_fields_iovec);
+        g->extra_fields_n_iovec = 0;
+        g->extra_fields_data = mfree(g->extra_fields_data);
+        g->extra_fields_mtime = NSEC_INFINITY;
+
+        g->log_level_max = -1;
+
+        g->log_ratelimit_interval = s->ratelimit_interval;
+        g->log_ratelimit_burst = s->ratelimit_burst;
+}
+
+static CgroupContext* cgroup_context_free(Server *s, CgroupContext *g) {
+        assert(s);
+
+        if (!g)
+                return NULL;
+
+        if (g->cgroup)
+                (void) hashmap_remove_value(s->cgroup_contexts, g->cgroup, g);
+
+        cgroup_context_reset(s, g);
+
+        journal_ratelimit_group_release(g->ratelimit_group);
+
+        free(g->cgroup);
+        free(g->session);
+        free(g->unit);
+        free(g->user_unit);
+        free(g->slice);
+        free(g->user_slice);
+
+        return mfree(g);
+}
+
+static CgroupContext* cgroup_context_unref(Server *s, CgroupContext *g) {
+        assert(s);
+
+        if (!g)
+                return NULL;
+
+        assert(g->n_ref > 0);
+
+        g->n_ref--;
+        if (g->n_ref > 0)
+                return NULL;
+
+        return cgroup_context_free(s, g);
+}
+
+static void cgroup_context_acquire_ratelimit_group(Server *s, CgroupContext *g) {
+        int r;
+
+        assert(s);
+        assert(g);
+
+        /* Rate limiting is per unit, hence all cgroups of a unit, e.g. the ones below user@.service, share
+         * one group. Without a group the messages are not rate limited. */
+
+        if (!g->unit || !s->ratelimit)
+                return;
+
+        r = journal_ratelimit_group_acquire(s->ratelimit, g->unit, now(CLOCK_MONOTONIC), &g->ratelimit_group);
+        if (r < 0)
+                log_debug_errno(r, "Failed to acquire rate limit group for %s, not rate limiting it: %m", g->unit);
+}
+
+static int cgroup_context_new(Server *s, const char *cgroup, const char *unit_id, CgroupContext **ret) {
+        CgroupContext *g;
+        int r;
+
+        assert(s);
+        assert(!!cgroup != !!unit_id);
+        assert(ret);
+
+        g = new(CgroupContext, 1);
+        if (!g)
+                return -ENOMEM;
+
+        *g = (CgroupContext) {
+                .n_ref = 1,
+                .owner_uid = UID_INVALID,
+                .timestamp = USEC_INFINITY,
+                .extra_fields_mtime = NSEC_INFINITY,
+                .log_level_max = -1,
+                .log_ratelimit_interval = s->ratelimit_interval,
+                .log_ratelimit_burst = s->ratelimit_burst,
+        };
+
+        if (unit_id) {
+                /* We know nothing but the unit of the client, hence this context is not shared with anybody */
+                g->unit = strdup(unit_id);
+                if (!g->unit) {
+                        cgroup_context_free(s, g);
+                        return -ENOMEM;
+                }
+
+                cgroup_context_acquire_ratelimit_group(s, g);
+
+                *ret = g;
+                return 0;
+        }
+
+        g->cgroup = strdup(cgroup);
+        if (!g->cgroup) {
+                cgroup_context_free(s, g);
+                return -ENOMEM;
+        }
+
+        (void) cg_path_get_session(g->cgroup, &g->session);
+
+        if (cg_path_get_owner_uid(g->cgroup, &g->owner_uid) < 0)
+                g->owner_uid = UID_INVALID;
+
+        (void) cg_path_get_unit(g->cgroup, &g->unit);
+        (void) cg_path_get_user_unit(g->cgroup, &g->user_unit);
+        (void) cg_path_get_slice(g->cgroup, &g->slice);
+        (void) cg_path_get_user_slice(g->cgroup, &g->user_slice);
+
+        cgroup_context_acquire_ratelimit_group(s, g);
+
+        r = hashmap_ensure_put(&s->cgroup_contexts, &string_hash_ops, g->cgroup, g);
+        if (r < 0) {
+                cgroup_context_free(s, g);
+                return r;
+        }
+
+        *ret = g;
+        return 0;
+}
+
+static int cgroup_context_acquire(Server *s, const char *cgroup, CgroupContext **ret) {
+        CgroupContext *g;
+        int r;
+
+        assert(s);
+        assert(cgroup);
+        assert(ret);
+
+        g = hashmap_get(s->cgroup_contexts, cgroup);
+        if (g) {
+                s->n_cgroup_context_hits++;
+                g->n_ref++;
+                *ret = g;
+                return 0;
+        }
+
+        s->n_cgroup_context_misses++;
+
+        r = cgroup_context_new(s, cgroup, NULL, &g);
+        if (r < 0)
+                return r;
+
+        *ret = g;
+        return 0;
+}
+
 static int client_context_new(Server *s, pid_t pid, ClientContext **ret) {
         _cleanup_free_ ClientContext *c = NULL;
         int r;
@@ -119,17 +303,13 @@ static int client_context_new(Server *s, pid_t pid, ClientContext **ret) {
 
         *c = (ClientContext) {
                 .pid = pid,
+                .pidfd = -1,
                 .uid = UID_INVALID,
                 .gid = GID_INVALID,
                 .auditid = AUDIT_SESSION_INVALID,
                 .loginuid = UID_INVALID,
-                .owner_uid = UID_INVALID,
                 .lru_index = PRIOQ_IDX_NULL,
                 .timestamp = USEC_INFINITY,
-                .extra_fields_mtime = NSEC_INFINITY,
-                .log_level_max = -1,
-                .log_ratelimit_interval = s->ratelimit_interval,
-                .log_ratelimit_burst = s->ratelimit_burst,
         };
 
         r = hashmap_ensure_put(&s->client_contexts, NULL, PID_TO_PTR(pid), c);
@@ -140,15 +320,33 @@ static int client_context_new(Server *s, pid_t pid, ClientContext **ret) {
         return 0;
 }
 
+static void client_context_flush_fields(ClientContext *c) {
+        assert(c);
+
+        c->fields_valid = false;
+        c->fields_buffer = mfree(c->fields_buffer);
+        c->fields_iovec = mfree(c->fields_iovec);
+        c->fields_n_iovec = 0;
+        c->fields_hashes = mfree(c->fields_hashes);
+        c->fields_hashes_file_id = SD_ID128_NULL;
+}
+
 static void client_context_reset(Server *s, ClientContext *c) {
         assert(s);
         assert(c);
 
+        client_context_flush_fields(c);
+
         c->timestamp = USEC_INFINITY;
 
+        /* The PID might have been recycled by now, hence forget the process we knew */
+        c->pidfd = safe_close(c->pidfd);
+
         c->uid = UID_INVALID;
         c->gid = GID_INVALID;
 
+        c->process_stale = false;
+
         c->comm = mfree(c->comm);
         c->exe = mfree(c->exe);
         c->cmdline = mfree(c->cmdline);
@@ -157,28 +355,10 @@ static void client_context_reset(Server *s, ClientContext *c) {
         c->auditid = AUDIT_SESSION_INVALID;
         c->loginuid = UID_INVALID;
 
-        c->cgroup = mfree(c->cgroup);
-        c->session = mfree(c->session);
-        c->owner_uid = UID_INVALID;
-        c->unit = mfree(c->unit);
-        c->user_unit = mfree(c->user_unit);
-        c->slice = mfree(c->slice);
-        c->user_slice = mfree(c->user_slice);
-
-        c->invocation_id = SD_ID128_NULL;
-
         c->label = mfree(c->label);
         c->label_size = 0;
 
-        c->extra_fields_iovec = mfree(c->extra_fields_iovec);
-        c->extra_fields_n_iovec = 0;
-        c->extra_fields_data = mfree(c->extra_fields_data);
-        c->extra_fields_mtime = NSEC_INFINITY;
-
-        c->log_level_max = -1;
-
-        c->log_ratelimit_interval = s->ratelimit_interval;
-        c->log_ratelimit_burst = s->ratelimit_burst;
+        c->cgroup_context = cgroup_context_unref(s, c->cgroup_context);
 }
 
 static ClientContext* client_context_free(Server *s, ClientContext *c) {
@@ -213,12 +393,45 @@ static void client_context_read_uid_gid(ClientContext *c, const struct ucred *uc
                 (void) get_process_gid(c->pid, &c->gid);
 }
 
-static void client_context_read_basic(ClientContext *c) {
+static int client_context_check_pidfd(ClientContext *c) {
+        int r;
+
+        assert(c);
+
+        /* Returns > 0 if the process behind the pidfd is still around, 0 if it is gone, and -EBADF if we have no
+         * pidfd for it */
+
+        if (c->pidfd < 0)
+                return -EBADF;
+
+        r = fd_wait_for_event(c->pidfd, POLLIN, 0);
+        if (r < 0)
+                return r;
+
+        return r == 0;
+}
+
+static bool client_context_process_gone(ClientContext *c) {
+        int r;
+
+        assert(c);
+
+        r = client_context_check_pidfd(c);
+        if (r >= 0)
+                return r == 0;
+
+        return !pid_is_unwaited(c->pid);
+}
+
+void client_context_read_process(ClientContext *c) {
         char *t;
 
         assert(c);
         assert(pid_is_valid(c->pid));
 
+        if (!c->process_stale)
+                return;
+
         if (get_process_comm(c->pid, &t) >= 0)
                 free_and_replace(c->comm, t);
 
@@ -230,6 +443,192 @@ static void client_context_read_basic(ClientContext *c) {
 
         if (get_process_capeff(c->pid, &t) >= 0)
                 free_and_replace(c->capeff, t);
+
+        (void) audit_session_from_pid(c->pid, &c->auditid);
+        (void) audit_loginuid_from_pid(c->pid, &c->loginuid);
+
+        c->process_stale = false;
+
+        client_context_flush_fields(c);
+}
+
+typedef struct FieldsBuilder {
+        char *buffer;
+        size_t size;
+        size_t *ends; /* the end of each field in the buffer */
+        size_t n_fields;
+} FieldsBuilder;
+
+static void fields_builder_done(FieldsBuilder *b) {
+        assert(b);
+
+        free(b->buffer);
+        free(b->ends);
+}
+
+static int fields_builder_add(FieldsBuilder *b, const char *field, const void *value, size_t value_size) {
+        size_t l;
+        char *p;
+
+        assert(b);
+        assert(value || value_size == 0);
+
+        /* If no field name is specified, the value is expected to be a complete FIELD=value pair already */
+        l = field ? strlen(field) + 1 : 0;
+
+        if (!GREEDY_REALLOC(b->buffer, b->size + l + value_size))
+                return -ENOMEM;
+        if (!GREEDY_REALLOC(b->ends, b->n_fields + 1))
+                return -ENOMEM;
+
+        p = b->buffer + b->size;
+        if (field) {
+                p = stpcpy(p, field);
+                *(p++) = '=';
+        }
+        memcpy_safe(p, value, value_size);
+
+        b->size += l + value_size;
+        b->ends[b->n_fields++] = b->size;
+
+        return 0;
+}
+
+static int fields_builder_add_string(FieldsBuilder *b, const char *field, const char *value) {
+        if (!value)
+                return 0;
+
+        return fields_builder_add(b, field, value, strlen(value));
+}
+
+static int fields_builder_add_unsigned(FieldsBuilder *b, const char *field, uint64_t value) {
+        char buf[DECIMAL_STR_MAX(uint64_t)];
+
+        xsprintf(buf, "%" PRIu64, value);
+        return fields_builder_add_string(b, field, buf);
+}
+
+static int client_context_build_fields(ClientContext *c) {
+        _cleanup_(fields_builder_done) FieldsBuilder b = {};
+        const CgroupContext *g;
+        struct iovec *iovec;
+        size_t begin = 0;
+        int r;
+
+        assert(c);
+
+        /* Formats the metadata of the client in the order the journal always had it */
+
+        r = fields_builder_add_unsigned(&b, "_PID", c->pid);
+        if (r >= 0 && uid_is_valid(c->uid))
+                r = fields_builder_add_unsigned(&b, "_UID", c->uid);
+        if (r >= 0 && gid_is_valid(c->gid))
+                r = fields_builder_add_unsigned(&b, "_GID", c->gid);
+
+        if (r >= 0)
+                r = fields_builder_add_string(&b, "_COMM", c->comm);
+        if (r >= 0)
+                r = fields_builder_add_string(&b, "_EXE", c->exe);
+        if (r >= 0)
+                r = fields_builder_add_string(&b, "_CMDLINE", c->cmdline);
+        if (r >= 0)
+                r = fields_builder_add_string(&b, "_CAP_EFFECTIVE", c->capeff);
+        if (r >= 0 && c->label_size > 0)
+                r = fields_builder_add(&b, "_SELINUX_CONTEXT", c->label, c->label_size);
+        if (r >= 0 && audit_session_is_valid(c->auditid))
+                r = fields_builder_add_unsigned(&b, "_AUDIT_SESSION", c->auditid);
+        if (r >= 0 && uid_is_valid(c->loginuid))
+                r = fields_builder_add_unsigned(&b, "_AUDIT_LOGINUID", c->loginuid);
+
+        g = c->cgroup_context;
+        if (g) {
+                if (r >= 0)
+                        r = fields_builder_add_string(&b, "_SYSTEMD_CGROUP", g->cgroup);
+                if (r >= 0)
+                        r = fields_builder_add_string(&b, "_SYSTEMD_SESSION", g->session);
+                if (r >= 0 && uid_is_valid(g->owner_uid))
+                        r = fields_builder_add_unsigned(&b, "_SYSTEMD_OWNER_UID", g->owner_uid);
+                if (r >= 0)
+                        r = fields_builder_add_string(&b, "_SYSTEMD_UNIT", g->unit);
+                if (r >= 0)
+                        r = fields_builder_add_string(&b, "_SYSTEMD_USER_UNIT", g->user_unit);
+                if (r >= 0)
+                        r = fields_builder_add_string(&b, "_SYSTEMD_SLICE", g->slice);
+                if (r >= 0)
+                        r = fields_builder_add_string(&b, "_SYSTEMD_USER_SLICE", g->user_slice);
+                if (r >= 0 && !sd_id128_is_null(g->invocation_id))
+                        r = fields_builder_add_string(&b, "_SYSTEMD_INVOCATION_ID", SD_ID128_TO_STRING(g->invocation_id));
+
+                for (size_t i = 0; r >= 0 && i < g->extra_fields_n_iovec; i++)
+                        r = fields_builder_add(&b, NULL, g->extra_fields_iovec[i].iov_base, g->extra_fields_iovec[i].iov_len);
+        }
+        if (r < 0)
+                return r;
+
+        iovec = new(struct iovec, b.n_fields);
+        if (!iovec)
+                return -ENOMEM;
+
+        for (size_t i = 0; i < b.n_fields; i++) {
+                iovec[i] = IOVEC_MAKE(b.buffer + begin, b.ends[i] - begin);
+                begin = b.ends[i];
+        }
+
+        client_context_flush_fields(c);
+
+        c->fields_buffer = TAKE_PTR(b.buffer);
+        c->fields_iovec = iovec;
+        c->fields_n_iovec = b.n_fields;
+        c->fields_generation = g ? g->generation : 0;
+        c->fields_valid = true;
+
+        return 0;
+}
+
+int client_context_get_fields(ClientContext *c, const struct iovec **ret, size_t *ret_n) {
+        int r;
+
+        assert(c);
+        assert(ret);
+        assert(ret_n);
+
+        /* Returns the metadata of the client formatted as journal fields. The result remains valid until the
+         * context is refreshed. */
+
+        if (!c->fields_valid ||
+            (c->cgroup_context && c->cgroup_context->generation != c->fields_generation)) {
+                r = client_context_build_fields(c);
+                if (r < 0)
+                        return r;
+        }
+
+        *ret = c->fields_iovec;
+        *ret_n = c->fields_n_iovec;
+        return 0;
+}
+
+const uint64_t* client_context_get_field_hashes(ClientContext *c, JournalFile *f) {
+        assert(c);
+        assert(f);
+        assert(c->fields_valid);
+
+        /* Returns the hashes of the fields returned by client_context_get_fields() for the specified journal
+         * file, or NULL if we can't provide them. */
+
+        if (c->fields_hashes && sd_id128_equal(c->fields_hashes_file_id, f->header->file_id))
+                return c->fields_hashes;
+
+        if (!c->fields_hashes) {
+                c->fields_hashes = new(uint64_t, c->fields_n_iovec);
+                if (!c->fields_hashes)
+                        return NULL;
+        }
+
+        for (size_t i = 0; i < c->fields_n_iovec; i++)
+                c->fields_hashes[i] = journal_file_hash_data(f, c->fields_iovec[i].iov_base, c->fields_iovec[i].iov_len);
+
+        c->fields_hashes_file_id = f->header->file_id;
+        return c->fields_hashes;
 }
 
 static int client_context_read_label(
@@ -270,6 +669,7 @@ static int client_context_read_label(
 
 static int client_context_read_cgroup(Server *s, ClientContext *c, const char *unit_id) {
         _cleanup_free_ char *t = NULL;
+        CgroupContext *g;
         int r;
 
         assert(c);
@@ -280,65 +680,50 @@ static int client_context_read_cgroup(Server *s, ClientContext *c, const char *u
                 /* We use the unit ID passed in as fallback if we have nothing cached yet and cg_pid_get_path_shifted()
                  * failed or process is running in a root cgroup. Zombie processes are automatically migrated to root cgroup
                  * on cgroup v1 and we want to be able to map log messages from them too. */
-                if (unit_id && !c->unit) {
-                        c->unit = strdup(unit_id);
-                        if (c->unit)
+                if (unit_id && !client_context_unit(c)) {
+                        if (cgroup_context_new(s, NULL, unit_id, &g) >= 0) {
+                                cgroup_context_unref(s, c->cgroup_context);
+                                c->cgroup_context = g;
                                 return 0;
+                        }
                 }
 
                 return r;
         }
 
         /* Let's shortcut this if the cgroup path didn't change */
-        if (streq_ptr(c->cgroup, t))
+        if (c->cgroup_context && streq_ptr(c->cgroup_context->cgroup, t))
                 return 0;
 
-        free_and_replace(c->cgroup, t);
-
-        (void) cg_path_get_session(c->cgroup, &t);
-        free_and_replace(c->session, t);
-
-        if (cg_path_get_owner_uid(c->cgroup, &c->owner_uid) < 0)
-                c->owner_uid = UID_INVALID;
-
-        (void) cg_path_get_unit(c->cgroup, &t);
-        free_and_replace(c->unit, t);
-
-        (void) cg_path_get_user_unit(c->cgroup, &t);
-        free_and_replace(c->user_unit, t);
-
-        (void) cg_path_get_slice(c->cgroup, &t);
-        free_and_replace(c->slice, t);
+        r = cgroup_context_acquire(s, t, &g);
+        if (r < 0)
+                return r;
 
-        (void) cg_path_get_user_slice(c->cgroup, &t);
-        free_and_replace(c->user_slice, t);
+        cgroup_context_unref(s, c->cgroup_context);
+        c->cgroup_context = g;
 
         return 0;
 }
 
-static int client_context_read_invocation_id(
-                Server *s,
-                ClientContext *c) {
-
+static int cgroup_context_read_invocation_id(CgroupContext *g) {
         _cleanup_free_ char *p = NULL, *value = NULL;
         int r;
 
-        assert(s);
-        assert(c);
+        assert(g);
 
         /* Read the invocation ID of a unit off a unit.
          * PID 1 stores it in a per-unit symlink in /run/systemd/units/
          * User managers store it in a per-unit symlink under /run/user/<uid>/systemd/units/ */
 
-        if (!c->unit)
+        if (!g->unit)
                 return 0;
 
-        if (c->user_unit) {
-                r = asprintf(&p, "/run/user/" UID_FMT "/systemd/units/invocation:%s", c->owner_uid, c->user_unit);
+        if (g->user_unit) {
+                r = asprintf(&p, "/run/user/" UID_FMT "/systemd/units/invocation:%s", g->owner_uid, g->user_unit);
                 if (r < 0)
                         return r;
         } else {
-                p = strjoin("/run/systemd/units/invocation:", c->unit);
+                p = strjoin("/run/systemd/units/invocation:", g->unit);
                 if (!p)
                         return -ENOMEM;
         }
@@ -347,21 +732,20 @@ static int client_context_read_invocation_id(
         if (r < 0)
                 return r;
 
-        return sd_id128_from_string(value, &c->invocation_id);
+        return sd_id128_from_string(value, &g->invocation_id);
 }
 
-static int client_context_read_log_level_max(
-                Server *s,
-                ClientContext *c) {
-
+static int cgroup_context_read_log_level_max(CgroupContext *g) {
         _cleanup_free_ char *value = NULL;
         const char *p;
         int r, ll;
 
-        if (!c->unit)
+        assert(g);
+
+        if (!g->unit)
                 return 0;
 
-        p = strjoina("/run/systemd/units/log-level-max:", c->unit);
+        p = strjoina("/run/systemd/units/log-level-max:", g->unit);
         r = readlink_malloc(p, &value);
         if (r < 0)
                 return r;
@@ -370,13 +754,11 @@ static int client_context_read_log_level_max(
         if (ll < 0)
                 return ll;
 
-        c->log_level_max = ll;
+        g->log_level_max = ll;
         return 0;
 }
 
-static int client_context_read_extra_fields(
-                Server *s,
-                ClientContext *c) {
+static int cgroup_context_read_extra_fields(CgroupContext *g) {
 
         _cleanup_free_ struct iovec *iovec = NULL;
         size_t size = 0, n_iovec = 0, left;
@@ -387,12 +769,14 @@ static int client_context_read_extra_fields(
         uint8_t *q;
         int r;
 
-        if (!c->unit)
+        assert(g);
+
+        if (!g->unit)
                 return 0;
 
-        p = strjoina("/run/systemd/units/log-extra-fields:", c->unit);
+        p = strjoina("/run/systemd/units/log-extra-fields:", g->unit);
 
-        if (c->extra_fields_mtime != NSEC_INFINITY) {
+        if (g->extra_fields_mtime != NSEC_INFINITY) {
                 if (stat(p, &st) < 0) {
                         if (errno == ENOENT)
                                 return 0;
@@ -400,7 +784,7 @@ static int client_context_read_extra_fields(
                         return -errno;
                 }
 
-                if (timespec_load_nsec(&st.st_mtim) == c->extra_fields_mtime)
+                if (timespec_load_nsec(&st.st_mtim) == g->extra_fields_mtime)
                         return 0;
         }
 
@@ -453,51 +837,77 @@ static int client_context_read_extra_fields(
                 left -= n, q += n;
         }
 
-        free(c->extra_fields_iovec);
-        free(c->extra_fields_data);
+        free(g->extra_fields_iovec);
+        free(g->extra_fields_data);
 
-        c->extra_fields_iovec = TAKE_PTR(iovec);
-        c->extra_fields_n_iovec = n_iovec;
-        c->extra_fields_data = TAKE_PTR(data);
-        c->extra_fields_mtime = timespec_load_nsec(&st.st_mtim);
+        g->extra_fields_iovec = TAKE_PTR(iovec);
+        g->extra_fields_n_iovec = n_iovec;
+        g->extra_fields_data = TAKE_PTR(data);
+        g->extra_fields_mtime = timespec_load_nsec(&st.st_mtim);
 
         return 0;
 }
 
-static int client_context_read_log_ratelimit_interval(ClientContext *c) {
+static int cgroup_context_read_log_ratelimit_interval(CgroupContext *g) {
         _cleanup_free_ char *value = NULL;
         const char *p;
         int r;
 
-        assert(c);
+        assert(g);
 
-        if (!c->unit)
+        if (!g->unit)
                 return 0;
 
-        p = strjoina("/run/systemd/units/log-rate-limit-interval:", c->unit);
+        p = strjoina("/run/systemd/units/log-rate-limit-interval:", g->unit);
         r = readlink_malloc(p, &value);
         if (r < 0)
                 return r;
 
-        return safe_atou64(value, &c->log_ratelimit_interval);
+        return safe_atou64(value, &g->log_ratelimit_interval);
 }
 
-static int client_context_read_log_ratelimit_burst(ClientContext *c) {
+static int cgroup_context_read_log_ratelimit_burst(CgroupContext *g) {
         _cleanup_free_ char *value = NULL;
         const char *p;
         int r;
 
-        assert(c);
+        assert(g);
 
-        if (!c->unit)
+        if (!g->unit)
                 return 0;
 
-        p = strjoina("/run/systemd/units/log-rate-limit-burst:", c->unit);
+        p = strjoina("/run/systemd/units/log-rate-limit-burst:", g->unit);
         r = readlink_malloc(p, &value);
         if (r < 0)
                 return r;
 
-        return safe_atou(value, &c->log_ratelimit_burst);
+        return safe_atou(value, &g->log_ratelimit_burst);
+}
+
+static void cgroup_context_maybe_refresh(Server *s, CgroupContext *g, usec_t timestamp) {
+        assert(s);
+        assert(g);
+
+        /* The data is shared between all clients in the cgroup, hence is refreshed only once per refresh
+         * interval, regardless how many of them log. Old data we can't refresh is kept, like for the
+         * per-process data, unless it is older than the upper limit. */
+
+        if (g->timestamp != USEC_INFINITY) {
+                if (g->timestamp + REFRESH_USEC >= timestamp)
+                        return;
+
+                if (g->timestamp + MAX_USEC < timestamp)
+                        cgroup_context_reset(s, g);
+        }
+
+        (void) cgroup_context_read_invocation_id(g);
+        (void) cgroup_context_read_log_level_max(g);
+        (void) cgroup_context_read_extra_fields(g);
+        (void) cgroup_context_read_log_ratelimit_interval(g);
+        (void) cgroup_context_read_log_ratelimit_burst(g);
+
+        g->timestamp = timestamp;
+        g->generation++;
 }
 
 static void client_context_really_refresh(
@@ -515,19 +925,20 @@ static void client_context_really_refresh(
         if (timestamp == USEC_INFINITY)
                 timestamp = now(CLOCK_MONOTONIC);
 
+        if (c->pidfd < 0)
+                c->pidfd = pidfd_open(c->pid, 0); /* Failure is fine, we'll fall back to the PID then */
+
+        client_context_flush_fields(c);
+
         client_context_read_uid_gid(c, ucred);
-        client_context_read_basic(c);
         (void) client_context_read_label(c, label, label_size);
 
-        (void) audit_session_from_pid(c->pid, &c->auditid);
-        (void) audit_loginuid_from_pid(c->pid, &c->loginuid);
-
         (void) client_context_read_cgroup(s, c, unit_id);
-        (void) client_context_read_invocation_id(s, c);
-        (void) client_context_read_log_level_max(s, c);
-        (void) client_context_read_extra_fields(s, c);
-        (void) client_context_read_log_ratelimit_interval(c);
-        (void) client_context_read_log_ratelimit_burst(c);
+        if (c->cgroup_context)
+                cgroup_context_maybe_refresh(s, c->cgroup_context, timestamp);
+
+        /* The rest of the per-process data is only read once we know we need it */
+        c->process_stale = true;
 
         c->timestamp = timestamp;
 
@@ -556,8 +967,9 @@ void client_context_maybe_refresh(
                 goto refresh;
 
         /* If the data isn't pinned and if the cashed data is older than the upper limit, we flush it out
-         * entirely. This follows the logic that as long as an entry is pinned the PID reuse is unlikely. */
-        if (c->n_ref == 0 && c->timestamp + MAX_USEC < timestamp) {
+         * entirely. This follows the logic that as long as an entry is pinned the PID reuse is unlikely. If our
+         * pidfd tells us that the process is still around, the PID has not been reused either. */
+        if (c->n_ref == 0 && c->timestamp + MAX_USEC < timestamp && client_context_check_pidfd(c) <= 0) {
                 client_context_reset(s, c);
                 goto refresh;
         }
@@ -602,7 +1014,7 @@ static void client_context_try_shrink_to(Server *s, size_t limit) {
 
                         assert(c->n_ref == 0);
 
-                        if (!pid_is_unwaited(c->pid))
+                        if (client_context_process_gone(c))
                                 client_context_free(s, c);
                         else
                                 idx ++;
@@ -641,9 +1053,28 @@ void client_context_flush_all(Server *s) {
 
         assert(prioq_size(s->client_contexts_lru) == 0);
         assert(hashmap_size(s->client_contexts) == 0);
+        assert(hashmap_size(s->cgroup_contexts) == 0);
 
         s->client_contexts_lru = prioq_free(s->client_contexts_lru);
         s->client_contexts = hashmap_free(s->client_contexts);
+        s->cgroup_contexts = hashmap_free(s->cgroup_contexts);
+}
+
+ClientContext* client_context_ref(Server *s, ClientContext *c) {
+        assert(s);
+
+        if (!c)
+                return NULL;
+
+        if (c->in_lru) {
+                /* The entry wasn't pinned so far, let's remove it from the LRU list then */
+                assert(c->n_ref == 0);
+                assert_se(prioq_remove(s->client_contexts_lru, c, &c->lru_index) >= 0);
+                c->in_lru = false;
+        }
+
+        c->n_ref++;
+        return c;
 }
 
 static int client_context_get_internal(
@@ -666,17 +1097,10 @@ static int client_context_get_internal(
 
         c = hashmap_get(s->client_contexts, PID_TO_PTR(pid));
         if (c) {
+                s->n_client_context_hits++;
 
-                if (add_ref) {
-                        if (c->in_lru) {
-                                /* The entry wasn't pinned so far, let's remove it from the LRU list then */
-                                assert(c->n_ref == 0);
-                                assert_se(prioq_remove(s->client_contexts_lru, c, &c->lru_index) >= 0);
-                                c->in_lru = false;
-                        }
-
-                        c->n_ref++;
-                }
+                if (add_ref)
+                        client_context_ref(s, c);
 
                 client_context_maybe_refresh(s, c, ucred, label, label_len, unit_id, USEC_INFINITY);
 
@@ -684,6 +1108,8 @@ static int client_context_get_internal(
                 return 0;
         }
 
+        s->n_client_context_misses++;
+
         client_context_try_shrink_to(s, cache_max()-1);
 
         r = client_context_new(s, pid, &c);
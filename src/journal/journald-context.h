@@ -7,29 +7,20 @@
 
 #include "sd-id128.h"
 
+#include "journald-rate-limit.h"
 #include "time-util.h"
 
 typedef struct ClientContext ClientContext;
+typedef struct CgroupContext CgroupContext;
 
 #include "journald-server.h"
 
-struct ClientContext {
+/* Metadata that is derived from the cgroup of a client, and hence shared between all clients in the same
+ * cgroup. */
+struct CgroupContext {
         unsigned n_ref;
-        unsigned lru_index;
         usec_t timestamp;
-        bool in_lru;
-
-        pid_t pid;
-        uid_t uid;
-        gid_t gid;
-
-        char *comm;
-        char *exe;
-        char *cmdline;
-        char *capeff;
-
-        uint32_t auditid;
-        uid_t loginuid;
+        uint64_t generation; /* increased whenever the data is reread */
 
         char *cgroup;
         char *session;
@@ -43,9 +34,6 @@ struct ClientContext {
 
         sd_id128_t invocation_id;
 
-        char *label;
-        size_t label_size;
-
         int log_level_max;
 
         struct iovec *extra_fields_iovec;
@@ -55,6 +43,47 @@ struct ClientContext {
 
         usec_t log_ratelimit_interval;
         unsigned log_ratelimit_burst;
+
+        /* Shared by all cgroups of the unit, and kept around after the last of them is gone */
+        JournalRateLimitGroup *ratelimit_group;
+};
+
+struct ClientContext {
+        unsigned n_ref;
+        unsigned lru_index;
+        usec_t timestamp;
+        bool in_lru;
+
+        pid_t pid;
+        int pidfd;
+        uid_t uid;
+        gid_t gid;
+
+        /* Only read from /proc when a message of the client is actually stored, see
+         * client_context_read_process() */
+        bool process_stale;
+
+        char *comm;
+        char *exe;
+        char *cmdline;
+        char *capeff;
+
+        uint32_t auditid;
+        uid_t loginuid;
+
+        char *label;
+        size_t label_size;
+
+        CgroupContext *cgroup_context;
+
+        /* All of the above, formatted as journal fields, see client_context_get_fields() */
+        bool fields_valid;
+        uint64_t fields_generation;
+        char *fields_buffer;
+        struct iovec *fields_iovec;
+        size_t fields_n_iovec;
+        uint64_t *fields_hashes;
+        sd_id128_t fields_hashes_file_id;
 };
 
 int client_context_get(
@@ -73,6 +102,7 @@ int client_context_acquire(
                 const char *unit_id,
                 ClientContext **ret);
 
+ClientContext* client_context_ref(Server *s, ClientContext *c);
 ClientContext* client_context_release(Server *s, ClientContext *c);
 
 void client_context_maybe_refresh(
@@ -83,19 +113,28 @@ void client_context_maybe_refresh(
                 const char *unit_id,
                 usec_t tstamp);
 
+void client_context_read_process(ClientContext *c);
+
+int client_context_get_fields(ClientContext *c, const struct iovec **ret, size_t *ret_n);
+const uint64_t* client_context_get_field_hashes(ClientContext *c, JournalFile *f);
+
 void client_context_acquire_default(Server *s);
 void client_context_flush_all(Server *s);
 
 static inline size_t client_context_extra_fields_n_iovec(const ClientContext *c) {
-        return c ? c->extra_fields_n_iovec : 0;
+        return c && c->cgroup_context ? c->cgroup_context->extra_fields_n_iovec : 0;
+}
+
+static inline const char* client_context_unit(const ClientContext *c) {
+        return c && c->cgroup_context ? c->cgroup_context->unit : NULL;
 }
 
 static inline bool client_context_test_priority(const ClientContext *c, int priority) {
-        if (!c)
+        if (!c || !c->cgroup_context)
                 return true;
 
-        if (c->log_level_max < 0)
+        if (c->cgroup_context->log_level_max < 0)
                 return true;
 
-        return LOG_PRI(priority) <= c->log_level_max;
+        return LOG_PRI(priority) <= c->cgroup_context->log_level_max;
 }
@@ -1,18 +1,15 @@
 /* SPDX-License-Identifier: LGPL-2.1-or-later */
 
 #include <errno.h>
+#include <syslog.h>
 
 #include "alloc-util.h"
-#include "hashmap.h"
 #include "journald-rate-limit.h"
-#include "list.h"
-#include "random-util.h"
+#include "macro.h"
 #include "string-util.h"
-#include "time-util.h"
+#include "util.h"
 
-#define POOLS_MAX 5
-#define BUCKETS_MAX 127
-#define GROUPS_MAX 2047
+#define GROUPS_VACUUM_MIN 64U
 
 static const int priority_map[] = {
         [LOG_EMERG]   = 0,
@@ -25,134 +22,121 @@ static const int priority_map[] = {
         [LOG_DEBUG]   = 4
 };
 
-typedef struct JournalRateLimitPool JournalRateLimitPool;
-typedef struct JournalRateLimitGroup JournalRateLimitGroup;
+assert_cc(ELEMENTSOF(priority_map) == LOG_DEBUG + 1);
 
-struct JournalRateLimitPool {
-        usec_t begin;
-        unsigned num;
-        unsigned suppressed;
-};
-
-struct JournalRateLimitGroup {
-        JournalRateLimit *parent;
-
-        char *id;
-
-        /* Interval is stored to keep track of when the group expires */
-        usec_t interval;
-
-        JournalRateLimitPool pools[POOLS_MAX];
-        uint64_t hash;
-
-        LIST_FIELDS(JournalRateLimitGroup, bucket);
-        LIST_FIELDS(JournalRateLimitGroup, lru);
-};
-
-struct JournalRateLimit {
+static JournalRateLimitGroup *journal_ratelimit_group_free(JournalRateLimitGroup *g) {
+        if (!g)
+                return NULL;
 
-        JournalRateLimitGroup* buckets[BUCKETS_MAX];
-        JournalRateLimitGroup *lru, *lru_tail;
+        free(g->id);
+        return mfree(g);
+}
 
-        unsigned n_groups;
+DEFINE_TRIVIAL_CLEANUP_FUNC(JournalRateLimitGroup*, journal_ratelimit_group_free);
 
-        uint8_t hash_key[16];
-};
+DEFINE_PRIVATE_HASH_OPS_WITH_VALUE_DESTRUCTOR(group_hash_ops, char, string_hash_func, string_compare_func,
+                                              JournalRateLimitGroup, journal_ratelimit_group_free);
 
 JournalRateLimit *journal_ratelimit_new(void) {
         JournalRateLimit *r;
 
-        r = new0(JournalRateLimit, 1);
+        r = new(JournalRateLimit, 1);
         if (!r)
                 return NULL;
 
-        random_bytes(r->hash_key, sizeof(r->hash_key));
+        *r = (JournalRateLimit) {
+                .n_groups_vacuum = GROUPS_VACUUM_MIN,
+        };
 
         return r;
 }
 
-static void journal_ratelimit_group_free(JournalRateLimitGroup *g) {
-        assert(g);
-
-        if (g->parent) {
-                assert(g->parent->n_groups > 0);
-
-                if (g->parent->lru_tail == g)
-                        g->parent->lru_tail = g->lru_prev;
-
-                LIST_REMOVE(lru, g->parent->lru, g);
-                LIST_REMOVE(bucket, g->parent->buckets[g->hash % BUCKETS_MAX], g);
-
-                g->parent->n_groups--;
-        }
+JournalRateLimit *journal_ratelimit_free(JournalRateLimit *r) {
+        if (!r)
+                return NULL;
 
-        free(g->id);
-        free(g);
+        hashmap_free(r->groups);
+        return mfree(r);
 }
 
-void journal_ratelimit_free(JournalRateLimit *r) {
-        assert(r);
-
-        while (r->lru)
-                journal_ratelimit_group_free(r->lru);
-
-        free(r);
-}
+static bool journal_ratelimit_group_idle(const JournalRateLimitGroup *g, usec_t ts) {
+        assert(g);
 
-static bool journal_ratelimit_group_expired(JournalRateLimitGroup *g, usec_t ts) {
-        unsigned i;
+        /* A group that is not referenced, whose budget is full again and that has no suppressed messages to
+         * report behaves exactly like a new one, hence can be dropped without giving anybody extra budget */
 
-        assert(g);
+        if (g->n_ref > 0)
+                return false;
 
-        for (i = 0; i < POOLS_MAX; i++)
-                if (g->pools[i].begin + g->interval >= ts)
+        for (size_t i = 0; i < ELEMENTSOF(g->pools); i++)
+                if (g->pools[i].tat > ts || g->pools[i].suppressed > 0)
                         return false;
 
         return true;
 }
 
 static void journal_ratelimit_vacuum(JournalRateLimit *r, usec_t ts) {
+        JournalRateLimitGroup *g;
+
         assert(r);
 
-        /* Makes room for at least one new item, but drop all
-         * expored items too. */
+        HASHMAP_FOREACH(g, r->groups)
+                if (journal_ratelimit_group_idle(g, ts))
+                        journal_ratelimit_group_free(hashmap_remove(r->groups, g->id));
 
-        while (r->n_groups >= GROUPS_MAX ||
-               (r->lru_tail && journal_ratelimit_group_expired(r->lru_tail, ts)))
-                journal_ratelimit_group_free(r->lru_tail);
+        /* Only look again once the table doubled in size, so that this stays O(1) per group amortized */
+        r->n_groups_vacuum = MAX(hashmap_size(r->groups) * 2, GROUPS_VACUUM_MIN);
 }
 
-static JournalRateLimitGroup* journal_ratelimit_group_new(JournalRateLimit *r, const char *id, usec_t interval, usec_t ts) {
+int journal_ratelimit_group_acquire(JournalRateLimit *r, const char *id, usec_t ts, JournalRateLimitGroup **ret) {
+        _cleanup_(journal_ratelimit_group_freep) JournalRateLimitGroup *n = NULL;
         JournalRateLimitGroup *g;
+        int k;
 
         assert(r);
         assert(id);
+        assert(ret);
 
-        g = new0(JournalRateLimitGroup, 1);
-        if (!g)
-                return NULL;
+        /* Returns the group of the unit, which all cgroups of the unit share, with a new reference */
+
+        g = hashmap_get(r->groups, id);
+        if (g) {
+                g->n_ref++;
+                *ret = g;
+                return 0;
+        }
 
-        g->id = strdup(id);
-        if (!g->id)
-                goto fail;
+        if (hashmap_size(r->groups) >= r->n_groups_vacuum)
+                journal_ratelimit_vacuum(r, ts);
 
-        g->hash = siphash24_string(g->id, r->hash_key);
+        n = new(JournalRateLimitGroup, 1);
+        if (!n)
+                return -ENOMEM;
 
-        g->interval = interval;
+        *n = (JournalRateLimitGroup) {
+                .n_ref = 1,
+                .id = strdup(id),
+        };
+        if (!n->id)
+                return -ENOMEM;
 
-        journal_ratelimit_vacuum(r, ts);
+        k = hashmap_ensure_put(&r->groups, &group_hash_ops, n->id, n);
+        if (k < 0)
+                return k;
 
-        LIST_PREPEND(bucket, r->buckets[g->hash % BUCKETS_MAX], g);
-        LIST_PREPEND(lru, r->lru, g);
-        if (!g->lru_next)
-                r->lru_tail = g;
-        r->n_groups++;
+        *ret = TAKE_PTR(n);
+        return 1;
+}
+
+JournalRateLimitGroup *journal_ratelimit_group_release(JournalRateLimitGroup *g) {
+        if (!g)
+                return NULL;
 
-        g->parent = r;
-        return g;
+        /* The group stays in the table until it is idle, see journal_ratelimit_vacuum() */
+
+        assert(g->n_ref > 0);
+        g->n_ref--;
 
-fail:
-        journal_ratelimit_group_free(g);
         return NULL;
 }
 
@@ -184,71 +168,54 @@ static unsigned burst_modulate(unsigned burst, uint64_t available) {
         return burst;
 }
 
-int journal_ratelimit_test(JournalRateLimit *r, const char *id, usec_t rl_interval, unsigned rl_burst, int priority, uint64_t available) {
-        uint64_t h;
-        JournalRateLimitGroup *g;
+int journal_ratelimit_test(JournalRateLimitGroup *g, usec_t rl_interval, unsigned rl_burst, int priority, uint64_t available, usec_t ts) {
         JournalRateLimitPool *p;
-        unsigned burst;
-        usec_t ts;
+        usec_t step, tat;
+        unsigned burst, s;
 
-        assert(id);
+        assert(priority >= 0 && priority <= LOG_DEBUG);
 
         /* Returns:
          *
          * 0     → the log message shall be suppressed,
          * 1 + n → the log message shall be permitted, and n messages were dropped from the peer before
-         * < 0   → error
          */
 
-        if (!r)
+        if (!g || rl_interval == 0 || rl_burst == 0)
                 return 1;
 
-        ts = now(CLOCK_MONOTONIC);
-
-        h = siphash24_string(id, r->hash_key);
-        g = r->buckets[h % BUCKETS_MAX];
+        burst = MAX(burst_modulate(rl_burst, available), 1u);
+        step = MAX(rl_interval / burst, (usec_t) 1);
 
-        LIST_FOREACH(bucket, g, g)
-                if (streq(g->id, id))
-                        break;
+        g->interval = rl_interval;
+        g->burst = rl_burst;
 
-        if (!g) {
-                g = journal_ratelimit_group_new(r, id, rl_interval, ts);
-                if (!g)
-                        return -ENOMEM;
-        } else
-                g->interval = rl_interval;
+        p = &g->pools[priority_map[priority]];
 
-        if (rl_interval == 0 || rl_burst == 0)
-                return 1;
+        tat = MAX(p->tat, ts);
+        if (tat + step > ts + rl_interval) {
+                p->suppressed++;
+                g->n_suppressed++;
+                return 0;
+        }
 
-        burst = burst_modulate(rl_burst, available);
+        p->tat = tat + step;
 
-        p = &g->pools[priority_map[priority]];
+        s = p->suppressed;
+        p->suppressed = 0;
 
-        if (p->begin <= 0) {
-                p->suppressed = 0;
-                p->num = 1;
-                p->begin = ts;
-                return 1;
-        }
+        return 1 + s;
+}
 
-        if (p->begin + rl_interval < ts) {
-                unsigned s;
+unsigned journal_ratelimit_pending(const JournalRateLimitGroup *g) {
+        unsigned n = 0;
 
-                s = p->suppressed;
-                p->suppressed = 0;
-                p->num = 1;
-                p->begin = ts;
+        assert(g);
 
-                return 1 + s;
-        }
+        /* Returns the number of suppressed messages that have not been reported yet */
 
-        if (p->num < burst) {
-                p->num++;
-                return 1;
-        }
+        for (size_t i = 0; i < ELEMENTSOF(g->pools); i++)
+                n += g->pools[i].suppressed;
 
-        p->suppressed++;
-        return 0;
+        return n;
 }
@@ -1,10 +1,51 @@
 /* SPDX-License-Identifier: LGPL-2.1-or-later */
 #pragma once
 
+#include <inttypes.h>
+
+#include "hashmap.h"
 #include "time-util.h"
 
-typedef struct JournalRateLimit JournalRateLimit;
+/* Messages are rate limited separately for these classes of priorities, so that a flood of debug messages
+ * cannot push out the errors of the same service. */
+#define JOURNAL_RATELIMIT_POOLS_MAX 5
+
+typedef struct JournalRateLimitPool {
+        /* The theoretical arrival time of the next message: every permitted message moves it forward by
+         * interval/burst, and messages are suppressed while it is more than one interval ahead of now. This
+         * is equivalent to a bucket of 'burst' tokens that refills at a rate of burst per interval. */
+        usec_t tat;
+        unsigned suppressed;
+} JournalRateLimitPool;
+
+/* Rate limit state of one unit. Cgroup contexts of the unit keep a reference to it, hence looking it up is free
+ * and checking it is O(1). It outlives them though, so that a unit doesn't get a fresh budget whenever its
+ * contexts are evicted. */
+typedef struct JournalRateLimitGroup {
+        unsigned n_ref;
+        char *id;
+
+        /* The parameters last used, for reporting */
+        usec_t interval;
+        unsigned burst;
+
+        JournalRateLimitPool pools[JOURNAL_RATELIMIT_POOLS_MAX];
+        uint64_t n_suppressed; /* messages suppressed in total */
+} JournalRateLimitGroup;
+
+/* All groups, keyed by unit name. Groups that nobody references are dropped once their budget refilled
+ * completely and their suppressed messages were reported, as they are indistinguishable from new ones then. */
+typedef struct JournalRateLimit {
+        Hashmap *groups;
+        size_t n_groups_vacuum; /* look for groups to drop once there are this many */
+} JournalRateLimit;
 
 JournalRateLimit *journal_ratelimit_new(void);
-void journal_ratelimit_free(JournalRateLimit *r);
-int journal_ratelimit_test(JournalRateLimit *r, const char *id, usec_t rl_interval, unsigned rl_burst, int priority, uint64_t available);
+JournalRateLimit *journal_ratelimit_free(JournalRateLimit *r);
+DEFINE_TRIVIAL_CLEANUP_FUNC(JournalRateLimit*, journal_ratelimit_free);
+
+int journal_ratelimit_group_acquire(JournalRateLimit *r, const char *id, usec_t ts, JournalRateLimitGroup **ret);
+JournalRateLimitGroup *journal_ratelimit_group_release(JournalRateLimitGroup *g);
+
+int journal_ratelimit_test(JournalRateLimitGroup *g, usec_t rl_interval, unsigned rl_burst, int priority, uint64_t available, usec_t ts);
+unsigned journal_ratelimit_pending(const JournalRateLimitGroup *g);
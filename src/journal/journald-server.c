@@ -72,12 +72,48 @@
 /* The period to insert between posting changes for coalescing */
 #define POST_CHANGE_TIMER_INTERVAL_USEC (250*USEC_PER_MSEC)
 
+/* The maximum number of entries we queue up before writing them out in one go */
+#define BATCH_ENTRIES_MAX 64U
+
+/* How many datagrams to receive at once by default and at most, see DatagramBatchSize= */
+#define DEFAULT_DATAGRAM_BATCH_SIZE 16U
+#define DATAGRAM_BATCH_SIZE_MAX 1024U
+
+/* The smallest buffer we use for each datagram received in a batch */
+#define DATAGRAM_SLOT_SIZE_MIN (64U*1024U)
+
+/* We use NAME_MAX space for the SELinux label here. The kernel currently enforces no limit, but according to
+ * suggestions from the SELinux people this will change and it will probably be identical to NAME_MAX. For now
+ * we use that, but this should be updated one day when the final limit is known. */
+typedef CMSG_BUFFER_TYPE(CMSG_SPACE(sizeof(struct ucred)) +
+                         CMSG_SPACE(sizeof(struct timeval)) +
+                         CMSG_SPACE(sizeof(int)) + /* fd */
+                         CMSG_SPACE(NAME_MAX) /* selinux label */) DatagramControl;
+
+/* Each datagram received in a batch gets its own buffer and control data */
+struct DatagramSlot {
+        char *buffer;
+        DatagramControl control;
+};
+
+struct BatchEntry {
+        uid_t uid;
+        int priority;
+        sd_id128_t hashes_file_id;
+        uint64_t *hashes;
+        size_t n;
+        struct iovec iovec[]; /* followed by the hashes and the payload */
+};
+
 /* Pick a good default that is likely to fit into AF_UNIX and AF_INET SOCK_DGRAM datagrams, and even leaves some room
  * for a bit of additional metadata. */
 #define DEFAULT_LINE_MAX (48*1024)
 
 #define DEFERRED_CLOSES_MAX (4096)
 
+/* How many rotated files to sync and mark as archived in parallel at most, each in a thread of its own */
+#define DEFERRED_CLOSES_OFFLINING_MAX (16)
+
 #define IDLE_TIMEOUT_USEC (30*USEC_PER_SEC)
 
 static int determine_path_usage(
@@ -126,6 +162,71 @@ static int determine_path_usage(
         return 0;
 }
 
+static uint64_t spare_usage(JournalStorage *storage) {
+        struct stat st;
+
+        assert(storage);
+
+        /* The spare file isn't linked into the directory yet, hence nobody enumerating it sees the file, but
+         * it takes up disk space all the same. */
+        if (!storage->spare)
+                return 0;
+
+        if (fstat(storage->spare->fd, &st) < 0) {
+                log_debug_errno(errno, "Failed to stat spare file for %s, ignoring: %m", storage->spare->path);
+                return 0;
+        }
+
+        return (uint64_t) st.st_blocks * 512UL;
+}
+
+static int determine_storage_usage(
+                Server *s,
+                JournalStorage *storage,
+                uint64_t *ret_used,
+                uint64_t *ret_free) {
+
+        struct statvfs ss;
+        JournalFile *f;
+        int r;
+
+        assert(s);
+        assert(storage);
+        assert(ret_used);
+        assert(ret_free);
+
+        if (!storage->inventory) {
+                r = determine_path_usage(s, storage->path, ret_used, ret_free);
+                if (r < 0)
+                        return r;
+
+                *ret_used += spare_usage(storage);
+                return 0;
+        }
+
+        r = journal_inventory_ensure_scanned(storage->inventory);
+        if (r < 0)
+                return log_full_errno(r == -ENOENT ? LOG_DEBUG : LOG_ERR,
+                                      r, "Failed to enumerate %s: %m", storage->path);
+
+        /* The inventory knows the size of all files nobody writes to anymore, hence we only need to look at
+         * the files we have open ourselves. */
+        FOREACH_POINTER(f, s->runtime_journal, s->system_journal)
+                if (f)
+                        (void) journal_inventory_update(storage->inventory, f);
+
+        ORDERED_HASHMAP_FOREACH(f, s->user_journals)
+                (void) journal_inventory_update(storage->inventory, f);
+
+        if (statvfs(storage->path, &ss) < 0)
+                return log_error_errno(errno, "Failed to statvfs(%s): %m", storage->path);
+
+        *ret_free = ss.f_bsize * ss.f_bavail;
+        *ret_used = storage->inventory->usage + spare_usage(storage);
+
+        return 0;
+}
+
 static void cache_space_invalidate(JournalStorageSpace *space) {
         zero(*space);
 }
@@ -147,7 +248,7 @@ static int cache_space_refresh(Server *s, JournalStorage *storage) {
         if (space->timestamp != 0 && usec_add(space->timestamp, RECHECK_SPACE_USEC) > ts)
                 return 0;
 
-        r = determine_path_usage(s, storage->path, &vfs_used, &vfs_avail);
+        r = determine_storage_usage(s, storage, &vfs_used, &vfs_avail);
         if (r < 0)
                 return r;
 
@@ -257,26 +358,42 @@ static void server_add_acls(JournalFile *f, uid_t uid) {
 
 static int open_journal(
                 Server *s,
+                JournalStorage *storage,
                 bool reliably,
                 const char *fname,
                 int flags,
                 bool seal,
-                JournalMetrics *metrics,
                 JournalFile **ret) {
 
         _cleanup_(journal_file_closep) JournalFile *f = NULL;
+        struct stat st = {};
+        bool existed;
         int r;
 
         assert(s);
+        assert(storage);
         assert(fname);
         assert(ret);
 
+        /* journal_file_open_reliably() moves a corrupted file out of the way as *.journal~ and replaces it.
+         * Notice that, so that the file isn't missing from the inventory until the next restart. */
+        existed = reliably && storage->inventory && stat(fname, &st) >= 0;
+
         if (reliably)
                 r = journal_file_open_reliably(fname, flags, 0640, s->compress.enabled, s->compress.threshold_bytes,
-                                               seal, metrics, s->mmap, s->deferred_closes, NULL, &f);
+                                               seal, &storage->metrics, s->mmap, s->deferred_closes, NULL, &f);
         else
                 r = journal_file_open(-1, fname, flags, 0640, s->compress.enabled, s->compress.threshold_bytes, seal,
-                                      metrics, s->mmap, s->deferred_closes, NULL, &f);
+                                      &storage->metrics, s->mmap, s->deferred_closes, NULL, &f);
+
+        if (existed) {
+                struct stat now_st;
+
+                if (stat(fname, &now_st) < 0 || now_st.st_dev != st.st_dev || now_st.st_ino != st.st_ino) {
+                        log_debug("%s has been replaced, rescanning %s later.", fname, storage->path);
+                        storage->inventory->need_scan = true;
+                }
+        }
 
         if (r < 0)
                 return r;
@@ -303,6 +420,119 @@ static bool flushed_flag_is_set(Server *s) {
         return access(fn, F_OK) >= 0;
 }
 
+static void server_open_inventory(Server *s, JournalStorage *storage) {
+        int r;
+
+        assert(s);
+        assert(storage);
+
+        if (storage->inventory)
+                return;
+
+        /* The directory is enumerated the first time the inventory is used */
+        r = journal_inventory_new(storage->path, &storage->inventory);
+        if (r < 0)
+                log_warning_errno(r, "Failed to allocate inventory of %s, ignoring: %m", storage->path);
+}
+
+static JournalStorage* server_storage_for_file(Server *s, JournalFile *f) {
+        assert(s);
+        assert(f);
+
+        if (path_startswith(f->path, s->system_storage.path))
+                return &s->system_storage;
+        if (path_startswith(f->path, s->runtime_storage.path))
+                return &s->runtime_storage;
+
+        return NULL;
+}
+
+static JournalFile** server_spare_for(Server *s, JournalFile **f) {
+        assert(s);
+        assert(f);
+
+        /* Only the system journal and the runtime journal get a spare file, user journals don't. There
+         * may be lots of them, and each spare takes up as much space as a new journal file. */
+
+        if (f == &s->system_journal)
+                return &s->system_storage.spare;
+        if (f == &s->runtime_journal)
+                return &s->runtime_storage.spare;
+
+        return NULL;
+}
+
+static int dispatch_spare(sd_event_source *es, void *userdata) {
+        Server *s = userdata;
+        JournalStorage *storage;
+        JournalFile *f;
+        bool seal;
+        int r;
+
+        assert(s);
+
+        /* Prepares the file that takes the place of the journal we currently write to when that is
+         * rotated, so that the rotation doesn't have to wait for a new file to be allocated and synced to
+         * disk. We do this whenever there's nothing else to do. */
+
+        if (s->system_journal) {
+                storage = &s->system_storage;
+                f = s->system_journal;
+                seal = s->seal;
+        } else if (s->runtime_journal) {
+                storage = &s->runtime_storage;
+                f = s->runtime_journal;
+                seal = false;
+        } else
+                return 0;
+
+        if (storage->spare)
+                return 0;
+
+        /* Don't take up space if there's none left for journal files anyway */
+        r = cache_space_refresh(s, storage);
+        if (r < 0 || storage->space.available == 0)
+                return 0;
+
+        r = journal_file_open_spare(f, s->compress.enabled, s->compress.threshold_bytes, seal, &storage->spare);
+        if (r < 0) {
+                log_debug_errno(r, "Failed to prepare spare file for %s, ignoring: %m", f->path);
+                return 0;
+        }
+
+        log_debug("Prepared spare file for %s.", f->path);
+
+        /* The spare counts towards the usage of the storage */
+        cache_space_invalidate(&storage->space);
+
+        return 0;
+}
+
+static void server_schedule_spare(Server *s) {
+        int r;
+
+        assert(s);
+
+        if (s->spare_event_source) {
+                r = sd_event_source_set_enabled(s->spare_event_source, SD_EVENT_ONESHOT);
+                if (r < 0)
+                        log_debug_errno(r, "Failed to enable spare file event source, ignoring: %m");
+                return;
+        }
+
+        r = sd_event_add_defer(s->event, &s->spare_event_source, dispatch_spare, s);
+        if (r < 0) {
+                log_debug_errno(r, "Failed to add spare file event source, ignoring: %m");
+                return;
+        }
+
+        r = sd_event_source_set_priority(s->spare_event_source, SD_EVENT_PRIORITY_IDLE);
+        if (r < 0)
+                log_debug_errno(r, "Failed to set priority of spare file event source, ignoring: %m");
+
+        (void) sd_event_source_set_description(s->spare_event_source, "journal-spare");
+}
+
 static int system_journal_open(Server *s, bool flush_requested, bool relinquish_requested) {
         const char *fn;
         int r = 0;
@@ -322,11 +552,13 @@ static int system_journal_open(Server *s, bool flush_requested, bool relinquish_
                 (void) mkdir(s->system_storage.path, 0755);
 
                 fn = strjoina(s->system_storage.path, "/system.journal");
-                r = open_journal(s, true, fn, O_RDWR|O_CREAT, s->seal, &s->system_storage.metrics, &s->system_journal);
+                r = open_journal(s, &s->system_storage, true, fn, O_RDWR|O_CREAT, s->seal, &s->system_journal);
                 if (r >= 0) {
                         server_add_acls(s->system_journal, 0);
+                        server_open_inventory(s, &s->system_storage);
                         (void) cache_space_refresh(s, &s->system_storage);
                         patch_min_use(&s->system_storage);
+                        server_schedule_spare(s);
                 } else {
                         if (!IN_SET(r, -ENOENT, -EROFS))
                                 log_warning_errno(r, "Failed to open system journal: %m");
@@ -355,7 +587,7 @@ static int system_journal_open(Server *s, bool flush_requested, bool relinquish_
                          * if it already exists, so that we can flush
                          * it into the system journal */
 
-                        r = open_journal(s, false, fn, O_RDWR, false, &s->runtime_storage.metrics, &s->runtime_journal);
+                        r = open_journal(s, &s->runtime_storage, false, fn, O_RDWR, false, &s->runtime_journal);
                         if (r < 0) {
                                 if (r != -ENOENT)
                                         log_warning_errno(r, "Failed to open runtime journal: %m");
@@ -370,15 +602,17 @@ static int system_journal_open(Server *s, bool flush_requested, bool relinquish_
                         (void) mkdir_parents(s->runtime_storage.path, 0755);
                         (void) mkdir(s->runtime_storage.path, 0750);
 
-                        r = open_journal(s, true, fn, O_RDWR|O_CREAT, false, &s->runtime_storage.metrics, &s->runtime_journal);
+                        r = open_journal(s, &s->runtime_storage, true, fn, O_RDWR|O_CREAT, false, &s->runtime_journal);
                         if (r < 0)
                                 return log_error_errno(r, "Failed to open runtime journal: %m");
                 }
 
                 if (s->runtime_journal) {
                         server_add_acls(s->runtime_journal, 0);
+                        server_open_inventory(s, &s->runtime_storage);
                         (void) cache_space_refresh(s, &s->runtime_storage);
                         patch_min_use(&s->runtime_storage);
+                        server_schedule_spare(s);
                 }
         }
 
@@ -433,7 +667,7 @@ static JournalFile* find_journal(Server *s, uid_t uid) {
                 (void) journal_file_close(f);
         }
 
-        r = open_journal(s, true, p, O_RDWR|O_CREAT, s->seal, &s->system_storage.metrics, &f);
+        r = open_journal(s, &s->system_storage, true, p, O_RDWR|O_CREAT, s->seal, &f);
         if (r < 0)
                 return s->system_journal;
 
@@ -447,6 +681,30 @@ static JournalFile* find_journal(Server *s, uid_t uid) {
         return f;
 }
 
+static JournalFile* peek_journal(Server *s, uid_t uid) {
+        JournalFile *f;
+
+        assert(s);
+
+        /* Like find_journal(), but doesn't open or create anything, and only returns the journal file
+         * entries of the specified UID would be written to right now, if it is open already. */
+
+        if (s->runtime_journal)
+                return s->runtime_journal;
+
+        if (!IN_SET(s->storage, STORAGE_AUTO, STORAGE_PERSISTENT))
+                return NULL;
+
+        if (uid_for_system_journal(uid))
+                return s->system_journal;
+
+        f = ordered_hashmap_get(s->user_journals, UID_TO_PTR(uid));
+        if (f)
+                return f;
+
+        return s->system_journal;
+}
+
 static int do_rotate(
                 Server *s,
                 JournalFile **f,
@@ -454,20 +712,46 @@ static int do_rotate(
                 bool seal,
                 uint32_t uid) {
 
+        _cleanup_(journal_inventory_file_freep) JournalInventoryFile *archived = NULL;
+        JournalStorage *storage;
+        JournalFile **spare;
         int r;
         assert(s);
 
         if (!*f)
                 return -EINVAL;
 
-        r = journal_file_rotate(f, s->compress.enabled, s->compress.threshold_bytes, seal, s->deferred_closes);
-        if (r < 0) {
-                if (*f)
-                        return log_error_errno(r, "Failed to rotate %s: %m", (*f)->path);
-                else
-                        return log_error_errno(r, "Failed to create new %s journal: %m", name);
+        /* Take note of the file while we still have it, so that it can be added to the inventory of its
+         * directory once it is archived. */
+        storage = server_storage_for_file(s, *f);
+        if (storage && storage->inventory) {
+                r = journal_inventory_file_new_archived(storage->inventory, *f, &archived);
+                if (r < 0) {
+                        log_debug_errno(r, "Failed to describe %s for the inventory, rescanning later: %m", (*f)->path);
+                        storage->inventory->need_scan = true;
+                }
         }
 
+        spare = server_spare_for(s, f);
+        if (spare && *spare)
+                r = journal_file_rotate_to_spare(f, spare, s->deferred_closes);
+        else
+                r = journal_file_rotate(f, s->compress.enabled, s->compress.threshold_bytes, seal, s->deferred_closes);
+        if (spare)
+                server_schedule_spare(s);
+        if (r < 0 && *f)
+                return log_error_errno(r, "Failed to rotate %s: %m", (*f)->path);
+
+        /* The old file has been archived at this point, even if we failed to create the new one */
+        if (archived)
+                (void) journal_inventory_add_archived(storage->inventory, TAKE_PTR(archived));
+
+        if (r < 0)
+                return log_error_errno(r, "Failed to create new %s journal: %m", name);
+
+        if (storage && storage->inventory)
+                (void) journal_inventory_update(storage->inventory, *f);
+
         server_add_acls(*f, uid);
         return r;
 }
@@ -504,6 +788,33 @@ static void server_vacuum_deferred_closes(Server *s) {
         }
 }
 
+static void server_limit_offlining(Server *s) {
+        JournalFile *f;
+        unsigned n = 0;
+
+        assert(s);
+
+        /* Rotated files are synced and marked as archived in a thread each, see journal_initiate_close().
+         * Don't start more of those than the disk can reasonably serve at the same time, but wait for some
+         * of them to finish first. */
+
+        SET_FOREACH(f, s->deferred_closes)
+                if (journal_file_is_offlining(f))
+                        n++;
+
+        SET_FOREACH(f, s->deferred_closes) {
+                if (n < DEFERRED_CLOSES_OFFLINING_MAX)
+                        break;
+
+                if (!journal_file_is_offlining(f))
+                        continue;
+
+                (void) set_remove(s->deferred_closes, f);
+                (void) journal_file_close(f);
+                n--;
+        }
+}
+
 static int vacuum_offline_user_journals(Server *s) {
         _cleanup_closedir_ DIR *d = NULL;
         int r;
@@ -519,6 +830,7 @@ static int vacuum_offline_user_journals(Server *s) {
         }
 
         for (;;) {
+                _cleanup_(journal_inventory_file_freep) JournalInventoryFile *archived = NULL;
                 _cleanup_free_ char *u = NULL, *full = NULL;
                 _cleanup_close_ int fd = -1;
                 const char *a, *b;
@@ -569,6 +881,7 @@ static int vacuum_offline_user_journals(Server *s) {
 
                 /* Make some room in the set of deferred close()s */
                 server_vacuum_deferred_closes(s);
+                server_limit_offlining(s);
 
                 /* Open the file briefly, so that we can archive it */
                 r = journal_file_open(fd,
@@ -592,14 +905,28 @@ static int vacuum_offline_user_journals(Server *s) {
                         else
                                 log_debug("Successfully moved %s out of the way.", full);
 
+                        /* The file is now known under a different name */
+                        if (s->system_storage.inventory)
+                                s->system_storage.inventory->need_scan = true;
+
                         continue;
                 }
 
                 TAKE_FD(fd); /* Donated to journal_file_open() */
 
+                if (s->system_storage.inventory) {
+                        r = journal_inventory_file_new_archived(s->system_storage.inventory, f, &archived);
+                        if (r < 0) {
+                                log_debug_errno(r, "Failed to describe %s for the inventory, rescanning later: %m", full);
+                                s->system_storage.inventory->need_scan = true;
+                        }
+                }
+
                 r = journal_file_archive(f);
                 if (r < 0)
                         log_debug_errno(r, "Failed to archive journal file '%s', ignoring: %m", full);
+                else if (archived)
+                        (void) journal_inventory_add_archived(s->system_storage.inventory, TAKE_PTR(archived));
 
                 f = journal_initiate_close(f, s->deferred_closes);
         }
@@ -620,6 +947,9 @@ void server_rotate(Server *s) {
 
         /* Then, rotate all user journals we have open (keeping them open) */
         ORDERED_HASHMAP_FOREACH_KEY(f, k, s->user_journals) {
+                server_vacuum_deferred_closes(s);
+                server_limit_offlining(s);
+
                 r = do_rotate(s, &f, "user", s->seal, PTR_TO_UID(k));
                 if (r >= 0)
                         ordered_hashmap_replace(s->user_journals, k, f);
@@ -661,8 +991,118 @@ void server_sync(Server *s) {
         s->sync_scheduled = false;
 }
 
-static void do_vacuum(Server *s, JournalStorage *storage, bool verbose) {
+void server_data_cache_stats(Server *s, uint64_t *ret_hits, uint64_t *ret_misses) {
+        uint64_t hits = 0, misses = 0;
+        JournalFile *f;
+
+        assert(s);
+        assert(ret_hits);
+        assert(ret_misses);
+
+        /* Sums up how data objects were looked up in the journal files that are currently open. Note that
+         * the counters start from zero again whenever a file is rotated. */
+
+        FOREACH_POINTER(f, s->runtime_journal, s->system_journal)
+                if (f) {
+                        hits += f->n_data_cache_hits;
+                        misses += f->n_data_cache_misses;
+                }
+
+        ORDERED_HASHMAP_FOREACH(f, s->user_journals) {
+                hits += f->n_data_cache_hits;
+                misses += f->n_data_cache_misses;
+        }
+
+        *ret_hits = hits;
+        *ret_misses = misses;
+}
+
+static void vacuum_jobs_free(Server *s) {
+        assert(s);
+        assert(!s->vacuum_thread_running);
+
+        for (size_t i = 0; i < s->n_vacuum_jobs; i++) {
+                free(s->vacuum_jobs[i].directory);
+                journal_inventory_file_free_many(s->vacuum_jobs[i].victims, s->vacuum_jobs[i].n_victims);
+        }
+
+        s->vacuum_jobs = mfree(s->vacuum_jobs);
+        s->n_vacuum_jobs = 0;
+}
+
+static void* server_vacuum_thread(void *userdata) {
+        Server *s = userdata;
+
+        /* The main thread doesn't touch the jobs until it joined us */
+
+        for (size_t i = 0; i < s->n_vacuum_jobs; i++) {
+                VacuumJob *j = s->vacuum_jobs + i;
+
+                (void) journal_vacuum_delete(j->directory, TAKE_PTR(j->victims), j->n_victims, s->vacuum_verbose);
+                j->n_victims = 0;
+        }
+
+        return NULL;
+}
+
+void server_vacuum_wait(Server *s) {
+        int r;
+
+        assert(s);
+
+        if (s->vacuum_thread_running) {
+                r = pthread_join(s->vacuum_thread, NULL);
+                if (r > 0)
+                        log_warning_errno(r, "Failed to join vacuum thread, ignoring: %m");
+
+                s->vacuum_thread_running = false;
+        }
+
+        vacuum_jobs_free(s);
+}
+
+static void vacuum_start(Server *s, bool verbose, bool wait) {
+        sigset_t ss, saved_ss;
+        int r, k;
+
+        assert(s);
+        assert(!s->vacuum_thread_running);
+
+        if (s->n_vacuum_jobs == 0)
+                return;
+
+        s->vacuum_verbose = verbose;
+
+        /* Deleting large files takes a while, since their blocks are deallocated. Unless we need the space
+         * right away, let's not hold up the processing of log messages for that. */
+        if (!wait) {
+                assert_se(sigfillset(&ss) >= 0);
+
+                r = pthread_sigmask(SIG_BLOCK, &ss, &saved_ss);
+                if (r == 0) {
+                        r = pthread_create(&s->vacuum_thread, NULL, server_vacuum_thread, s);
+
+                        k = pthread_sigmask(SIG_SETMASK, &saved_ss, NULL);
+                        if (k > 0)
+                                log_warning_errno(k, "Failed to restore signal mask, ignoring: %m");
+                }
+                if (r == 0) {
+                        s->vacuum_thread_running = true;
+                        return;
+                }
 
+                log_debug_errno(r, "Failed to start vacuum thread, deleting files synchronously: %m");
+        }
+
+        (void) server_vacuum_thread(s);
+        vacuum_jobs_free(s);
+}
+
+static void do_vacuum(Server *s, JournalStorage *storage, bool verbose) {
+        JournalInventoryFile **victims = NULL;
+        _cleanup_free_ char *directory = NULL;
+        size_t n_victims = 0;
+        uint64_t limit, spare;
         int r;
 
         assert(s);
@@ -670,23 +1110,69 @@ static void do_vacuum(Server *s, JournalStorage *storage, bool verbose) {
 
         (void) cache_space_refresh(s, storage);
 
+        /* The spare file can't be vacuumed, hence leave room for it. A limit of 0 means none at all. */
+        limit = storage->space.limit;
+        spare = spare_usage(storage);
+        if (limit > 0 && spare > 0)
+                limit = MAX(LESS_BY(limit, spare), UINT64_C(1));
+
         if (verbose)
                 server_space_usage_message(s, storage);
 
-        r = journal_directory_vacuum(storage->path, storage->space.limit,
+        if (!storage->inventory) {
+                r = journal_directory_vacuum(storage->path, limit,
+                                             storage->metrics.n_max_files, s->max_retention_usec,
+                                             &s->oldest_file_usec, verbose);
+                if (r < 0 && r != -ENOENT)
+                        log_warning_errno(r, "Failed to vacuum %s, ignoring: %m", storage->path);
+
+                cache_space_invalidate(&storage->space);
+                return;
+        }
+
+        /* A verbose vacuum is explicitly requested, hence a good opportunity to look at the whole directory
+         * again, in case somebody else added files behind our back. */
+        if (verbose)
+                storage->inventory->need_scan = true;
+
+        r = journal_inventory_vacuum(storage->inventory, limit,
                                      storage->metrics.n_max_files, s->max_retention_usec,
-                                     &s->oldest_file_usec, verbose);
-        if (r < 0 && r != -ENOENT)
-                log_warning_errno(r, "Failed to vacuum %s, ignoring: %m", storage->path);
+                                     &s->oldest_file_usec, &victims, &n_victims);
+        if (r < 0) {
+                if (r != -ENOENT)
+                        log_warning_errno(r, "Failed to vacuum %s, ignoring: %m", storage->path);
+                return;
+        }
 
         cache_space_invalidate(&storage->space);
+
+        if (n_victims == 0) {
+                free(victims);
+                return;
+        }
+
+        directory = strdup(storage->path);
+        if (!directory || !GREEDY_REALLOC(s->vacuum_jobs, s->n_vacuum_jobs + 1)) {
+                log_oom();
+                (void) journal_vacuum_delete(storage->path, victims, n_victims, verbose);
+                return;
+        }
+
+        s->vacuum_jobs[s->n_vacuum_jobs++] = (VacuumJob) {
+                .directory = TAKE_PTR(directory),
+                .victims = victims,
+                .n_victims = n_victims,
+        };
 }
 
-int server_vacuum(Server *s, bool verbose) {
+int server_vacuum(Server *s, bool verbose, bool wait) {
         assert(s);
 
         log_debug("Vacuuming...");
 
+        /* Let the previous run finish first, so that the space it frees is accounted for */
+        server_vacuum_wait(s);
+
         s->oldest_file_usec = 0;
 
         if (s->system_journal)
@@ -694,6 +1180,8 @@ int server_vacuum(Server *s, bool verbose) {
         if (s->runtime_journal)
                 do_vacuum(s, &s->runtime_storage, verbose);
 
+        vacuum_start(s, verbose, wait);
+
         return 0;
 }
 
@@ -789,8 +1277,24 @@ static bool shall_try_append_again(JournalFile *f, int r) {
         }
 }
 
-static void write_to_journal(Server *s, uid_t uid, struct iovec *iovec, size_t n, int priority) {
-        bool vacuumed = false, rotate = false;
+static const uint64_t* hashes_for_file(JournalFile *f, const uint64_t *hashes, sd_id128_t file_id) {
+        assert(f);
+
+        /* Precalculated hashes may only be used for the file they were calculated for. The file we write to
+         * might have been rotated in the meantime. */
+
+        return hashes && sd_id128_equal(f->header->file_id, file_id) ? hashes : NULL;
+}
+
+static void write_to_journal_now(
+                Server *s,
+                uid_t uid,
+                struct iovec *iovec,
+                const uint64_t *hashes, sd_id128_t hashes_file_id,
+                size_t n,
+                int priority) {
+
+        bool rotate = false;
         struct dual_timestamp ts;
         JournalFile *f;
         int r;
@@ -827,8 +1331,7 @@ static void write_to_journal(Server *s, uid_t uid, struct iovec *iovec, size_t n
 
         if (rotate) {
                 server_rotate(s);
-                server_vacuum(s, false);
-                vacuumed = true;
+                server_vacuum(s, false, false);
 
                 f = find_journal(s, uid);
                 if (!f)
@@ -837,32 +1340,218 @@ static void write_to_journal(Server *s, uid_t uid, struct iovec *iovec, size_t n
 
         s->last_realtime_clock = ts.realtime;
 
-        r = journal_file_append_entry(f, &ts, NULL, iovec, n, &s->seqnum, NULL, NULL);
+        r = journal_file_append_entry_full(f, &ts, NULL, iovec, hashes_for_file(f, hashes, hashes_file_id), n, &s->seqnum, NULL, NULL);
         if (r >= 0) {
                 server_schedule_sync(s, priority);
                 return;
         }
 
-        if (vacuumed || !shall_try_append_again(f, r)) {
+        if (!shall_try_append_again(f, r)) {
                 log_error_errno(r, "Failed to write entry (%zu items, %zu bytes), ignoring: %m", n, IOVEC_TOTAL_SIZE(iovec, n));
                 return;
         }
 
-        server_rotate(s);
-        server_vacuum(s, false);
+        if (rotate)
+                /* We are writing to a fresh file already, but the files picked by the vacuum we started
+                 * might not have been deleted yet. Let's wait for that. */
+                server_vacuum_wait(s);
+        else {
+                server_rotate(s);
+                server_vacuum(s, false, true);
 
-        f = find_journal(s, uid);
-        if (!f)
-                return;
+                f = find_journal(s, uid);
+                if (!f)
+                        return;
+        }
 
         log_debug("Retrying write.");
-        r = journal_file_append_entry(f, &ts, NULL, iovec, n, &s->seqnum, NULL, NULL);
+        r = journal_file_append_entry_full(f, &ts, NULL, iovec, hashes_for_file(f, hashes, hashes_file_id), n, &s->seqnum, NULL, NULL);
         if (r < 0)
                 log_error_errno(r, "Failed to write entry (%zu items, %zu bytes) despite vacuuming, ignoring: %m", n, IOVEC_TOTAL_SIZE(iovec, n));
         else
                 server_schedule_sync(s, priority);
 }
 
+static BatchEntry* batch_entry_new(
+                uid_t uid,
+                const struct iovec *iovec,
+                const uint64_t *hashes, sd_id128_t hashes_file_id,
+                size_t n,
+                int priority) {
+
+        BatchEntry *e;
+        uint8_t *p;
+
+        /* Copies the fields, since they usually point to the stack of the caller */
+
+        e = malloc(offsetof(BatchEntry, iovec) + n * sizeof(struct iovec) + (hashes ? n * sizeof(uint64_t) : 0) +
+                   IOVEC_TOTAL_SIZE(iovec, n));
+        if (!e)
+                return NULL;
+
+        e->uid = uid;
+        e->priority = priority;
+        e->hashes_file_id = hashes_file_id;
+        e->n = n;
+
+        p = (uint8_t*) (e->iovec + n);
+
+        if (hashes) {
+                e->hashes = memcpy(p, hashes, n * sizeof(uint64_t));
+                p += n * sizeof(uint64_t);
+        } else
+                e->hashes = NULL;
+
+        for (size_t i = 0; i < n; i++) {
+                e->iovec[i] = IOVEC_MAKE(p, iovec[i].iov_len);
+                memcpy_safe(p, iovec[i].iov_base, iovec[i].iov_len);
+                p += iovec[i].iov_len;
+        }
+
+        return e;
+}
+
+static void write_batch_to_journal(Server *s, uid_t uid, BatchEntry **batch, size_t n_batch) {
+        JournalFileEntry *entries;
+        struct dual_timestamp ts;
+        size_t n_done = 0;
+        int priority = LOG_DEBUG;
+        JournalFile *f;
+        int r;
+
+        assert(s);
+        assert(batch);
+        assert(n_batch > 0);
+
+        assert_se(sd_event_now(s->event, CLOCK_REALTIME, &ts.realtime) >= 0);
+        assert_se(sd_event_now(s->event, CLOCK_MONOTONIC, &ts.monotonic) >= 0);
+
+        /* Leave time jumps and rotation to the single entry logic, it knows how to deal with them */
+        if (ts.realtime < s->last_realtime_clock)
+                goto fallback;
+
+        f = find_journal(s, uid);
+        if (!f)
+                return;
+
+        if (journal_file_rotate_suggested(f, s->max_file_usec))
+                goto fallback;
+
+        s->last_realtime_clock = ts.realtime;
+
+        entries = newa(JournalFileEntry, n_batch);
+        for (size_t i = 0; i < n_batch; i++) {
+                entries[i] = (JournalFileEntry) {
+                        .iovec = batch[i]->iovec,
+                        .hashes = hashes_for_file(f, batch[i]->hashes, batch[i]->hashes_file_id),
+                        .n_iovec = batch[i]->n,
+                };
+
+                priority = MIN(priority, batch[i]->priority);
+        }
+
+        r = journal_file_append_entries(f, &ts, entries, n_batch, &s->seqnum, &n_done);
+        if (r >= 0) {
+                server_schedule_sync(s, priority);
+                return;
+        }
+
+        log_debug_errno(r, "Failed to write %zu of %zu entries in one go, writing them one by one: %m",
+                        n_batch - n_done, n_batch);
+
+        if (n_done > 0)
+                server_schedule_sync(s, priority);
+
+fallback:
+        for (size_t i = n_done; i < n_batch; i++)
+                write_to_journal_now(s, uid,
+                                     batch[i]->iovec,
+                                     batch[i]->hashes, batch[i]->hashes_file_id,
+                                     batch[i]->n,
+                                     batch[i]->priority);
+}
+
+static void server_flush_batch(Server *s) {
+        size_t i = 0;
+
+        assert(s);
+
+        while (i < s->n_batch) {
+                size_t k = i + 1;
+
+                /* Entries for the same journal file are written out together */
+                while (k < s->n_batch && s->batch[k]->uid == s->batch[i]->uid)
+                        k++;
+
+                write_batch_to_journal(s, s->batch[i]->uid, s->batch + i, k - i);
+
+                i = k;
+        }
+
+        for (i = 0; i < s->n_batch; i++)
+                free(s->batch[i]);
+
+        s->n_batch = 0;
+}
+
+void server_begin_batch(Server *s) {
+        assert(s);
+
+        /* Between server_begin_batch() and server_end_batch() log messages are not written immediately but
+         * queued up, and then appended to the journal files together, which is cheaper. Use this when
+         * dispatching multiple messages that are available at once. */
+
+        s->batch_depth++;
+}
+
+void server_end_batch(Server *s) {
+        assert(s);
+        assert(s->batch_depth > 0);
+
+        if (--s->batch_depth > 0)
+                return;
+
+        server_flush_batch(s);
+}
+
+static void write_to_journal(
+                Server *s,
+                uid_t uid,
+                struct iovec *iovec,
+                const uint64_t *hashes, sd_id128_t hashes_file_id,
+                size_t n,
+                int priority) {
+
+        BatchEntry *e;
+
+        assert(s);
+        assert(iovec);
+        assert(n > 0);
+
+        if (s->batch_depth == 0) {
+                write_to_journal_now(s, uid, iovec, hashes, hashes_file_id, n, priority);
+                return;
+        }
+
+        if (s->n_batch >= BATCH_ENTRIES_MAX)
+                server_flush_batch(s);
+
+        if (!GREEDY_REALLOC(s->batch, s->n_batch + 1))
+                goto fallback;
+
+        e = batch_entry_new(uid, iovec, hashes, hashes_file_id, n, priority);
+        if (!e)
+                goto fallback;
+
+        s->batch[s->n_batch++] = e;
+        return;
+
+fallback:
+        /* Keep the order of entries */
+        server_flush_batch(s);
+        write_to_journal_now(s, uid, iovec, hashes, hashes_file_id, n, priority);
+}
+
 #define IOVEC_ADD_NUMERIC_FIELD(iovec, n, value, type, isset, format, field)  \
         if (isset(value)) {                                             \
                 char *k;                                                \
@@ -897,15 +1586,21 @@ static void write_to_journal(Server *s, uid_t uid, struct iovec *iovec, size_t n
 static void dispatch_message_real(
                 Server *s,
                 struct iovec *iovec, size_t n, size_t m,
-                const ClientContext *c,
+                ClientContext *c,
                 const struct timeval *tv,
                 int priority,
                 pid_t object_pid) {
 
         char source_time[sizeof("_SOURCE_REALTIME_TIMESTAMP=") + DECIMAL_STR_MAX(usec_t)];
-        _cleanup_free_ char *cmdline1 = NULL, *cmdline2 = NULL;
+        sd_id128_t hashes_file_id = SD_ID128_NULL;
+        const struct iovec *fields = NULL;
+        size_t fields_index = 0, n_fields = 0;
+        _cleanup_free_ char *cmdline2 = NULL;
+        uint64_t *hashes = NULL;
         uid_t journal_uid;
         ClientContext *o;
+        JournalFile *f;
+        int r;
 
         assert(s);
         assert(iovec);
@@ -916,42 +1611,29 @@ static void dispatch_message_real(
                client_context_extra_fields_n_iovec(c) <= m);
 
         if (c) {
-                IOVEC_ADD_NUMERIC_FIELD(iovec, n, c->pid, pid_t, pid_is_valid, PID_FMT, "_PID");
-                IOVEC_ADD_NUMERIC_FIELD(iovec, n, c->uid, uid_t, uid_is_valid, UID_FMT, "_UID");
-                IOVEC_ADD_NUMERIC_FIELD(iovec, n, c->gid, gid_t, gid_is_valid, GID_FMT, "_GID");
-
-                IOVEC_ADD_STRING_FIELD(iovec, n, c->comm, "_COMM"); /* At most TASK_COMM_LENGTH (16 bytes) */
-                IOVEC_ADD_STRING_FIELD(iovec, n, c->exe, "_EXE"); /* A path, so at most PATH_MAX (4096 bytes) */
-
-                if (c->cmdline)
-                        /* At most _SC_ARG_MAX (2MB usually), which is too much to put on stack.
-                         * Let's use a heap allocation for this one. */
-                        cmdline1 = set_iovec_string_field(iovec, &n, "_CMDLINE=", c->cmdline);
-
-                IOVEC_ADD_STRING_FIELD(iovec, n, c->capeff, "_CAP_EFFECTIVE"); /* Read from /proc/.../status */
-                IOVEC_ADD_SIZED_FIELD(iovec, n, c->label, c->label_size, "_SELINUX_CONTEXT");
-                IOVEC_ADD_NUMERIC_FIELD(iovec, n, c->auditid, uint32_t, audit_session_is_valid, "%" PRIu32, "_AUDIT_SESSION");
-                IOVEC_ADD_NUMERIC_FIELD(iovec, n, c->loginuid, uid_t, uid_is_valid, UID_FMT, "_AUDIT_LOGINUID");
-
-                IOVEC_ADD_STRING_FIELD(iovec, n, c->cgroup, "_SYSTEMD_CGROUP"); /* A path */
-                IOVEC_ADD_STRING_FIELD(iovec, n, c->session, "_SYSTEMD_SESSION");
-                IOVEC_ADD_NUMERIC_FIELD(iovec, n, c->owner_uid, uid_t, uid_is_valid, UID_FMT, "_SYSTEMD_OWNER_UID");
-                IOVEC_ADD_STRING_FIELD(iovec, n, c->unit, "_SYSTEMD_UNIT"); /* Unit names are bounded by UNIT_NAME_MAX */
-                IOVEC_ADD_STRING_FIELD(iovec, n, c->user_unit, "_SYSTEMD_USER_UNIT");
-                IOVEC_ADD_STRING_FIELD(iovec, n, c->slice, "_SYSTEMD_SLICE");
-                IOVEC_ADD_STRING_FIELD(iovec, n, c->user_slice, "_SYSTEMD_USER_SLICE");
-
-                IOVEC_ADD_ID128_FIELD(iovec, n, c->invocation_id, "_SYSTEMD_INVOCATION_ID");
-
-                if (c->extra_fields_n_iovec > 0) {
-                        memcpy(iovec + n, c->extra_fields_iovec, c->extra_fields_n_iovec * sizeof(struct iovec));
-                        n += c->extra_fields_n_iovec;
+                /* Make sure the context isn't flushed out of the cache while we use its fields, for example
+                 * when looking up the context of the object PID below. */
+                client_context_ref(s, c);
+
+                client_context_read_process(c);
+
+                /* The fields of the client are formatted only once, see journald-context.c */
+                r = client_context_get_fields(c, &fields, &n_fields);
+                if (r < 0)
+                        log_debug_errno(r, "Failed to format metadata of client, ignoring: %m");
+                else {
+                        memcpy(iovec + n, fields, n_fields * sizeof(struct iovec));
+                        fields_index = n;
+                        n += n_fields;
                 }
         }
 
         assert(n <= m);
 
         if (pid_is_valid(object_pid) && client_context_get(s, object_pid, NULL, NULL, 0, NULL, &o) >= 0) {
+                const CgroupContext *g = o->cgroup_context;
+
+                client_context_read_process(o);
 
                 IOVEC_ADD_NUMERIC_FIELD(iovec, n, o->pid, pid_t, pid_is_valid, PID_FMT, "OBJECT_PID");
                 IOVEC_ADD_NUMERIC_FIELD(iovec, n, o->uid, uid_t, uid_is_valid, UID_FMT, "OBJECT_UID");
@@ -968,15 +1650,17 @@ static void dispatch_message_real(
                 IOVEC_ADD_NUMERIC_FIELD(iovec, n, o->auditid, uint32_t, audit_session_is_valid, "%" PRIu32, "OBJECT_AUDIT_SESSION");
                 IOVEC_ADD_NUMERIC_FIELD(iovec, n, o->loginuid, uid_t, uid_is_valid, UID_FMT, "OBJECT_AUDIT_LOGINUID");
 
-                IOVEC_ADD_STRING_FIELD(iovec, n, o->cgroup, "OBJECT_SYSTEMD_CGROUP");
-                IOVEC_ADD_STRING_FIELD(iovec, n, o->session, "OBJECT_SYSTEMD_SESSION");
-                IOVEC_ADD_NUMERIC_FIELD(iovec, n, o->owner_uid, uid_t, uid_is_valid, UID_FMT, "OBJECT_SYSTEMD_OWNER_UID");
-                IOVEC_ADD_STRING_FIELD(iovec, n, o->unit, "OBJECT_SYSTEMD_UNIT");
-                IOVEC_ADD_STRING_FIELD(iovec, n, o->user_unit, "OBJECT_SYSTEMD_USER_UNIT");
-                IOVEC_ADD_STRING_FIELD(iovec, n, o->slice, "OBJECT_SYSTEMD_SLICE");
-                IOVEC_ADD_STRING_FIELD(iovec, n, o->user_slice, "OBJECT_SYSTEMD_USER_SLICE");
+                if (g) {
+                        IOVEC_ADD_STRING_FIELD(iovec, n, g->cgroup, "OBJECT_SYSTEMD_CGROUP");
+                        IOVEC_ADD_STRING_FIELD(iovec, n, g->session, "OBJECT_SYSTEMD_SESSION");
+                        IOVEC_ADD_NUMERIC_FIELD(iovec, n, g->owner_uid, uid_t, uid_is_valid, UID_FMT, "OBJECT_SYSTEMD_OWNER_UID");
+                        IOVEC_ADD_STRING_FIELD(iovec, n, g->unit, "OBJECT_SYSTEMD_UNIT");
+                        IOVEC_ADD_STRING_FIELD(iovec, n, g->user_unit, "OBJECT_SYSTEMD_USER_UNIT");
+                        IOVEC_ADD_STRING_FIELD(iovec, n, g->slice, "OBJECT_SYSTEMD_SLICE");
+                        IOVEC_ADD_STRING_FIELD(iovec, n, g->user_slice, "OBJECT_SYSTEMD_USER_SLICE");
 
-                IOVEC_ADD_ID128_FIELD(iovec, n, o->invocation_id, "OBJECT_SYSTEMD_INVOCATION_ID=");
+                        IOVEC_ADD_ID128_FIELD(iovec, n, g->invocation_id, "OBJECT_SYSTEMD_INVOCATION_ID=");
+                }
         }
 
         assert(n <= m);
@@ -1006,17 +1690,36 @@ static void dispatch_message_real(
         if (s->split_mode == SPLIT_UID && c && uid_is_valid(c->uid))
                 /* Split up strictly by (non-root) UID */
                 journal_uid = c->uid;
-        else if (s->split_mode == SPLIT_LOGIN && c && c->uid > 0 && uid_is_valid(c->owner_uid))
+        else if (s->split_mode == SPLIT_LOGIN && c && c->uid > 0 && c->cgroup_context && uid_is_valid(c->cgroup_context->owner_uid))
                 /* Split up by login UIDs.  We do this only if the
                  * realuid is not root, in order not to accidentally
                  * leak privileged information to the user that is
                  * logged by a privileged process that is part of an
                  * unprivileged session. */
-                journal_uid = c->owner_uid;
+                journal_uid = c->cgroup_context->owner_uid;
         else
                 journal_uid = 0;
 
-        write_to_journal(s, journal_uid, iovec, n, priority);
+        /* Pass along the hashes of the client's fields for the file we are going to write to, so that they
+         * don't have to be calculated for every message again. */
+        f = n_fields > 0 ? peek_journal(s, journal_uid) : NULL;
+        if (f) {
+                const uint64_t *h;
+
+                h = client_context_get_field_hashes(c, f);
+                if (h) {
+                        hashes = newa(uint64_t, n);
+                        for (size_t i = 0; i < n; i++)
+                                hashes[i] = UINT64_MAX;
+                        memcpy(hashes + fields_index, h, n_fields * sizeof(uint64_t));
+
+                        hashes_file_id = f->header->file_id;
+                }
+        }
+
+        write_to_journal(s, journal_uid, iovec, hashes, hashes_file_id, n, priority);
+
+        client_context_release(s, c);
 }
 
 void server_driver_message(Server *s, pid_t object_pid, const char *message_id, const char *format, ...) {
@@ -1093,18 +1796,26 @@ void server_dispatch_message(
         if (s->storage == STORAGE_NONE)
                 return;
 
-        if (c && c->unit) {
-                (void) determine_space(s, &available, NULL);
+        if (client_context_unit(c)) {
+                CgroupContext *g = c->cgroup_context;
+
+                /* The cgroup context references the rate limit group of the unit, hence there's nothing to
+                 * look up here. Only query the disk space if it is actually needed. */
+                if (g->ratelimit_group && g->log_ratelimit_interval > 0 && g->log_ratelimit_burst > 0)
+                        (void) determine_space(s, &available, NULL);
 
-                rl = journal_ratelimit_test(s->ratelimit, c->unit, c->log_ratelimit_interval, c->log_ratelimit_burst, priority & LOG_PRIMASK, available);
-                if (rl == 0)
+                rl = journal_ratelimit_test(g->ratelimit_group, g->log_ratelimit_interval, g->log_ratelimit_burst,
+                                            priority & LOG_PRIMASK, available, now(CLOCK_MONOTONIC));
+                if (rl == 0) {
+                        s->n_ratelimit_suppressed++;
                         return;
+                }
 
                 /* Write a suppression message if we suppressed something */
                 if (rl > 1)
                         server_driver_message(s, c->pid,
                                               "MESSAGE_ID=" SD_MESSAGE_JOURNAL_DROPPED_STR,
-                                              LOG_MESSAGE("Suppressed %i messages from %s", rl - 1, c->unit),
+                                              LOG_MESSAGE("Suppressed %i messages from %s", rl - 1, g->unit),
                                               "N_DROPPED=%i", rl - 1,
                                               NULL);
         }
@@ -1173,7 +1884,7 @@ int server_flush_to_var(Server *s, bool require_flag_file) {
                 }
 
                 server_rotate(s);
-                server_vacuum(s, false);
+                server_vacuum(s, false, true);
 
                 if (!s->system_journal) {
                         log_notice("Didn't flush runtime journal since rotation of system journal wasn't successful.");
@@ -1196,9 +1907,12 @@ finish:
                 journal_file_post_change(s->system_journal);
 
         s->runtime_journal = journal_file_close(s->runtime_journal);
+        s->runtime_storage.spare = journal_file_close(s->runtime_storage.spare);
 
-        if (r >= 0)
+        if (r >= 0) {
                 (void) rm_rf(s->runtime_storage.path, REMOVE_ROOT);
+                s->runtime_storage.inventory = journal_inventory_free(s->runtime_storage.inventory);
+        }
 
         sd_journal_close(j);
 
@@ -1233,12 +1947,19 @@ static int server_relinquish_var(Server *s) {
 
         log_debug("Relinquishing %s...", s->system_storage.path);
 
+        /* Make sure we don't keep the directory busy */
+        server_vacuum_wait(s);
+
         (void) system_journal_open(s, false, true);
 
         s->system_journal = journal_file_close(s->system_journal);
+        s->system_storage.spare = journal_file_close(s->system_storage.spare);
         ordered_hashmap_clear_with_destructor(s->user_journals, journal_file_close);
         set_clear_with_destructor(s->deferred_closes, journal_file_close);
 
+        /* We don't know what happens to the directory while we don't use it */
+        s->system_storage.inventory = journal_inventory_free(s->system_storage.inventory);
+
         fn = strjoina(s->runtime_directory, "/flushed");
         if (unlink(fn) < 0 && errno != ENOENT)
                 log_warning_errno(errno, "Failed to unlink %s, ignoring: %m", fn);
@@ -1247,76 +1968,20 @@ static int server_relinquish_var(Server *s) {
         return 0;
 }
 
-int server_process_datagram(
-                sd_event_source *es,
-                int fd,
-                uint32_t revents,
-                void *userdata) {
-
-        size_t label_len = 0, m;
-        Server *s = userdata;
+static void server_process_datagram_one(Server *s, int fd, char *buffer, size_t n, struct msghdr *msghdr) {
+        size_t label_len = 0;
         struct ucred *ucred = NULL;
         struct timeval *tv = NULL;
         struct cmsghdr *cmsg;
         char *label = NULL;
-        struct iovec iovec;
-        ssize_t n;
-        int *fds = NULL, v = 0;
+        int *fds = NULL;
         size_t n_fds = 0;
 
-        /* We use NAME_MAX space for the SELinux label here. The kernel currently enforces no limit, but
-         * according to suggestions from the SELinux people this will change and it will probably be
-         * identical to NAME_MAX. For now we use that, but this should be updated one day when the final
-         * limit is known. */
-        CMSG_BUFFER_TYPE(CMSG_SPACE(sizeof(struct ucred)) +
-                         CMSG_SPACE(sizeof(struct timeval)) +
-                         CMSG_SPACE(sizeof(int)) + /* fd */
-                         CMSG_SPACE(NAME_MAX) /* selinux label */) control;
-
-        union sockaddr_union sa = {};
-
-        struct msghdr msghdr = {
-                .msg_iov = &iovec,
-                .msg_iovlen = 1,
-                .msg_control = &control,
-                .msg_controllen = sizeof(control),
-                .msg_name = &sa,
-                .msg_namelen = sizeof(sa),
-        };
-
         assert(s);
-        assert(fd == s->native_fd || fd == s->syslog_fd || fd == s->audit_fd);
-
-        if (revents != EPOLLIN)
-                return log_error_errno(SYNTHETIC_ERRNO(EIO),
-                                       "Got invalid event from epoll for datagram fd: %" PRIx32,
-                                       revents);
-
-        /* Try to get the right size, if we can. (Not all sockets support SIOCINQ, hence we just try, but don't rely on
-         * it.) */
-        (void) ioctl(fd, SIOCINQ, &v);
-
-        /* Fix it up, if it is too small. We use the same fixed value as auditd here. Awful! */
-        m = PAGE_ALIGN(MAX3((size_t) v + 1,
-                            (size_t) LINE_MAX,
-                            ALIGN(sizeof(struct nlmsghdr)) + ALIGN((size_t) MAX_AUDIT_MESSAGE_LENGTH)) + 1);
-
-        if (!GREEDY_REALLOC(s->buffer, m))
-                return log_oom();
-
-        iovec = IOVEC_MAKE(s->buffer, MALLOC_ELEMENTSOF(s->buffer) - 1); /* Leave room for trailing NUL we add later */
-
-        n = recvmsg_safe(fd, &msghdr, MSG_DONTWAIT|MSG_CMSG_CLOEXEC);
-        if (IN_SET(n, -EINTR, -EAGAIN))
-                return 0;
-        if (n == -EXFULL) {
-                log_warning("Got message with truncated control data (too many fds sent?), ignoring.");
-                return 0;
-        }
-        if (n < 0)
-                return log_error_errno(n, "recvmsg() failed: %m");
+        assert(buffer);
+        assert(msghdr);
 
-        CMSG_FOREACH(cmsg, &msghdr)
+        CMSG_FOREACH(cmsg, msghdr)
                 if (cmsg->cmsg_level == SOL_SOCKET &&
                     cmsg->cmsg_type == SCM_CREDENTIALS &&
                     cmsg->cmsg_len == CMSG_LEN(sizeof(struct ucred))) {
@@ -1340,17 +2005,17 @@ int server_process_datagram(
                 }
 
         /* And a trailing NUL, just in case */
-        s->buffer[n] = 0;
+        buffer[n] = 0;
 
         if (fd == s->syslog_fd) {
                 if (n > 0 && n_fds == 0)
-                        server_process_syslog_message(s, s->buffer, n, ucred, tv, label, label_len);
+                        server_process_syslog_message(s, buffer, n, ucred, tv, label, label_len);
                 else if (n_fds > 0)
                         log_warning("Got file descriptors via syslog socket. Ignoring.");
 
         } else if (fd == s->native_fd) {
                 if (n > 0 && n_fds == 0)
-                        server_process_native_message(s, s->buffer, n, ucred, tv, label, label_len);
+                        server_process_native_message(s, buffer, n, ucred, tv, label, label_len);
                 else if (n == 0 && n_fds == 1)
                         server_process_native_file(s, fds[0], ucred, tv, label, label_len);
                 else if (n_fds > 0)
@@ -1360,23 +2025,230 @@ int server_process_datagram(
                 assert(fd == s->audit_fd);
 
                 if (n > 0 && n_fds == 0)
-                        server_process_audit_message(s, s->buffer, n, ucred, &sa, msghdr.msg_namelen);
+                        server_process_audit_message(s, buffer, n, ucred, msghdr->msg_name, msghdr->msg_namelen);
                 else if (n_fds > 0)
                         log_warning("Got file descriptors via audit socket. Ignoring.");
         }
 
         close_many(fds, n_fds);
+}
+
+static int server_allocate_datagram_slots(Server *s) {
+        _cleanup_free_ char *wmem_max = NULL;
+        DatagramSlot *slots;
+        size_t size = 0;
+        uint8_t *p;
+        int r;
+
+        assert(s);
+        assert(s->datagram_batch_size > 1);
+
+        if (s->datagram_slots)
+                return 0;
+
+        /* Unlike for a single datagram, we cannot ask the kernel how large the datagrams are that we are going
+         * to receive. Unprivileged clients cannot send datagrams larger than their send buffer though, which
+         * is capped by net.core.wmem_max, hence make every slot this large. */
+        r = read_one_line_file("/proc/sys/net/core/wmem_max", &wmem_max);
+        if (r < 0)
+                log_debug_errno(r, "Failed to read net.core.wmem_max, ignoring: %m");
+        else {
+                r = safe_atozu(wmem_max, &size);
+                if (r < 0)
+                        log_debug_errno(r, "Failed to parse net.core.wmem_max, ignoring: %m");
+        }
+
+        size = PAGE_ALIGN(MAX3(size + 1, (size_t) LINE_MAX, (size_t) DATAGRAM_SLOT_SIZE_MIN));
+        if (size == 0 || size > SIZE_MAX / s->datagram_batch_size) /* PAGE_ALIGN() wraps to 0 on overflow */
+                return -ENOMEM;
+
+        slots = new0(DatagramSlot, s->datagram_batch_size);
+        if (!slots)
+                return -ENOMEM;
+
+        /* That's a lot of memory if wmem_max is large, but it is only reserved, not committed. Pages are
+         * only populated as far as datagrams actually fill them. */
+        p = mmap(NULL, size * s->datagram_batch_size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+        if (p == MAP_FAILED) {
+                free(slots);
+                return -errno;
+        }
+
+        for (size_t i = 0; i < s->datagram_batch_size; i++)
+                slots[i].buffer = (char*) p + i * size;
+
+        s->datagram_slots = slots;
+        s->n_datagram_slots = s->datagram_batch_size;
+        s->datagram_slot_size = size;
+
+        return 0;
+}
+
+static void server_free_datagram_slots(Server *s) {
+        assert(s);
+
+        if (s->datagram_slots)
+                (void) munmap(s->datagram_slots[0].buffer, s->datagram_slot_size * s->n_datagram_slots);
+
+        s->datagram_slots = mfree(s->datagram_slots);
+        s->n_datagram_slots = 0;
+}
+
+static int server_process_datagram_single(Server *s, int fd) {
+        struct iovec iovec;
+        ssize_t n;
+        size_t m;
+        int v = 0;
+
+        DatagramControl control;
+        union sockaddr_union sa = {};
+
+        struct msghdr msghdr = {
+                .msg_iov = &iovec,
+                .msg_iovlen = 1,
+                .msg_control = &control,
+                .msg_controllen = sizeof(control),
+                .msg_name = &sa,
+                .msg_namelen = sizeof(sa),
+        };
+
+        assert(s);
+
+        /* Try to get the right size, if we can. (Not all sockets support SIOCINQ, hence we just try, but don't rely on
+         * it.) */
+        (void) ioctl(fd, SIOCINQ, &v);
+
+        /* Fix it up, if it is too small. We use the same fixed value as auditd here. Awful! */
+        m = PAGE_ALIGN(MAX3((size_t) v + 1,
+                            (size_t) LINE_MAX,
+                            ALIGN(sizeof(struct nlmsghdr)) + ALIGN((size_t) MAX_AUDIT_MESSAGE_LENGTH)) + 1);
+
+        if (!GREEDY_REALLOC(s->buffer, m))
+                return log_oom();
+
+        iovec = IOVEC_MAKE(s->buffer, MALLOC_ELEMENTSOF(s->buffer) - 1); /* Leave room for trailing NUL we add later */
+
+        n = recvmsg_safe(fd, &msghdr, MSG_DONTWAIT|MSG_CMSG_CLOEXEC);
+        if (IN_SET(n, -EINTR, -EAGAIN))
+                return 0;
+        if (n == -EXFULL) {
+                log_warning("Got message with truncated control data (too many fds sent?), ignoring.");
+                return 0;
+        }
+        if (n < 0)
+                return log_error_errno(n, "recvmsg() failed: %m");
+
+        server_process_datagram_one(s, fd, s->buffer, n, &msghdr);
+
+        server_refresh_idle_timer(s);
+        return 0;
+}
+
+static int server_process_datagram_batch(Server *s, int fd) {
+        struct mmsghdr *msgvec;
+        struct iovec *iovec;
+        int n, r, v = 0;
+
+        assert(s);
+
+        r = server_allocate_datagram_slots(s);
+        if (r < 0) {
+                log_warning_errno(r, "Failed to allocate datagram batch buffers, receiving datagrams one by one from now on: %m");
+                s->datagram_batch_size = 1;
+                return server_process_datagram_single(s, fd);
+        }
+
+        /* Privileged clients may raise their send buffer beyond wmem_max, and datagrams that don't fit into a
+         * slot would be truncated. Hence, check the size of the next datagram first (not all sockets support
+         * SIOCINQ, so this is best effort), and receive it on its own if it is too large. */
+        if (ioctl(fd, SIOCINQ, &v) >= 0 && (size_t) v >= s->datagram_slot_size)
+                return server_process_datagram_single(s, fd);
+
+        msgvec = newa(struct mmsghdr, s->n_datagram_slots);
+        iovec = newa(struct iovec, s->n_datagram_slots);
+
+        for (size_t i = 0; i < s->n_datagram_slots; i++) {
+                DatagramSlot *slot = s->datagram_slots + i;
+
+                iovec[i] = IOVEC_MAKE(slot->buffer, s->datagram_slot_size - 1); /* Leave room for trailing NUL */
+                msgvec[i] = (struct mmsghdr) {
+                        .msg_hdr = {
+                                .msg_iov = iovec + i,
+                                .msg_iovlen = 1,
+                                .msg_control = &slot->control,
+                                .msg_controllen = sizeof(slot->control),
+                        },
+                };
+        }
+
+        n = recvmmsg(fd, msgvec, s->n_datagram_slots, MSG_DONTWAIT|MSG_CMSG_CLOEXEC|MSG_TRUNC, NULL);
+        if (n < 0) {
+                if (IN_SET(errno, EINTR, EAGAIN))
+                        return 0;
+
+                return log_error_errno(errno, "recvmmsg() failed: %m");
+        }
+
+        /* Write the messages from all datagrams to the journal together */
+        server_begin_batch(s);
+
+        for (int i = 0; i < n; i++) {
+                struct msghdr *msghdr = &msgvec[i].msg_hdr;
+
+                if (FLAGS_SET(msghdr->msg_flags, MSG_CTRUNC)) {
+                        cmsg_close_all(msghdr);
+                        log_warning("Got message with truncated control data (too many fds sent?), ignoring.");
+                        continue;
+                }
+
+                /* Only the first datagram could be checked above. A datagram larger than wmem_max right
+                 * behind it is already gone when we notice it was truncated, hence all we can do is tell. */
+                if (FLAGS_SET(msghdr->msg_flags, MSG_TRUNC)) {
+                        cmsg_close_all(msghdr);
+                        log_warning("Got datagram of %u bytes queued behind others, which is larger than the %zu bytes that can be received in a batch, ignoring.",
+                                    msgvec[i].msg_len, s->datagram_slot_size - 1);
+                        continue;
+                }
+
+                server_process_datagram_one(s, fd, s->datagram_slots[i].buffer, msgvec[i].msg_len, msghdr);
+        }
+
+        server_end_batch(s);
 
         server_refresh_idle_timer(s);
         return 0;
 }
 
+int server_process_datagram(
+                sd_event_source *es,
+                int fd,
+                uint32_t revents,
+                void *userdata) {
+
+        Server *s = userdata;
+
+        assert(s);
+        assert(fd == s->native_fd || fd == s->syslog_fd || fd == s->audit_fd);
+
+        if (revents != EPOLLIN)
+                return log_error_errno(SYNTHETIC_ERRNO(EIO),
+                                       "Got invalid event from epoll for datagram fd: %" PRIx32,
+                                       revents);
+
+        /* Under load many datagrams are queued on the syslog and native sockets, receive them in batches
+         * then. Audit messages are not that frequent, and need the sender address. */
+        if (s->datagram_batch_size > 1 && fd != s->audit_fd)
+                return server_process_datagram_batch(s, fd);
+
+        return server_process_datagram_single(s, fd);
+}
+
 static void server_full_flush(Server *s) {
         assert(s);
 
         (void) server_flush_to_var(s, false);
         server_sync(s);
-        server_vacuum(s, false);
+        server_vacuum(s, false, false);
 
         server_space_usage_message(s, NULL);
 
@@ -1406,7 +2278,7 @@ static void server_full_rotate(Server *s) {
         assert(s);
 
         server_rotate(s);
-        server_vacuum(s, true);
+        server_vacuum(s, true, true);
 
         if (s->system_journal)
                 patch_min_use(&s->system_storage);
@@ -2007,6 +2879,78 @@ static int vl_method_relinquish_var(Varlink *link, JsonVariant *parameters, Varl
         return varlink_reply(link, NULL);
 }
 
+static int vl_method_get_statistics(Varlink *link, JsonVariant *parameters, VarlinkMethodFlags flags, void *userdata) {
+        uint64_t data_cache_hits, data_cache_misses;
+        Server *s = userdata;
+
+        assert(link);
+        assert(s);
+
+        if (json_variant_elements(parameters) > 0)
+                return varlink_error_invalid_parameter(link, parameters);
+
+        /* Reports how well the client metadata and data object caches work, and how many messages were
+         * suppressed by rate limiting. */
+
+        server_data_cache_stats(s, &data_cache_hits, &data_cache_misses);
+
+        return varlink_replyb(
+                        link,
+                        JSON_BUILD_OBJECT(
+                                JSON_BUILD_PAIR("clientContexts", JSON_BUILD_UNSIGNED(hashmap_size(s->client_contexts))),
+                                JSON_BUILD_PAIR("clientContextHits", JSON_BUILD_UNSIGNED(s->n_client_context_hits)),
+                                JSON_BUILD_PAIR("clientContextMisses", JSON_BUILD_UNSIGNED(s->n_client_context_misses)),
+                                JSON_BUILD_PAIR("cgroupContexts", JSON_BUILD_UNSIGNED(hashmap_size(s->cgroup_contexts))),
+                                JSON_BUILD_PAIR("cgroupContextHits", JSON_BUILD_UNSIGNED(s->n_cgroup_context_hits)),
+                                JSON_BUILD_PAIR("cgroupContextMisses", JSON_BUILD_UNSIGNED(s->n_cgroup_context_misses)),
+                                JSON_BUILD_PAIR("dataCacheHits", JSON_BUILD_UNSIGNED(data_cache_hits)),
+                                JSON_BUILD_PAIR("dataCacheMisses", JSON_BUILD_UNSIGNED(data_cache_misses)),
+                                JSON_BUILD_PAIR("ratelimitSuppressed", JSON_BUILD_UNSIGNED(s->n_ratelimit_suppressed))));
+}
+
+static int vl_method_get_rate_limits(Varlink *link, JsonVariant *parameters, VarlinkMethodFlags flags, void *userdata) {
+        _cleanup_(json_variant_unrefp) JsonVariant *units = NULL;
+        JournalRateLimitGroup *g;
+        Server *s = userdata;
+        int r;
+
+        assert(link);
+        assert(s);
+
+        if (json_variant_elements(parameters) > 0)
+                return varlink_error_invalid_parameter(link, parameters);
+
+        /* Reports the rate limit state of every unit we currently track, i.e. how many of its messages were
+         * suppressed so far, and how many of those have not been reported in the journal yet. */
+
+        r = json_build(&units, JSON_BUILD_EMPTY_ARRAY);
+        if (r < 0)
+                return r;
+
+        HASHMAP_FOREACH(g, s->ratelimit->groups) {
+                _cleanup_(json_variant_unrefp) JsonVariant *v = NULL;
+
+                r = json_build(&v, JSON_BUILD_OBJECT(
+                                        JSON_BUILD_PAIR("unit", JSON_BUILD_STRING(g->id)),
+                                        JSON_BUILD_PAIR("intervalUSec", JSON_BUILD_UNSIGNED(g->interval)),
+                                        JSON_BUILD_PAIR("burst", JSON_BUILD_UNSIGNED(g->burst)),
+                                        JSON_BUILD_PAIR("suppressed", JSON_BUILD_UNSIGNED(g->n_suppressed)),
+                                        JSON_BUILD_PAIR("pending", JSON_BUILD_UNSIGNED(journal_ratelimit_pending(g)))));
+                if (r < 0)
+                        return r;
+
+                r = json_variant_append_array(&units, v);
+                if (r < 0)
+                        return r;
+        }
+
+        return varlink_replyb(
+                        link,
+                        JSON_BUILD_OBJECT(
+                                JSON_BUILD_PAIR("suppressed", JSON_BUILD_UNSIGNED(s->n_ratelimit_suppressed)),
+                                JSON_BUILD_PAIR("units", JSON_BUILD_VARIANT(units))));
+}
+
 static int vl_connect(VarlinkServer *server, Varlink *link, void *userdata) {
         Server *s = userdata;
 
@@ -2045,7 +2989,9 @@ static int server_open_varlink(Server *s, const char *socket, int fd) {
                         "io.systemd.Journal.Synchronize",   vl_method_synchronize,
                         "io.systemd.Journal.Rotate",        vl_method_rotate,
                         "io.systemd.Journal.FlushToVar",    vl_method_flush_to_var,
-                        "io.systemd.Journal.RelinquishVar", vl_method_relinquish_var);
+                        "io.systemd.Journal.RelinquishVar", vl_method_relinquish_var,
+                        "io.systemd.Journal.GetStatistics", vl_method_get_statistics,
+                        "io.systemd.Journal.GetRateLimits", vl_method_get_rate_limits);
         if (r < 0)
                 return r;
 
@@ -2210,6 +3156,7 @@ int server_init(Server *s, const char *namespace) {
                 .max_level_wall = LOG_EMERG,
 
                 .line_max = DEFAULT_LINE_MAX,
+                .datagram_batch_size = DEFAULT_DATAGRAM_BATCH_SIZE,
 
                 .runtime_storage.name = "Runtime Journal",
                 .system_storage.name = "System Journal",
@@ -2447,18 +3394,31 @@ void server_maybe_append_tags(Server *s) {
 void server_done(Server *s) {
         assert(s);
 
+        /* Write out what is still queued first, while everything it might need is still around */
+        server_flush_batch(s);
+        free(s->batch);
+
         free(s->namespace);
         free(s->namespace_field);
 
+        server_free_datagram_slots(s);
+
+        server_vacuum_wait(s);
+        journal_inventory_free(s->system_storage.inventory);
+        journal_inventory_free(s->runtime_storage.inventory);
+
         set_free_with_destructor(s->deferred_closes, journal_file_close);
 
         while (s->stdout_streams)
                 stdout_stream_free(s->stdout_streams);
 
         client_context_flush_all(s);
+        journal_ratelimit_free(s->ratelimit);
 
         (void) journal_file_close(s->system_journal);
         (void) journal_file_close(s->runtime_journal);
+        (void) journal_file_close(s->system_storage.spare);
+        (void) journal_file_close(s->runtime_storage.spare);
 
         ordered_hashmap_free_with_destructor(s->user_journals, journal_file_close);
 
@@ -2467,6 +3427,7 @@ void server_done(Server *s) {
         sd_event_source_unref(s->syslog_event_source);
         sd_event_source_unref(s->native_event_source);
         sd_event_source_unref(s->stdout_event_source);
+        sd_event_source_unref(s->stdout_batch_event_source);
         sd_event_source_unref(s->dev_kmsg_event_source);
         sd_event_source_unref(s->audit_event_source);
         sd_event_source_unref(s->sync_event_source);
@@ -2479,6 +3440,7 @@ void server_done(Server *s) {
         sd_event_source_unref(s->notify_event_source);
         sd_event_source_unref(s->watchdog_event_source);
         sd_event_source_unref(s->idle_event_source);
+        sd_event_source_unref(s->spare_event_source);
         sd_event_unref(s->event);
 
         safe_close(s->syslog_fd);
@@ -2489,9 +3451,6 @@ void server_done(Server *s) {
         safe_close(s->hostname_fd);
         safe_close(s->notify_fd);
 
-        if (s->ratelimit)
-                journal_ratelimit_free(s->ratelimit);
-
         if (s->kernel_seqnum)
                 munmap(s->kernel_seqnum, sizeof(uint64_t));
 
@@ -2525,6 +3484,49 @@ static const char* const split_mode_table[_SPLIT_MAX] = {
 DEFINE_STRING_TABLE_LOOKUP(split_mode, SplitMode);
 DEFINE_CONFIG_PARSE_ENUM(config_parse_split_mode, split_mode, SplitMode, "Failed to parse split mode setting");
 
+int config_parse_datagram_batch_size(
+                const char* unit,
+                const char *filename,
+                unsigned line,
+                const char *section,
+                unsigned section_line,
+                const char *lvalue,
+                int ltype,
+                const char *rvalue,
+                void *data,
+                void *userdata) {
+
+        unsigned *n = data;
+        unsigned v;
+        int r;
+
+        assert(filename);
+        assert(lvalue);
+        assert(rvalue);
+        assert(data);
+
+        if (isempty(rvalue)) {
+                /* Empty assignment means default */
+                *n = DEFAULT_DATAGRAM_BATCH_SIZE;
+                return 0;
+        }
+
+        r = safe_atou(rvalue, &v);
+        if (r < 0) {
+                log_syntax(unit, LOG_WARNING, filename, line, r, "Failed to parse DatagramBatchSize= value, ignoring: %s", rvalue);
+                return 0;
+        }
+
+        if (v > DATAGRAM_BATCH_SIZE_MAX) {
+                log_syntax(unit, LOG_WARNING, filename, line, 0, "DatagramBatchSize= too large, clamping to %u: %s", DATAGRAM_BATCH_SIZE_MAX, rvalue);
+                v = DATAGRAM_BATCH_SIZE_MAX;
+        }
+
+        /* 0 and 1 both mean that datagrams are received one by one */
+        *n = MAX(v, 1U);
+        return 0;
+}
+
 int config_parse_line_max(
                 const char* unit,
                 const char *filename,
@@ -1,16 +1,20 @@
 /* SPDX-License-Identifier: LGPL-2.1-or-later */
 #pragma once
 
+#include <pthread.h>
 #include <stdbool.h>
 #include <sys/types.h>
 
 #include "sd-event.h"
 
 typedef struct Server Server;
+typedef struct BatchEntry BatchEntry;
+typedef struct DatagramSlot DatagramSlot;
 
 #include "conf-parser.h"
 #include "hashmap.h"
 #include "journal-file.h"
+#include "journal-vacuum.h"
 #include "journald-context.h"
 #include "journald-rate-limit.h"
 #include "journald-stream.h"
@@ -57,8 +61,20 @@ typedef struct JournalStorage {
 
         JournalMetrics metrics;
         JournalStorageSpace space;
+
+        /* The journal files in the directory, so that it needn't be enumerated for each vacuum */
+        JournalInventory *inventory;
+
+        /* Prepared ahead of time to replace the system journal in the directory when it is rotated */
+        JournalFile *spare;
 } JournalStorage;
 
+typedef struct VacuumJob {
+        char *directory;
+        JournalInventoryFile **victims;
+        size_t n_victims;
+} VacuumJob;
+
 struct Server {
         char *namespace;
 
@@ -75,6 +91,7 @@ struct Server {
         sd_event_source *syslog_event_source;
         sd_event_source *native_event_source;
         sd_event_source *stdout_event_source;
+        sd_event_source *stdout_batch_event_source;
         sd_event_source *dev_kmsg_event_source;
         sd_event_source *audit_event_source;
         sd_event_source *sync_event_source;
@@ -87,6 +104,7 @@ struct Server {
         sd_event_source *notify_event_source;
         sd_event_source *watchdog_event_source;
         sd_event_source *idle_event_source;
+        sd_event_source *spare_event_source;
 
         JournalFile *runtime_journal;
         JournalFile *system_journal;
@@ -96,10 +114,28 @@ struct Server {
 
         char *buffer;
 
+        /* Buffers for receiving datagrams in batches, see DatagramBatchSize= */
+        DatagramSlot *datagram_slots;
+        size_t n_datagram_slots;
+        size_t datagram_slot_size;
+
+        /* Entries queued up while a batch of messages is dispatched, see server_begin_batch() */
+        BatchEntry **batch;
+        size_t n_batch;
+        unsigned batch_depth;
+
+        /* Archived files picked by server_vacuum() are deleted in a separate thread */
+        pthread_t vacuum_thread;
+        bool vacuum_thread_running;
+        VacuumJob *vacuum_jobs;
+        size_t n_vacuum_jobs;
+        bool vacuum_verbose;
+
         JournalRateLimit *ratelimit;
         usec_t sync_interval_usec;
         usec_t ratelimit_interval;
         unsigned ratelimit_burst;
+        uint64_t n_ratelimit_suppressed;
 
         JournalStorage runtime_storage;
         JournalStorage system_storage;
@@ -124,6 +160,7 @@ struct Server {
         LIST_HEAD(StdoutStream, stdout_streams);
         LIST_HEAD(StdoutStream, stdout_streams_notify_queue);
         unsigned n_stdout_streams;
+        bool stdout_batch;
 
         char *tty_path;
 
@@ -161,10 +198,17 @@ struct Server {
         usec_t last_realtime_clock;
 
         size_t line_max;
+        unsigned datagram_batch_size;
 
         /* Caching of client metadata */
         Hashmap *client_contexts;
         Prioq *client_contexts_lru;
+        Hashmap *cgroup_contexts;
+
+        uint64_t n_client_context_hits;
+        uint64_t n_client_context_misses;
+        uint64_t n_cgroup_context_hits;
+        uint64_t n_cgroup_context_misses;
 
         usec_t last_cache_pid_flush;
 
@@ -191,6 +235,8 @@ struct Server {
 /* kmsg: Maximum number of extra fields we'll import from udev's devices */
 #define N_IOVEC_UDEV_FIELDS 32
 
+void server_begin_batch(Server *s);
+void server_end_batch(Server *s);
 void server_dispatch_message(Server *s, struct iovec *iovec, size_t n, size_t m, ClientContext *c, const struct timeval *tv, int priority, pid_t object_pid);
 void server_driver_message(Server *s, pid_t object_pid, const char *message_id, const char *format, ...) _sentinel_ _printf_(4,0);
 
@@ -199,6 +245,7 @@ const struct ConfigPerfItem* journald_gperf_lookup(const char *key, GPERF_LEN_TY
 
 CONFIG_PARSER_PROTOTYPE(config_parse_storage);
 CONFIG_PARSER_PROTOTYPE(config_parse_line_max);
+CONFIG_PARSER_PROTOTYPE(config_parse_datagram_batch_size);
 CONFIG_PARSER_PROTOTYPE(config_parse_compress);
 
 const char *storage_to_string(Storage s) _const_;
@@ -212,7 +259,9 @@ SplitMode split_mode_from_string(const char *s) _pure_;
 int server_init(Server *s, const char *namespace);
 void server_done(Server *s);
 void server_sync(Server *s);
-int server_vacuum(Server *s, bool verbose);
+void server_data_cache_stats(Server *s, uint64_t *ret_hits, uint64_t *ret_misses);
+int server_vacuum(Server *s, bool verbose, bool wait);
+void server_vacuum_wait(Server *s);
 void server_rotate(Server *s);
 int server_schedule_sync(Server *s, int priority);
 int server_flush_to_var(Server *s, bool require_flag_file);
@@ -78,6 +78,7 @@ struct StdoutStream {
         struct ucred ucred;
         char *label;
         char *identifier;
+        char *identifier_field;
         char *unit_id;
         int priority;
         bool level_prefix:1;
@@ -91,6 +92,10 @@ struct StdoutStream {
         char *buffer;
         size_t length;
 
+        /* The MESSAGE= field of the line being logged. Kept around, so that it isn't allocated anew for each
+         * line. The batch the entry goes to copies it. */
+        char *message;
+
         sd_event_source *event_source;
 
         char *state_file;
@@ -130,9 +135,11 @@ StdoutStream* stdout_stream_free(StdoutStream *s) {
         safe_close(s->fd);
         free(s->label);
         free(s->identifier);
+        free(s->identifier_field);
         free(s->unit_id);
         free(s->state_file);
         free(s->buffer);
+        free(s->message);
 
         return mfree(s);
 }
@@ -255,8 +262,7 @@ static int stdout_stream_log(
         int priority;
         char syslog_priority[] = "PRIORITY=\0";
         char syslog_facility[STRLEN("SYSLOG_FACILITY=") + DECIMAL_STR_MAX(int) + 1];
-        _cleanup_free_ char *message = NULL, *syslog_identifier = NULL;
-        size_t n = 0, m;
+        size_t n = 0, m, l;
         int r;
 
         assert(s);
@@ -310,11 +316,10 @@ static int stdout_stream_log(
                 iovec[n++] = IOVEC_MAKE_STRING(syslog_facility);
         }
 
-        if (s->identifier) {
-                syslog_identifier = strjoin("SYSLOG_IDENTIFIER=", s->identifier);
-                if (syslog_identifier)
-                        iovec[n++] = IOVEC_MAKE_STRING(syslog_identifier);
-        }
+        if (s->identifier && !s->identifier_field)
+                s->identifier_field = strjoin("SYSLOG_IDENTIFIER=", s->identifier);
+        if (s->identifier_field)
+                iovec[n++] = IOVEC_MAKE_STRING(s->identifier_field);
 
         static const char * const line_break_field_table[_LINE_BREAK_MAX] = {
                 [LINE_BREAK_NEWLINE]    = NULL, /* Do not add field if traditional newline */
@@ -331,9 +336,11 @@ static int stdout_stream_log(
         if (c)
                 iovec[n++] = IOVEC_MAKE_STRING(c);
 
-        message = strjoin("MESSAGE=", p);
-        if (message)
-                iovec[n++] = IOVEC_MAKE_STRING(message);
+        l = strlen(p);
+        if (GREEDY_REALLOC(s->message, STRLEN("MESSAGE=") + l + 1)) {
+                memcpy(mempcpy(s->message, "MESSAGE=", STRLEN("MESSAGE=")), p, l + 1);
+                iovec[n++] = IOVEC_MAKE(s->message, STRLEN("MESSAGE=") + l);
+        }
 
         server_dispatch_message(s->server, iovec, n, m, s->context, NULL, priority, 0);
         return 0;
@@ -500,6 +507,9 @@ static int stdout_stream_scan(
 
         line_max = stdout_stream_line_max(s);
 
+        /* A single read usually carries multiple lines, write them out together */
+        server_begin_batch(s->server);
+
         for (;;) {
                 LineBreak line_break;
                 size_t skip, found;
@@ -528,7 +538,7 @@ static int stdout_stream_scan(
 
                 r = stdout_stream_found(s, p, found, line_break);
                 if (r < 0)
-                        return r;
+                        goto finish;
 
                 p += skip;
                 consumed += skip;
@@ -538,7 +548,7 @@ static int stdout_stream_scan(
         if (force_flush >= 0 && remaining > 0) {
                 r = stdout_stream_found(s, p, remaining, force_flush);
                 if (r < 0)
-                        return r;
+                        goto finish;
 
                 consumed += remaining;
         }
@@ -546,9 +556,63 @@ static int stdout_stream_scan(
         if (ret_consumed)
                 *ret_consumed = consumed;
 
+        r = 0;
+
+finish:
+        server_end_batch(s->server);
+
+        return r;
+}
+
+static int stdout_streams_end_batch(sd_event_source *es, void *userdata) {
+        Server *s = userdata;
+
+        assert(s);
+        assert(s->stdout_batch);
+
+        s->stdout_batch = false;
+        server_end_batch(s);
+
         return 0;
 }
 
+static void stdout_streams_begin_batch(Server *s) {
+        int r;
+
+        assert(s);
+
+        /* Usually several streams become readable at the same time. Keep a batch open until all of them have
+         * been processed, and write out the lines they carried together. The deferred event source that ends
+         * the batch has a lower priority than the streams, hence it is dispatched once none of them is
+         * pending anymore. */
+
+        if (s->stdout_batch)
+                return;
+
+        if (!s->stdout_batch_event_source) {
+                r = sd_event_add_defer(s->event, &s->stdout_batch_event_source, stdout_streams_end_batch, s);
+                if (r < 0) {
+                        log_debug_errno(r, "Failed to allocate stdout batch event source, ignoring: %m");
+                        return;
+                }
+
+                r = sd_event_source_set_priority(s->stdout_batch_event_source, SD_EVENT_PRIORITY_NORMAL+6);
+                if (r < 0)
+                        log_debug_errno(r, "Failed to adjust stdout batch event source priority, ignoring: %m");
+
+                (void) sd_event_source_set_description(s->stdout_batch_event_source, "stdout-batch");
+        }
+
+        r = sd_event_source_set_enabled(s->stdout_batch_event_source, SD_EVENT_ONESHOT);
+        if (r < 0) {
+                log_debug_errno(r, "Failed to enable stdout batch event source, ignoring: %m");
+                return;
+        }
+
+        server_begin_batch(s);
+        s->stdout_batch = true;
+}
+
 static int stdout_stream_process(sd_event_source *es, int fd, uint32_t revents, void *userdata) {
         CMSG_BUFFER_TYPE(CMSG_SPACE(sizeof(struct ucred))) control;
         size_t limit, consumed, allocated;
@@ -600,6 +664,8 @@ static int stdout_stream_process(sd_event_source *es, int fd, uint32_t revents,
         }
         cmsg_close_all(&msghdr);
 
+        stdout_streams_begin_batch(s->server);
+
         if (l == 0) {
                 (void) stdout_stream_scan(s, s->buffer, s->length, /* force_flush = */ LINE_BREAK_EOF, NULL);
                 goto terminate;
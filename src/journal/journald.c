@@ -52,7 +52,7 @@ int main(int argc, char *argv[]) {
         if (r < 0)
                 goto finish;
 
-        server_vacuum(&server, false);
+        server_vacuum(&server, false, false);
         server_flush_to_var(&server, true);
         server_flush_dev_kmsg(&server);
 
@@ -90,7 +90,7 @@ int main(int argc, char *argv[]) {
                         if (server.oldest_file_usec + server.max_retention_usec < n) {
                                 log_info("Retention time reached.");
                                 server_rotate(&server);
-                                server_vacuum(&server, false);
+                                server_vacuum(&server, false, false);
                                 continue;
                         }
 
@@ -0,0 +1,575 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+
+/* End-to-end benchmark of journald's ingestion path: runs a journald server in this process, with its
+ * sockets and journal files in a temporary directory, and drives it from a number of client threads that
+ * each log via the native protocol, /dev/log datagrams or a stdout stream. Afterwards the journal is read
+ * back, to determine how many messages made it in and how long it took until journald picked them up.
+ *
+ * Example: test-journald-benchmark --threads=8 --messages=50000 --native=2 --syslog=1 --stdout=1 */
+
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "sd-daemon.h"
+#include "sd-journal.h"
+
+#include "alloc-util.h"
+#include "fd-util.h"
+#include "format-util.h"
+#include "io-util.h"
+#include "journald-server.h"
+#include "log.h"
+#include "memory-util.h"
+#include "parse-util.h"
+#include "path-util.h"
+#include "process-util.h"
+#include "rm-rf.h"
+#include "signal-util.h"
+#include "socket-util.h"
+#include "sort-util.h"
+#include "stdio-util.h"
+#include "string-util.h"
+#include "tests.h"
+#include "time-util.h"
+#include "tmpfile-util.h"
+
+#define IDENTIFIER "journald-benchmark"
+
+typedef enum Protocol {
+        PROTOCOL_NATIVE,
+        PROTOCOL_SYSLOG,
+        PROTOCOL_STDOUT,
+        _PROTOCOL_MAX,
+} Protocol;
+
+static const char* const protocol_name[_PROTOCOL_MAX] = {
+        [PROTOCOL_NATIVE] = "native",
+        [PROTOCOL_SYSLOG] = "syslog",
+        [PROTOCOL_STDOUT] = "stdout",
+};
+
+/* The _TRANSPORT= field journald attaches to messages received via each protocol */
+static const char* const protocol_transport[_PROTOCOL_MAX] = {
+        [PROTOCOL_NATIVE] = "journal",
+        [PROTOCOL_SYSLOG] = "syslog",
+        [PROTOCOL_STDOUT] = "stdout",
+};
+
+/* The socket in the runtime directory each protocol connects to */
+static const char* const protocol_socket[_PROTOCOL_MAX] = {
+        [PROTOCOL_NATIVE] = "socket",
+        [PROTOCOL_SYSLOG] = "dev-log",
+        [PROTOCOL_STDOUT] = "stdout",
+};
+
+static unsigned arg_threads = 4;
+static unsigned arg_messages = 20000;
+static unsigned arg_weight[_PROTOCOL_MAX] = { 1, 1, 1 };
+static size_t arg_size = 64;
+static const char *arg_directory = NULL;
+static bool arg_ratelimit = true;
+static unsigned arg_datagram_batch_size = UINT_MAX;
+
+typedef struct Client {
+        pthread_t thread;
+        Protocol protocol;
+        const char *runtime_directory;
+        const char *filler;
+        unsigned *n_running;
+
+        unsigned n_sent;
+        int error;
+} Client;
+
+static int client_send(Client *c, int fd) {
+        _cleanup_free_ char *buf = NULL;
+        size_t n, m;
+
+        assert(c);
+        assert(fd >= 0);
+
+        m = arg_size + 128;
+        buf = new(char, m);
+        if (!buf)
+                return -ENOMEM;
+
+        if (c->protocol == PROTOCOL_STDOUT) {
+                /* Identifier, unit, priority, level prefix, forward to syslog, kmsg and console */
+                static const char header[] = IDENTIFIER "\n\n6\n0\n0\n0\n0\n";
+                ssize_t k;
+
+                k = loop_write(fd, header, strlen(header), false);
+                if (k < 0)
+                        return k;
+        }
+
+        for (unsigned i = 0; i < arg_messages; i++) {
+                usec_t t = now(CLOCK_REALTIME);
+                ssize_t k;
+
+                switch (c->protocol) {
+
+                case PROTOCOL_NATIVE:
+                        n = snprintf(buf, m, "SYSLOG_IDENTIFIER=" IDENTIFIER "\nPRIORITY=6\nMESSAGE=bench " USEC_FMT " %s\n", t, c->filler);
+                        break;
+
+                case PROTOCOL_SYSLOG:
+                        n = snprintf(buf, m, "<14>" IDENTIFIER ": bench " USEC_FMT " %s", t, c->filler);
+                        break;
+
+                case PROTOCOL_STDOUT:
+                        n = snprintf(buf, m, "bench " USEC_FMT " %s\n", t, c->filler);
+                        break;
+
+                default:
+                        assert_not_reached();
+                }
+
+                assert(n < m);
+
+                if (c->protocol == PROTOCOL_STDOUT)
+                        k = loop_write(fd, buf, n, false);
+                else
+                        k = send(fd, buf, n, MSG_NOSIGNAL) < 0 ? -errno : 0;
+                if (k < 0)
+                        return k;
+
+                c->n_sent++;
+        }
+
+        return 0;
+}
+
+static void* client_thread(void *userdata) {
+        Client *c = userdata;
+        union sockaddr_union sa = {};
+        _cleanup_close_ int fd = -1;
+        const char *path;
+        int salen;
+
+        path = prefix_roota(c->runtime_directory, protocol_socket[c->protocol]);
+
+        salen = sockaddr_un_set_path(&sa.un, path);
+        if (salen < 0) {
+                c->error = salen;
+                goto finish;
+        }
+
+        fd = socket(AF_UNIX, (c->protocol == PROTOCOL_STDOUT ? SOCK_STREAM : SOCK_DGRAM)|SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+                c->error = -errno;
+                goto finish;
+        }
+
+        if (connect(fd, &sa.sa, salen) < 0) {
+                c->error = -errno;
+                goto finish;
+        }
+
+        c->error = client_send(c, fd);
+
+finish:
+        (void) __atomic_sub_fetch(c->n_running, 1, __ATOMIC_SEQ_CST);
+        return NULL;
+}
+
+static int open_sockets(const char *runtime_directory) {
+        static const int types[_PROTOCOL_MAX] = {
+                [PROTOCOL_NATIVE] = SOCK_DGRAM,
+                [PROTOCOL_SYSLOG] = SOCK_DGRAM,
+                [PROTOCOL_STDOUT] = SOCK_STREAM,
+        };
+
+        char pid[DECIMAL_STR_MAX(pid_t)], n[DECIMAL_STR_MAX(int)];
+
+        /* Pass the sockets to the server as if they were socket activated, like in a real system. This
+         * also keeps server_init() from subscribing to the audit socket, which it would do otherwise. */
+
+        for (Protocol p = 0; p < _PROTOCOL_MAX; p++) {
+                union sockaddr_union sa = {};
+                const char *path;
+                int fd, salen;
+
+                path = prefix_roota(runtime_directory, protocol_socket[p]);
+                salen = sockaddr_un_set_path(&sa.un, path);
+                if (salen < 0)
+                        return salen;
+
+                fd = socket(AF_UNIX, types[p], 0);
+                if (fd < 0)
+                        return -errno;
+
+                if (fd != SD_LISTEN_FDS_START + (int) p) {
+                        safe_close(fd);
+                        return log_error_errno(SYNTHETIC_ERRNO(EBUSY),
+                                               "File descriptor %i is already in use, can't pass sockets.",
+                                               SD_LISTEN_FDS_START + (int) p);
+                }
+
+                if (bind(fd, &sa.sa, salen) < 0)
+                        return -errno;
+
+                if (p == PROTOCOL_STDOUT && listen(fd, SOMAXCONN) < 0)
+                        return -errno;
+        }
+
+        xsprintf(pid, PID_FMT, getpid_cached());
+        xsprintf(n, "%i", _PROTOCOL_MAX);
+        if (setenv("LISTEN_PID", pid, 1) < 0 ||
+            setenv("LISTEN_FDS", n, 1) < 0)
+                return -errno;
+
+        return 0;
+}
+
+static int usec_compare(const usec_t *a, const usec_t *b) {
+        return CMP(*a, *b);
+}
+
+static int read_back(const char *logs_directory, unsigned n_received[static _PROTOCOL_MAX], usec_t **ret_latencies, size_t *ret_n_latencies) {
+        _cleanup_(sd_journal_closep) sd_journal *j = NULL;
+        _cleanup_free_ usec_t *latencies = NULL;
+        size_t n_latencies = 0;
+        int r;
+
+        r = sd_journal_open_directory(&j, logs_directory, 0);
+        if (r < 0)
+                return log_error_errno(r, "Failed to open journal: %m");
+
+        r = sd_journal_add_match(j, "SYSLOG_IDENTIFIER=" IDENTIFIER, 0);
+        if (r < 0)
+                return log_error_errno(r, "Failed to add match: %m");
+
+        SD_JOURNAL_FOREACH(j) {
+                const char *e;
+                const void *d;
+                size_t l;
+                char number[DECIMAL_STR_MAX(usec_t)];
+                usec_t sent, received;
+                Protocol p;
+
+                r = sd_journal_get_data(j, "_TRANSPORT", &d, &l);
+                if (r < 0)
+                        return log_error_errno(r, "Failed to read transport of entry: %m");
+
+                for (p = 0; p < _PROTOCOL_MAX; p++)
+                        if (memcmp_nn((const char*) d + STRLEN("_TRANSPORT="), l - STRLEN("_TRANSPORT="),
+                                      protocol_transport[p], strlen(protocol_transport[p])) == 0)
+                                break;
+                if (p >= _PROTOCOL_MAX)
+                        continue;
+
+                r = sd_journal_get_data(j, "MESSAGE", &d, &l);
+                if (r < 0)
+                        return log_error_errno(r, "Failed to read message of entry: %m");
+
+                /* Don't use strndupa() here, we're in a loop over all entries */
+                e = memory_startswith(d, l, "MESSAGE=bench ");
+                if (!e)
+                        continue;
+
+                l -= e - (const char*) d;
+                if (l >= sizeof(number))
+                        l = sizeof(number) - 1;
+                memcpy(number, e, l);
+                number[l] = 0;
+                number[strcspn(number, " ")] = 0;
+
+                if (safe_atou64(number, &sent) < 0)
+                        continue;
+
+                r = sd_journal_get_realtime_usec(j, &received);
+                if (r < 0)
+                        return log_error_errno(r, "Failed to read timestamp of entry: %m");
+
+                if (!GREEDY_REALLOC(latencies, n_latencies + 1))
+                        return log_oom();
+
+                latencies[n_latencies++] = usec_sub_unsigned(received, sent);
+                n_received[p]++;
+        }
+
+        typesafe_qsort(latencies, n_latencies, usec_compare);
+
+        *ret_latencies = TAKE_PTR(latencies);
+        *ret_n_latencies = n_latencies;
+        return 0;
+}
+
+static usec_t percentile(const usec_t *l, size_t n, unsigned p) {
+        if (n == 0)
+                return 0;
+
+        return l[MIN(n * p / 100, n - 1)];
+}
+
+static void help(void) {
+        printf("%s [OPTIONS...]\n\n"
+               "Benchmarks journald's ingestion of messages from several clients.\n\n"
+               "  -h --help               Show this help\n"
+               "     --threads=N          Number of client threads (default: %u)\n"
+               "     --messages=N         Messages to send per client thread (default: %u)\n"
+               "     --size=BYTES         Size of the padding added to each message (default: %zu)\n"
+               "     --native=WEIGHT      Share of clients using the native protocol (default: 1)\n"
+               "     --syslog=WEIGHT      Share of clients using /dev/log (default: 1)\n"
+               "     --stdout=WEIGHT      Share of clients using a stdout stream (default: 1)\n"
+               "     --directory=PATH     Where to put the journal files (default: /dev/shm)\n"
+               "     --no-ratelimit       Turn off journald's rate limiting\n"
+               "     --datagram-batch-size=N\n"
+               "                          Receive up to N datagrams at once (default: journald's)\n",
+               program_invocation_short_name,
+               arg_threads, arg_messages, arg_size);
+}
+
+static int parse_argv(int argc, char *argv[]) {
+        enum {
+                ARG_THREADS = 0x100,
+                ARG_MESSAGES,
+                ARG_SIZE,
+                ARG_NATIVE,
+                ARG_SYSLOG,
+                ARG_STDOUT,
+                ARG_DIRECTORY,
+                ARG_NO_RATELIMIT,
+                ARG_DATAGRAM_BATCH_SIZE,
+        };
+
+        static const struct option options[] = {
+                { "help",                no_argument,       NULL, 'h'                     },
+                { "threads",             required_argument, NULL, ARG_THREADS             },
+                { "messages",            required_argument, NULL, ARG_MESSAGES            },
+                { "size",                required_argument, NULL, ARG_SIZE                },
+                { "native",              required_argument, NULL, ARG_NATIVE              },
+                { "syslog",              required_argument, NULL, ARG_SYSLOG              },
+                { "stdout",              required_argument, NULL, ARG_STDOUT              },
+                { "directory",           required_argument, NULL, ARG_DIRECTORY           },
+                { "no-ratelimit",        no_argument,       NULL, ARG_NO_RATELIMIT        },
+                { "datagram-batch-size", required_argument, NULL, ARG_DATAGRAM_BATCH_SIZE },
+                {}
+        };
+
+        int c, r;
+
+        while ((c = getopt_long(argc, argv, "h", options, NULL)) >= 0)
+                switch (c) {
+
+                case 'h':
+                        help();
+                        return 0;
+
+                case ARG_THREADS:
+                        r = safe_atou(optarg, &arg_threads);
+                        if (r < 0 || arg_threads == 0)
+                                return log_error_errno(r < 0 ? r : SYNTHETIC_ERRNO(EINVAL), "Invalid number of threads: %s", optarg);
+                        break;
+
+                case ARG_MESSAGES:
+                        r = safe_atou(optarg, &arg_messages);
+                        if (r < 0)
+                                return log_error_errno(r, "Invalid number of messages: %s", optarg);
+                        break;
+
+                case ARG_SIZE:
+                        r = safe_atozu(optarg, &arg_size);
+                        if (r < 0 || arg_size > 64 * 1024)
+                                return log_error_errno(r < 0 ? r : SYNTHETIC_ERRNO(ERANGE), "Invalid message size: %s", optarg);
+                        break;
+
+                case ARG_NATIVE:
+                case ARG_SYSLOG:
+                case ARG_STDOUT:
+                        r = safe_atou(optarg, arg_weight + (c - ARG_NATIVE));
+                        if (r < 0)
+                                return log_error_errno(r, "Invalid weight: %s", optarg);
+                        break;
+
+                case ARG_DIRECTORY:
+                        arg_directory = optarg;
+                        break;
+
+                case ARG_NO_RATELIMIT:
+                        arg_ratelimit = false;
+                        break;
+
+                case ARG_DATAGRAM_BATCH_SIZE:
+                        r = safe_atou(optarg, &arg_datagram_batch_size);
+                        if (r < 0 || arg_datagram_batch_size == 0)
+                                return log_error_errno(r < 0 ? r : SYNTHETIC_ERRNO(EINVAL), "Invalid datagram batch size: %s", optarg);
+                        break;
+
+                case '?':
+                        return -EINVAL;
+
+                default:
+                        assert_not_reached();
+                }
+
+        if (arg_weight[PROTOCOL_NATIVE] + arg_weight[PROTOCOL_SYSLOG] + arg_weight[PROTOCOL_STDOUT] == 0)
+                return log_error_errno(SYNTHETIC_ERRNO(EINVAL), "At least one protocol needs a non-zero weight.");
+
+        return 1;
+}
+
+static Protocol pick_protocol(unsigned i) {
+        unsigned total = 0, k;
+
+        /* Distribute the clients over the protocols according to their weights */
+
+        for (Protocol p = 0; p < _PROTOCOL_MAX; p++)
+                total += arg_weight[p];
+
+        k = i % total;
+        for (Protocol p = 0; p < _PROTOCOL_MAX; p++) {
+                if (k < arg_weight[p])
+                        return p;
+
+                k -= arg_weight[p];
+        }
+
+        assert_not_reached();
+}
+
+int main(int argc, char *argv[]) {
+        _cleanup_(rm_rf_physical_and_freep) char *t = NULL;
+        _cleanup_free_ Client *clients = NULL;
+        _cleanup_free_ usec_t *latencies = NULL;
+        _cleanup_free_ char *filler = NULL;
+        unsigned n_sent[_PROTOCOL_MAX] = {}, n_received[_PROTOCOL_MAX] = {}, n_running, sent = 0, received = 0;
+        const char *runtime_directory, *logs_directory;
+        struct rusage ru_begin, ru_end;
+        uint64_t data_cache_hits, data_cache_misses;
+        usec_t begin, elapsed, cpu;
+        size_t n_latencies;
+        Server s;
+        int r;
+
+        test_setup_logging(LOG_NOTICE);
+
+        r = parse_argv(argc, argv);
+        if (r <= 0)
+                return r < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+
+        if (access("/etc/machine-id", F_OK) != 0)
+                return log_tests_skipped("/etc/machine-id not found");
+
+        if (!arg_directory)
+                arg_directory = access("/dev/shm", W_OK) >= 0 ? "/dev/shm" : "/tmp";
+
+        assert_se(mkdtemp_malloc(prefix_roota(arg_directory, "journald-benchmark-XXXXXX"), &t) >= 0);
+
+        runtime_directory = prefix_roota(t, "run");
+        logs_directory = prefix_roota(t, "log");
+        assert_se(mkdir(runtime_directory, 0755) >= 0);
+
+        assert_se(setenv("RUNTIME_DIRECTORY", runtime_directory, 1) >= 0);
+        assert_se(setenv("LOGS_DIRECTORY", logs_directory, 1) >= 0);
+
+        r = open_sockets(runtime_directory);
+        if (r < 0)
+                return log_error_errno(r, "Failed to create sockets: %m");
+
+        /* Clients writing to stdout streams that got closed shouldn't kill us */
+        assert_se(ignore_signals(SIGPIPE, -1) >= 0);
+
+        r = server_init(&s, "benchmark");
+        if (r < 0)
+                return log_error_errno(r, "Failed to initialize server: %m");
+
+        if (!arg_ratelimit)
+                s.ratelimit_interval = s.ratelimit_burst = 0;
+        if (arg_datagram_batch_size != UINT_MAX)
+                s.datagram_batch_size = arg_datagram_batch_size;
+
+        filler = new(char, arg_size + 1);
+        assert_se(filler);
+        memset(filler, 'x', arg_size);
+        filler[arg_size] = 0;
+
+        clients = new0(Client, arg_threads);
+        assert_se(clients);
+
+        log_notice("Sending %u messages from each of %u clients...", arg_messages, arg_threads);
+
+        assert_se(getrusage(RUSAGE_THREAD, &ru_begin) >= 0);
+        begin = now(CLOCK_MONOTONIC);
+
+        n_running = arg_threads;
+        for (unsigned i = 0; i < arg_threads; i++) {
+                clients[i] = (Client) {
+                        .protocol = pick_protocol(i),
+                        .runtime_directory = runtime_directory,
+                        .filler = filler,
+                        .n_running = &n_running,
+                };
+
+                assert_se(pthread_create(&clients[i].thread, NULL, client_thread, clients + i) == 0);
+        }
+
+        /* Process messages until all clients are done, and nothing came in for a while */
+        for (;;) {
+                r = sd_event_run(s.event, 200 * USEC_PER_MSEC);
+                if (r < 0)
+                        return log_error_errno(r, "Failed to run event loop: %m");
+                if (r == 0 && __atomic_load_n(&n_running, __ATOMIC_SEQ_CST) == 0)
+                        break;
+        }
+
+        /* Don't count the idle period at the end */
+        elapsed = usec_sub_unsigned(now(CLOCK_MONOTONIC), begin + 200 * USEC_PER_MSEC);
+        elapsed = MAX(elapsed, (usec_t) 1);
+        assert_se(getrusage(RUSAGE_THREAD, &ru_end) >= 0);
+
+        for (unsigned i = 0; i < arg_threads; i++) {
+                assert_se(pthread_join(clients[i].thread, NULL) == 0);
+
+                if (clients[i].error < 0)
+                        log_warning_errno(clients[i].error, "Client %u (%s) failed: %m",
+                                          i, protocol_name[clients[i].protocol]);
+
+                n_sent[clients[i].protocol] += clients[i].n_sent;
+                sent += clients[i].n_sent;
+        }
+
+        server_sync(&s);
+
+        r = read_back(logs_directory, n_received, &latencies, &n_latencies);
+        if (r < 0)
+                return r;
+
+        for (Protocol p = 0; p < _PROTOCOL_MAX; p++)
+                received += n_received[p];
+
+        cpu = usec_sub_unsigned(timeval_load(&ru_end.ru_utime) + timeval_load(&ru_end.ru_stime),
+                                timeval_load(&ru_begin.ru_utime) + timeval_load(&ru_begin.ru_stime));
+
+        printf("Clients:          %u, %zu bytes of padding per message\n", arg_threads, arg_size);
+        for (Protocol p = 0; p < _PROTOCOL_MAX; p++)
+                if (n_sent[p] > 0)
+                        printf("  %-14s  %u sent, %u received, %u dropped\n",
+                               protocol_name[p], n_sent[p], n_received[p], n_sent[p] - MIN(n_received[p], n_sent[p]));
+        printf("Rate limiting:    %s\n", arg_ratelimit ? "on" : "off");
+        printf("Datagram batches: %u\n", s.datagram_batch_size);
+        printf("Elapsed:          %s\n", FORMAT_TIMESPAN(elapsed, USEC_PER_MSEC));
+        printf("Throughput:       %" PRIu64 " msgs/s\n", (uint64_t) received * USEC_PER_SEC / elapsed);
+        printf("Latency:          p50 %s, p99 %s, max %s\n",
+               FORMAT_TIMESPAN(percentile(latencies, n_latencies, 50), 1),
+               FORMAT_TIMESPAN(percentile(latencies, n_latencies, 99), 1),
+               FORMAT_TIMESPAN(n_latencies > 0 ? latencies[n_latencies - 1] : 0, 1));
+        printf("Dropped:          %u\n", sent - MIN(received, sent));
+        printf("Server CPU:       %s, %" PRIu64 " ns per message\n",
+               FORMAT_TIMESPAN(cpu, USEC_PER_MSEC),
+               received > 0 ? cpu * NSEC_PER_USEC / received : 0);
+        printf("Context cache:    %" PRIu64 " hits, %" PRIu64 " misses, cgroups %" PRIu64 " hits, %" PRIu64 " misses\n",
+               s.n_client_context_hits, s.n_client_context_misses,
+               s.n_cgroup_context_hits, s.n_cgroup_context_misses);
+
+        server_data_cache_stats(&s, &data_cache_hits, &data_cache_misses);
+        printf("Data cache:       %" PRIu64 " hits, %" PRIu64 " misses\n", data_cache_hits, data_cache_misses);
+
+        server_done(&s);
+
+        return 0;
+}
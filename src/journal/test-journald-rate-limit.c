@@ -0,0 +1,176 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+
+#include <syslog.h>
+
+#include "journald-rate-limit.h"
+#include "stdio-util.h"
+#include "tests.h"
+
+#define INTERVAL (30 * USEC_PER_SEC)
+#define BURST 10U
+
+static void test_burst(void) {
+        JournalRateLimitGroup r = {};
+        usec_t ts = 1000 * USEC_PER_SEC;
+
+        log_info("/* %s */", __func__);
+
+        /* The first BURST messages pass, then everything is suppressed */
+        for (unsigned i = 0; i < BURST; i++)
+                assert_se(journal_ratelimit_test(&r, INTERVAL, BURST, LOG_INFO, 0, ts) == 1);
+        for (unsigned i = 0; i < 5; i++)
+                assert_se(journal_ratelimit_test(&r, INTERVAL, BURST, LOG_INFO, 0, ts) == 0);
+
+        assert_se(r.n_suppressed == 5);
+        assert_se(journal_ratelimit_pending(&r) == 5);
+
+        /* Other priority classes have their own budget */
+        assert_se(journal_ratelimit_test(&r, INTERVAL, BURST, LOG_ERR, 0, ts) == 1);
+        assert_se(journal_ratelimit_test(&r, INTERVAL, BURST, LOG_DEBUG, 0, ts) == 1);
+
+        /* One message worth of budget is back after interval/burst, and the dropped messages are reported
+         * with it */
+        ts += INTERVAL / BURST - 1;
+        assert_se(journal_ratelimit_test(&r, INTERVAL, BURST, LOG_INFO, 0, ts) == 0);
+        ts += 1;
+        assert_se(journal_ratelimit_test(&r, INTERVAL, BURST, LOG_INFO, 0, ts) == 1 + 6);
+        assert_se(journal_ratelimit_test(&r, INTERVAL, BURST, LOG_INFO, 0, ts) == 0);
+
+        assert_se(r.n_suppressed == 7);
+        assert_se(journal_ratelimit_pending(&r) == 1);
+
+        /* After a full interval of silence the whole burst is available again */
+        ts += INTERVAL;
+        assert_se(journal_ratelimit_test(&r, INTERVAL, BURST, LOG_INFO, 0, ts) == 1 + 1);
+        for (unsigned i = 1; i < BURST; i++)
+                assert_se(journal_ratelimit_test(&r, INTERVAL, BURST, LOG_INFO, 0, ts) == 1);
+        assert_se(journal_ratelimit_test(&r, INTERVAL, BURST, LOG_INFO, 0, ts) == 0);
+        assert_se(journal_ratelimit_pending(&r) == 1);
+}
+
+static void test_sustained_rate(void) {
+        JournalRateLimitGroup r = {};
+        usec_t ts = 1000 * USEC_PER_SEC;
+        unsigned permitted = 0;
+
+        log_info("/* %s */", __func__);
+
+        /* Log twice as fast as allowed for ten intervals: we should get one burst plus the refill rate */
+        for (unsigned i = 0; i < 20 * BURST; i++, ts += INTERVAL / BURST / 2)
+                if (journal_ratelimit_test(&r, INTERVAL, BURST, LOG_WARNING, 0, ts) > 0)
+                        permitted++;
+
+        assert_se(permitted >= 11 * BURST - 1 && permitted <= 11 * BURST + 1);
+        assert_se(r.n_suppressed == 20 * BURST - permitted);
+}
+
+static void test_disabled(void) {
+        JournalRateLimitGroup r = {};
+
+        log_info("/* %s */", __func__);
+
+        for (unsigned i = 0; i < 2 * BURST; i++) {
+                assert_se(journal_ratelimit_test(&r, 0, BURST, LOG_INFO, 0, 1) == 1);
+                assert_se(journal_ratelimit_test(&r, INTERVAL, 0, LOG_INFO, 0, 1) == 1);
+                assert_se(journal_ratelimit_test(NULL, INTERVAL, BURST, LOG_INFO, 0, 1) == 1);
+        }
+
+        assert_se(r.n_suppressed == 0);
+}
+
+static void test_modulate(void) {
+        JournalRateLimitGroup r = {};
+        unsigned permitted = 0;
+
+        log_info("/* %s */", __func__);
+
+        /* With 4GB of free disk space the burst is multiplied by four */
+        for (unsigned i = 0; i < 5 * BURST; i++)
+                if (journal_ratelimit_test(&r, INTERVAL, BURST, LOG_INFO, UINT64_C(4) << 30, 1) > 0)
+                        permitted++;
+
+        assert_se(permitted == 4 * BURST);
+}
+
+static void test_groups(void) {
+        _cleanup_(journal_ratelimit_freep) JournalRateLimit *r = NULL;
+        JournalRateLimitGroup *a, *b, *c;
+        usec_t ts = 1000 * USEC_PER_SEC;
+        char id[32];
+
+        log_info("/* %s */", __func__);
+
+        assert_se(r = journal_ratelimit_new());
+
+        /* All cgroups of a unit share one group */
+        assert_se(journal_ratelimit_group_acquire(r, "foo.service", ts, &a) == 1);
+        assert_se(journal_ratelimit_group_acquire(r, "foo.service", ts, &b) == 0);
+        assert_se(a == b);
+        assert_se(a->n_ref == 2);
+        assert_se(journal_ratelimit_group_acquire(r, "bar.service", ts, &c) == 1);
+        assert_se(c != a);
+
+        for (unsigned i = 0; i < BURST; i++)
+                assert_se(journal_ratelimit_test(a, INTERVAL, BURST, LOG_INFO, 0, ts) == 1);
+        assert_se(journal_ratelimit_test(a, INTERVAL, BURST, LOG_INFO, 0, ts) == 0);
+        assert_se(journal_ratelimit_test(c, INTERVAL, BURST, LOG_INFO, 0, ts) == 1);
+
+        journal_ratelimit_group_release(a);
+        journal_ratelimit_group_release(b);
+        journal_ratelimit_group_release(c);
+
+        /* Lots of other units log once, which makes the table look for idle groups a few times */
+        for (unsigned i = 0; i < 1000; i++) {
+                JournalRateLimitGroup *g;
+
+                xsprintf(id, "unit%u.service", i);
+                assert_se(journal_ratelimit_group_acquire(r, id, ts, &g) == 1);
+                assert_se(journal_ratelimit_test(g, INTERVAL, BURST, LOG_INFO, 0, ts) == 1);
+                journal_ratelimit_group_release(g);
+        }
+
+        /* The exhausted unit didn't get a fresh budget when its last reference was dropped, and its
+         * suppressed message is still reported */
+        assert_se(journal_ratelimit_group_acquire(r, "foo.service", ts, &a) == 0);
+        assert_se(journal_ratelimit_test(a, INTERVAL, BURST, LOG_INFO, 0, ts) == 0);
+        assert_se(journal_ratelimit_test(a, INTERVAL, BURST, LOG_INFO, 0, ts + INTERVAL) == 1 + 2);
+        journal_ratelimit_group_release(a);
+
+        /* Once the budgets refilled, the groups are all idle and are dropped */
+        ts += 2 * INTERVAL;
+        for (unsigned i = 0; i < 3000; i++) {
+                JournalRateLimitGroup *g;
+
+                xsprintf(id, "other%u.service", i);
+                assert_se(journal_ratelimit_group_acquire(r, id, ts, &g) == 1);
+                journal_ratelimit_group_release(g);
+        }
+
+        assert_se(!hashmap_contains(r->groups, "foo.service"));
+        assert_se(!hashmap_contains(r->groups, "unit0.service"));
+        assert_se(hashmap_size(r->groups) < 3000);
+
+        /* A group that is referenced is never dropped */
+        assert_se(journal_ratelimit_group_acquire(r, "baz.service", ts, &a) == 1);
+        for (unsigned i = 0; i < 3000; i++) {
+                JournalRateLimitGroup *g;
+
+                xsprintf(id, "more%u.service", i);
+                assert_se(journal_ratelimit_group_acquire(r, id, ts, &g) == 1);
+                journal_ratelimit_group_release(g);
+        }
+        assert_se(hashmap_get(r->groups, "baz.service") == a);
+        journal_ratelimit_group_release(a);
+}
+
+int main(int argc, char *argv[]) {
+        test_setup_logging(LOG_INFO);
+
+        test_burst();
+        test_sustained_rate();
+        test_disabled();
+        test_modulate();
+        test_groups();
+
+        return 0;
+}
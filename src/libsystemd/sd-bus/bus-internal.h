@@ -217,8 +217,18 @@ struct sd_bus {
 
         signed int use_memfd:2;
 
+        /* During authentication a linear buffer, once running a ring buffer of rbuffer_allocated bytes, with
+         * rbuffer_size bytes of data starting at rbuffer_start. The ring buffer starts out small and grows
+         * up to BUS_RBUFFER_SIZE_MAX as needed. */
         void *rbuffer;
         size_t rbuffer_size;
+        size_t rbuffer_start;
+        size_t rbuffer_allocated;
+
+        /* A message that does not fit into the ring buffer is read into a buffer of its own */
+        void *rmessage;
+        size_t rmessage_size;
+        size_t rmessage_need;
 
         sd_bus_message **rqueue;
         size_t rqueue_size;
@@ -334,6 +344,8 @@ struct sd_bus {
 
 #define BUS_MESSAGE_SIZE_MAX (128*1024*1024)
 #define BUS_AUTH_SIZE_MAX (64*1024)
+#define BUS_RBUFFER_SIZE_MIN (4*1024)
+#define BUS_RBUFFER_SIZE_MAX (64*1024)
 /* Note that the D-Bus specification states that bus paths shall have no size limit. We enforce here one
  * anyway, since truly unbounded strings are a security problem. The limit we pick is relatively large however,
  * to not clash unnecessarily with real-life applications. */
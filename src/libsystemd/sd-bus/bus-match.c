@@ -4,9 +4,12 @@
 #include "bus-internal.h"
 #include "bus-match.h"
 #include "bus-message.h"
+#include "env-util.h"
 #include "fd-util.h"
 #include "fileio.h"
 #include "hexdecoct.h"
+#include "random-util.h"
+#include "siphash24.h"
 #include "sort-util.h"
 #include "string-util.h"
 #include "strv.h"
@@ -115,27 +118,25 @@ static bool bus_match_node_maybe_free(struct bus_match_node *node) {
         return true;
 }
 
-static bool value_node_test(
-                struct bus_match_node *node,
+static bool value_test(
                 enum bus_match_node_type parent_type,
+                uint8_t node_u8,
+                const char *node_str,
                 uint8_t value_u8,
                 const char *value_str,
                 char **value_strv,
                 sd_bus_message *m) {
 
-        assert(node);
-        assert(node->type == BUS_MATCH_VALUE);
-
-        /* Tests parameters against this value node, doing prefix
-         * magic and stuff. */
+        /* Tests parameters against the value of a value node, doing
+         * prefix magic and stuff. */
 
         switch (parent_type) {
 
         case BUS_MATCH_MESSAGE_TYPE:
-                return node->value.u8 == value_u8;
+                return node_u8 == value_u8;
 
         case BUS_MATCH_SENDER:
-                if (streq_ptr(node->value.str, value_str))
+                if (streq_ptr(node_str, value_str))
                         return true;
 
                 if (m->creds.mask & SD_BUS_CREDS_WELL_KNOWN_NAMES) {
@@ -146,7 +147,7 @@ static bool value_node_test(
                          * for an accurate match */
 
                         STRV_FOREACH(i, m->creds.well_known_names)
-                                if (streq_ptr(node->value.str, *i))
+                                if (streq_ptr(node_str, *i))
                                         return true;
 
                 } else {
@@ -156,7 +157,7 @@ static bool value_node_test(
                          * let's just hope that dbus-daemon doesn't
                          * send us stuff we didn't want. */
 
-                        if (node->value.str[0] != ':' && value_str && value_str[0] == ':')
+                        if (node_str[0] != ':' && value_str && value_str[0] == ':')
                                 return true;
                 }
 
@@ -169,7 +170,7 @@ static bool value_node_test(
         case BUS_MATCH_ARG ... BUS_MATCH_ARG_LAST:
 
                 if (value_str)
-                        return streq_ptr(node->value.str, value_str);
+                        return streq_ptr(node_str, value_str);
 
                 return false;
 
@@ -177,7 +178,7 @@ static bool value_node_test(
                 char **i;
 
                 STRV_FOREACH(i, value_strv)
-                        if (streq_ptr(node->value.str, *i))
+                        if (streq_ptr(node_str, *i))
                                 return true;
 
                 return false;
@@ -185,16 +186,16 @@ static bool value_node_test(
 
         case BUS_MATCH_ARG_NAMESPACE ... BUS_MATCH_ARG_NAMESPACE_LAST:
                 if (value_str)
-                        return namespace_simple_pattern(node->value.str, value_str);
+                        return namespace_simple_pattern(node_str, value_str);
 
                 return false;
 
         case BUS_MATCH_PATH_NAMESPACE:
-                return path_simple_pattern(node->value.str, value_str);
+                return path_simple_pattern(node_str, value_str);
 
         case BUS_MATCH_ARG_PATH ... BUS_MATCH_ARG_PATH_LAST:
                 if (value_str)
-                        return path_complex_pattern(node->value.str, value_str);
+                        return path_complex_pattern(node_str, value_str);
 
                 return false;
 
@@ -203,6 +204,20 @@ static bool value_node_test(
         }
 }
 
+static bool value_node_test(
+                struct bus_match_node *node,
+                enum bus_match_node_type parent_type,
+                uint8_t value_u8,
+                const char *value_str,
+                char **value_strv,
+                sd_bus_message *m) {
+
+        assert(node);
+        assert(node->type == BUS_MATCH_VALUE);
+
+        return value_test(parent_type, node->value.u8, node->value.str, value_u8, value_str, value_strv, m);
+}
+
 static bool value_node_same(
                 struct bus_match_node *node,
                 enum bus_match_node_type parent_type,
@@ -238,7 +253,61 @@ static bool value_node_same(
         }
 }
 
-int bus_match_run(
+static int match_callback_run(
+                sd_bus *bus,
+                struct match_callback *callback,
+                sd_bus_message *m) {
+
+        int r;
+
+        assert(callback);
+        assert(m);
+
+        if (bus) {
+                /* Don't run this match as long as the AddMatch() call is not complete yet.
+                 *
+                 * Don't run this match unless the 'after' counter has been reached.
+                 *
+                 * Don't run this match more than once per iteration */
+
+                if (callback->install_slot ||
+                    m->read_counter <= callback->after ||
+                    callback->last_iteration == bus->iteration_counter)
+                        return 0;
+
+                callback->last_iteration = bus->iteration_counter;
+        }
+
+        r = sd_bus_message_rewind(m, true);
+        if (r < 0)
+                return r;
+
+        if (callback->callback) {
+                _cleanup_(sd_bus_error_free) sd_bus_error error_buffer = SD_BUS_ERROR_NULL;
+                sd_bus_slot *slot;
+
+                slot = container_of(callback, sd_bus_slot, match_callback);
+                if (bus) {
+                        bus->current_slot = sd_bus_slot_ref(slot);
+                        bus->current_handler = callback->callback;
+                        bus->current_userdata = slot->userdata;
+                }
+                r = callback->callback(m, slot->userdata, &error_buffer);
+                if (bus) {
+                        bus->current_userdata = NULL;
+                        bus->current_handler = NULL;
+                        bus->current_slot = sd_bus_slot_unref(slot);
+                }
+
+                r = bus_maybe_reply_error(m, r, &error_buffer);
+                if (r != 0)
+                        return r;
+        }
+
+        return 0;
+}
+
+static int bus_match_run_node(
                 sd_bus *bus,
                 struct bus_match_node *node,
                 sd_bus_message *m) {
@@ -257,8 +326,8 @@ int bus_match_run(
                 return 0;
 
         /* Not these special semantics: when traversing the tree we
-         * usually let bus_match_run() when called for a node
-         * recursively invoke bus_match_run(). There's are two
+         * usually let bus_match_run_node() when called for a node
+         * recursively invoke bus_match_run_node(). There's are two
          * exceptions here though, which are BUS_NODE_ROOT (which
          * cannot have a sibling), and BUS_NODE_VALUE (whose siblings
          * are invoked anyway by its parent. */
@@ -271,7 +340,7 @@ int bus_match_run(
                  * we won't call any. The children of the root node
                  * are compares or leaves, they will automatically
                  * call their siblings. */
-                return bus_match_run(bus, node->child, m);
+                return bus_match_run_node(bus, node->child, m);
 
         case BUS_MATCH_VALUE:
 
@@ -281,56 +350,19 @@ int bus_match_run(
                  * automatically call their siblings */
 
                 assert(node->child);
-                return bus_match_run(bus, node->child, m);
+                return bus_match_run_node(bus, node->child, m);
 
         case BUS_MATCH_LEAF:
 
-                if (bus) {
-                        /* Don't run this match as long as the AddMatch() call is not complete yet.
-                         *
-                         * Don't run this match unless the 'after' counter has been reached.
-                         *
-                         * Don't run this match more than once per iteration */
-
-                        if (node->leaf.callback->install_slot ||
-                            m->read_counter <= node->leaf.callback->after ||
-                            node->leaf.callback->last_iteration == bus->iteration_counter)
-                                return bus_match_run(bus, node->next, m);
-
-                        node->leaf.callback->last_iteration = bus->iteration_counter;
-                }
-
-                r = sd_bus_message_rewind(m, true);
-                if (r < 0)
-                        return r;
-
                 /* Run the callback. And then invoke siblings. */
-                if (node->leaf.callback->callback) {
-                        _cleanup_(sd_bus_error_free) sd_bus_error error_buffer = SD_BUS_ERROR_NULL;
-                        sd_bus_slot *slot;
-
-                        slot = container_of(node->leaf.callback, sd_bus_slot, match_callback);
-                        if (bus) {
-                                bus->current_slot = sd_bus_slot_ref(slot);
-                                bus->current_handler = node->leaf.callback->callback;
-                                bus->current_userdata = slot->userdata;
-                        }
-                        r = node->leaf.callback->callback(m, slot->userdata, &error_buffer);
-                        if (bus) {
-                                bus->current_userdata = NULL;
-                                bus->current_handler = NULL;
-                                bus->current_slot = sd_bus_slot_unref(slot);
-                        }
-
-                        r = bus_maybe_reply_error(m, r, &error_buffer);
-                        if (r != 0)
-                                return r;
+                r = match_callback_run(bus, node->leaf.callback, m);
+                if (r != 0)
+                        return r;
 
-                        if (bus && bus->match_callbacks_modified)
-                                return 0;
-                }
+                if (bus && bus->match_callbacks_modified)
+                        return 0;
 
-                return bus_match_run(bus, node->next, m);
+                return bus_match_run_node(bus, node->next, m);
 
         case BUS_MATCH_MESSAGE_TYPE:
                 test_u8 = m->header->type;
@@ -391,7 +423,7 @@ int bus_match_run(
                         STRV_FOREACH(i, test_strv) {
                                 found = hashmap_get(node->compare.children, *i);
                                 if (found) {
-                                        r = bus_match_run(bus, found, m);
+                                        r = bus_match_run_node(bus, found, m);
                                         if (r != 0)
                                                 return r;
                                 }
@@ -404,7 +436,7 @@ int bus_match_run(
                         found = NULL;
 
                 if (found) {
-                        r = bus_match_run(bus, found, m);
+                        r = bus_match_run_node(bus, found, m);
                         if (r != 0)
                                 return r;
                 }
@@ -414,7 +446,7 @@ int bus_match_run(
                         if (!value_node_test(c, node->type, test_u8, test_str, test_strv, m))
                                 continue;
 
-                        r = bus_match_run(bus, c, m);
+                        r = bus_match_run_node(bus, c, m);
                         if (r != 0)
                                 return r;
 
@@ -426,7 +458,754 @@ int bus_match_run(
                 return 0;
 
         /* And now, let's invoke our siblings */
-        return bus_match_run(bus, node->next, m);
+        return bus_match_run_node(bus, node->next, m);
+}
+
+/* The compiled form of the tree, which is what is run once the set of matches stopped changing. Each list
+ * of siblings becomes a contiguous block of instructions, and each value node an entry in the value table
+ * of its compare node, which refers to the block of its children. Values that are compared as strings are
+ * kept in open addressing hash tables, with a multiplier picked to spread the keys with as few collisions
+ * as possible, which for small tables usually makes the hash perfect. Path and namespace prefix matches
+ * are looked up by hashing each prefix of the tested string that could match, hence their cost does not
+ * grow with the number of matches either. All strings are interned into one buffer. */
+
+#define BUS_MATCH_COMPILE_AFTER_RUNS 16U
+#define BUS_MATCH_COMPILE_MIN_LEAVES 64U
+
+#define MATCH_VALUE_EMPTY SIZE_MAX
+#define MATCH_MULTIPLIER UINT64_C(0x9e3779b97f4a7c15)
+#define MATCH_MULTIPLIER_TRIES 8U
+
+/* Arguments are fields 0…63, the header fields follow */
+#define MATCH_FIELD_DESTINATION 64U
+#define MATCH_FIELD_INTERFACE 65U
+#define MATCH_FIELD_MEMBER 66U
+#define MATCH_FIELD_PATH 67U
+#define _MATCH_FIELD_MAX 68U
+
+typedef struct MatchValue {
+        uint64_t hash;
+        size_t str;             /* Offset into the string buffer, MATCH_VALUE_EMPTY for unused table entries */
+        uint8_t u8;
+        unsigned first, n;      /* The block of instructions to run if the value matches */
+} MatchValue;
+
+typedef struct MatchInsn {
+        enum bus_match_node_type type;
+        union {
+                struct match_callback *callback;
+                struct {
+                        unsigned values;
+                        unsigned n_values;      /* For hash tables this is the size, a power of two */
+                        unsigned shift;
+                        uint64_t multiplier;
+                        unsigned sorted, n_sorted; /* Values of arg path matches, sorted by string */
+                } compare;
+        };
+} MatchInsn;
+
+struct bus_match_compiled {
+        uint8_t hash_key[16];
+
+        MatchInsn *insns;
+        size_t n_insns;
+        unsigned n_root;        /* The block of the children of the root starts at 0 */
+
+        MatchValue *values;
+        size_t n_values;
+
+        unsigned *sorted;
+        size_t n_sorted;
+
+        char *strings;
+        size_t n_strings;
+
+        bool stale;             /* The tree changed while this was running, free it when done */
+};
+
+typedef struct MatchRun {
+        sd_bus *bus;
+        sd_bus_message *m;
+        struct bus_match_compiled *c;
+
+        /* The fields of the message, retrieved and hashed on first use */
+        uint64_t have_str[2], have_hash[2], have_strv;
+        const char *str[_MATCH_FIELD_MAX];
+        uint64_t hash[_MATCH_FIELD_MAX];
+        char **strv[64];
+} MatchRun;
+
+#define FIELD_IS_SET(mask, f) (((mask)[(f) / 64] & (UINT64_C(1) << ((f) % 64))) != 0)
+#define FIELD_SET(mask, f) ((mask)[(f) / 64] |= UINT64_C(1) << ((f) % 64))
+
+static bool BUS_MATCH_COMPILE_AS_LIST(enum bus_match_node_type t) {
+        return IN_SET(t, BUS_MATCH_MESSAGE_TYPE, BUS_MATCH_SENDER);
+}
+
+static struct bus_match_compiled *bus_match_compiled_free(struct bus_match_compiled *c) {
+        if (!c)
+                return NULL;
+
+        free(c->insns);
+        free(c->values);
+        free(c->sorted);
+        free(c->strings);
+        return mfree(c);
+}
+
+DEFINE_TRIVIAL_CLEANUP_FUNC(struct bus_match_compiled*, bus_match_compiled_free);
+
+static unsigned table_slot(uint64_t hash, uint64_t multiplier, unsigned shift) {
+        return (unsigned) ((hash * multiplier) >> shift);
+}
+
+static int compiled_intern(
+                struct bus_match_compiled *c,
+                Hashmap **interned,
+                const char *s,
+                size_t *ret) {
+
+        void *p;
+        size_t l;
+        int r;
+
+        assert(c);
+        assert(interned);
+        assert(s);
+        assert(ret);
+
+        p = hashmap_get(*interned, s);
+        if (p) {
+                *ret = PTR_TO_SIZE(p) - 1;
+                return 0;
+        }
+
+        l = strlen(s) + 1;
+        if (!GREEDY_REALLOC(c->strings, c->n_strings + l))
+                return -ENOMEM;
+
+        memcpy(c->strings + c->n_strings, s, l);
+
+        r = hashmap_ensure_put(interned, &string_hash_ops, s, SIZE_TO_PTR(c->n_strings + 1));
+        if (r < 0)
+                return r;
+
+        *ret = c->n_strings;
+        c->n_strings += l;
+        return 0;
+}
+
+static int compiled_value_compare(const unsigned *a, const unsigned *b, struct bus_match_compiled *c) {
+        return strcmp(c->strings + c->values[*a].str, c->strings + c->values[*b].str);
+}
+
+static int compiled_add_table(
+                struct bus_match_compiled *c,
+                const MatchValue *entries,
+                unsigned n,
+                MatchInsn *insn) {
+
+        _cleanup_free_ uint64_t *used = NULL;
+        unsigned size = 2, shift = 63, best_collisions = UINT_MAX;
+        uint64_t multiplier = MATCH_MULTIPLIER, best = MATCH_MULTIPLIER;
+        size_t base;
+
+        assert(c);
+        assert(entries || n == 0);
+        assert(insn);
+
+        /* At most half of the table is used, so that probing ends quickly if there are collisions */
+        while (size < 2 * n) {
+                size <<= 1;
+                shift--;
+        }
+
+        used = new(uint64_t, DIV_ROUND_UP(size, 64));
+        if (!used)
+                return -ENOMEM;
+
+        for (unsigned t = 0; t < MATCH_MULTIPLIER_TRIES && best_collisions > 0; t++) {
+                unsigned collisions = 0;
+
+                memzero(used, DIV_ROUND_UP(size, 64) * sizeof(uint64_t));
+
+                for (unsigned i = 0; i < n; i++) {
+                        unsigned k = table_slot(entries[i].hash, multiplier, shift);
+
+                        if (FIELD_IS_SET(used, k))
+                                collisions++;
+                        else
+                                FIELD_SET(used, k);
+                }
+
+                if (collisions < best_collisions) {
+                        best_collisions = collisions;
+                        best = multiplier;
+                }
+
+                multiplier = (multiplier * UINT64_C(6364136223846793005) + UINT64_C(1442695040888963407)) | 1;
+        }
+
+        if (!GREEDY_REALLOC(c->values, c->n_values + size))
+                return -ENOMEM;
+
+        base = c->n_values;
+        c->n_values += size;
+
+        for (unsigned i = 0; i < size; i++)
+                c->values[base + i] = (MatchValue) {
+                        .str = MATCH_VALUE_EMPTY,
+                };
+
+        for (unsigned i = 0; i < n; i++) {
+                unsigned k = table_slot(entries[i].hash, best, shift);
+
+                while (c->values[base + k].str != MATCH_VALUE_EMPTY)
+                        k = (k + 1) & (size - 1);
+
+                c->values[base + k] = entries[i];
+        }
+
+        insn->compare.values = base;
+        insn->compare.n_values = size;
+        insn->compare.shift = shift;
+        insn->compare.multiplier = best;
+
+        if (insn->type >= BUS_MATCH_ARG_PATH && insn->type <= BUS_MATCH_ARG_PATH_LAST) {
+                unsigned *sorted;
+
+                /* Patterns that are longer than the tested string are found by looking for the range of
+                 * patterns that start with it */
+                if (!GREEDY_REALLOC(c->sorted, c->n_sorted + MAX(n, 1U)))
+                        return -ENOMEM;
+
+                insn->compare.sorted = c->n_sorted;
+                insn->compare.n_sorted = n;
+                sorted = c->sorted + c->n_sorted;
+
+                for (unsigned i = 0; i < size; i++)
+                        if (c->values[base + i].str != MATCH_VALUE_EMPTY)
+                                c->sorted[c->n_sorted++] = base + i;
+
+                typesafe_qsort_r(sorted, n, compiled_value_compare, c);
+        }
+
+        return 0;
+}
+
+static int compiled_add_block(
+                struct bus_match_compiled *c,
+                Hashmap **interned,
+                struct bus_match_node *first,
+                unsigned *ret_first,
+                unsigned *ret_n);
+
+static int compiled_add_compare(
+                struct bus_match_compiled *c,
+                Hashmap **interned,
+                struct bus_match_node *node,
+                MatchInsn *insn) {
+
+        _cleanup_free_ struct bus_match_node **children = NULL;
+        _cleanup_free_ MatchValue *entries = NULL;
+        struct bus_match_node *v;
+        unsigned n = 0;
+        size_t base;
+        int r;
+
+        assert(c);
+        assert(node);
+        assert(BUS_MATCH_IS_COMPARE(node->type));
+        assert(insn);
+
+        if (BUS_MATCH_CAN_HASH(node->type))
+                n = hashmap_size(node->compare.children);
+        else
+                for (v = node->child; v; v = v->next)
+                        n++;
+
+        children = new(struct bus_match_node*, MAX(n, 1U));
+        entries = new(MatchValue, MAX(n, 1U));
+        if (!children || !entries)
+                return -ENOMEM;
+
+        n = 0;
+        if (BUS_MATCH_CAN_HASH(node->type))
+                HASHMAP_FOREACH(v, node->compare.children)
+                        children[n++] = v;
+        else
+                for (v = node->child; v; v = v->next)
+                        children[n++] = v;
+
+        for (unsigned i = 0; i < n; i++) {
+                MatchValue *e = entries + i;
+
+                v = children[i];
+                assert(v->type == BUS_MATCH_VALUE);
+
+                *e = (MatchValue) {
+                        .str = MATCH_VALUE_EMPTY,
+                        .u8 = v->value.u8,
+                };
+
+                if (node->type != BUS_MATCH_MESSAGE_TYPE) {
+                        assert(v->value.str);
+
+                        r = compiled_intern(c, interned, v->value.str, &e->str);
+                        if (r < 0)
+                                return r;
+
+                        e->hash = siphash24(v->value.str, strlen(v->value.str), c->hash_key);
+                }
+
+                r = compiled_add_block(c, interned, v->child, &e->first, &e->n);
+                if (r < 0)
+                        return r;
+        }
+
+        if (!BUS_MATCH_COMPILE_AS_LIST(node->type))
+                return compiled_add_table(c, entries, n, insn);
+
+        /* Only a few values each, which are tested in order like the tree does */
+        if (!GREEDY_REALLOC(c->values, c->n_values + MAX(n, 1U)))
+                return -ENOMEM;
+
+        base = c->n_values;
+        memcpy_safe(c->values + base, entries, n * sizeof(MatchValue));
+        c->n_values += n;
+
+        insn->compare.values = base;
+        insn->compare.n_values = n;
+        return 0;
+}
+
+static int compiled_add_block(
+                struct bus_match_compiled *c,
+                Hashmap **interned,
+                struct bus_match_node *first,
+                unsigned *ret_first,
+                unsigned *ret_n) {
+
+        unsigned n = 0, i = 0;
+        size_t base;
+        int r;
+
+        assert(c);
+        assert(ret_first);
+        assert(ret_n);
+
+        for (struct bus_match_node *node = first; node; node = node->next)
+                n++;
+
+        if (!GREEDY_REALLOC(c->insns, c->n_insns + MAX(n, 1U)))
+                return -ENOMEM;
+
+        /* Reserve the block first, the children go after it */
+        base = c->n_insns;
+        c->n_insns += n;
+
+        for (struct bus_match_node *node = first; node; node = node->next, i++) {
+                MatchInsn insn = {
+                        .type = node->type,
+                };
+
+                if (node->type == BUS_MATCH_LEAF)
+                        insn.callback = node->leaf.callback;
+                else {
+                        r = compiled_add_compare(c, interned, node, &insn);
+                        if (r < 0)
+                                return r;
+                }
+
+                c->insns[base + i] = insn;
+        }
+
+        *ret_first = base;
+        *ret_n = n;
+        return 0;
+}
+
+int bus_match_compile(struct bus_match_node *root) {
+        _cleanup_(bus_match_compiled_freep) struct bus_match_compiled *c = NULL;
+        _cleanup_hashmap_free_ Hashmap *interned = NULL;
+        unsigned first;
+        int r;
+
+        assert(root);
+        assert(root->type == BUS_MATCH_ROOT);
+
+        if (root->root.n_running > 0)
+                return -EBUSY;
+
+        c = new0(struct bus_match_compiled, 1);
+        if (!c)
+                return -ENOMEM;
+
+        random_bytes(c->hash_key, sizeof(c->hash_key));
+
+        r = compiled_add_block(c, &interned, root->child, &first, &c->n_root);
+        if (r < 0)
+                return r;
+
+        assert(first == 0);
+
+        bus_match_compiled_free(root->root.compiled);
+        root->root.compiled = TAKE_PTR(c);
+        return 0;
+}
+
+static void bus_match_root_changed(struct bus_match_node *root) {
+        assert(root);
+        assert(root->type == BUS_MATCH_ROOT);
+
+        root->root.n_runs = 0;
+
+        if (!root->root.compiled)
+                return;
+
+        /* Don't pull the compiled form away under a run that is still using it */
+        if (root->root.n_running > 0)
+                root->root.compiled->stale = true;
+        else
+                root->root.compiled = bus_match_compiled_free(root->root.compiled);
+}
+
+static const char *match_run_get_str(MatchRun *r, unsigned f) {
+        assert(r);
+        assert(f < _MATCH_FIELD_MAX);
+
+        if (!FIELD_IS_SET(r->have_str, f)) {
+                const char *s = NULL;
+
+                switch (f) {
+
+                case MATCH_FIELD_DESTINATION:
+                        s = r->m->destination;
+                        break;
+
+                case MATCH_FIELD_INTERFACE:
+                        s = r->m->interface;
+                        break;
+
+                case MATCH_FIELD_MEMBER:
+                        s = r->m->member;
+                        break;
+
+                case MATCH_FIELD_PATH:
+                        s = r->m->path;
+                        break;
+
+                default:
+                        (void) bus_message_get_arg(r->m, f, &s);
+                }
+
+                r->str[f] = s;
+                FIELD_SET(r->have_str, f);
+        }
+
+        return r->str[f];
+}
+
+static uint64_t match_run_get_hash(MatchRun *r, unsigned f, const char *s) {
+        assert(r);
+        assert(s);
+
+        if (!FIELD_IS_SET(r->have_hash, f)) {
+                r->hash[f] = siphash24(s, strlen(s), r->c->hash_key);
+                FIELD_SET(r->have_hash, f);
+        }
+
+        return r->hash[f];
+}
+
+static char **match_run_get_strv(MatchRun *r, unsigned i) {
+        assert(r);
+        assert(i < 64);
+
+        if (!(r->have_strv & (UINT64_C(1) << i))) {
+                r->strv[i] = NULL;
+                (void) bus_message_get_arg_strv(r->m, i, &r->strv[i]);
+                r->have_strv |= UINT64_C(1) << i;
+        }
+
+        return r->strv[i];
+}
+
+static void match_run_done(MatchRun *r) {
+        assert(r);
+
+        for (unsigned i = 0; i < 64; i++)
+                if (r->have_strv & (UINT64_C(1) << i))
+                        strv_free(r->strv[i]);
+}
+
+static const MatchValue *compiled_find(
+                struct bus_match_compiled *c,
+                const MatchInsn *insn,
+                uint64_t hash,
+                const char *s,
+                size_t l) {
+
+        unsigned mask = insn->compare.n_values - 1;
+
+        /* Looks up the first l characters of s */
+
+        for (unsigned k = table_slot(hash, insn->compare.multiplier, insn->compare.shift);; k = (k + 1) & mask) {
+                const MatchValue *v = c->values + insn->compare.values + k;
+
+                if (v->str == MATCH_VALUE_EMPTY)
+                        return NULL;
+
+                if (v->hash == hash && strncmp(c->strings + v->str, s, l) == 0 && c->strings[v->str + l] == 0)
+                        return v;
+        }
+}
+
+static int compiled_run_block(MatchRun *r, unsigned first, unsigned n);
+
+static int compiled_run_prefixes(MatchRun *r, const MatchInsn *insn, const char *s, char separator, bool complex) {
+        struct bus_match_compiled *c = r->c;
+        struct siphash state;
+        size_t l, done = 0;
+        int k;
+
+        /* Tries all prefixes of s that can be patterns matching s: s itself, and for a simple pattern
+         * (see simple_pattern_check()) the prefixes that are followed by a separator or end in one, for a
+         * complex pattern (see complex_pattern_check()) the prefixes that end in a separator. The hash of
+         * each is derived from the one of the previous prefix. */
+
+        l = strlen(s);
+        siphash24_init(&state, c->hash_key);
+
+        for (size_t i = 0; i <= l; i++) {
+                const MatchValue *v;
+                struct siphash copy;
+
+                if (!(i == l ||
+                      (i > 0 && s[i-1] == separator) ||
+                      (!complex && s[i] == separator)))
+                        continue;
+
+                siphash24_compress_safe(s + done, i - done, &state);
+                done = i;
+
+                copy = state;
+                v = compiled_find(c, insn, siphash24_finalize(&copy), s, i);
+                if (!v)
+                        continue;
+
+                k = compiled_run_block(r, v->first, v->n);
+                if (k != 0)
+                        return k;
+
+                if (r->bus && r->bus->match_callbacks_modified)
+                        return 0;
+        }
+
+        /* A complex pattern also matches if s is a prefix of it and ends in a separator */
+        if (complex && l > 0 && s[l-1] == separator) {
+                const unsigned *sorted = c->sorted + insn->compare.sorted;
+                unsigned lo = 0, hi = insn->compare.n_sorted;
+
+                while (lo < hi) {
+                        unsigned mid = lo + (hi - lo) / 2;
+
+                        if (strcmp(c->strings + c->values[sorted[mid]].str, s) < 0)
+                                lo = mid + 1;
+                        else
+                                hi = mid;
+                }
+
+                for (; lo < insn->compare.n_sorted; lo++) {
+                        const MatchValue *v = c->values + sorted[lo];
+                        const char *p = c->strings + v->str;
+
+                        if (strncmp(p, s, l) != 0)
+                                break;
+                        if (p[l] == 0)
+                                continue;
+
+                        k = compiled_run_block(r, v->first, v->n);
+                        if (k != 0)
+                                return k;
+
+                        if (r->bus && r->bus->match_callbacks_modified)
+                                return 0;
+                }
+        }
+
+        return 0;
+}
+
+static int compiled_run_compare(MatchRun *r, const MatchInsn *insn) {
+        struct bus_match_compiled *c = r->c;
+        const MatchValue *v;
+        const char *s;
+        unsigned f;
+        char **i;
+        int k;
+
+        switch (insn->type) {
+
+        case BUS_MATCH_MESSAGE_TYPE:
+        case BUS_MATCH_SENDER:
+                for (unsigned j = 0; j < insn->compare.n_values; j++) {
+                        v = c->values + insn->compare.values + j;
+
+                        if (!value_test(insn->type,
+                                        v->u8,
+                                        v->str != MATCH_VALUE_EMPTY ? c->strings + v->str : NULL,
+                                        r->m->header->type,
+                                        r->m->sender,
+                                        NULL,
+                                        r->m))
+                                continue;
+
+                        k = compiled_run_block(r, v->first, v->n);
+                        if (k != 0)
+                                return k;
+
+                        if (r->bus && r->bus->match_callbacks_modified)
+                                return 0;
+                }
+
+                return 0;
+
+        case BUS_MATCH_DESTINATION:
+                f = MATCH_FIELD_DESTINATION;
+                break;
+
+        case BUS_MATCH_INTERFACE:
+                f = MATCH_FIELD_INTERFACE;
+                break;
+
+        case BUS_MATCH_MEMBER:
+                f = MATCH_FIELD_MEMBER;
+                break;
+
+        case BUS_MATCH_PATH:
+                f = MATCH_FIELD_PATH;
+                break;
+
+        case BUS_MATCH_ARG ... BUS_MATCH_ARG_LAST:
+                f = insn->type - BUS_MATCH_ARG;
+                break;
+
+        case BUS_MATCH_PATH_NAMESPACE:
+                s = match_run_get_str(r, MATCH_FIELD_PATH);
+                return s ? compiled_run_prefixes(r, insn, s, '/', false) : 0;
+
+        case BUS_MATCH_ARG_NAMESPACE ... BUS_MATCH_ARG_NAMESPACE_LAST:
+                s = match_run_get_str(r, insn->type - BUS_MATCH_ARG_NAMESPACE);
+                return s ? compiled_run_prefixes(r, insn, s, '.', false) : 0;
+
+        case BUS_MATCH_ARG_PATH ... BUS_MATCH_ARG_PATH_LAST:
+                s = match_run_get_str(r, insn->type - BUS_MATCH_ARG_PATH);
+                return s ? compiled_run_prefixes(r, insn, s, '/', true) : 0;
+
+        case BUS_MATCH_ARG_HAS ... BUS_MATCH_ARG_HAS_LAST:
+                STRV_FOREACH(i, match_run_get_strv(r, insn->type - BUS_MATCH_ARG_HAS)) {
+                        v = compiled_find(c, insn, siphash24(*i, strlen(*i), c->hash_key), *i, strlen(*i));
+                        if (!v)
+                                continue;
+
+                        k = compiled_run_block(r, v->first, v->n);
+                        if (k != 0)
+                                return k;
+
+                        if (r->bus && r->bus->match_callbacks_modified)
+                                return 0;
+                }
+
+                return 0;
+
+        default:
+                assert_not_reached();
+        }
+
+        /* Exact matches, via the hash table */
+        s = match_run_get_str(r, f);
+        if (!s)
+                return 0;
+
+        v = compiled_find(c, insn, match_run_get_hash(r, f, s), s, strlen(s));
+        if (!v)
+                return 0;
+
+        return compiled_run_block(r, v->first, v->n);
+}
+
+static int compiled_run_block(MatchRun *r, unsigned first, unsigned n) {
+        int k;
+
+        assert(r);
+
+        for (unsigned i = first; i < first + n; i++) {
+                const MatchInsn *insn = r->c->insns + i;
+
+                if (insn->type == BUS_MATCH_LEAF)
+                        k = match_callback_run(r->bus, insn->callback, r->m);
+                else
+                        k = compiled_run_compare(r, insn);
+                if (k != 0)
+                        return k;
+
+                if (r->bus && r->bus->match_callbacks_modified)
+                        return 0;
+        }
+
+        return 0;
+}
+
+int bus_match_run(
+                sd_bus *bus,
+                struct bus_match_node *node,
+                sd_bus_message *m) {
+
+        struct bus_match_compiled *c;
+        int r;
+
+        assert(m);
+
+        if (!node || node->type != BUS_MATCH_ROOT)
+                return bus_match_run_node(bus, node, m);
+
+        if (bus && bus->match_callbacks_modified)
+                return 0;
+
+        if (node->root.n_running == 0) {
+                if (node->root.compiled && node->root.compiled->stale)
+                        node->root.compiled = bus_match_compiled_free(node->root.compiled);
+
+                /* Compile the tree once it stopped changing for a while, if it is large enough for this
+                 * to pay off. If that fails, we simply continue to walk the tree. */
+                if (!node->root.compiled &&
+                    node->root.n_runs++ == BUS_MATCH_COMPILE_AFTER_RUNS &&
+                    node->root.n_leaves >= BUS_MATCH_COMPILE_MIN_LEAVES &&
+                    getenv_bool_secure("SYSTEMD_BUS_MATCH_COMPILE") != 0) {
+
+                        r = bus_match_compile(node);
+                        if (r < 0)
+                                log_debug_errno(r, "Failed to compile bus matches, ignoring: %m");
+                }
+        }
+
+        c = node->root.compiled;
+        if (!c || c->stale)
+                return bus_match_run_node(bus, node, m);
+
+        MatchRun run = {
+                .bus = bus,
+                .m = m,
+                .c = c,
+        };
+
+        node->root.n_running++;
+        r = compiled_run_block(&run, 0, c->n_root);
+        node->root.n_running--;
+
+        match_run_done(&run);
+        return r;
 }
 
 static int bus_match_add_compare_value(
@@ -891,22 +1670,32 @@ int bus_match_add(
                 unsigned n_components,
                 struct match_callback *callback) {
 
+        struct bus_match_node *where;
         int r;
 
         assert(root);
+        assert(root->type == BUS_MATCH_ROOT);
         assert(callback);
 
+        bus_match_root_changed(root);
+
+        where = root;
         for (unsigned i = 0; i < n_components; i++) {
-                r = bus_match_add_compare_value(root,
+                r = bus_match_add_compare_value(where,
                                                 components[i].type,
                                                 components[i].value_u8,
                                                 components[i].value_str,
-                                                &root);
+                                                &where);
                 if (r < 0)
                         return r;
         }
 
-        return bus_match_add_leaf(root, callback);
+        r = bus_match_add_leaf(where, callback);
+        if (r < 0)
+                return r;
+
+        root->root.n_leaves++;
+        return r;
 }
 
 int bus_match_remove(
@@ -916,6 +1705,7 @@ int bus_match_remove(
         struct bus_match_node *node, *pp;
 
         assert(root);
+        assert(root->type == BUS_MATCH_ROOT);
         assert(callback);
 
         node = callback->match_node;
@@ -924,6 +1714,9 @@ int bus_match_remove(
 
         assert(node->type == BUS_MATCH_LEAF);
 
+        bus_match_root_changed(root);
+        root->root.n_leaves--;
+
         callback->match_node = NULL;
 
         /* Free the leaf */
@@ -961,6 +1754,11 @@ void bus_match_free(struct bus_match_node *node) {
 
         if (node->type != BUS_MATCH_ROOT)
                 bus_match_node_free(node);
+        else {
+                node->root.compiled = bus_match_compiled_free(node->root.compiled);
+                node->root.n_leaves = 0;
+                node->root.n_runs = 0;
+        }
 }
 
 const char* bus_match_node_type_to_string(enum bus_match_node_type t, char buf[], size_t l) {
@@ -48,6 +48,13 @@ struct bus_match_node {
                         /* If this is set, then the child is NULL */
                         Hashmap *children;
                 } compare;
+                struct {
+                        /* The flattened form of the tree, built lazily once the matches stop changing */
+                        struct bus_match_compiled *compiled;
+                        unsigned n_leaves;
+                        unsigned n_runs; /* since the last change of the tree */
+                        unsigned n_running;
+                } root;
         };
 };
 
@@ -68,6 +75,8 @@ int bus_match_run(sd_bus *bus, struct bus_match_node *root, sd_bus_message *m);
 int bus_match_add(struct bus_match_node *root, struct bus_match_component *components, unsigned n_components, struct match_callback *callback);
 int bus_match_remove(struct bus_match_node *root, struct match_callback *callback);
 
+int bus_match_compile(struct bus_match_node *root);
+
 void bus_match_free(struct bus_match_node *node);
 
 void bus_match_dump(FILE *out, struct bus_match_node *node, unsigned level);
@@ -528,16 +528,19 @@ int bus_message_from_header(
         return 0;
 }
 
-int bus_message_from_malloc(
+static int message_from_malloc(
                 sd_bus *bus,
                 void *buffer,
                 size_t length,
                 int *fds,
                 size_t n_fds,
+                bool fds_prefix,
                 const char *label,
+                size_t *ret_n_fds,
                 sd_bus_message **ret) {
 
         _cleanup_(sd_bus_message_unrefp) sd_bus_message *m = NULL;
+        uint32_t unix_fds;
         size_t sz;
         int r;
 
@@ -546,7 +549,7 @@ int bus_message_from_malloc(
                         buffer, length, /* in this case the initial bytes and the final bytes are the same */
                         buffer, length,
                         length,
-                        fds, n_fds,
+                        fds_prefix ? NULL : fds, fds_prefix ? 0 : n_fds,
                         label,
                         0, &m);
         if (r < 0)
@@ -565,18 +568,61 @@ int bus_message_from_malloc(
         m->iovec = m->iovec_fixed;
         m->iovec[0] = IOVEC_MAKE(buffer, length);
 
-        r = bus_message_parse_fields(m);
+        r = bus_message_parse_fields(m, &unix_fds);
         if (r < 0)
                 return r;
 
+        if (fds_prefix) {
+                /* The fds array holds the fds of this and possibly later messages, take ours */
+                if (unix_fds > n_fds)
+                        return -EBADMSG;
+
+                if (unix_fds > 0) {
+                        m->fds = newdup(int, fds, unix_fds);
+                        if (!m->fds)
+                                return -ENOMEM;
+
+                        m->n_fds = unix_fds;
+                }
+        } else if (m->n_fds != unix_fds)
+                return -EBADMSG;
+
         /* We take possession of the memory and fds now */
         m->free_header = true;
         m->free_fds = true;
 
+        if (ret_n_fds)
+                *ret_n_fds = m->n_fds;
+
         *ret = TAKE_PTR(m);
         return 0;
 }
 
+int bus_message_from_malloc(
+                sd_bus *bus,
+                void *buffer,
+                size_t length,
+                int *fds,
+                size_t n_fds,
+                const char *label,
+                sd_bus_message **ret) {
+
+        return message_from_malloc(bus, buffer, length, fds, n_fds, false, label, NULL, ret);
+}
+
+int bus_message_from_malloc_take_fds(
+                sd_bus *bus,
+                void *buffer,
+                size_t length,
+                int *fds,
+                size_t n_fds,
+                const char *label,
+                size_t *ret_n_fds,
+                sd_bus_message **ret) {
+
+        return message_from_malloc(bus, buffer, length, fds, n_fds, true, label, ret_n_fds, ret);
+}
+
 _public_ int sd_bus_message_new(
                 sd_bus *bus,
                 sd_bus_message **m,
@@ -5148,7 +5194,7 @@ static int message_skip_fields(
         }
 }
 
-int bus_message_parse_fields(sd_bus_message *m) {
+int bus_message_parse_fields(sd_bus_message *m, uint32_t *ret_unix_fds) {
         size_t ri;
         int r;
         uint32_t unix_fds = 0;
@@ -5467,9 +5513,6 @@ int bus_message_parse_fields(sd_bus_message *m) {
                 i++;
         }
 
-        if (m->n_fds != unix_fds)
-                return -EBADMSG;
-
         switch (m->header->type) {
 
         case SD_BUS_MESSAGE_SIGNAL:
@@ -5532,6 +5575,8 @@ int bus_message_parse_fields(sd_bus_message *m) {
         if (m->header->type == SD_BUS_MESSAGE_METHOD_ERROR)
                 (void) sd_bus_message_read(m, "s", &m->error.message);
 
+        /* The number of fds is checked by the caller, which might not have attached them yet */
+        *ret_unix_fds = unix_fds;
         return 0;
 }
 
@@ -199,11 +199,20 @@ int bus_message_from_malloc(
                 size_t n_fds,
                 const char *label,
                 sd_bus_message **ret);
+int bus_message_from_malloc_take_fds(
+                sd_bus *bus,
+                void *buffer,
+                size_t length,
+                int *fds,
+                size_t n_fds,
+                const char *label,
+                size_t *ret_n_fds,
+                sd_bus_message **ret);
 
 int bus_message_get_arg(sd_bus_message *m, unsigned i, const char **str);
 int bus_message_get_arg_strv(sd_bus_message *m, unsigned i, char ***strv);
 
-int bus_message_parse_fields(sd_bus_message *m);
+int bus_message_parse_fields(sd_bus_message *m, uint32_t *ret_unix_fds);
 
 struct bus_body_part *message_append_part(sd_bus_message *m);
 
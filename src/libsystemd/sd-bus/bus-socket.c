@@ -1,6 +1,7 @@
 /* SPDX-License-Identifier: LGPL-2.1-or-later */
 
 #include <endian.h>
+#include <limits.h>
 #include <poll.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -1016,56 +1017,81 @@ int bus_socket_take_fd(sd_bus *b) {
         return bus_socket_start_auth(b);
 }
 
-int bus_socket_write_message(sd_bus *bus, sd_bus_message *m, size_t *idx) {
+int bus_socket_write_messages(sd_bus *bus, sd_bus_message **messages, size_t n_messages, size_t *idx) {
+        sd_bus_message *first;
         struct iovec *iov;
+        size_t n = 0, n_iovec = 0;
         ssize_t k;
-        size_t n;
         unsigned j;
         int r;
 
         assert(bus);
-        assert(m);
+        assert(messages);
+        assert(n_messages > 0);
         assert(idx);
         assert(IN_SET(bus->state, BUS_RUNNING, BUS_HELLO));
 
-        if (*idx >= BUS_MESSAGE_SIZE(m))
+        /* Writes as many of the messages as the socket takes with a single syscall. *idx is the offset into
+         * the first message, and is advanced by the number of bytes written, possibly beyond the end of it.
+         * A message with fds is always at the beginning of a write, so that the fds arrive together with
+         * its first byte, as receivers that read exactly one message at a time expect it. */
+
+        first = messages[0];
+
+        if (*idx >= BUS_MESSAGE_SIZE(first))
                 return 0;
 
-        r = bus_message_setup_iovec(m);
+        r = bus_message_setup_iovec(first);
         if (r < 0)
                 return r;
 
-        n = m->n_iovec * sizeof(struct iovec);
-        iov = newa(struct iovec, n);
-        memcpy_safe(iov, m->iovec, n);
+        for (n = 1, n_iovec = first->n_iovec; n < n_messages; n++) {
+                sd_bus_message *m = messages[n];
+
+                if (m->n_fds > 0)
+                        break;
+
+                /* If this fails, we'll see the error again once the message is the first one */
+                if (bus_message_setup_iovec(m) < 0)
+                        break;
+
+                if (n_iovec + m->n_iovec > IOV_MAX)
+                        break;
+
+                n_iovec += m->n_iovec;
+        }
+
+        iov = newa(struct iovec, n_iovec);
+        for (size_t i = 0, l = 0; i < n; l += messages[i]->n_iovec, i++)
+                memcpy(iov + l, messages[i]->iovec, messages[i]->n_iovec * sizeof(struct iovec));
 
         j = 0;
         iovec_advance(iov, &j, *idx);
 
         if (bus->prefer_writev)
-                k = writev(bus->output_fd, iov, m->n_iovec);
+                k = writev(bus->output_fd, iov + j, n_iovec - j);
         else {
                 struct msghdr mh = {
-                        .msg_iov = iov,
-                        .msg_iovlen = m->n_iovec,
+                        .msg_iov = iov + j,
+                        .msg_iovlen = n_iovec - j,
                 };
 
-                if (m->n_fds > 0 && *idx == 0) {
+                if (first->n_fds > 0 && *idx == 0) {
                         struct cmsghdr *control;
 
-                        mh.msg_controllen = CMSG_SPACE(sizeof(int) * m->n_fds);
+                        mh.msg_controllen = CMSG_SPACE(sizeof(int) * first->n_fds);
                         mh.msg_control = alloca0(mh.msg_controllen);
                         control = CMSG_FIRSTHDR(&mh);
-                        control->cmsg_len = CMSG_LEN(sizeof(int) * m->n_fds);
+                        control->cmsg_len = CMSG_LEN(sizeof(int) * first->n_fds);
                         control->cmsg_level = SOL_SOCKET;
                         control->cmsg_type = SCM_RIGHTS;
-                        memcpy(CMSG_DATA(control), m->fds, sizeof(int) * m->n_fds);
+                        memcpy(CMSG_DATA(control), first->fds, sizeof(int) * first->n_fds);
                 }
 
                 k = sendmsg(bus->output_fd, &mh, MSG_DONTWAIT|MSG_NOSIGNAL);
                 if (k < 0 && errno == ENOTSOCK) {
                         bus->prefer_writev = true;
-                        k = writev(bus->output_fd, iov, m->n_iovec);
+                        k = writev(bus->output_fd, iov + j, n_iovec - j);
                 }
         }
 
@@ -1076,9 +1102,101 @@ int bus_socket_write_message(sd_bus *bus, sd_bus_message *m, size_t *idx) {
         return 1;
 }
 
+int bus_socket_write_message(sd_bus *bus, sd_bus_message *m, size_t *idx) {
+        return bus_socket_write_messages(bus, &m, 1, idx);
+}
+
+static void bus_socket_rbuffer_copy(sd_bus *bus, size_t offset, void *p, size_t size) {
+        size_t i, k;
+
+        assert(bus);
+        assert(offset + size <= bus->rbuffer_size);
+
+        /* Copies data out of the ring buffer, offset is relative to the first byte in it */
+
+        i = (bus->rbuffer_start + offset) % bus->rbuffer_allocated;
+        k = MIN(size, bus->rbuffer_allocated - i);
+
+        memcpy_safe(p, (uint8_t*) bus->rbuffer + i, k);
+        memcpy_safe((uint8_t*) p + k, bus->rbuffer, size - k);
+}
+
+static void bus_socket_rbuffer_drop(sd_bus *bus, size_t size) {
+        assert(bus);
+        assert(size <= bus->rbuffer_size);
+
+        bus->rbuffer_size -= size;
+
+        /* Start over at the beginning when empty, so that the next read doesn't wrap */
+        bus->rbuffer_start = bus->rbuffer_size > 0 ? (bus->rbuffer_start + size) % bus->rbuffer_allocated : 0;
+}
+
+static size_t bus_socket_rbuffer_size_for(size_t allocated, size_t size) {
+        size_t n;
+
+        /* The smallest ring buffer size that holds more than size bytes, starting from the current one */
+        for (n = MAX(allocated, (size_t) BUS_RBUFFER_SIZE_MIN); n <= size && n < BUS_RBUFFER_SIZE_MAX; n *= 2)
+                ;
+
+        return MIN(n, (size_t) BUS_RBUFFER_SIZE_MAX);
+}
+
+static int bus_socket_rbuffer_setup(sd_bus *bus) {
+        size_t n;
+        void *b;
+
+        assert(bus);
+
+        if (bus->rbuffer_allocated > 0)
+                return 0;
+
+        /* Whatever the authentication left over is at the beginning of the buffer already. Most connections
+         * only ever see small messages, hence start out with a small ring buffer. */
+        assert_cc(BUS_RBUFFER_SIZE_MAX >= BUS_AUTH_SIZE_MAX);
+        assert(bus->rbuffer_size < BUS_RBUFFER_SIZE_MAX);
+
+        n = bus_socket_rbuffer_size_for(0, bus->rbuffer_size);
+
+        b = realloc(bus->rbuffer, n);
+        if (!b)
+                return -ENOMEM;
+
+        bus->rbuffer = b;
+        bus->rbuffer_start = 0;
+        bus->rbuffer_allocated = n;
+        return 0;
+}
+
+static int bus_socket_rbuffer_grow(sd_bus *bus, size_t size) {
+        size_t n;
+        void *b;
+
+        assert(bus);
+        assert(bus->rbuffer_allocated > 0);
+
+        /* Grows the ring buffer so that it holds at least size bytes, as far as BUS_RBUFFER_SIZE_MAX allows.
+         * The data is moved to the beginning of the new buffer on the way. */
+
+        n = bus_socket_rbuffer_size_for(bus->rbuffer_allocated, size - 1);
+        if (n <= bus->rbuffer_allocated)
+                return 0;
+
+        b = malloc(n);
+        if (!b)
+                return -ENOMEM;
+
+        bus_socket_rbuffer_copy(bus, 0, b, bus->rbuffer_size);
+
+        free(bus->rbuffer);
+        bus->rbuffer = b;
+        bus->rbuffer_start = 0;
+        bus->rbuffer_allocated = n;
+        return 1;
+}
+
 static int bus_socket_read_message_need(sd_bus *bus, size_t *need) {
+        struct bus_header h;
         uint32_t a, b;
-        uint8_t e;
         uint64_t sum;
 
         assert(bus);
@@ -1107,14 +1225,16 @@ static int bus_socket_read_message_need(sd_bus *bus, size_t *need) {
                 return 0;
         }
 
-        a = ((const uint32_t*) bus->rbuffer)[1];
-        b = ((const uint32_t*) bus->rbuffer)[3];
+        /* The header might wrap around the end of the ring buffer */
+        bus_socket_rbuffer_copy(bus, 0, &h, sizeof(h));
 
-        e = ((const uint8_t*) bus->rbuffer)[0];
-        if (e == BUS_LITTLE_ENDIAN) {
+        a = h.dbus1.body_size;
+        b = h.dbus1.fields_size;
+
+        if (h.endian == BUS_LITTLE_ENDIAN) {
                 a = le32toh(a);
                 b = le32toh(b);
-        } else if (e == BUS_BIG_ENDIAN) {
+        } else if (h.endian == BUS_BIG_ENDIAN) {
                 a = be32toh(a);
                 b = be32toh(b);
         } else
@@ -1128,92 +1248,195 @@ static int bus_socket_read_message_need(sd_bus *bus, size_t *need) {
         return 0;
 }
 
-static int bus_socket_make_message(sd_bus *bus, size_t size) {
+static int bus_socket_make_message(sd_bus *bus, void *buffer, size_t size) {
         sd_bus_message *t = NULL;
-        void *b;
+        size_t n_fds = 0;
         int r;
 
         assert(bus);
-        assert(bus->rbuffer_size >= size);
+        assert(buffer);
         assert(IN_SET(bus->state, BUS_RUNNING, BUS_HELLO));
 
+        /* Takes possession of the buffer, unless this fails. The message gets as many of the received fds as
+         * its header says it carries, since one read might return fds for more than one message. */
+
         r = bus_rqueue_make_room(bus);
         if (r < 0)
                 return r;
 
-        if (bus->rbuffer_size > size) {
-                b = memdup((const uint8_t*) bus->rbuffer + size,
-                           bus->rbuffer_size - size);
-                if (!b)
-                        return -ENOMEM;
-        } else
-                b = NULL;
-
-        r = bus_message_from_malloc(bus,
-                                    bus->rbuffer, size,
-                                    bus->fds, bus->n_fds,
-                                    NULL,
-                                    &t);
+        r = bus_message_from_malloc_take_fds(bus,
+                                             buffer, size,
+                                             bus->fds, bus->n_fds,
+                                             NULL,
+                                             &n_fds,
+                                             &t);
         if (r == -EBADMSG) {
                 log_debug_errno(r, "Received invalid message from connection %s, dropping.", strna(bus->description));
-                free(bus->rbuffer); /* We want to drop current rbuffer and proceed with whatever remains in b */
-        } else if (r < 0) {
-                free(b);
-                return r;
+                free(buffer);
+
+                /* We can't tell which fds belonged to the message, hence drop them all */
+                close_many(bus->fds, bus->n_fds);
+                bus->fds = mfree(bus->fds);
+                bus->n_fds = 0;
+                return 1;
         }
+        if (r < 0)
+                return r;
 
-        /* rbuffer ownership was either transferred to t, or we got EBADMSG and dropped it. */
-        bus->rbuffer = b;
-        bus->rbuffer_size -= size;
+        /* The message owns the fds it took now */
+        memmove(bus->fds, bus->fds + n_fds, (bus->n_fds - n_fds) * sizeof(int));
+        bus->n_fds -= n_fds;
+        if (bus->n_fds == 0)
+                bus->fds = mfree(bus->fds);
 
-        bus->fds = NULL;
-        bus->n_fds = 0;
+        t->read_counter = ++bus->read_counter;
+        bus->rqueue[bus->rqueue_size++] = bus_message_ref_queued(t, bus);
+        sd_bus_message_unref(t);
 
-        if (t) {
-                t->read_counter = ++bus->read_counter;
-                bus->rqueue[bus->rqueue_size++] = bus_message_ref_queued(t, bus);
-                sd_bus_message_unref(t);
-        }
+        return 1;
+}
+
+static int bus_socket_make_rmessage(sd_bus *bus) {
+        int r;
+
+        assert(bus);
+        assert(bus->rmessage);
+        assert(bus->rmessage_size == bus->rmessage_need);
 
+        r = bus_socket_make_message(bus, bus->rmessage, bus->rmessage_need);
+        if (r < 0)
+                return r;
+
+        bus->rmessage = NULL;
+        bus->rmessage_size = bus->rmessage_need = 0;
         return 1;
 }
 
+static int bus_socket_make_messages(sd_bus *bus) {
+        int r, ret = 0;
+
+        assert(bus);
+
+        /* Turns all complete messages in the ring buffer into messages. If there's the beginning of one that
+         * doesn't fit into the ring buffer, moves it over into a buffer of its own. */
+
+        for (;;) {
+                size_t need;
+                void *b;
+
+                r = bus_socket_read_message_need(bus, &need);
+                if (r < 0)
+                        return r;
+
+                if (need > bus->rbuffer_allocated) {
+                        r = bus_socket_rbuffer_grow(bus, need);
+                        if (r < 0)
+                                return r;
+                }
+
+                if (need > bus->rbuffer_allocated) {
+                        b = malloc(need);
+                        if (!b)
+                                return -ENOMEM;
+
+                        bus_socket_rbuffer_copy(bus, 0, b, bus->rbuffer_size);
+
+                        bus->rmessage = b;
+                        bus->rmessage_size = bus->rbuffer_size;
+                        bus->rmessage_need = need;
+                        bus_socket_rbuffer_drop(bus, bus->rbuffer_size);
+                        break;
+                }
+
+                if (bus->rbuffer_size < need)
+                        break;
+
+                b = malloc(need);
+                if (!b)
+                        return -ENOMEM;
+
+                bus_socket_rbuffer_copy(bus, 0, b, need);
+
+                r = bus_socket_make_message(bus, b, need);
+                if (r < 0) {
+                        free(b);
+                        return r;
+                }
+
+                bus_socket_rbuffer_drop(bus, need);
+                ret = 1;
+        }
+
+        if (bus->n_fds > 0 && bus->rbuffer_size == 0 && !bus->rmessage) {
+                /* Nothing's left that could claim them */
+                log_debug("Received %zu file descriptors more than the messages on connection %s carry, closing them.",
+                          bus->n_fds, strna(bus->description));
+
+                close_many(bus->fds, bus->n_fds);
+                bus->fds = mfree(bus->fds);
+                bus->n_fds = 0;
+        }
+
+        return ret;
+}
+
 int bus_socket_read_message(sd_bus *bus) {
         struct msghdr mh;
-        struct iovec iov = {};
+        struct iovec iov[2] = {};
+        unsigned n_iov;
         ssize_t k;
-        size_t need;
         int r;
-        void *b;
         CMSG_BUFFER_TYPE(CMSG_SPACE(sizeof(int) * BUS_FDS_MAX)) control;
         bool handle_cmsg = false;
 
         assert(bus);
         assert(IN_SET(bus->state, BUS_RUNNING, BUS_HELLO));
 
-        r = bus_socket_read_message_need(bus, &need);
+        r = bus_socket_rbuffer_setup(bus);
         if (r < 0)
                 return r;
 
-        if (bus->rbuffer_size >= need)
-                return bus_socket_make_message(bus, need);
+        /* There might be complete messages left over from the authentication phase, or from a previous
+         * call that failed */
+        if (!bus->rmessage)
+                r = bus_socket_make_messages(bus);
+        else if (bus->rmessage_size >= bus->rmessage_need)
+                r = bus_socket_make_rmessage(bus);
+        else
+                r = 0;
+        if (r != 0)
+                return r;
 
-        b = realloc(bus->rbuffer, need);
-        if (!b)
-                return -ENOMEM;
+        if (bus->rmessage) {
+                /* Large messages are read with exactly the size they need */
+                iov[0] = IOVEC_MAKE((uint8_t*) bus->rmessage + bus->rmessage_size, bus->rmessage_need - bus->rmessage_size);
+                n_iov = 1;
+        } else {
+                size_t end = bus->rbuffer_start + bus->rbuffer_size;
 
-        bus->rbuffer = b;
+                /* Otherwise read as much as fits into the free space of the ring buffer, which might be in
+                 * two pieces. There's always some, as otherwise there'd be a complete message in it. */
+                assert(bus->rbuffer_size < bus->rbuffer_allocated);
 
-        iov = IOVEC_MAKE((uint8_t *)bus->rbuffer + bus->rbuffer_size, need - bus->rbuffer_size);
+                if (end < bus->rbuffer_allocated) {
+                        iov[0] = IOVEC_MAKE((uint8_t*) bus->rbuffer + end, bus->rbuffer_allocated - end);
+                        iov[1] = IOVEC_MAKE(bus->rbuffer, bus->rbuffer_start);
+                        n_iov = bus->rbuffer_start > 0 ? 2 : 1;
+                } else {
+                        end -= bus->rbuffer_allocated;
+                        iov[0] = IOVEC_MAKE((uint8_t*) bus->rbuffer + end, bus->rbuffer_start - end);
+                        n_iov = 1;
+                }
+        }
 
         if (bus->prefer_readv) {
-                k = readv(bus->input_fd, &iov, 1);
+                k = readv(bus->input_fd, iov, n_iov);
                 if (k < 0)
                         k = -errno;
         } else {
                 mh = (struct msghdr) {
-                        .msg_iov = &iov,
-                        .msg_iovlen = 1,
+                        .msg_iov = iov,
+                        .msg_iovlen = n_iov,
                         .msg_control = &control,
                         .msg_controllen = sizeof(control),
                 };
@@ -1221,7 +1444,7 @@ int bus_socket_read_message(sd_bus *bus) {
                 k = recvmsg_safe(bus->input_fd, &mh, MSG_DONTWAIT|MSG_CMSG_CLOEXEC);
                 if (k == -ENOTSOCK) {
                         bus->prefer_readv = true;
-                        k = readv(bus->input_fd, &iov, 1);
+                        k = readv(bus->input_fd, iov, n_iov);
                         if (k < 0)
                                 k = -errno;
                 } else
@@ -1237,7 +1460,16 @@ int bus_socket_read_message(sd_bus *bus) {
                 return -ECONNRESET;
         }
 
-        bus->rbuffer_size += k;
+        if (bus->rmessage)
+                bus->rmessage_size += k;
+        else {
+                bus->rbuffer_size += k;
+
+                /* All free space was filled, hence more is likely queued. Let the next read take more at
+                 * once. If that fails, we just continue with the buffer we have. */
+                if (bus->rbuffer_size == bus->rbuffer_allocated)
+                        (void) bus_socket_rbuffer_grow(bus, bus->rbuffer_allocated + 1);
+        }
 
         if (handle_cmsg) {
                 struct cmsghdr *cmsg;
@@ -1272,13 +1504,16 @@ int bus_socket_read_message(sd_bus *bus) {
                                           cmsg->cmsg_level, cmsg->cmsg_type);
         }
 
-        r = bus_socket_read_message_need(bus, &need);
+        if (bus->rmessage) {
+                if (bus->rmessage_size < bus->rmessage_need)
+                        return 1;
+
+                r = bus_socket_make_rmessage(bus);
+        } else
+                r = bus_socket_make_messages(bus);
         if (r < 0)
                 return r;
 
-        if (bus->rbuffer_size >= need)
-                return bus_socket_make_message(bus, need);
-
         return 1;
 }
 
@@ -1,18 +1,151 @@
 /* SPDX-License-Identifier: LGPL-2.1-or-later */
 
+#include <sys/socket.h>
+
 #include "alloc-util.h"
 #include "bus-internal.h"
 #include "bus-match.h"
+#include "bus-message.h"
 #include "env-util.h"
 #include "fd-util.h"
 #include "fileio.h"
 #include "fuzz.h"
+#include "strv.h"
+#include "utf8.h"
+
+/* Messages are made up from the first few matches, and run against the tree and its compiled form */
+#define N_MESSAGES 16U
+
+static bool *ran = NULL;
+
+static int match_callback(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+        ran[PTR_TO_UINT(userdata)] = true;
+        return 0;
+}
+
+static int message_new_for_components(
+                sd_bus *bus,
+                const struct bus_match_component *components,
+                unsigned n_components,
+                sd_bus_message **ret) {
+
+        _cleanup_(sd_bus_message_unrefp) sd_bus_message *m = NULL;
+        const struct bus_match_component *args[64] = {};
+        const char *path = "/", *interface = "org.example.Fuzz", *member = "Fuzz", *sender = NULL, *destination = NULL;
+        uint8_t type = SD_BUS_MESSAGE_SIGNAL;
+        unsigned n_args = 0;
+        int r;
+
+        /* Builds a message that has the values of the components where they are valid, hence usually matches
+         * them, and others that are prefixes or extensions of them */
+
+        for (unsigned i = 0; i < n_components; i++) {
+                const struct bus_match_component *c = components + i;
+                unsigned k;
+
+                switch (c->type) {
+
+                case BUS_MATCH_MESSAGE_TYPE:
+                        if (c->value_u8 == SD_BUS_MESSAGE_METHOD_CALL)
+                                type = SD_BUS_MESSAGE_METHOD_CALL;
+                        continue;
+
+                case BUS_MATCH_SENDER:
+                        if (service_name_is_valid(c->value_str))
+                                sender = c->value_str;
+                        continue;
+
+                case BUS_MATCH_DESTINATION:
+                        if (service_name_is_valid(c->value_str))
+                                destination = c->value_str;
+                        continue;
+
+                case BUS_MATCH_INTERFACE:
+                        if (interface_name_is_valid(c->value_str))
+                                interface = c->value_str;
+                        continue;
+
+                case BUS_MATCH_MEMBER:
+                        if (member_name_is_valid(c->value_str))
+                                member = c->value_str;
+                        continue;
+
+                case BUS_MATCH_PATH:
+                case BUS_MATCH_PATH_NAMESPACE:
+                        if (object_path_is_valid(c->value_str))
+                                path = c->value_str;
+                        continue;
+
+                case BUS_MATCH_ARG ... BUS_MATCH_ARG_LAST:
+                        k = c->type - BUS_MATCH_ARG;
+                        break;
+
+                case BUS_MATCH_ARG_PATH ... BUS_MATCH_ARG_PATH_LAST:
+                        k = c->type - BUS_MATCH_ARG_PATH;
+                        break;
+
+                case BUS_MATCH_ARG_NAMESPACE ... BUS_MATCH_ARG_NAMESPACE_LAST:
+                        k = c->type - BUS_MATCH_ARG_NAMESPACE;
+                        break;
+
+                case BUS_MATCH_ARG_HAS ... BUS_MATCH_ARG_HAS_LAST:
+                        k = c->type - BUS_MATCH_ARG_HAS;
+                        break;
+
+                default:
+                        continue;
+                }
+
+                if (!args[k])
+                        args[k] = c;
+                n_args = MAX(n_args, k + 1);
+        }
+
+        if (type == SD_BUS_MESSAGE_METHOD_CALL)
+                r = sd_bus_message_new_method_call(bus, &m, destination, path, interface, member);
+        else {
+                r = sd_bus_message_new_signal(bus, &m, path, interface, member);
+                if (r >= 0 && destination)
+                        r = sd_bus_message_set_destination(m, destination);
+        }
+        if (r < 0)
+                return r;
+
+        if (sender) {
+                r = sd_bus_message_set_sender(m, sender);
+                if (r < 0)
+                        return r;
+        }
+
+        for (unsigned i = 0; i < n_args; i++) {
+                const char *s = args[i] && utf8_is_valid(args[i]->value_str) ? args[i]->value_str : "";
+
+                if (args[i] && args[i]->type >= BUS_MATCH_ARG_HAS)
+                        r = sd_bus_message_append(m, "as", 1, s);
+                else
+                        r = sd_bus_message_append(m, "s", s);
+                if (r < 0)
+                        return r;
+        }
+
+        r = sd_bus_message_seal(m, 1, 0);
+        if (r < 0)
+                return r;
+
+        *ret = TAKE_PTR(m);
+        return 0;
+}
 
 int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
         _cleanup_free_ char *out = NULL; /* out should be freed after g */
         size_t out_size;
         _cleanup_fclose_ FILE *g = NULL;
         _cleanup_(sd_bus_unrefp) sd_bus *bus = NULL;
+        _cleanup_close_pair_ int fds[2] = { -1, -1 };
+        _cleanup_free_ bool *ran_tree = NULL, *ran_compiled = NULL;
+        sd_bus_message *messages[N_MESSAGES] = {};
+        sd_bus_slot **slots = NULL;
+        size_t n_slots = 0, n_messages = 0;
         int r;
 
         /* We don't want to fill the logs with messages about parse errors.
@@ -20,20 +153,17 @@ int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
         if (!getenv("SYSTEMD_LOG_LEVEL"))
                 log_set_max_level(LOG_CRIT);
 
-        r = sd_bus_new(&bus);
-        assert_se(r >= 0);
+        /* Messages can only be created for a bus that was started */
+        assert_se(socketpair(AF_UNIX, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0, fds) >= 0);
+        assert_se(sd_bus_new(&bus) >= 0);
+        assert_se(sd_bus_set_fd(bus, fds[0], fds[0]) >= 0);
+        fds[0] = -1;
+        assert_se(sd_bus_start(bus) >= 0);
 
         struct bus_match_node root = {
                 .type = BUS_MATCH_ROOT,
         };
 
-        /* Note that we use the pointer to match_callback substructure, but the code
-         * uses container_of() to access outside of the passed-in type. */
-        sd_bus_slot slot = {
-                .type = BUS_MATCH_CALLBACK,
-                .match_callback = {},
-        };
-
         if (getenv_bool("SYSTEMD_FUZZ_OUTPUT") <= 0)
                 assert_se(g = open_memstream_unlocked(&out, &out_size));
 
@@ -45,8 +175,10 @@ int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
 
                 line = memdup_suffix0((char*) data + offset,
                                       end ? end - (char*) data - offset : size - offset);
-                if (!line)
-                        return log_oom_debug();
+                if (!line) {
+                        log_oom_debug();
+                        break;
+                }
 
                 offset = end ? (size_t) (end - (char*) data + 1) : size;
 
@@ -71,7 +203,30 @@ int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
                 if (g)
                         fprintf(g, "%s\n", again);
 
-                r = bus_match_add(&root, components, n_components, &slot.match_callback);
+                if (n_messages < N_MESSAGES) {
+                        r = message_new_for_components(bus, components, n_components, messages + n_messages);
+                        if (r >= 0)
+                                n_messages++;
+                        else
+                                log_debug_errno(r, "Failed to create message for match, ignoring: %m");
+                }
+
+                /* Note that we use the pointer to match_callback substructure, but the code
+                 * uses container_of() to access outside of the passed-in type. */
+                sd_bus_slot *slot = NULL;
+                if (!GREEDY_REALLOC(slots, n_slots + 1) ||
+                    !(slot = new0(sd_bus_slot, 1))) {
+                        bus_match_parse_free(components, n_components);
+                        log_oom();
+                        break;
+                }
+
+                slot->type = BUS_MATCH_CALLBACK;
+                slot->userdata = UINT_TO_PTR(n_slots);
+                slot->match_callback.callback = match_callback;
+                slots[n_slots++] = slot;
+
+                r = bus_match_add(&root, components, n_components, &slot->match_callback);
                 bus_match_parse_free(components, n_components);
                 if (r < 0) {
                         log_error_errno(r, "Failed to add match: %m");
@@ -80,7 +235,38 @@ int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
         }
 
         bus_match_dump(g ?: stdout, &root, 0); /* We do this even on failure, to check consistency after error. */
+
+        /* The compiled form has to run the same callbacks as the tree walk, but possibly in a different
+         * order. These are fewer runs than it takes for the tree to be compiled automatically. */
+        ran_tree = new0(bool, n_messages * n_slots + 1);
+        ran_compiled = new0(bool, n_messages * n_slots + 1);
+        if (ran_tree && ran_compiled) {
+                for (size_t i = 0; i < n_messages; i++) {
+                        ran = ran_tree + i * n_slots;
+                        assert_se(bus_match_run(NULL, &root, messages[i]) == 0);
+                }
+
+                r = bus_match_compile(&root);
+                assert_se(r >= 0 || r == -ENOMEM);
+
+                if (r >= 0) {
+                        for (size_t i = 0; i < n_messages; i++) {
+                                ran = ran_compiled + i * n_slots;
+                                assert_se(bus_match_run(NULL, &root, messages[i]) == 0);
+                        }
+
+                        assert_se(memcmp(ran_tree, ran_compiled, n_messages * n_slots * sizeof(bool)) == 0);
+                }
+        }
+        ran = NULL;
+
         bus_match_free(&root);
 
+        for (size_t i = 0; i < n_messages; i++)
+                sd_bus_message_unref(messages[i]);
+        for (size_t i = 0; i < n_slots; i++)
+                free(slots[i]);
+        free(slots);
+
         return 0;
 }
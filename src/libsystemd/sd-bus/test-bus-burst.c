@@ -0,0 +1,259 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "sd-bus.h"
+#include "sd-event.h"
+
+#include "alloc-util.h"
+#include "bus-internal.h"
+#include "bus-message.h"
+#include "fd-util.h"
+#include "random-util.h"
+#include "tests.h"
+
+/* Sends bursts of messages of various sizes, some with fds, some larger than the initial read buffer and some
+ * larger than it may ever grow, and checks that they arrive complete, in order and with the right fds
+ * attached. */
+
+#define N_MESSAGES 3000U
+
+typedef struct Pipe {
+        int in, out;
+        uint8_t buffer[4096];
+        size_t size, offset;
+} Pipe;
+
+static bool message_has_fd(unsigned i) {
+        return i % 37 == 5;
+}
+
+static size_t message_payload_size(unsigned i) {
+        return i % 500 == 250 ? 100000 :
+               i % 500 == 125 ? 20000 :
+               (i * 7) % 301;
+}
+
+static void send_message(sd_bus *bus, unsigned i, const int fds[2]) {
+        _cleanup_(sd_bus_message_unrefp) sd_bus_message *m = NULL;
+        _cleanup_free_ char *payload = NULL;
+        size_t n;
+
+        n = message_payload_size(i);
+        assert_se(payload = malloc(n + 1));
+        memset(payload, 'a' + i % 26, n);
+        payload[n] = 0;
+
+        assert_se(sd_bus_message_new_signal(bus, &m, "/", "org.example.Burst", "Burst") >= 0);
+
+        if (fds && message_has_fd(i))
+                assert_se(sd_bus_message_append(m, "ush", i, payload, fds[i % 2]) >= 0);
+        else
+                assert_se(sd_bus_message_append(m, "us", i, payload) >= 0);
+
+        assert_se(sd_bus_send(bus, m, NULL) >= 0);
+}
+
+static void check_message(sd_bus_message *m, unsigned i, const int fds[2]) {
+        const char *payload;
+        unsigned j;
+
+        assert_se(sd_bus_message_is_signal(m, "org.example.Burst", "Burst"));
+        assert_se(sd_bus_message_read(m, "us", &j, &payload) >= 0);
+        assert_se(j == i);
+        assert_se(strlen(payload) == message_payload_size(i));
+        assert_se(strspn(payload, CHAR_TO_STR('a' + i % 26)) == message_payload_size(i));
+
+        if (fds && message_has_fd(i)) {
+                struct stat a, b;
+                int fd;
+
+                assert_se(m->n_fds == 1);
+                assert_se(sd_bus_message_read(m, "h", &fd) >= 0);
+
+                /* Not the same number, but the same file */
+                assert_se(fstat(fd, &a) >= 0);
+                assert_se(fstat(fds[i % 2], &b) >= 0);
+                assert_se(a.st_dev == b.st_dev && a.st_ino == b.st_ino);
+        } else
+                assert_se(m->n_fds == 0);
+
+        assert_se(sd_bus_message_at_end(m, true) > 0);
+}
+
+static bool pipe_pump(Pipe *p) {
+        ssize_t k;
+
+        /* Forwards what's available in pieces of random size, so that messages are split up at arbitrary
+         * points on the receiving side */
+
+        if (p->size == 0) {
+                k = read(p->in, p->buffer, 1 + random_u64_range(sizeof(p->buffer)));
+                if (k < 0 && errno == EAGAIN)
+                        return false;
+                assert_se(k > 0);
+
+                p->size = k;
+                p->offset = 0;
+        }
+
+        k = write(p->out, p->buffer + p->offset, 1 + random_u64_range(p->size - p->offset));
+        if (k < 0 && errno == EAGAIN)
+                return false;
+        assert_se(k > 0);
+
+        p->offset += k;
+        if (p->offset >= p->size)
+                p->size = 0;
+
+        return true;
+}
+
+static void new_buses(int sender_fd, int receiver_fd, Pipe *up, Pipe *down, sd_bus **ret_sender, sd_bus **ret_receiver) {
+        _cleanup_(sd_bus_unrefp) sd_bus *a = NULL, *b = NULL;
+        sd_id128_t id;
+
+        assert_se(sd_id128_randomize(&id) >= 0);
+
+        assert_se(sd_bus_new(&a) >= 0);
+        assert_se(sd_bus_set_fd(a, sender_fd, sender_fd) >= 0);
+        assert_se(sd_bus_negotiate_fds(a, !up) >= 0);
+        assert_se(sd_bus_start(a) >= 0);
+
+        assert_se(sd_bus_new(&b) >= 0);
+        assert_se(sd_bus_set_fd(b, receiver_fd, receiver_fd) >= 0);
+        assert_se(sd_bus_set_server(b, true, id) >= 0);
+        assert_se(sd_bus_negotiate_fds(b, !up) >= 0);
+        assert_se(sd_bus_start(b) >= 0);
+
+        /* Bring the connection up, as sending fds requires it to be */
+        while (sd_bus_is_ready(a) <= 0 || sd_bus_is_ready(b) <= 0) {
+                assert_se(sd_bus_process(a, NULL) >= 0);
+                assert_se(sd_bus_process(b, NULL) >= 0);
+
+                if (up) {
+                        pipe_pump(up);
+                        pipe_pump(down);
+                }
+        }
+
+        *ret_sender = TAKE_PTR(a);
+        *ret_receiver = TAKE_PTR(b);
+}
+
+static void test_burst(bool chunked) {
+        _cleanup_(sd_bus_unrefp) sd_bus *sender = NULL, *receiver = NULL;
+        _cleanup_close_pair_ int a[2] = { -1, -1 }, b[2] = { -1, -1 }, fds[2] = { -1, -1 };
+        Pipe up = {}, down = {};
+        unsigned n_received = 0;
+
+        log_info("/* %s(chunked=%s) */", __func__, yes_no(chunked));
+
+        assert_se(socketpair(AF_UNIX, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0, a) >= 0);
+
+        /* fds can't be passed along by the pipe in between */
+        if (chunked) {
+                assert_se(socketpair(AF_UNIX, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0, b) >= 0);
+                up = (Pipe) { .in = a[1], .out = b[1] };
+                down = (Pipe) { .in = b[1], .out = a[1] };
+
+                new_buses(a[0], b[0], &up, &down, &sender, &receiver);
+                a[0] = b[0] = -1;
+        } else {
+                assert_se(pipe2(fds, O_CLOEXEC) >= 0);
+
+                new_buses(a[0], a[1], NULL, NULL, &sender, &receiver);
+                a[0] = a[1] = -1;
+        }
+
+        /* Once the socket is full, the rest is queued */
+        for (unsigned i = 0; i < N_MESSAGES; i++)
+                send_message(sender, i, chunked ? NULL : fds);
+
+        while (n_received < N_MESSAGES) {
+                _cleanup_(sd_bus_message_unrefp) sd_bus_message *m = NULL;
+                bool progress = false;
+                int r;
+
+                r = sd_bus_process(sender, NULL);
+                assert_se(r >= 0);
+                progress = progress || r > 0;
+
+                r = sd_bus_process(receiver, &m);
+                assert_se(r >= 0);
+                progress = progress || r > 0;
+
+                if (chunked) {
+                        progress = pipe_pump(&up) || progress;
+                        progress = pipe_pump(&down) || progress;
+                }
+
+                if (m && sd_bus_message_is_signal(m, NULL, NULL))
+                        check_message(m, n_received++, chunked ? NULL : fds);
+
+                if (!progress && !chunked)
+                        assert_se(sd_bus_wait(receiver, 100 * USEC_PER_MSEC) >= 0);
+        }
+
+        assert_se(sender->wqueue_size == 0);
+        assert_se(receiver->rqueue_size == 0);
+        assert_se(receiver->n_fds == 0);
+}
+
+static int defer_handler(sd_event_source *s, void *userdata) {
+        sd_bus *bus = userdata;
+
+        for (unsigned i = 0; i < 100; i++)
+                send_message(bus, i, NULL);
+
+        /* Messages sent while the event loop dispatches are written right away, as the loop might be left
+         * without another iteration */
+        assert_se(bus->wqueue_size == 0);
+
+        return 0;
+}
+
+static void test_event_loop(void) {
+        _cleanup_(sd_bus_unrefp) sd_bus *sender = NULL, *receiver = NULL;
+        _cleanup_(sd_event_source_unrefp) sd_event_source *s = NULL;
+        _cleanup_(sd_event_unrefp) sd_event *e = NULL;
+        _cleanup_close_pair_ int a[2] = { -1, -1 };
+        unsigned n_received = 0;
+
+        log_info("/* %s */", __func__);
+
+        assert_se(socketpair(AF_UNIX, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0, a) >= 0);
+        new_buses(a[0], a[1], NULL, NULL, &sender, &receiver);
+        a[0] = a[1] = -1;
+
+        assert_se(sd_event_new(&e) >= 0);
+        assert_se(sd_bus_attach_event(sender, e, SD_EVENT_PRIORITY_NORMAL) >= 0);
+        assert_se(sd_event_add_defer(e, &s, defer_handler, sender) >= 0);
+        assert_se(sd_event_source_set_enabled(s, SD_EVENT_ONESHOT) >= 0);
+
+        /* Leave the loop after one iteration, without sd_event_exit(), like PID 1 does */
+        assert_se(sd_event_run(e, 0) > 0);
+        assert_se(sender->wqueue_size == 0);
+        assert_se(sd_bus_detach_event(sender) >= 0);
+
+        while (n_received < 100) {
+                _cleanup_(sd_bus_message_unrefp) sd_bus_message *m = NULL;
+
+                assert_se(sd_bus_process(receiver, &m) > 0);
+                if (m)
+                        check_message(m, n_received++, NULL);
+        }
+}
+
+int main(int argc, char *argv[]) {
+        test_setup_logging(LOG_INFO);
+
+        test_burst(false);
+        test_burst(true);
+        test_event_loop();
+
+        return 0;
+}
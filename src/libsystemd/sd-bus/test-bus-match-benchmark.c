@@ -0,0 +1,176 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+
+#include <sys/socket.h>
+
+#include "alloc-util.h"
+#include "bus-internal.h"
+#include "bus-match.h"
+#include "bus-message.h"
+#include "bus-slot.h"
+#include "fd-util.h"
+#include "log.h"
+#include "parse-util.h"
+#include "random-util.h"
+#include "tests.h"
+#include "time-util.h"
+
+/* Runs messages against a large set of matches of the kinds PID 1 and logind carry: NameOwnerChanged for
+ * specific names, PropertiesChanged on specific objects, and path and argument prefix matches. This is
+ * done once by walking the match tree and once with its compiled form.
+ *
+ * Usage: test-bus-match-benchmark [MATCHES [MESSAGES]] */
+
+static unsigned arg_matches = 10000;
+static unsigned arg_messages = 200000;
+
+#define N_KINDS 4U
+
+static unsigned n_ran = 0;
+
+static int match_callback(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+        n_ran++;
+        return 0;
+}
+
+static int add_match(struct bus_match_node *root, sd_bus_slot *slot, unsigned i) {
+        struct bus_match_component *components;
+        _cleanup_free_ char *match = NULL;
+        unsigned n_components;
+        int r;
+
+        switch (i % N_KINDS) {
+
+        case 0:
+                r = asprintf(&match,
+                             "type='signal',sender='org.freedesktop.DBus',path='/org/freedesktop/DBus',"
+                             "interface='org.freedesktop.DBus',member='NameOwnerChanged',arg0='org.example.Client%u'", i);
+                break;
+
+        case 1:
+                r = asprintf(&match,
+                             "type='signal',path='/org/freedesktop/systemd1/unit/u%u',"
+                             "interface='org.freedesktop.DBus.Properties',member='PropertiesChanged'", i);
+                break;
+
+        case 2:
+                r = asprintf(&match, "type='signal',path_namespace='/org/freedesktop/login1/session/s%u'", i);
+                break;
+
+        default:
+                r = asprintf(&match, "type='signal',interface='org.example.Watch',arg0path='/org/example/o%u/'", i);
+        }
+        if (r < 0)
+                return -ENOMEM;
+
+        r = bus_match_parse(match, &components, &n_components);
+        if (r < 0)
+                return r;
+
+        slot->type = BUS_MATCH_CALLBACK;
+        slot->match_callback.callback = match_callback;
+
+        r = bus_match_add(root, components, n_components, &slot->match_callback);
+        bus_match_parse_free(components, n_components);
+        return r;
+}
+
+static void make_message(sd_bus *bus, unsigned i, sd_bus_message **ret) {
+        _cleanup_(sd_bus_message_unrefp) sd_bus_message *m = NULL;
+        _cleanup_free_ char *s = NULL;
+
+        switch (i % N_KINDS) {
+
+        case 0:
+                assert_se(asprintf(&s, "org.example.Client%u", i) >= 0);
+                assert_se(sd_bus_message_new_signal(bus, &m, "/org/freedesktop/DBus", "org.freedesktop.DBus", "NameOwnerChanged") >= 0);
+                assert_se(sd_bus_message_set_sender(m, "org.freedesktop.DBus") >= 0);
+                assert_se(sd_bus_message_append(m, "sss", s, "", ":1.1") >= 0);
+                break;
+
+        case 1:
+                assert_se(asprintf(&s, "/org/freedesktop/systemd1/unit/u%u", i) >= 0);
+                assert_se(sd_bus_message_new_signal(bus, &m, s, "org.freedesktop.DBus.Properties", "PropertiesChanged") >= 0);
+                assert_se(sd_bus_message_append(m, "sa{sv}as", "org.freedesktop.systemd1.Unit", 0, 0) >= 0);
+                break;
+
+        case 2:
+                assert_se(asprintf(&s, "/org/freedesktop/login1/session/s%u/seat", i) >= 0);
+                assert_se(sd_bus_message_new_signal(bus, &m, s, "org.freedesktop.login1.Session", "Lock") >= 0);
+                break;
+
+        default:
+                assert_se(asprintf(&s, "/org/example/o%u/child", i) >= 0);
+                assert_se(sd_bus_message_new_signal(bus, &m, "/org/example", "org.example.Watch", "Changed") >= 0);
+                assert_se(sd_bus_message_append(m, "o", s) >= 0);
+        }
+
+        assert_se(sd_bus_message_seal(m, i + 1, 0) >= 0);
+        *ret = TAKE_PTR(m);
+}
+
+static unsigned benchmark(struct bus_match_node *root, sd_bus_message **messages, unsigned n_messages, bool compiled) {
+        usec_t begin, elapsed;
+
+        if (compiled)
+                assert_se(bus_match_compile(root) >= 0);
+
+        n_ran = 0;
+        begin = now(CLOCK_MONOTONIC);
+
+        for (unsigned i = 0; i < arg_messages; i++)
+                assert_se(bus_match_run(NULL, root, messages[i % n_messages]) >= 0);
+
+        elapsed = now(CLOCK_MONOTONIC) - begin;
+
+        log_info("%-8s %u matches, %u messages, %u callbacks, %.3f us per message",
+                 compiled ? "compiled" : "tree", arg_matches, arg_messages, n_ran,
+                 (double) elapsed / arg_messages);
+
+        return n_ran;
+}
+
+int main(int argc, char *argv[]) {
+        struct bus_match_node root = {
+                .type = BUS_MATCH_ROOT,
+        };
+        _cleanup_(sd_bus_unrefp) sd_bus *bus = NULL;
+        _cleanup_close_pair_ int fds[2] = { -1, -1 };
+        _cleanup_free_ sd_bus_slot *slots = NULL;
+        sd_bus_message *messages[1024];
+        unsigned n_tree, n_compiled;
+
+        test_setup_logging(LOG_INFO);
+
+        if (argc > 1)
+                assert_se(safe_atou(argv[1], &arg_matches) >= 0 && arg_matches > 0);
+        if (argc > 2)
+                assert_se(safe_atou(argv[2], &arg_messages) >= 0);
+
+        /* Messages can only be created for a bus that was started */
+        assert_se(socketpair(AF_UNIX, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0, fds) >= 0);
+        assert_se(sd_bus_new(&bus) >= 0);
+        assert_se(sd_bus_set_fd(bus, fds[0], fds[0]) >= 0);
+        fds[0] = -1;
+        assert_se(sd_bus_start(bus) >= 0);
+
+        assert_se(slots = new0(sd_bus_slot, arg_matches));
+        for (unsigned i = 0; i < arg_matches; i++)
+                assert_se(add_match(&root, slots + i, i) >= 0);
+
+        /* Most messages match one of the matches, some match none */
+        for (unsigned i = 0; i < ELEMENTSOF(messages); i++)
+                make_message(bus, random_u64_range(arg_matches + arg_matches / 4), messages + i);
+
+        /* Don't let the tree be compiled behind our back */
+        assert_se(setenv("SYSTEMD_BUS_MATCH_COMPILE", "0", 1) >= 0);
+
+        n_tree = benchmark(&root, messages, ELEMENTSOF(messages), false);
+        n_compiled = benchmark(&root, messages, ELEMENTSOF(messages), true);
+        assert_se(n_tree == n_compiled);
+
+        for (unsigned i = 0; i < ELEMENTSOF(messages); i++)
+                sd_bus_message_unref(messages[i]);
+
+        bus_match_free(&root);
+        return 0;
+}
@@ -0,0 +1,233 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+
+#include "alloc-util.h"
+#include "event-pool.h"
+#include "fd-util.h"
+#include "log.h"
+#include "stdio-util.h"
+
+typedef struct EventPoolLoop {
+        sd_event *event;
+        unsigned index;
+        pthread_t thread;
+        bool running;
+        int cpu; /* the CPU the thread is pinned to, or -1 */
+} EventPoolLoop;
+
+struct EventPool {
+        EventPoolLoop *loops;
+        unsigned n_loops;
+        unsigned next; /* for round-robin distribution, updated atomically */
+};
+
+typedef struct EventPoolFd {
+        event_pool_fd_handler_t callback;
+        int fd;
+        void *userdata;
+} EventPoolFd;
+
+static void *loop_thread(void *userdata) {
+        EventPoolLoop *l = userdata;
+        char name[STRLEN("sd-event-") + DECIMAL_STR_MAX(unsigned)];
+        int r;
+
+        /* Truncated to 15 characters by the kernel */
+        xsprintf(name, "sd-event-%u", l->index);
+        (void) prctl(PR_SET_NAME, name);
+
+        if (l->cpu >= 0) {
+                cpu_set_t cpus;
+
+                CPU_ZERO(&cpus);
+                CPU_SET(l->cpu, &cpus);
+
+                r = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+                if (r > 0)
+                        log_debug_errno(r, "Failed to pin event loop thread to CPU %i, ignoring: %m", l->cpu);
+        }
+
+        r = sd_event_loop(l->event);
+        if (r < 0)
+                log_debug_errno(r, "Event loop in worker thread failed: %m");
+
+        return NULL;
+}
+
+static int exit_closure(sd_event *e, void *userdata) {
+        return sd_event_exit(e, 0);
+}
+
+EventPool *event_pool_free(EventPool *p) {
+        if (!p)
+                return NULL;
+
+        for (unsigned i = 0; i < p->n_loops; i++) {
+                EventPoolLoop *l = p->loops + i;
+                int r;
+
+                if (l->running) {
+                        r = sd_event_post_to(l->event, exit_closure, NULL, NULL);
+                        if (r < 0) {
+                                /* We cannot stop the thread, hence leave the event loop to it */
+                                log_debug_errno(r, "Failed to stop event loop thread, leaving it behind: %m");
+                                (void) pthread_detach(l->thread);
+                                continue;
+                        }
+
+                        (void) pthread_join(l->thread, NULL);
+                }
+
+                sd_event_unref(l->event);
+        }
+
+        free(p->loops);
+        return mfree(p);
+}
+
+int event_pool_new(unsigned n_loops, bool pin_cpus, EventPool **ret) {
+        _cleanup_(event_pool_freep) EventPool *p = NULL;
+        sigset_t ss, saved_ss;
+        cpu_set_t cpus;
+        int r, cpu = -1;
+
+        assert(n_loops > 0);
+        assert(ret);
+
+        p = new0(EventPool, 1);
+        if (!p)
+                return -ENOMEM;
+
+        p->loops = new0(EventPoolLoop, n_loops);
+        if (!p->loops)
+                return -ENOMEM;
+
+        if (pin_cpus && sched_getaffinity(0, sizeof(cpus), &cpus) < 0)
+                return -errno;
+
+        for (; p->n_loops < n_loops; p->n_loops++) {
+                EventPoolLoop *l = p->loops + p->n_loops;
+
+                l->index = p->n_loops;
+
+                r = sd_event_new(&l->event);
+                if (r < 0)
+                        return r;
+
+                r = sd_event_add_post_to_queue(l->event, NULL);
+                if (r < 0) {
+                        l->event = sd_event_unref(l->event);
+                        return r;
+                }
+
+                /* Spread the loops over the CPUs we may run on, so that a loop is picked by the CPU that
+                 * received a connection's packets in event_pool_pick_for_fd() */
+                if (pin_cpus) {
+                        do
+                                cpu = (cpu + 1) % CPU_SETSIZE;
+                        while (!CPU_ISSET(cpu, &cpus));
+                }
+                l->cpu = cpu;
+        }
+
+        /* Leave all signals to the main thread */
+        assert_se(sigfillset(&ss) >= 0);
+        r = pthread_sigmask(SIG_BLOCK, &ss, &saved_ss);
+        if (r > 0)
+                return -r;
+
+        for (unsigned i = 0; i < p->n_loops; i++) {
+                EventPoolLoop *l = p->loops + i;
+
+                r = pthread_create(&l->thread, NULL, loop_thread, l);
+                if (r > 0)
+                        break;
+
+                l->running = true;
+        }
+
+        (void) pthread_sigmask(SIG_SETMASK, &saved_ss, NULL);
+
+        if (r > 0)
+                return -r;
+
+        *ret = TAKE_PTR(p);
+        return 0;
+}
+
+unsigned event_pool_size(EventPool *p) {
+        return p ? p->n_loops : 0;
+}
+
+sd_event *event_pool_get(EventPool *p, unsigned i) {
+        assert(p);
+        assert(i < p->n_loops);
+
+        return p->loops[i].event;
+}
+
+unsigned event_pool_pick_for_fd(EventPool *p, int fd) {
+        socklen_t l = sizeof(int);
+        int cpu;
+
+        assert(p);
+        assert(fd >= 0);
+
+        /* Prefer the loop running on the CPU that processed the packets of the connection, so that they
+         * stay hot in its caches. For sockets that have not received anything yet, and those for which
+         * the kernel does not track this, e.g. AF_UNIX ones, go round-robin instead. */
+        if (getsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &l) >= 0 && cpu >= 0)
+                for (unsigned i = 0; i < p->n_loops; i++)
+                        if (p->loops[i].cpu == cpu)
+                                return i;
+
+        return __sync_fetch_and_add(&p->next, 1) % p->n_loops;
+}
+
+static void event_pool_fd_free(void *userdata) {
+        EventPoolFd *f = userdata;
+
+        /* Closes the fd if the closure never ran, because the event loop was freed first */
+        safe_close(f->fd);
+        free(f);
+}
+
+static int fd_closure(sd_event *e, void *userdata) {
+        EventPoolFd *f = userdata;
+
+        /* The callback takes ownership of the fd, the struct is released by event_pool_fd_free() */
+        return f->callback(e, TAKE_FD(f->fd), f->userdata);
+}
+
+int event_pool_dispatch_fd(EventPool *p, int fd, event_pool_fd_handler_t callback, void *userdata) {
+        _cleanup_free_ EventPoolFd *f = NULL;
+        int r;
+
+        assert(p);
+        assert(fd >= 0);
+        assert(callback);
+
+        /* On success, the fd is owned by the callback, on failure it stays with the caller */
+
+        f = new(EventPoolFd, 1);
+        if (!f)
+                return -ENOMEM;
+
+        *f = (EventPoolFd) {
+                .callback = callback,
+                .fd = fd,
+                .userdata = userdata,
+        };
+
+        r = sd_event_post_to(event_pool_get(p, event_pool_pick_for_fd(p, fd)), fd_closure, f, event_pool_fd_free);
+        if (r < 0)
+                return r;
+
+        TAKE_PTR(f);
+        return 0;
+}
@@ -0,0 +1,24 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+#pragma once
+
+#include "sd-event.h"
+
+#include "macro.h"
+
+/* A number of event loops, each running in a worker thread of its own. Work is handed to them with
+ * sd_event_post_to(), and connections are distributed over them with event_pool_dispatch_fd(). */
+
+typedef struct EventPool EventPool;
+
+/* Called in the thread of the event loop the fd was dispatched to, and takes ownership of the fd */
+typedef int (*event_pool_fd_handler_t)(sd_event *e, int fd, void *userdata);
+
+int event_pool_new(unsigned n_loops, bool pin_cpus, EventPool **ret);
+EventPool *event_pool_free(EventPool *p);
+DEFINE_TRIVIAL_CLEANUP_FUNC(EventPool*, event_pool_free);
+
+unsigned event_pool_size(EventPool *p);
+sd_event *event_pool_get(EventPool *p, unsigned i);
+
+unsigned event_pool_pick_for_fd(EventPool *p, int fd);
+int event_pool_dispatch_fd(EventPool *p, int fd, event_pool_fd_handler_t callback, void *userdata);
@@ -12,6 +12,7 @@
 #include "list.h"
 #include "prioq.h"
 #include "ratelimit.h"
+#include "timer-wheel.h"
 
 typedef enum EventSourceType {
         SOURCE_IO,
@@ -39,6 +40,7 @@ typedef enum WakeupType {
         WAKEUP_CLOCK_DATA,
         WAKEUP_SIGNAL_DATA,
         WAKEUP_INOTIFY_DATA,
+        WAKEUP_URING,
         _WAKEUP_TYPE_MAX,
         _WAKEUP_TYPE_INVALID = -EINVAL,
 } WakeupType;
@@ -77,7 +79,9 @@ struct sd_event_source {
         RateLimit rate_limit;
 
         /* These are primarily fields relevant for time event sources, but since any event source can
-         * effectively become one when rate-limited, this is part of the common fields. */
+         * effectively become one when rate-limited, this is part of the common fields. If the event loop
+         * orders time event sources in timer wheels, time event sources use time.earliest_node and
+         * time.latest_node instead. */
         unsigned earliest_index;
         unsigned latest_index;
 
@@ -87,12 +91,15 @@ struct sd_event_source {
                         int fd;
                         uint32_t events;
                         uint32_t revents;
+                        unsigned uring_slot; /* only valid while registered in the io_uring */
                         bool registered:1;
                         bool owned:1;
                 } io;
                 struct {
                         sd_event_time_handler_t callback;
                         usec_t next, accuracy;
+                        TimerWheelNode earliest_node;
+                        TimerWheelNode latest_node;
                 } time;
                 struct {
                         sd_event_signal_handler_t callback;
@@ -139,10 +146,14 @@ struct clock_data {
          * dispatched, and one ordered by the latest times they must
          * have been dispatched. The range between the top entries in
          * the two prioqs is the time window we can freely schedule
-         * wakeups in */
+         * wakeups in. Alternatively, the same is done with two timer
+         * wheels, which only contain the event sources that are
+         * enabled and not pending yet, or ratelimited. */
 
         Prioq *earliest;
         Prioq *latest;
+        TimerWheel *earliest_wheel;
+        TimerWheel *latest_wheel;
         usec_t next;
 
         bool needs_rearm:1;
@@ -0,0 +1,588 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+
+#include <endian.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#if HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+#endif
+
+#include "alloc-util.h"
+#include "event-uring.h"
+#include "fd-util.h"
+#include "log.h"
+#include "missing_syscall.h"
+
+/* Multishot polls and updates of poll requests are the newest features we rely on. Both came with kernel
+ * 5.13, as did IORING_FEAT_RSRC_TAGS, which is hence what we check for at runtime. */
+#if HAVE_LINUX_IO_URING_H && defined(IORING_POLL_ADD_MULTI) && defined(IORING_FEAT_RSRC_TAGS)
+#  define EVENT_URING_SUPPORTED 1
+#else
+#  define EVENT_URING_SUPPORTED 0
+#endif
+
+#define EVENT_URING_ENTRIES 256U
+
+/* The user data of requests whose completion is of no interest */
+#define USER_DATA_IGNORE UINT64_MAX
+
+/* Set in the user data of requests that update the poll request of a slot */
+#define USER_DATA_UPDATE (UINT64_C(1) << 31)
+#define SLOTS_MAX ((unsigned) USER_DATA_UPDATE)
+
+/* Each event source that is registered gets a slot, and the user data of its poll requests is the index of
+ * the slot plus the generation of the slot. Whenever the poll request of a slot is cancelled or replaced,
+ * the generation is bumped, so that completions that are still on their way are recognized as stale, even
+ * if the event source is long gone. */
+struct EventUringSlot {
+        sd_event_source *source;        /* NULL if the slot is free */
+        uint32_t generation;
+        unsigned next_free;
+        bool armed;                     /* a poll request is queued or active */
+        bool rearm;                     /* listed in the rearm array */
+        bool updating;                  /* the queued request updates an active one */
+        bool multishot;
+        int fd;                         /* the fd the request is for */
+        unsigned queued_at;             /* position of the last request in the submission ring */
+};
+
+EventUring* event_uring_free(EventUring *u) {
+        if (!u)
+                return NULL;
+
+        if (u->sqes)
+                (void) munmap(u->sqes, u->sqes_size);
+        if (u->ring)
+                (void) munmap(u->ring, u->ring_size);
+
+        safe_close(u->fd);
+        free(u->slots);
+        free(u->rearm);
+
+        return mfree(u);
+}
+
+int event_uring_check_fd(int fd) {
+        struct stat st;
+
+        /* epoll refuses fds that cannot be polled in a meaningful way, and callers rely on that to tell
+         * regular files apart. Polls in io_uring accept them and always report them ready, hence refuse
+         * them the same way. */
+
+        if (fstat(fd, &st) < 0)
+                return -errno;
+
+        if (S_ISREG(st.st_mode) || S_ISDIR(st.st_mode))
+                return -EPERM;
+
+        return 0;
+}
+
+#if EVENT_URING_SUPPORTED
+
+static unsigned load_acquire(const unsigned *p) {
+        return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+static void store_release(unsigned *p, unsigned v) {
+        __atomic_store_n(p, v, __ATOMIC_RELEASE);
+}
+
+static uint64_t slot_user_data(EventUring *u, EventUringSlot *slot) {
+        return (uint64_t) slot->generation << 32 | (uint64_t) (slot - u->slots);
+}
+
+static EventUringSlot* slot_lookup(EventUring *u, uint64_t user_data) {
+        EventUringSlot *slot;
+        size_t i;
+
+        if (user_data == USER_DATA_IGNORE)
+                return NULL;
+
+        i = (uint32_t) (user_data & ~USER_DATA_UPDATE);
+        if (i >= u->n_slots)
+                return NULL;
+
+        slot = u->slots + i;
+        if (!slot->source || slot->generation != (uint32_t) (user_data >> 32))
+                return NULL;
+
+        return slot;
+}
+
+static int slot_alloc(EventUring *u, sd_event_source *s, EventUringSlot **ret) {
+        unsigned i;
+
+        if (u->free_slot != UINT_MAX) {
+                i = u->free_slot;
+                u->free_slot = u->slots[i].next_free;
+        } else {
+                if (u->n_slots >= SLOTS_MAX)
+                        return -ENOSPC;
+
+                if (!GREEDY_REALLOC(u->slots, u->n_slots + 1))
+                        return -ENOMEM;
+
+                i = u->n_slots++;
+                u->slots[i] = (EventUringSlot) {};
+        }
+
+        u->slots[i].source = s;
+        s->io.uring_slot = i;
+
+        *ret = u->slots + i;
+        return 0;
+}
+
+static void slot_free(EventUring *u, EventUringSlot *slot) {
+        assert(!slot->armed);
+
+        slot->source = NULL;
+        slot->rearm = false;
+        slot->generation++;
+        slot->next_free = u->free_slot;
+        u->free_slot = slot - u->slots;
+}
+
+static bool slot_submitted(EventUring *u, EventUringSlot *slot) {
+        return (int) (slot->queued_at - u->sq_submitted) < 0;
+}
+
+static struct io_uring_sqe* sqe_at(EventUring *u, unsigned position) {
+        return (struct io_uring_sqe*) u->sqes + (position & *u->sq_mask);
+}
+
+static int flush_sq(EventUring *u) {
+        assert(u);
+
+        while (u->sq_submitted != u->sq_queued) {
+                int n;
+
+                store_release(u->sq_tail, u->sq_queued);
+
+                n = io_uring_enter(u->fd, u->sq_queued - u->sq_submitted, 0, 0);
+                if (n < 0) {
+                        if (errno == EINTR)
+                                continue;
+
+                        /* If the kernel cannot take more right now, the requests stay queued until the
+                         * completions are processed. */
+                        if (IN_SET(errno, EAGAIN, EBUSY))
+                                return 0;
+
+                        return -errno;
+                }
+                if (n == 0)
+                        break;
+
+                u->sq_submitted += n;
+        }
+
+        return 0;
+}
+
+static int get_sqe(EventUring *u, struct io_uring_sqe **ret) {
+        struct io_uring_sqe *sqe;
+        int r;
+
+        if (u->sq_queued - load_acquire(u->sq_head) >= u->sq_entries) {
+                r = flush_sq(u);
+                if (r < 0)
+                        return r;
+
+                if (u->sq_queued - load_acquire(u->sq_head) >= u->sq_entries)
+                        return -EBUSY;
+        }
+
+        sqe = sqe_at(u, u->sq_queued);
+        *sqe = (struct io_uring_sqe) {};
+        u->sq_array[u->sq_queued & *u->sq_mask] = u->sq_queued & *u->sq_mask;
+        u->sq_queued++;
+
+        *ret = sqe;
+        return 0;
+}
+
+static void sqe_set_events(struct io_uring_sqe *sqe, uint32_t events) {
+        uint32_t mask;
+
+        /* Sources are level-triggered unless EPOLLET is set, hence those get a poll request per
+         * notification, which is only renewed after the source was dispatched. Edge-triggered sources get
+         * a multishot request, which stays active until cancelled. */
+        mask = events & ~EPOLLET;
+#if __BYTE_ORDER == __BIG_ENDIAN
+        mask = mask << 16 | mask >> 16;
+#endif
+
+        sqe->poll32_events = mask;
+        if (FLAGS_SET(events, EPOLLET))
+                sqe->len |= IORING_POLL_ADD_MULTI;
+}
+
+static int queue_poll(EventUring *u, EventUringSlot *slot, uint32_t events) {
+        struct io_uring_sqe *sqe;
+        int r;
+
+        assert(!slot->armed);
+
+        r = get_sqe(u, &sqe);
+        if (r < 0)
+                return r;
+
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = slot->fd = slot->source->io.fd;
+        sqe->user_data = slot_user_data(u, slot);
+        sqe_set_events(sqe, events);
+
+        slot->armed = true;
+        slot->rearm = slot->updating = false;
+        slot->multishot = FLAGS_SET(events, EPOLLET);
+        slot->queued_at = u->sq_queued - 1;
+        return 0;
+}
+
+static int update_poll(EventUring *u, EventUringSlot *slot, uint32_t events) {
+        struct io_uring_sqe *sqe;
+        int r;
+
+        assert(slot->armed);
+
+        /* Changes the events of an active request in place, which is cheaper than replacing it */
+
+        r = get_sqe(u, &sqe);
+        if (r < 0)
+                return r;
+
+        sqe->opcode = IORING_OP_POLL_REMOVE;
+        sqe->addr = slot_user_data(u, slot);
+        slot->generation++;
+        sqe->off = slot_user_data(u, slot);
+        sqe->len = IORING_POLL_UPDATE_EVENTS|IORING_POLL_UPDATE_USER_DATA;
+        sqe->user_data = slot_user_data(u, slot) | USER_DATA_UPDATE;
+        sqe_set_events(sqe, events);
+
+        slot->updating = true;
+        slot->queued_at = u->sq_queued - 1;
+        return 0;
+}
+
+static int schedule_rearm(EventUring *u, EventUringSlot *slot) {
+        if (slot->rearm)
+                return 0;
+
+        if (!GREEDY_REALLOC(u->rearm, u->n_rearm + 1))
+                return -ENOMEM;
+
+        u->rearm[u->n_rearm++] = slot - u->slots;
+        slot->rearm = true;
+        return 0;
+}
+
+static int cancel_poll(EventUring *u, EventUringSlot *slot) {
+        struct io_uring_sqe *sqe;
+        int r = 0;
+
+        if (!slot->armed)
+                return 0;
+
+        if (!slot_submitted(u, slot)) {
+                struct io_uring_sqe *q = sqe_at(u, slot->queued_at);
+
+                /* The kernel has not seen the request yet. Turn an update into the removal of the request
+                 * it would have updated, and anything else into a no-op. */
+                if (slot->updating)
+                        *q = (struct io_uring_sqe) {
+                                .opcode = IORING_OP_POLL_REMOVE,
+                                .addr = q->addr,
+                                .user_data = USER_DATA_IGNORE,
+                        };
+                else
+                        *q = (struct io_uring_sqe) {
+                                .opcode = IORING_OP_NOP,
+                                .user_data = USER_DATA_IGNORE,
+                        };
+        } else {
+                r = get_sqe(u, &sqe);
+                if (r >= 0) {
+                        sqe->opcode = IORING_OP_POLL_REMOVE;
+                        sqe->addr = slot_user_data(u, slot);
+                        sqe->user_data = USER_DATA_IGNORE;
+                }
+        }
+
+        /* Even if the request could not be cancelled, its completions are stale from now on */
+        slot->armed = slot->updating = false;
+        slot->generation++;
+
+        return r;
+}
+
+int event_uring_new(EventUring **ret) {
+        _cleanup_(event_uring_freep) EventUring *u = NULL;
+        struct io_uring_params p = {};
+        int fd;
+
+        assert(ret);
+
+        u = new(EventUring, 1);
+        if (!u)
+                return -ENOMEM;
+
+        *u = (EventUring) {
+                .wakeup = WAKEUP_URING,
+                .fd = -1,
+                .free_slot = UINT_MAX,
+        };
+
+        fd = io_uring_setup(EVENT_URING_ENTRIES, &p);
+        if (fd < 0)
+                return -errno;
+
+        u->fd = fd_move_above_stdio(fd);
+
+        if ((p.features & (IORING_FEAT_NODROP|IORING_FEAT_RSRC_TAGS)) != (IORING_FEAT_NODROP|IORING_FEAT_RSRC_TAGS))
+                return -EOPNOTSUPP;
+
+        /* Since IORING_FEAT_NODROP implies IORING_FEAT_SINGLE_MMAP, both rings are in one mapping */
+        u->ring_size = MAX(p.sq_off.array + p.sq_entries * sizeof(unsigned),
+                           p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe));
+        u->ring = mmap(NULL, u->ring_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+        if (u->ring == MAP_FAILED) {
+                u->ring = NULL;
+                return -errno;
+        }
+
+        u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+        u->sqes = mmap(NULL, u->sqes_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, u->fd, IORING_OFF_SQES);
+        if (u->sqes == MAP_FAILED) {
+                u->sqes = NULL;
+                return -errno;
+        }
+
+        u->sq_head = (unsigned*) ((uint8_t*) u->ring + p.sq_off.head);
+        u->sq_tail = (unsigned*) ((uint8_t*) u->ring + p.sq_off.tail);
+        u->sq_mask = (unsigned*) ((uint8_t*) u->ring + p.sq_off.ring_mask);
+        u->sq_flags = (unsigned*) ((uint8_t*) u->ring + p.sq_off.flags);
+        u->sq_array = (unsigned*) ((uint8_t*) u->ring + p.sq_off.array);
+        u->sq_entries = p.sq_entries;
+        u->sq_queued = u->sq_submitted = *u->sq_tail;
+
+        u->cq_head = (unsigned*) ((uint8_t*) u->ring + p.cq_off.head);
+        u->cq_tail = (unsigned*) ((uint8_t*) u->ring + p.cq_off.tail);
+        u->cq_mask = (unsigned*) ((uint8_t*) u->ring + p.cq_off.ring_mask);
+        u->cqes = (uint8_t*) u->ring + p.cq_off.cqes;
+
+        *ret = TAKE_PTR(u);
+        return 0;
+}
+
+int event_uring_poll_add(EventUring *u, sd_event_source *s, uint32_t events) {
+        EventUringSlot *slot;
+        int r;
+
+        assert(u);
+        assert(s);
+        assert(s->type == SOURCE_IO);
+
+        if (!s->io.registered) {
+                r = slot_alloc(u, s, &slot);
+                if (r < 0)
+                        return r;
+        } else {
+                slot = u->slots + s->io.uring_slot;
+                assert(slot->source == s);
+
+                /* Updating an active request applies the new events, and resets the edge, just like
+                 * EPOLL_CTL_MOD. Requests the kernel has not seen yet, or that are for another fd, are
+                 * replaced, and so are those that switch between oneshot and multishot, since updates
+                 * cannot do that. */
+                if (slot->armed && slot_submitted(u, slot) && slot->fd == s->io.fd &&
+                    slot->multishot == FLAGS_SET(events, EPOLLET)) {
+                        r = update_poll(u, slot, events);
+                        if (r < 0)
+                                goto fail;
+
+                        return 0;
+                }
+
+                r = cancel_poll(u, slot);
+                if (r < 0)
+                        goto fail;
+        }
+
+        r = queue_poll(u, slot, events);
+        if (r < 0)
+                goto fail;
+
+        s->io.registered = true;
+        return 0;
+
+fail:
+        (void) cancel_poll(u, slot);
+        slot_free(u, slot);
+        s->io.registered = false;
+        return r;
+}
+
+void event_uring_poll_remove(EventUring *u, sd_event_source *s) {
+        EventUringSlot *slot;
+        bool submit;
+        int r;
+
+        assert(u);
+        assert(s);
+        assert(s->type == SOURCE_IO);
+
+        if (!s->io.registered)
+                return;
+
+        slot = u->slots + s->io.uring_slot;
+        assert(slot->source == s);
+
+        /* Active poll requests hold a reference to the file, hence make sure the kernel drops it right away,
+         * so that the fd may be closed as soon as the event source is disabled or gone. */
+        submit = slot->armed && slot_submitted(u, slot);
+
+        r = cancel_poll(u, slot);
+        if (r < 0)
+                log_debug_errno(r, "Failed to cancel poll request of event source, ignoring: %m");
+
+        slot_free(u, slot);
+        s->io.registered = false;
+
+        if (submit) {
+                r = event_uring_submit(u);
+                if (r < 0)
+                        log_debug_errno(r, "Failed to submit cancellation of poll request, ignoring: %m");
+        }
+}
+
+int event_uring_submit(EventUring *u) {
+        size_t i, k;
+        int r = 0;
+
+        assert(u);
+
+        /* Renew the poll requests that completed. Sources that were not dispatched yet are skipped, there
+         * is no point in being told again that they are ready. */
+        for (i = 0, k = 0; i < u->n_rearm; i++) {
+                EventUringSlot *slot = u->slots + u->rearm[i];
+
+                if (!slot->rearm)
+                        continue;
+
+                if (r >= 0 && !slot->source->pending)
+                        r = queue_poll(u, slot, slot->source->io.events);
+                if (slot->rearm)
+                        u->rearm[k++] = u->rearm[i];
+        }
+        u->n_rearm = k;
+
+        if (r < 0)
+                log_debug_errno(r, "Failed to renew poll requests, retrying later: %m");
+
+        return flush_sq(u);
+}
+
+int event_uring_next(EventUring *u, sd_event_source **ret, uint32_t *ret_revents) {
+        assert(u);
+        assert(ret);
+        assert(ret_revents);
+
+        for (;;) {
+                struct io_uring_cqe *cqe;
+                EventUringSlot *slot;
+                sd_event_source *s;
+                uint64_t user_data;
+                unsigned head;
+                uint32_t flags;
+                int32_t res;
+                int r;
+
+                head = *u->cq_head;
+                if (head == load_acquire(u->cq_tail)) {
+                        if (!FLAGS_SET(load_acquire(u->sq_flags), IORING_SQ_CQ_OVERFLOW))
+                                return 0;
+
+                        /* Completions that did not fit into the ring are kept by the kernel until we ask
+                         * for them */
+                        r = io_uring_enter(u->fd, 0, 0, IORING_ENTER_GETEVENTS);
+                        if (r < 0 && errno != EINTR)
+                                return -errno;
+
+                        continue;
+                }
+
+                cqe = (struct io_uring_cqe*) u->cqes + (head & *u->cq_mask);
+                user_data = cqe->user_data;
+                res = cqe->res;
+                flags = cqe->flags;
+                store_release(u->cq_head, head + 1);
+
+                slot = slot_lookup(u, user_data);
+                if (!slot)
+                        continue;
+
+                if (FLAGS_SET(user_data, USER_DATA_UPDATE)) {
+                        /* If the update failed, the request was gone already, and its completion was
+                         * discarded as stale. Hence ask again. */
+                        if (res < 0 && slot->armed) {
+                                slot->armed = slot->updating = false;
+
+                                r = schedule_rearm(u, slot);
+                                if (r < 0)
+                                        return r;
+                        }
+
+                        continue;
+                }
+
+                s = slot->source;
+
+                if (!FLAGS_SET(flags, IORING_CQE_F_MORE)) {
+                        slot->armed = false;
+
+                        if (res < 0)
+                                /* Leave the source without request, until it is changed */
+                                log_debug_errno(res, "Poll request of event source %s failed: %m",
+                                                strna(s->description));
+                        else if (s->enabled != SD_EVENT_ONESHOT) {
+                                /* The request is renewed with the next submission, i.e. after the source
+                                 * was dispatched. Doing it here would mean that submitting a full ring
+                                 * produces completions while we are reaping them. */
+                                r = schedule_rearm(u, slot);
+                                if (r < 0)
+                                        return r;
+                        }
+                }
+
+                *ret = s;
+                *ret_revents = res < 0 ? EPOLLERR : (uint32_t) res;
+                return 1;
+        }
+}
+
+#else
+
+int event_uring_new(EventUring **ret) {
+        return -EOPNOTSUPP;
+}
+
+int event_uring_poll_add(EventUring *u, sd_event_source *s, uint32_t events) {
+        assert_not_reached();
+}
+
+void event_uring_poll_remove(EventUring *u, sd_event_source *s) {
+        assert_not_reached();
+}
+
+int event_uring_submit(EventUring *u) {
+        assert_not_reached();
+}
+
+int event_uring_next(EventUring *u, sd_event_source **ret, uint32_t *ret_revents) {
+        assert_not_reached();
+}
+
+#endif
@@ -0,0 +1,52 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+#pragma once
+
+#include <inttypes.h>
+
+#include "event-source.h"
+#include "macro.h"
+
+/* An io_uring instance that watches the fds of IO event sources in place of epoll_ctl(). Poll requests are
+ * queued in the submission ring and submitted together once per event loop iteration, and completions are
+ * read from the completion ring without any syscall. The ring fd itself is watched by the epoll fd of the
+ * event loop, which hence remains the one fd to wait on. */
+
+typedef struct EventUringSlot EventUringSlot;
+
+typedef struct EventUring {
+        WakeupType wakeup;
+        int fd;
+
+        /* Both rings share one mapping. sq_queued is our private tail of the submission ring, and
+         * sq_submitted how far the kernel took it. */
+        void *ring;
+        size_t ring_size;
+        unsigned *sq_head, *sq_tail, *sq_mask, *sq_flags, *sq_array;
+        unsigned sq_entries;
+        unsigned sq_queued, sq_submitted;
+        unsigned *cq_head, *cq_tail, *cq_mask;
+        void *cqes;
+
+        void *sqes;
+        size_t sqes_size;
+
+        /* One slot per registered event source, see event-uring.c */
+        EventUringSlot *slots;
+        size_t n_slots;
+        unsigned free_slot;
+
+        /* Slots whose oneshot poll request completed, and that need a new one */
+        unsigned *rearm;
+        size_t n_rearm;
+} EventUring;
+
+int event_uring_new(EventUring **ret);
+EventUring* event_uring_free(EventUring *u);
+DEFINE_TRIVIAL_CLEANUP_FUNC(EventUring*, event_uring_free);
+
+int event_uring_check_fd(int fd);
+int event_uring_poll_add(EventUring *u, sd_event_source *s, uint32_t events);
+void event_uring_poll_remove(EventUring *u, sd_event_source *s);
+
+int event_uring_submit(EventUring *u);
+int event_uring_next(EventUring *u, sd_event_source **ret, uint32_t *ret_revents);
@@ -1,6 +1,7 @@
 /* SPDX-License-Identifier: LGPL-2.1-or-later */
 
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/timerfd.h>
 #include <sys/wait.h>
 
@@ -11,6 +12,7 @@
 #include "alloc-util.h"
 #include "env-util.h"
 #include "event-source.h"
+#include "event-uring.h"
 #include "fd-util.h"
 #include "fs-util.h"
 #include "hashmap.h"
@@ -85,6 +87,15 @@ DEFINE_PRIVATE_STRING_TABLE_LOOKUP_TO_STRING(event_source_type, int);
                SOURCE_DEFER,                    \
                SOURCE_INOTIFY)
 
+typedef struct PostToItem PostToItem;
+
+struct PostToItem {
+        PostToItem *next;
+        sd_event_post_to_handler_t callback;
+        sd_event_destroy_t destroy;
+        void *userdata;
+};
+
 /* This is used to assert that we didn't pass an unexpected source type to event_source_time_prioq_put().
  * Time sources and ratelimited sources can be passed, so effectively this is the same as the
  * EVENT_SOURCE_CAN_RATE_LIMIT() macro. */
@@ -96,6 +107,9 @@ struct sd_event {
         int epoll_fd;
         int watchdog_fd;
 
+        /* If set, IO event sources are watched by this instead of the epoll fd */
+        EventUring *uring;
+
         Prioq *pending;
         Prioq *prepare;
 
@@ -120,6 +134,12 @@ struct sd_event {
 
         Prioq *exit;
 
+        /* Closures posted by sd_event_post_to(), possibly from other threads. Pushed onto this stack with
+         * atomic operations, and taken off in one go by the thread running the event loop, which is
+         * woken up through the eventfd. */
+        PostToItem *post_to_items;
+        int post_to_fd;
+
         Hashmap *inotify_data; /* indexed by priority */
 
         /* A list of inode structures that still have an fd open, that we need to close before the next loop iteration */
@@ -138,6 +158,7 @@ struct sd_event {
         bool need_process_child:1;
         bool watchdog:1;
         bool profile_delays:1;
+        bool timer_wheel:1;
 
         int exit_code;
 
@@ -315,6 +336,8 @@ static void free_clock_data(struct clock_data *d) {
         safe_close(d->fd);
         prioq_free(d->earliest);
         prioq_free(d->latest);
+        timer_wheel_free(d->earliest_wheel);
+        timer_wheel_free(d->latest_wheel);
 }
 
 static sd_event *event_free(sd_event *e) {
@@ -333,6 +356,7 @@ static sd_event *event_free(sd_event *e) {
         if (e->default_event_ptr)
                 *(e->default_event_ptr) = NULL;
 
+        event_uring_free(e->uring);
         safe_close(e->epoll_fd);
         safe_close(e->watchdog_fd);
 
@@ -354,11 +378,46 @@ static sd_event *event_free(sd_event *e) {
         hashmap_free(e->child_sources);
         set_free(e->post_sources);
 
+        /* Closures that were never dispatched are dropped, but their userdata is released */
+        while (e->post_to_items) {
+                PostToItem *i = e->post_to_items;
+
+                e->post_to_items = i->next;
+                if (i->destroy)
+                        i->destroy(i->userdata);
+                free(i);
+        }
+        safe_close(e->post_to_fd);
+
         free(e->event_queue);
 
         return mfree(e);
 }
 
+static int event_setup_uring(sd_event *e) {
+        _cleanup_(event_uring_freep) EventUring *u = NULL;
+        struct epoll_event ev;
+        int r;
+
+        assert(e);
+
+        r = event_uring_new(&u);
+        if (r < 0)
+                return log_debug_errno(r, "Failed to set up io_uring, using epoll for IO event sources: %m");
+
+        ev = (struct epoll_event) {
+                .events = EPOLLIN,
+                .data.ptr = u,
+        };
+
+        if (epoll_ctl(e->epoll_fd, EPOLL_CTL_ADD, u->fd, &ev) < 0)
+                return log_debug_errno(errno, "Failed to add io_uring fd to epoll, using epoll for IO event sources: %m");
+
+        log_debug("Using io_uring for IO event sources.");
+        e->uring = TAKE_PTR(u);
+        return 0;
+}
+
 _public_ int sd_event_new(sd_event** ret) {
         sd_event *e;
         int r;
@@ -373,6 +432,7 @@ _public_ int sd_event_new(sd_event** ret) {
                 .n_ref = 1,
                 .epoll_fd = -1,
                 .watchdog_fd = -1,
+                .post_to_fd = -1,
                 .realtime.wakeup = WAKEUP_CLOCK_DATA,
                 .realtime.fd = -1,
                 .realtime.next = USEC_INFINITY,
@@ -404,6 +464,14 @@ _public_ int sd_event_new(sd_event** ret) {
 
         e->epoll_fd = fd_move_above_stdio(e->epoll_fd);
 
+        if (getenv_bool_secure("SD_EVENT_IO_URING") > 0)
+                (void) event_setup_uring(e);
+
+        if (getenv_bool_secure("SD_EVENT_TIMER_WHEEL") > 0) {
+                log_debug("Using timer wheels for time event sources.");
+                e->timer_wheel = true;
+        }
+
         if (secure_getenv("SD_EVENT_PROFILE_DELAYS")) {
                 log_debug("Event loop profiling enabled. Logarithmic histogram of event loop iterations in the range 2^0 … 2^63 us will be logged every 5s.");
                 e->profile_delays = true;
@@ -444,6 +512,11 @@ static void source_io_unregister(sd_event_source *s) {
         if (!s->io.registered)
                 return;
 
+        if (s->event->uring) {
+                event_uring_poll_remove(s->event->uring, s);
+                return;
+        }
+
         if (epoll_ctl(s->event->epoll_fd, EPOLL_CTL_DEL, s->io.fd, NULL) < 0)
                 log_debug_errno(errno, "Failed to remove source %s (type %s) from epoll, ignoring: %m",
                                 strna(s->description), event_source_type_to_string(s->type));
@@ -460,6 +533,12 @@ static int source_io_register(
         assert(s->type == SOURCE_IO);
         assert(enabled != SD_EVENT_OFF);
 
+        if (s->event->uring)
+                /* Poll requests in io_uring are oneshot unless edge-triggered, hence only the latter needs
+                 * to be turned into a oneshot request */
+                return event_uring_poll_add(s->event->uring, s,
+                                            enabled == SD_EVENT_ONESHOT ? events & ~EPOLLET : events);
+
         struct epoll_event ev = {
                 .events = events | (enabled == SD_EVENT_ONESHOT ? EPOLLONESHOT : 0),
                 .data.ptr = s,
@@ -770,6 +849,31 @@ static void event_source_pp_prioq_reshuffle(sd_event_source *s) {
                 prioq_reshuffle(s->event->prepare, s, &s->prepare_index);
 }
 
+static bool event_source_uses_timer_wheel(const sd_event_source *s) {
+        assert(s);
+
+        /* Only time event sources carry the linkage for the timer wheels. Other event sources only show up
+         * in the clock data while they are ratelimited, which is rare, and are kept in the prioqs then. */
+        return s->event->timer_wheel && EVENT_SOURCE_IS_TIME(s->type);
+}
+
+static void event_source_time_wheel_update(sd_event_source *s, struct clock_data *d) {
+        assert(s);
+        assert(d);
+        assert(event_source_uses_timer_wheel(s));
+
+        /* Unlike the prioqs, the timer wheels only contain the event sources the timer might have to be
+         * armed for, i.e. those that would be ordered first by time_prioq_compare(). */
+
+        if (s->enabled != SD_EVENT_OFF && event_source_timer_candidate(s)) {
+                timer_wheel_put(d->earliest_wheel, &s->time.earliest_node, time_event_source_next(s));
+                timer_wheel_put(d->latest_wheel, &s->time.latest_node, time_event_source_latest(s));
+        } else {
+                timer_wheel_remove(d->earliest_wheel, &s->time.earliest_node);
+                timer_wheel_remove(d->latest_wheel, &s->time.latest_node);
+        }
+}
+
 static void event_source_time_prioq_reshuffle(sd_event_source *s) {
         struct clock_data *d;
 
@@ -786,8 +890,12 @@ static void event_source_time_prioq_reshuffle(sd_event_source *s) {
         else
                 return; /* no-op for an event source which is neither a timer nor ratelimited. */
 
-        prioq_reshuffle(d->earliest, s, &s->earliest_index);
-        prioq_reshuffle(d->latest, s, &s->latest_index);
+        if (event_source_uses_timer_wheel(s))
+                event_source_time_wheel_update(s, d);
+        else {
+                prioq_reshuffle(d->earliest, s, &s->earliest_index);
+                prioq_reshuffle(d->latest, s, &s->latest_index);
+        }
         d->needs_rearm = true;
 }
 
@@ -798,9 +906,14 @@ static void event_source_time_prioq_remove(
         assert(s);
         assert(d);
 
-        prioq_remove(d->earliest, s, &s->earliest_index);
-        prioq_remove(d->latest, s, &s->latest_index);
-        s->earliest_index = s->latest_index = PRIOQ_IDX_NULL;
+        if (event_source_uses_timer_wheel(s)) {
+                timer_wheel_remove(d->earliest_wheel, &s->time.earliest_node);
+                timer_wheel_remove(d->latest_wheel, &s->time.latest_node);
+        } else {
+                prioq_remove(d->earliest, s, &s->earliest_index);
+                prioq_remove(d->latest, s, &s->latest_index);
+                s->earliest_index = s->latest_index = PRIOQ_IDX_NULL;
+        }
         d->needs_rearm = true;
 }
 
@@ -1095,6 +1208,12 @@ _public_ int sd_event_add_io(
         if (!callback)
                 callback = io_exit_callback;
 
+        if (e->uring) {
+                r = event_uring_check_fd(fd);
+                if (r < 0)
+                        return r;
+        }
+
         s = source_new(e, !ret, SOURCE_IO);
         if (!s)
                 return -ENOMEM;
@@ -1184,6 +1303,22 @@ static int setup_clock_data(sd_event *e, struct clock_data *d, clockid_t clock)
                         return r;
         }
 
+        if (e->timer_wheel) {
+                if (!d->earliest_wheel) {
+                        d->earliest_wheel = timer_wheel_new();
+                        if (!d->earliest_wheel)
+                                return -ENOMEM;
+                }
+
+                if (!d->latest_wheel) {
+                        d->latest_wheel = timer_wheel_new();
+                        if (!d->latest_wheel)
+                                return -ENOMEM;
+                }
+        }
+
+        /* Even with timer wheels, ratelimited event sources that aren't time event sources are queued here */
+
         r = prioq_ensure_allocated(&d->earliest, earliest_time_prioq_compare);
         if (r < 0)
                 return r;
@@ -1195,6 +1330,45 @@ static int setup_clock_data(sd_event *e, struct clock_data *d, clockid_t clock)
         return 0;
 }
 
+static sd_event_source* clock_data_peek_earliest(sd_event *e, struct clock_data *d) {
+        sd_event_source *a, *b;
+        TimerWheelNode *n;
+
+        assert(e);
+        assert(d);
+
+        a = prioq_peek(d->earliest);
+        if (!e->timer_wheel)
+                return a;
+
+        /* Time event sources are in the timer wheel, everything else in the prioq, pick the first of both */
+        n = timer_wheel_peek(d->earliest_wheel);
+        b = n ? container_of(n, sd_event_source, time.earliest_node) : NULL;
+        if (!a || !b)
+                return a ?: b;
+
+        return earliest_time_prioq_compare(a, b) <= 0 ? a : b;
+}
+
+static sd_event_source* clock_data_peek_latest(sd_event *e, struct clock_data *d) {
+        sd_event_source *a, *b;
+        TimerWheelNode *n;
+
+        assert(e);
+        assert(d);
+
+        a = prioq_peek(d->latest);
+        if (!e->timer_wheel)
+                return a;
+
+        n = timer_wheel_peek(d->latest_wheel);
+        b = n ? container_of(n, sd_event_source, time.latest_node) : NULL;
+        if (!a || !b)
+                return a ?: b;
+
+        return latest_time_prioq_compare(a, b) <= 0 ? a : b;
+}
+
 static int event_source_time_prioq_put(
                 sd_event_source *s,
                 struct clock_data *d) {
@@ -1205,6 +1379,13 @@ static int event_source_time_prioq_put(
         assert(d);
         assert(EVENT_SOURCE_USES_TIME_PRIOQ(s->type));
 
+        if (event_source_uses_timer_wheel(s)) {
+                /* Queueing into a timer wheel cannot fail, the memory is part of the event source */
+                event_source_time_wheel_update(s, d);
+                d->needs_rearm = true;
+                return 0;
+        }
+
         r = prioq_put(d->earliest, s, &s->earliest_index);
         if (r < 0)
                 return r;
@@ -1673,6 +1854,119 @@ _public_ int sd_event_add_exit(
         return 0;
 }
 
+static int post_to_dispatch(sd_event_source *s, int fd, uint32_t revents, void *userdata) {
+        sd_event *e = userdata;
+        PostToItem *items, *reversed = NULL;
+        eventfd_t x;
+
+        assert(e);
+
+        /* Reset the eventfd before taking the closures, so that whatever is posted afterwards wakes us up
+         * again */
+        (void) eventfd_read(fd, &x);
+
+        items = __sync_lock_test_and_set(&e->post_to_items, NULL);
+
+        /* The stack has the most recently posted closure first, but they shall run in the order they were
+         * posted in */
+        while (items) {
+                PostToItem *i = items;
+
+                items = i->next;
+                i->next = reversed;
+                reversed = i;
+        }
+
+        while (reversed) {
+                _cleanup_free_ PostToItem *i = reversed;
+                int r;
+
+                reversed = i->next;
+
+                r = i->callback(e, i->userdata);
+                if (r < 0)
+                        log_debug_errno(r, "Closure posted to event loop failed, ignoring: %m");
+
+                if (i->destroy)
+                        i->destroy(i->userdata);
+        }
+
+        return 0;
+}
+
+_public_ int sd_event_add_post_to_queue(
+                sd_event *e,
+                sd_event_source **ret) {
+
+        _cleanup_close_ int fd = -1;
+        int r;
+
+        assert_return(e, -EINVAL);
+        assert_return(e = event_resolve(e), -ENOPKG);
+        assert_return(e->state != SD_EVENT_FINISHED, -ESTALE);
+        assert_return(!event_pid_changed(e), -ECHILD);
+
+        if (e->post_to_fd >= 0)
+                return -EBUSY;
+
+        fd = eventfd(0, EFD_CLOEXEC|EFD_NONBLOCK);
+        if (fd < 0)
+                return -errno;
+
+        fd = fd_move_above_stdio(fd);
+
+        r = sd_event_add_io(e, ret, fd, EPOLLIN, post_to_dispatch, e);
+        if (r < 0)
+                return r;
+
+        e->post_to_fd = TAKE_FD(fd);
+        return 0;
+}
+
+_public_ int sd_event_post_to(
+                sd_event *e,
+                sd_event_post_to_handler_t callback,
+                void *userdata,
+                sd_event_destroy_t destroy) {
+
+        PostToItem *i, *head;
+
+        /* This may be called from any thread, hence only looks at what does not change anymore once the
+         * queue is set up. SD_EVENT_DEFAULT is refused, since it would refer to the default event loop of the
+         * calling thread rather than the one meant. */
+
+        assert_return(e, -EINVAL);
+        assert_return(e != SD_EVENT_DEFAULT, -EINVAL);
+        assert_return(callback, -EINVAL);
+        assert_return(!event_pid_changed(e), -ECHILD);
+
+        if (e->post_to_fd < 0)
+                return -ENXIO;
+
+        i = new(PostToItem, 1);
+        if (!i)
+                return -ENOMEM;
+
+        *i = (PostToItem) {
+                .callback = callback,
+                .destroy = destroy,
+                .userdata = userdata,
+        };
+
+        do {
+                head = e->post_to_items;
+                i->next = head;
+        } while (!__sync_bool_compare_and_swap(&e->post_to_items, head, i));
+
+        /* Only the closure that made the stack non-empty needs to wake up the event loop, the others are
+         * taken along with it. Writing can only fail if the counter overflows, which it cannot since it
+         * is reset whenever the closures are taken. */
+        if (!head)
+                (void) eventfd_write(e->post_to_fd, 1);
+
+        return 0;
+}
+
 static void event_free_inotify_data(sd_event *e, struct inotify_data *d) {
         assert(e);
 
@@ -2129,9 +2423,29 @@ _public_ int sd_event_source_set_io_fd(sd_event_source *s, int fd) {
         if (s->io.fd == fd)
                 return 0;
 
+        if (s->event->uring) {
+                r = event_uring_check_fd(fd);
+                if (r < 0)
+                        return r;
+        }
+
         if (event_source_is_offline(s)) {
                 s->io.fd = fd;
                 s->io.registered = false;
+        } else if (s->event->uring) {
+                int saved_fd;
+
+                saved_fd = s->io.fd;
+                assert(s->io.registered);
+
+                /* This replaces the poll request for the old fd */
+                s->io.fd = fd;
+                r = source_io_register(s, s->enabled, s->io.events);
+                if (r < 0) {
+                        s->io.fd = saved_fd;
+                        (void) source_io_register(s, s->enabled, s->io.events);
+                        return r;
+                }
         } else {
                 int saved_fd;
 
@@ -2979,7 +3293,7 @@ static int event_arm_timer(
 
         d->needs_rearm = false;
 
-        a = prioq_peek(d->earliest);
+        a = clock_data_peek_earliest(e, d);
         assert(!a || EVENT_SOURCE_USES_TIME_PRIOQ(a->type));
         if (!a || a->enabled == SD_EVENT_OFF || time_event_source_next(a) == USEC_INFINITY) {
 
@@ -2997,7 +3311,7 @@ static int event_arm_timer(
                 return 0;
         }
 
-        b = prioq_peek(d->latest);
+        b = clock_data_peek_latest(e, d);
         assert(!b || EVENT_SOURCE_USES_TIME_PRIOQ(b->type));
         assert(b && b->enabled != SD_EVENT_OFF);
 
@@ -3040,6 +3354,40 @@ static int process_io(sd_event *e, sd_event_source *s, uint32_t revents) {
         return source_set_pending(s, true);
 }
 
+static int process_uring(sd_event *e, EventUring *u, int64_t threshold, int64_t *min_priority) {
+        bool something_new = false;
+        int r;
+
+        assert(e);
+        assert(u);
+        assert(min_priority);
+
+        for (;;) {
+                sd_event_source *s;
+                uint32_t revents;
+
+                r = event_uring_next(u, &s, &revents);
+                if (r < 0)
+                        return r;
+                if (r == 0)
+                        break;
+
+                /* Unlike with epoll, a completion is not reported again, hence sources above the
+                 * threshold are marked pending too, they are just not counted as new */
+                r = process_io(e, s, revents);
+                if (r < 0)
+                        return r;
+
+                if (s->priority > threshold)
+                        continue;
+
+                *min_priority = MIN(*min_priority, s->priority);
+                something_new = true;
+        }
+
+        return something_new;
+}
+
 static int flush_timer(sd_event *e, int fd, uint32_t events, usec_t *next) {
         uint64_t x;
         ssize_t ss;
@@ -3078,7 +3426,7 @@ static int process_timer(
         assert(d);
 
         for (;;) {
-                s = prioq_peek(d->earliest);
+                s = clock_data_peek_earliest(e, d);
                 assert(!s || EVENT_SOURCE_USES_TIME_PRIOQ(s->type));
 
                 if (!s || time_event_source_next(s) > n)
@@ -3783,6 +4131,13 @@ _public_ int sd_event_prepare(sd_event *e) {
         if (event_next_pending(e) || e->need_process_child)
                 goto pending;
 
+        /* Embedders wait on the epoll fd themselves, hence the poll requests need to be in place now */
+        if (e->uring) {
+                r = event_uring_submit(e->uring);
+                if (r < 0)
+                        return r;
+        }
+
         e->state = SD_EVENT_ARMED;
 
         return 0;
@@ -3871,6 +4226,12 @@ static int process_epoll(sd_event *e, usec_t timeout, int64_t threshold, int64_t
         if (e->inotify_data_buffered)
                 timeout = 0;
 
+        if (e->uring) {
+                r = event_uring_submit(e->uring);
+                if (r < 0)
+                        return r;
+        }
+
         for (;;) {
                 r = epoll_wait_usec(
                                 e->epoll_fd,
@@ -3952,6 +4313,10 @@ static int process_epoll(sd_event *e, usec_t timeout, int64_t threshold, int64_t
                                 r = event_inotify_data_read(e, e->event_queue[i].data.ptr, e->event_queue[i].events, threshold);
                                 break;
 
+                        case WAKEUP_URING:
+                                r = process_uring(e, e->event_queue[i].data.ptr, threshold, &min_priority);
+                                break;
+
                         default:
                                 assert_not_reached();
                         }
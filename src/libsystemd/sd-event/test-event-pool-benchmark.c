@@ -0,0 +1,143 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+
+#include <pthread.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "sd-event.h"
+
+#include "alloc-util.h"
+#include "event-pool.h"
+#include "fd-util.h"
+#include "io-util.h"
+#include "log.h"
+#include "parse-util.h"
+#include "tests.h"
+#include "time-util.h"
+
+/* Runs an echo server on a pool of 1, 2, 4, … event loops, up to the given number, and as many client
+ * threads as there are loops. Each client keeps a few connections busy with small messages, and the number
+ * of round trips per second is reported for each pool size. As the clients need CPU time too, this scales
+ * with the number of loops only as long as there are at least twice as many CPUs.
+ *
+ * Usage: test-event-pool-benchmark [LOOPS [SECONDS]] */
+
+static unsigned arg_loops = 0;
+static unsigned arg_seconds = 3;
+
+#define CONNECTIONS_PER_CLIENT 16
+#define MESSAGE_SIZE 64
+
+typedef struct Client {
+        pthread_t thread;
+        int fds[CONNECTIONS_PER_CLIENT];
+        usec_t until;
+        uint64_t n_round_trips;
+} Client;
+
+static int echo_handler(sd_event_source *s, int fd, uint32_t revents, void *userdata) {
+        char buf[MESSAGE_SIZE * 4];
+        ssize_t n;
+
+        n = read(fd, buf, sizeof(buf));
+        if (n < 0)
+                return errno == EAGAIN ? 0 : -errno;
+        if (n == 0) {
+                /* The source is floating and owns the fd, this frees both */
+                sd_event_source_disable_unref(s);
+                return 0;
+        }
+
+        assert_se(write(fd, buf, n) == n);
+        return 0;
+}
+
+static int connection_handler(sd_event *e, int fd, void *userdata) {
+        sd_event_source *s;
+        int r;
+
+        r = sd_event_add_io(e, &s, fd, EPOLLIN, echo_handler, NULL);
+        if (r < 0) {
+                safe_close(fd);
+                return r;
+        }
+
+        assert_se(sd_event_source_set_io_fd_own(s, true) >= 0);
+        assert_se(sd_event_source_set_floating(s, true) >= 0);
+        sd_event_source_unref(s);
+
+        return 0;
+}
+
+static void *client_thread(void *userdata) {
+        Client *c = userdata;
+        char buf[MESSAGE_SIZE] = {};
+
+        while (now(CLOCK_MONOTONIC) < c->until) {
+                for (unsigned i = 0; i < CONNECTIONS_PER_CLIENT; i++)
+                        assert_se(write(c->fds[i], buf, sizeof(buf)) == sizeof(buf));
+
+                for (unsigned i = 0; i < CONNECTIONS_PER_CLIENT; i++)
+                        assert_se(loop_read_exact(c->fds[i], buf, sizeof(buf), false) >= 0);
+
+                c->n_round_trips += CONNECTIONS_PER_CLIENT;
+        }
+
+        return NULL;
+}
+
+static void benchmark(unsigned n_loops) {
+        _cleanup_(event_pool_freep) EventPool *p = NULL;
+        _cleanup_free_ Client *clients = NULL;
+        uint64_t n_round_trips = 0;
+        usec_t until;
+
+        assert_se(event_pool_new(n_loops, /* pin_cpus= */ true, &p) >= 0);
+        assert_se(clients = new0(Client, n_loops));
+
+        until = usec_add(now(CLOCK_MONOTONIC), arg_seconds * USEC_PER_SEC);
+
+        for (unsigned i = 0; i < n_loops; i++) {
+                Client *c = clients + i;
+
+                for (unsigned j = 0; j < CONNECTIONS_PER_CLIENT; j++) {
+                        int pair[2];
+
+                        assert_se(socketpair(AF_UNIX, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0, pair) >= 0);
+                        assert_se(event_pool_dispatch_fd(p, pair[0], connection_handler, NULL) >= 0);
+                        assert_se(fd_nonblock(pair[1], false) >= 0);
+                        c->fds[j] = pair[1];
+                }
+
+                c->until = until;
+        }
+
+        for (unsigned i = 0; i < n_loops; i++)
+                assert_se(pthread_create(&clients[i].thread, NULL, client_thread, clients + i) == 0);
+
+        for (unsigned i = 0; i < n_loops; i++) {
+                assert_se(pthread_join(clients[i].thread, NULL) == 0);
+                n_round_trips += clients[i].n_round_trips;
+                close_many(clients[i].fds, CONNECTIONS_PER_CLIENT);
+        }
+
+        log_info("%3u loops: %.0f round trips/s", n_loops, (double) n_round_trips / arg_seconds);
+}
+
+int main(int argc, char *argv[]) {
+        test_setup_logging(LOG_INFO);
+
+        if (argc > 1)
+                assert_se(safe_atou(argv[1], &arg_loops) >= 0 && arg_loops > 0);
+        if (argc > 2)
+                assert_se(safe_atou(argv[2], &arg_seconds) >= 0 && arg_seconds > 0);
+
+        if (arg_loops == 0)
+                arg_loops = MAX(sysconf(_SC_NPROCESSORS_ONLN), 1L);
+
+        for (unsigned n = 1; n < arg_loops; n *= 2)
+                benchmark(n);
+        benchmark(arg_loops);
+
+        return 0;
+}
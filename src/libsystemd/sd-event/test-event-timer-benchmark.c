@@ -0,0 +1,88 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+
+#include "sd-event.h"
+
+#include "alloc-util.h"
+#include "log.h"
+#include "parse-util.h"
+#include "random-util.h"
+#include "string-util.h"
+#include "tests.h"
+#include "time-util.h"
+
+/* Sets up many timers, and then keeps moving random ones of them to a new time, the way daemons push back
+ * their idle and watchdog timeouts whenever something happens. The event loop is run in between, so that
+ * the timer is armed and expired timers get dispatched and set up again. This is done once with the
+ * prioqs and once with the timer wheels ordering the time event sources, and the number of rearms per
+ * second is reported for both.
+ *
+ * Usage: test-event-timer-benchmark [TIMERS [REARMS]] */
+
+static unsigned arg_timers = 100000;
+static unsigned arg_rearms = 1000000;
+
+#define REARMS_PER_ITERATION 64
+
+static int time_handler(sd_event_source *s, uint64_t usec, void *userdata) {
+        unsigned *n_dispatched = userdata;
+
+        (*n_dispatched)++;
+
+        /* Expired timers are set up again, like periodic timers */
+        assert_se(sd_event_source_set_time_relative(s, 1 + random_u64_range(10 * USEC_PER_SEC)) >= 0);
+        assert_se(sd_event_source_set_enabled(s, SD_EVENT_ONESHOT) >= 0);
+
+        return 0;
+}
+
+static void benchmark(bool timer_wheel) {
+        _cleanup_(sd_event_unrefp) sd_event *e = NULL;
+        _cleanup_free_ sd_event_source **sources = NULL;
+        unsigned n_dispatched = 0;
+        usec_t begin, elapsed, n;
+
+        assert_se(setenv("SD_EVENT_TIMER_WHEEL", one_zero(timer_wheel), 1) >= 0);
+        assert_se(sd_event_new(&e) >= 0);
+
+        sources = new(sd_event_source*, arg_timers);
+        assert_se(sources);
+
+        n = now(CLOCK_MONOTONIC);
+        for (unsigned i = 0; i < arg_timers; i++)
+                assert_se(sd_event_add_time(e, sources + i, CLOCK_MONOTONIC,
+                                            n + 1 + random_u64_range(10 * USEC_PER_SEC), 0,
+                                            time_handler, &n_dispatched) >= 0);
+
+        begin = now(CLOCK_MONOTONIC);
+
+        for (unsigned i = 0; i < arg_rearms; i += REARMS_PER_ITERATION) {
+                for (unsigned j = 0; j < REARMS_PER_ITERATION; j++)
+                        assert_se(sd_event_source_set_time_relative(sources[random_u64_range(arg_timers)],
+                                                                    random_u64_range(10 * USEC_PER_SEC)) >= 0);
+
+                assert_se(sd_event_run(e, 0) >= 0);
+        }
+
+        elapsed = now(CLOCK_MONOTONIC) - begin;
+
+        log_info("%-8s %u timers, %.0f rearms/s, %u dispatched",
+                 timer_wheel ? "wheel" : "prioq", arg_timers,
+                 (double) arg_rearms * USEC_PER_SEC / elapsed, n_dispatched);
+
+        for (unsigned i = 0; i < arg_timers; i++)
+                sd_event_source_unref(sources[i]);
+}
+
+int main(int argc, char *argv[]) {
+        test_setup_logging(LOG_INFO);
+
+        if (argc > 1)
+                assert_se(safe_atou(argv[1], &arg_timers) >= 0 && arg_timers > 0);
+        if (argc > 2)
+                assert_se(safe_atou(argv[2], &arg_rearms) >= 0);
+
+        benchmark(false);
+        benchmark(true);
+
+        return 0;
+}
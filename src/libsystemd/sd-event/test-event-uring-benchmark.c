@@ -0,0 +1,170 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+
+#include <linux/perf_event.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "sd-event.h"
+
+#include "alloc-util.h"
+#include "fd-util.h"
+#include "fileio.h"
+#include "log.h"
+#include "missing_syscall.h"
+#include "parse-util.h"
+#include "random-util.h"
+#include "rlimit-util.h"
+#include "string-util.h"
+#include "strv.h"
+#include "tests.h"
+#include "time-util.h"
+
+/* Runs an event loop with many socket pairs, of which a few become readable in every iteration. The
+ * callbacks consume the data and change the events of other sources, similar to what daemons do when
+ * their output queues fill and drain. This is done once with epoll and once with io_uring, and the
+ * latency and the number of syscalls per dispatched source are reported for both. Syscalls are counted
+ * with the raw_syscalls:sys_enter tracepoint, which needs access to tracefs and perf.
+ *
+ * Usage: test-event-uring-benchmark [SOURCES [ITERATIONS]] */
+
+static unsigned arg_sources = 1000;
+static unsigned arg_iterations = 20000;
+
+#define READY_PER_ITERATION 8
+
+typedef struct Pair {
+        int fds[2];
+        sd_event_source *source;
+} Pair;
+
+static unsigned n_dispatched = 0;
+
+static int io_handler(sd_event_source *s, int fd, uint32_t revents, void *userdata) {
+        Pair *pairs = userdata;
+        Pair *other;
+        uint32_t events;
+        char c;
+
+        assert_se(read(fd, &c, 1) == 1);
+        n_dispatched++;
+
+        /* Change the events of some other source back and forth */
+        other = pairs + random_u64_range(arg_sources);
+        assert_se(sd_event_source_get_io_events(other->source, &events) >= 0);
+        assert_se(sd_event_source_set_io_events(other->source, events ^ EPOLLPRI) >= 0);
+
+        return 0;
+}
+
+static int open_syscall_counter(void) {
+        _cleanup_free_ char *id = NULL;
+        struct perf_event_attr attr = {
+                .type = PERF_TYPE_TRACEPOINT,
+                .size = sizeof(attr),
+                .disabled = true,
+        };
+        const char *p;
+        uint64_t config;
+        int fd, r;
+
+        FOREACH_STRING(p,
+                       "/sys/kernel/tracing/events/raw_syscalls/sys_enter/id",
+                       "/sys/kernel/debug/tracing/events/raw_syscalls/sys_enter/id") {
+                r = read_one_line_file(p, &id);
+                if (r >= 0)
+                        break;
+        }
+        if (r < 0)
+                return r;
+
+        r = safe_atou64(id, &config);
+        if (r < 0)
+                return r;
+
+        attr.config = config;
+
+        fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+        if (fd < 0)
+                return -errno;
+
+        return fd;
+}
+
+static void benchmark(bool uring) {
+        _cleanup_(sd_event_unrefp) sd_event *e = NULL;
+        _cleanup_free_ Pair *pairs = NULL;
+        _cleanup_close_ int counter = -1;
+        uint64_t n_syscalls = 0;
+        usec_t begin, elapsed;
+
+        assert_se(setenv("SD_EVENT_IO_URING", one_zero(uring), 1) >= 0);
+        assert_se(sd_event_new(&e) >= 0);
+
+        pairs = new(Pair, arg_sources);
+        assert_se(pairs);
+
+        for (unsigned i = 0; i < arg_sources; i++) {
+                assert_se(socketpair(AF_UNIX, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0, pairs[i].fds) >= 0);
+                assert_se(sd_event_add_io(e, &pairs[i].source, pairs[i].fds[0], EPOLLIN, io_handler, pairs) >= 0);
+        }
+
+        counter = open_syscall_counter();
+        if (counter < 0)
+                log_debug_errno(counter, "Failed to set up syscall counter, not counting syscalls: %m");
+
+        n_dispatched = 0;
+        begin = now(CLOCK_MONOTONIC);
+        if (counter >= 0)
+                assert_se(ioctl(counter, PERF_EVENT_IOC_ENABLE, 0) >= 0);
+
+        for (unsigned i = 0; i < arg_iterations; i++) {
+                for (unsigned j = 0; j < READY_PER_ITERATION; j++)
+                        assert_se(write(pairs[random_u64_range(arg_sources)].fds[1], "x", 1) == 1);
+
+                /* Dispatch everything that became ready */
+                while (sd_event_run(e, 0) > 0)
+                        ;
+        }
+
+        if (counter >= 0) {
+                assert_se(ioctl(counter, PERF_EVENT_IOC_DISABLE, 0) >= 0);
+                assert_se(read(counter, &n_syscalls, sizeof(n_syscalls)) == sizeof(n_syscalls));
+        }
+        elapsed = now(CLOCK_MONOTONIC) - begin;
+
+        /* The writes are not part of what is measured, but are counted too */
+        n_syscalls -= MIN(n_syscalls, (uint64_t) arg_iterations * READY_PER_ITERATION);
+
+        if (counter >= 0)
+                log_info("%-8s %u dispatches, %.3f us and %.2f syscalls per dispatch",
+                         uring ? "io_uring" : "epoll", n_dispatched,
+                         (double) elapsed / n_dispatched, (double) n_syscalls / n_dispatched);
+        else
+                log_info("%-8s %u dispatches, %.3f us and n/a syscalls per dispatch",
+                         uring ? "io_uring" : "epoll", n_dispatched,
+                         (double) elapsed / n_dispatched);
+
+        for (unsigned i = 0; i < arg_sources; i++) {
+                sd_event_source_disable_unref(pairs[i].source);
+                safe_close_pair(pairs[i].fds);
+        }
+}
+
+int main(int argc, char *argv[]) {
+        test_setup_logging(LOG_INFO);
+
+        if (argc > 1)
+                assert_se(safe_atou(argv[1], &arg_sources) >= 0 && arg_sources > 0);
+        if (argc > 2)
+                assert_se(safe_atou(argv[2], &arg_iterations) >= 0);
+
+        /* Each socket pair needs two fds */
+        (void) rlimit_nofile_bump(arg_sources * 2 + 100);
+
+        benchmark(false);
+        benchmark(true);
+
+        return 0;
+}
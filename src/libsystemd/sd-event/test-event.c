@@ -1,10 +1,13 @@
 /* SPDX-License-Identifier: LGPL-2.1-or-later */
 
+#include <pthread.h>
+#include <sys/socket.h>
 #include <sys/wait.h>
 
 #include "sd-event.h"
 
 #include "alloc-util.h"
+#include "event-pool.h"
 #include "exec-util.h"
 #include "fd-util.h"
 #include "fs-util.h"
@@ -713,6 +716,313 @@ static void test_simple_timeout(void) {
         assert_se(t >= usec_add(f, some_time));
 }
 
+static int count_handler(sd_event_source *s, int fd, uint32_t revents, void *userdata) {
+        unsigned *n = userdata;
+
+        (*n)++;
+        return 1;
+}
+
+static void test_io_semantics(bool uring) {
+        _cleanup_(sd_event_source_unrefp) sd_event_source *s = NULL;
+        _cleanup_(sd_event_unrefp) sd_event *e = NULL;
+        _cleanup_close_pair_ int p[2] = { -1, -1 }, q[2] = { -1, -1 };
+        _cleanup_close_ int fd = -1;
+        unsigned n = 0;
+
+        log_info("/* %s(uring=%s) */", __func__, yes_no(uring));
+
+        /* If io_uring is not available, this tests epoll once more */
+        assert_se(setenv("SD_EVENT_IO_URING", yes_no(uring), 1) >= 0);
+        assert_se(sd_event_new(&e) >= 0);
+
+        fd = open_tmpfile_unlinkable(NULL, O_RDWR|O_CLOEXEC);
+        assert_se(fd >= 0);
+        assert_se(sd_event_add_io(e, NULL, fd, EPOLLIN, count_handler, &n) == -EPERM);
+
+        assert_se(socketpair(AF_UNIX, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0, p) >= 0);
+        assert_se(socketpair(AF_UNIX, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0, q) >= 0);
+        assert_se(sd_event_add_io(e, &s, p[0], EPOLLIN, count_handler, &n) >= 0);
+        assert_se(sd_event_run(e, 0) == 0);
+
+        /* Level-triggered sources are reported until the data is read */
+        assert_se(write(p[1], "x", 1) == 1);
+        assert_se(sd_event_run(e, UINT64_MAX) == 1 && n == 1);
+        assert_se(sd_event_run(e, UINT64_MAX) == 1 && n == 2);
+
+        assert_se(sd_event_source_set_io_events(s, EPOLLOUT) >= 0);
+        assert_se(sd_event_run(e, UINT64_MAX) == 1 && n == 3);
+        assert_se(sd_event_source_set_io_events(s, EPOLLPRI) >= 0);
+        assert_se(sd_event_run(e, 0) == 0 && n == 3);
+
+        /* Edge-triggered sources are reported once per edge */
+        assert_se(sd_event_source_set_io_events(s, EPOLLIN|EPOLLET) >= 0);
+        assert_se(sd_event_run(e, UINT64_MAX) == 1 && n == 4);
+        assert_se(sd_event_run(e, 0) == 0 && n == 4);
+        assert_se(write(p[1], "x", 1) == 1);
+        assert_se(sd_event_run(e, UINT64_MAX) == 1 && n == 5);
+        assert_se(sd_event_run(e, 0) == 0 && n == 5);
+
+        assert_se(sd_event_source_set_io_events(s, EPOLLIN) >= 0);
+        assert_se(sd_event_source_set_enabled(s, SD_EVENT_ONESHOT) >= 0);
+        assert_se(sd_event_run(e, UINT64_MAX) == 1 && n == 6);
+        assert_se(sd_event_run(e, 0) == 0 && n == 6);
+
+        assert_se(sd_event_source_set_enabled(s, SD_EVENT_ON) >= 0);
+        assert_se(sd_event_source_set_io_fd(s, q[0]) >= 0);
+        assert_se(sd_event_run(e, 0) == 0 && n == 6);
+        assert_se(write(q[1], "x", 1) == 1);
+        assert_se(sd_event_run(e, UINT64_MAX) == 1 && n == 7);
+
+        assert_se(sd_event_source_set_enabled(s, SD_EVENT_OFF) >= 0);
+        assert_se(sd_event_run(e, 0) == 0 && n == 7);
+
+        assert_se(unsetenv("SD_EVENT_IO_URING") >= 0);
+}
+
+#define N_TIMERS 500U
+
+typedef struct Timer {
+        sd_event_source *source;
+        usec_t usec;
+        unsigned n_dispatched;
+} Timer;
+
+static int order_time_handler(sd_event_source *s, uint64_t usec, void *userdata) {
+        Timer *t = userdata;
+
+        /* Never dispatched before the time it was set to, and only once */
+        assert_se(usec >= t->usec);
+        assert_se(now(CLOCK_MONOTONIC) >= t->usec);
+        t->n_dispatched++;
+
+        return 0;
+}
+
+static void test_time_order(bool timer_wheel) {
+        _cleanup_(sd_event_unrefp) sd_event *e = NULL;
+        _cleanup_free_ Timer *timers = NULL;
+        unsigned n_expected = 0;
+        usec_t base;
+
+        log_info("/* %s(timer_wheel=%s) */", __func__, yes_no(timer_wheel));
+
+        assert_se(setenv("SD_EVENT_TIMER_WHEEL", yes_no(timer_wheel), 1) >= 0);
+        assert_se(sd_event_new(&e) >= 0);
+        assert_se(timers = new0(Timer, N_TIMERS));
+
+        base = now(CLOCK_MONOTONIC);
+        for (unsigned i = 0; i < N_TIMERS; i++) {
+                timers[i].usec = base + random_u64_range(200 * USEC_PER_MSEC);
+                assert_se(sd_event_add_time(e, &timers[i].source, CLOCK_MONOTONIC, timers[i].usec,
+                                            1 + random_u64_range(10 * USEC_PER_MSEC),
+                                            order_time_handler, timers + i) >= 0);
+        }
+
+        /* Move some timers around, and disable a few, the others are dispatched once */
+        for (unsigned i = 0; i < N_TIMERS; i++)
+                switch (random_u64_range(4)) {
+                case 0:
+                        timers[i].usec = base + random_u64_range(400 * USEC_PER_MSEC);
+                        assert_se(sd_event_source_set_time(timers[i].source, timers[i].usec) >= 0);
+                        n_expected++;
+                        break;
+                case 1:
+                        assert_se(sd_event_source_set_enabled(timers[i].source, SD_EVENT_OFF) >= 0);
+                        break;
+                default:
+                        n_expected++;
+                }
+
+        for (;;) {
+                unsigned n = 0;
+
+                for (unsigned i = 0; i < N_TIMERS; i++)
+                        n += timers[i].n_dispatched;
+                if (n == n_expected)
+                        break;
+
+                assert_se(sd_event_run(e, UINT64_MAX) >= 0);
+        }
+
+        for (unsigned i = 0; i < N_TIMERS; i++) {
+                assert_se(timers[i].n_dispatched <= 1);
+                sd_event_source_unref(timers[i].source);
+        }
+
+        assert_se(unsetenv("SD_EVENT_TIMER_WHEEL") >= 0);
+}
+
+#define N_POSTS 1000U
+#define N_POSTERS 4U
+
+typedef struct PostTo {
+        sd_event *event;
+        unsigned n_received[N_POSTERS];
+        pid_t tid;
+} PostTo;
+
+typedef struct Poster {
+        PostTo *post_to;
+        unsigned index;
+        unsigned n_sent;
+} Poster;
+
+static int post_to_handler(sd_event *e, void *userdata) {
+        Poster *p = userdata;
+
+        assert_se(e == p->post_to->event);
+        assert_se(gettid() == p->post_to->tid);
+
+        /* Closures from the same thread run in the order they were posted in */
+        assert_se(p->post_to->n_received[p->index]++ < p->n_sent);
+
+        return 0;
+}
+
+static int post_to_exit(sd_event *e, void *userdata) {
+        return sd_event_exit(e, 0);
+}
+
+static int post_to_nop(sd_event *e, void *userdata) {
+        return 0;
+}
+
+static void post_to_destroy(void *userdata) {
+        unsigned *n_destroyed = userdata;
+
+        (*n_destroyed)++;
+}
+
+static void *poster_thread(void *userdata) {
+        Poster *p = userdata;
+
+        for (unsigned i = 0; i < N_POSTS; i++) {
+                /* Count first, the closure might run right away */
+                p->n_sent++;
+                assert_se(sd_event_post_to(p->post_to->event, post_to_handler, p, NULL) >= 0);
+        }
+
+        return NULL;
+}
+
+static void *loop_thread(void *userdata) {
+        PostTo *t = userdata;
+
+        t->tid = gettid();
+        assert_se(sd_event_loop(t->event) >= 0);
+
+        return NULL;
+}
+
+static void test_post_to(void) {
+        _cleanup_(sd_event_unrefp) sd_event *e = NULL;
+        Poster posters[N_POSTERS];
+        pthread_t loop, threads[N_POSTERS];
+        PostTo t = {};
+
+        log_info("/* %s */", __func__);
+
+        assert_se(sd_event_new(&e) >= 0);
+        assert_se(sd_event_post_to(e, post_to_exit, NULL, NULL) == -ENXIO);
+        assert_se(sd_event_post_to(SD_EVENT_DEFAULT, post_to_exit, NULL, NULL) == -EINVAL);
+        assert_se(sd_event_add_post_to_queue(e, NULL) >= 0);
+        assert_se(sd_event_add_post_to_queue(e, NULL) == -EBUSY);
+
+        /* Posting from the thread the loop runs in works too */
+        t.event = e;
+        t.tid = gettid();
+        posters[0] = (Poster) { .post_to = &t, .n_sent = 1 };
+        assert_se(sd_event_post_to(e, post_to_handler, posters, NULL) >= 0);
+        assert_se(sd_event_run(e, UINT64_MAX) > 0);
+        assert_se(t.n_received[0] == 1);
+        t.n_received[0] = 0;
+
+        assert_se(pthread_create(&loop, NULL, loop_thread, &t) == 0);
+
+        for (unsigned i = 0; i < N_POSTERS; i++) {
+                posters[i] = (Poster) { .post_to = &t, .index = i };
+                assert_se(pthread_create(threads + i, NULL, poster_thread, posters + i) == 0);
+        }
+
+        for (unsigned i = 0; i < N_POSTERS; i++)
+                assert_se(pthread_join(threads[i], NULL) == 0);
+
+        /* Since the closures run in order, everything posted before has run when the loop exits */
+        assert_se(sd_event_post_to(e, post_to_exit, NULL, NULL) >= 0);
+        assert_se(pthread_join(loop, NULL) == 0);
+
+        for (unsigned i = 0; i < N_POSTERS; i++)
+                assert_se(t.n_received[i] == N_POSTS);
+}
+
+static void test_post_to_destroy(void) {
+        _cleanup_(sd_event_unrefp) sd_event *e = NULL;
+        unsigned n_destroyed = 0;
+
+        log_info("/* %s */", __func__);
+
+        assert_se(sd_event_new(&e) >= 0);
+        assert_se(sd_event_add_post_to_queue(e, NULL) >= 0);
+
+        /* Released once the closure ran… */
+        assert_se(sd_event_post_to(e, post_to_nop, &n_destroyed, post_to_destroy) >= 0);
+        assert_se(n_destroyed == 0);
+        assert_se(sd_event_run(e, UINT64_MAX) > 0);
+        assert_se(n_destroyed == 1);
+
+        /* …and when it is dropped since the event loop goes away first */
+        assert_se(sd_event_post_to(e, post_to_nop, &n_destroyed, post_to_destroy) >= 0);
+        assert_se(sd_event_post_to(e, post_to_nop, &n_destroyed, post_to_destroy) >= 0);
+        e = sd_event_unref(e);
+        assert_se(n_destroyed == 3);
+}
+
+static int pool_fd_handler(sd_event *e, int fd, void *userdata) {
+        _cleanup_close_ int fd_close = fd;
+        EventPool *p = userdata;
+
+        /* Report back which loop got the fd */
+        for (unsigned i = 0; i < event_pool_size(p); i++)
+                if (event_pool_get(p, i) == e) {
+                        char c = (char) i;
+
+                        assert_se(write(fd, &c, 1) == 1);
+                        return 0;
+                }
+
+        assert_not_reached();
+}
+
+#define N_POOL_LOOPS 3U
+
+static void test_event_pool(void) {
+        _cleanup_(event_pool_freep) EventPool *p = NULL;
+        unsigned n[N_POOL_LOOPS] = {};
+
+        log_info("/* %s */", __func__);
+
+        assert_se(event_pool_new(N_POOL_LOOPS, false, &p) >= 0);
+        assert_se(event_pool_size(p) == N_POOL_LOOPS);
+
+        /* AF_UNIX sockets have no incoming CPU, hence they are distributed round-robin */
+        for (unsigned i = 0; i < 10 * N_POOL_LOOPS; i++) {
+                _cleanup_close_pair_ int pair[2] = { -1, -1 };
+                char c;
+
+                assert_se(socketpair(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0, pair) >= 0);
+                assert_se(event_pool_dispatch_fd(p, pair[0], pool_fd_handler, p) >= 0);
+                pair[0] = -1;
+
+                assert_se(read(pair[1], &c, 1) == 1);
+                assert_se((unsigned) c < N_POOL_LOOPS);
+                n[(unsigned) c]++;
+        }
+
+        for (unsigned i = 0; i < N_POOL_LOOPS; i++)
+                assert_se(n[i] == 10);
+}
+
 int main(int argc, char *argv[]) {
         test_setup_logging(LOG_DEBUG);
 
@@ -731,5 +1041,22 @@ int main(int argc, char *argv[]) {
 
         test_ratelimit();
 
+        test_io_semantics(false);
+        test_io_semantics(true);
+
+        test_post_to();
+        test_post_to_destroy();
+        test_event_pool();
+
+        test_time_order(false);
+        test_time_order(true);
+
+        /* Run the tests that use time event sources and ratelimiting once more, with timer wheels */
+        assert_se(setenv("SD_EVENT_TIMER_WHEEL", "1", 1) >= 0);
+        test_simple_timeout();
+        test_basic(true);
+        test_ratelimit();
+        assert_se(unsetenv("SD_EVENT_TIMER_WHEEL") >= 0);
+
         return 0;
 }
@@ -18,6 +18,7 @@
 #endif
 
 #if HAVE_ZSTD
+#include <zdict.h>
 #include <zstd.h>
 #include <zstd_errors.h>
 #endif
@@ -42,6 +43,8 @@ DEFINE_TRIVIAL_CLEANUP_FUNC_FULL(LZ4F_decompressionContext_t, LZ4F_freeDecompres
 #if HAVE_ZSTD
 DEFINE_TRIVIAL_CLEANUP_FUNC_FULL(ZSTD_CCtx*, ZSTD_freeCCtx, NULL);
 DEFINE_TRIVIAL_CLEANUP_FUNC_FULL(ZSTD_DCtx*, ZSTD_freeDCtx, NULL);
+DEFINE_TRIVIAL_CLEANUP_FUNC_FULL(ZSTD_CDict*, ZSTD_freeCDict, NULL);
+DEFINE_TRIVIAL_CLEANUP_FUNC_FULL(ZSTD_DDict*, ZSTD_freeDDict, NULL);
 
 static int zstd_ret_to_errno(size_t ret) {
         switch (ZSTD_getErrorCode(ret)) {
@@ -57,6 +60,21 @@ static int zstd_ret_to_errno(size_t ret) {
 
 #define ALIGN_8(l) ALIGN_TO(l, sizeof(size_t))
 
+struct CompressDictionary {
+        void *dict;
+        size_t dict_size;
+        uint32_t id;
+
+#if HAVE_ZSTD
+        /* The digested forms of the dictionary are created lazily, as writers only ever need the
+         * compression side and readers only ever need the decompression side. */
+        ZSTD_CDict *cdict;
+        ZSTD_CCtx *cctx;
+        ZSTD_DDict *ddict;
+        ZSTD_DCtx *dctx;
+#endif
+};
+
 static const char* const object_compressed_table[_OBJECT_COMPRESSED_MAX] = {
         [OBJECT_COMPRESSED_XZ]   = "XZ",
         [OBJECT_COMPRESSED_LZ4]  = "LZ4",
@@ -158,6 +176,141 @@ int compress_blob_zstd(
 #endif
 }
 
+int compress_dictionary_train(
+                const void *samples,
+                const size_t *sample_sizes,
+                size_t n_samples,
+                size_t dict_max,
+                void **ret,
+                size_t *ret_size) {
+#if HAVE_ZSTD
+        _cleanup_free_ void *dict = NULL;
+        size_t k;
+
+        assert(samples);
+        assert(sample_sizes);
+        assert(dict_max > 0);
+        assert(ret);
+        assert(ret_size);
+
+        if (n_samples > UINT_MAX)
+                return -E2BIG;
+
+        dict = malloc(dict_max);
+        if (!dict)
+                return -ENOMEM;
+
+        k = ZDICT_trainFromBuffer(dict, dict_max, samples, sample_sizes, n_samples);
+        if (ZDICT_isError(k))
+                /* Usually this means there weren't enough samples, or they were too uniform to learn
+                 * anything from. */
+                return log_debug_errno(SYNTHETIC_ERRNO(ENODATA),
+                                       "Failed to train ZSTD dictionary from %zu samples: %s",
+                                       n_samples, ZDICT_getErrorName(k));
+
+        *ret = TAKE_PTR(dict);
+        *ret_size = k;
+        return 0;
+#else
+        return -EPROTONOSUPPORT;
+#endif
+}
+
+int compress_dictionary_new(const void *dict, size_t dict_size, CompressDictionary **ret) {
+#if HAVE_ZSTD
+        _cleanup_(compress_dictionary_freep) CompressDictionary *d = NULL;
+        uint32_t id;
+
+        assert(dict);
+        assert(ret);
+
+        /* Raw content dictionaries carry no ID, and frames compressed with them can't be told apart from
+         * frames compressed without any, hence insist on properly trained dictionaries. */
+        id = ZSTD_getDictID_fromDict(dict, dict_size);
+        if (id == 0)
+                return -EBADMSG;
+
+        d = new(CompressDictionary, 1);
+        if (!d)
+                return -ENOMEM;
+
+        *d = (CompressDictionary) {
+                .dict = memdup(dict, dict_size),
+                .dict_size = dict_size,
+                .id = id,
+        };
+        if (!d->dict)
+                return -ENOMEM;
+
+        *ret = TAKE_PTR(d);
+        return 0;
+#else
+        return -EPROTONOSUPPORT;
+#endif
+}
+
+CompressDictionary* compress_dictionary_free(CompressDictionary *d) {
+        if (!d)
+                return NULL;
+
+#if HAVE_ZSTD
+        ZSTD_freeCDict(d->cdict);
+        ZSTD_freeCCtx(d->cctx);
+        ZSTD_freeDDict(d->ddict);
+        ZSTD_freeDCtx(d->dctx);
+#endif
+
+        free(d->dict);
+        return mfree(d);
+}
+
+uint32_t compress_dictionary_id(const CompressDictionary *d) {
+        assert(d);
+
+        return d->id;
+}
+
+int compress_blob_zstd_dict(
+                CompressDictionary *d,
+                const void *src, uint64_t src_size,
+                void *dst, size_t dst_alloc_size, size_t *dst_size) {
+#if HAVE_ZSTD
+        size_t k;
+
+        assert(d);
+        assert(src);
+        assert(src_size > 0);
+        assert(dst);
+        assert(dst_alloc_size > 0);
+        assert(dst_size);
+
+        if (!d->cdict) {
+                _cleanup_(ZSTD_freeCDictp) ZSTD_CDict *cdict = NULL;
+                _cleanup_(ZSTD_freeCCtxp) ZSTD_CCtx *cctx = NULL;
+
+                cdict = ZSTD_createCDict(d->dict, d->dict_size, 0);
+                if (!cdict)
+                        return -ENOMEM;
+
+                cctx = ZSTD_createCCtx();
+                if (!cctx)
+                        return -ENOMEM;
+
+                d->cdict = TAKE_PTR(cdict);
+                d->cctx = TAKE_PTR(cctx);
+        }
+
+        k = ZSTD_compress_usingCDict(d->cctx, dst, dst_alloc_size, src, src_size, d->cdict);
+        if (ZSTD_isError(k))
+                return zstd_ret_to_errno(k);
+
+        *dst_size = k;
+        return 0;
+#else
+        return -EPROTONOSUPPORT;
+#endif
+}
+
 int decompress_blob_xz(
                 const void *src,
                 uint64_t src_size,
@@ -257,16 +410,54 @@ int decompress_blob_lz4(
 #endif
 }
 
-int decompress_blob_zstd(
+#if HAVE_ZSTD
+static int zstd_dictionary_dctx(CompressDictionary *d, ZSTD_DCtx **ret) {
+        size_t k;
+
+        assert(d);
+        assert(ret);
+
+        if (!d->ddict) {
+                _cleanup_(ZSTD_freeDDictp) ZSTD_DDict *ddict = NULL;
+                _cleanup_(ZSTD_freeDCtxp) ZSTD_DCtx *dctx = NULL;
+
+                ddict = ZSTD_createDDict(d->dict, d->dict_size);
+                if (!ddict)
+                        return -ENOMEM;
+
+                dctx = ZSTD_createDCtx();
+                if (!dctx)
+                        return -ENOMEM;
+
+                k = ZSTD_DCtx_refDDict(dctx, ddict);
+                if (ZSTD_isError(k))
+                        return zstd_ret_to_errno(k);
+
+                d->ddict = TAKE_PTR(ddict);
+                d->dctx = TAKE_PTR(dctx);
+        } else {
+                /* Drop any state left over from a previous, possibly aborted, frame. The referenced
+                 * dictionary is kept. */
+                k = ZSTD_DCtx_reset(d->dctx, ZSTD_reset_session_only);
+                if (ZSTD_isError(k))
+                        return zstd_ret_to_errno(k);
+        }
+
+        *ret = d->dctx;
+        return 0;
+}
+
+static int decompress_blob_zstd_full(
+                ZSTD_DCtx *dctx,
                 const void *src,
                 uint64_t src_size,
                 void **dst,
                 size_t *dst_size,
                 size_t dst_max) {
 
-#if HAVE_ZSTD
         uint64_t size;
 
+        assert(dctx);
         assert(src);
         assert(src_size > 0);
         assert(dst);
@@ -284,10 +475,6 @@ int decompress_blob_zstd(
         if (!(greedy_realloc(dst, MAX(ZSTD_DStreamOutSize(), size), 1)))
                 return -ENOMEM;
 
-        _cleanup_(ZSTD_freeDCtxp) ZSTD_DCtx *dctx = ZSTD_createDCtx();
-        if (!dctx)
-                return -ENOMEM;
-
         ZSTD_inBuffer input = {
                 .src = src,
                 .size = src_size,
@@ -306,6 +493,44 @@ int decompress_blob_zstd(
 
         *dst_size = size;
         return 0;
+}
+#endif
+
+int decompress_blob_zstd(
+                const void *src,
+                uint64_t src_size,
+                void **dst,
+                size_t *dst_size,
+                size_t dst_max) {
+
+#if HAVE_ZSTD
+        _cleanup_(ZSTD_freeDCtxp) ZSTD_DCtx *dctx = ZSTD_createDCtx();
+        if (!dctx)
+                return -ENOMEM;
+
+        return decompress_blob_zstd_full(dctx, src, src_size, dst, dst_size, dst_max);
+#else
+        return -EPROTONOSUPPORT;
+#endif
+}
+
+int decompress_blob_zstd_dict(
+                CompressDictionary *d,
+                const void *src,
+                uint64_t src_size,
+                void **dst,
+                size_t *dst_size,
+                size_t dst_max) {
+
+#if HAVE_ZSTD
+        ZSTD_DCtx *dctx;
+        int r;
+
+        r = zstd_dictionary_dctx(d, &dctx);
+        if (r < 0)
+                return r;
+
+        return decompress_blob_zstd_full(dctx, src, src_size, dst, dst_size, dst_max);
 #else
         return -EPROTONOSUPPORT;
 #endif
@@ -335,6 +560,14 @@ int decompress_blob(
                 return -EPROTONOSUPPORT;
 }
 
+uint32_t compressed_blob_dictionary_id(int compression, const void *src, uint64_t src_size) {
+#if HAVE_ZSTD
+        if (compression == OBJECT_COMPRESSED_ZSTD)
+                return ZSTD_getDictID_fromFrame(src, src_size);
+#endif
+        return 0;
+}
+
 int decompress_startswith_xz(
                 const void *src,
                 uint64_t src_size,
@@ -467,14 +700,17 @@ int decompress_startswith_lz4(
 #endif
 }
 
-int decompress_startswith_zstd(
+#if HAVE_ZSTD
+static int decompress_startswith_zstd_full(
+                ZSTD_DCtx *dctx,
                 const void *src,
                 uint64_t src_size,
                 void **buffer,
                 const void *prefix,
                 size_t prefix_len,
                 uint8_t extra) {
-#if HAVE_ZSTD
+
+        assert(dctx);
         assert(src);
         assert(src_size > 0);
         assert(buffer);
@@ -487,10 +723,6 @@ int decompress_startswith_zstd(
         if (size < prefix_len + 1)
                 return 0; /* Decompressed text too short to match the prefix and extra */
 
-        _cleanup_(ZSTD_freeDCtxp) ZSTD_DCtx *dctx = ZSTD_createDCtx();
-        if (!dctx)
-                return -ENOMEM;
-
         if (!(greedy_realloc(buffer, MAX(ZSTD_DStreamOutSize(), prefix_len + 1), 1)))
                 return -ENOMEM;
 
@@ -513,6 +745,44 @@ int decompress_startswith_zstd(
 
         return memcmp(*buffer, prefix, prefix_len) == 0 &&
                 ((const uint8_t*) *buffer)[prefix_len] == extra;
+}
+#endif
+
+int decompress_startswith_zstd(
+                const void *src,
+                uint64_t src_size,
+                void **buffer,
+                const void *prefix,
+                size_t prefix_len,
+                uint8_t extra) {
+#if HAVE_ZSTD
+        _cleanup_(ZSTD_freeDCtxp) ZSTD_DCtx *dctx = ZSTD_createDCtx();
+        if (!dctx)
+                return -ENOMEM;
+
+        return decompress_startswith_zstd_full(dctx, src, src_size, buffer, prefix, prefix_len, extra);
+#else
+        return -EPROTONOSUPPORT;
+#endif
+}
+
+int decompress_startswith_zstd_dict(
+                CompressDictionary *d,
+                const void *src,
+                uint64_t src_size,
+                void **buffer,
+                const void *prefix,
+                size_t prefix_len,
+                uint8_t extra) {
+#if HAVE_ZSTD
+        ZSTD_DCtx *dctx;
+        int r;
+
+        r = zstd_dictionary_dctx(d, &dctx);
+        if (r < 0)
+                return r;
+
+        return decompress_startswith_zstd_full(dctx, src, src_size, buffer, prefix, prefix_len, extra);
 #else
         return -EPROTONOSUPPORT;
 #endif
@@ -4,6 +4,7 @@
 #include <unistd.h>
 
 #include "journal-def.h"
+#include "macro.h"
 
 const char* object_compressed_to_string(int compression);
 int object_compressed_from_string(const char *compression);
@@ -15,6 +16,21 @@ int compress_blob_lz4(const void *src, uint64_t src_size,
 int compress_blob_zstd(const void *src, uint64_t src_size,
                        void *dst, size_t dst_alloc_size, size_t *dst_size);
 
+/* A trained zstd dictionary, along with the compression and decompression contexts that reference it. Not
+ * thread-safe: the contexts are reused between calls. */
+typedef struct CompressDictionary CompressDictionary;
+
+int compress_dictionary_train(const void *samples, const size_t *sample_sizes, size_t n_samples,
+                              size_t dict_max, void **ret, size_t *ret_size);
+int compress_dictionary_new(const void *dict, size_t dict_size, CompressDictionary **ret);
+CompressDictionary* compress_dictionary_free(CompressDictionary *d);
+DEFINE_TRIVIAL_CLEANUP_FUNC(CompressDictionary*, compress_dictionary_free);
+uint32_t compress_dictionary_id(const CompressDictionary *d);
+
+int compress_blob_zstd_dict(CompressDictionary *d,
+                            const void *src, uint64_t src_size,
+                            void *dst, size_t dst_alloc_size, size_t *dst_size);
+
 static inline int compress_blob(const void *src, uint64_t src_size,
                                 void *dst, size_t dst_alloc_size, size_t *dst_size) {
         int r;
@@ -42,10 +58,16 @@ int decompress_blob_lz4(const void *src, uint64_t src_size,
                         void **dst, size_t* dst_size, size_t dst_max);
 int decompress_blob_zstd(const void *src, uint64_t src_size,
                         void **dst, size_t* dst_size, size_t dst_max);
+int decompress_blob_zstd_dict(CompressDictionary *d,
+                              const void *src, uint64_t src_size,
+                              void **dst, size_t* dst_size, size_t dst_max);
 int decompress_blob(int compression,
                     const void *src, uint64_t src_size,
                     void **dst, size_t* dst_size, size_t dst_max);
 
+/* Returns the ID of the dictionary a compressed blob needs for decompression, or 0 if it needs none. */
+uint32_t compressed_blob_dictionary_id(int compression, const void *src, uint64_t src_size);
+
 int decompress_startswith_xz(const void *src, uint64_t src_size,
                              void **buffer,
                              const void *prefix, size_t prefix_len,
@@ -58,6 +80,11 @@ int decompress_startswith_zstd(const void *src, uint64_t src_size,
                                void **buffer,
                                const void *prefix, size_t prefix_len,
                                uint8_t extra);
+int decompress_startswith_zstd_dict(CompressDictionary *d,
+                                    const void *src, uint64_t src_size,
+                                    void **buffer,
+                                    const void *prefix, size_t prefix_len,
+                                    uint8_t extra);
 int decompress_startswith(int compression,
                           const void *src, uint64_t src_size,
                           void **buffer,
@@ -32,6 +32,7 @@
 #include "stat-util.h"
 #include "string-util.h"
 #include "strv.h"
+#include "tmpfile-util.h"
 #include "xattr-util.h"
 
 #define DEFAULT_DATA_HASH_TABLE_SIZE (2047ULL*sizeof(HashItem))
@@ -73,6 +74,23 @@
 /* How many entries to keep in the entry array chain cache at max */
 #define CHAIN_CACHE_MAX 20
 
+/* Add every n-th entry to the realtime index */
+#define REALTIME_INDEX_INTERVAL 64
+
+/* Number of items in the first realtime index object, each following one is twice as large */
+#define REALTIME_INDEX_ITEMS_MIN 256
+
+/* Once this many bytes of data object payloads have been collected, train a compression dictionary from
+ * them. Larger payloads compress well enough on their own and aren't sampled. */
+#define DICTIONARY_SAMPLES_SIZE (256 * 1024U)               /* 256 KiB */
+#define DICTIONARY_SAMPLE_SIZE_MAX (4 * 1024U)              /* 4 KiB */
+
+/* Maximum size of a trained compression dictionary */
+#define DICTIONARY_SIZE_MAX (16 * 1024U)                    /* 16 KiB */
+
+/* With a dictionary even short payloads compress well, hence lower the threshold to this */
+#define DICTIONARY_COMPRESS_THRESHOLD (64ULL)
+
 /* How much to increase the journal file size at once each time we allocate something new. */
 #define FILE_SIZE_INCREASE (8 * 1024 * 1024ULL)          /* 8MB */
 
@@ -117,6 +135,10 @@ static void journal_file_set_offline_internal(JournalFile *f) {
                 case OFFLINE_SYNCING:
                         (void) fsync(f->fd);
 
+                        /* Archived files have been renamed, see journal_file_archive() */
+                        if (f->archive)
+                                (void) fsync_directory_of_file(f->fd);
+
                         if (!__sync_bool_compare_and_swap(&f->offline_state, OFFLINE_SYNCING, OFFLINE_OFFLINING))
                                 continue;
 
@@ -393,14 +415,33 @@ JournalFile* journal_file_close(JournalFile *f) {
                 safe_close(f->fd);
         free(f->path);
 
+        /* A spare file that was never put into place, and which couldn't be created with O_TMPFILE */
+        if (f->spare_path) {
+                (void) unlink(f->spare_path);
+                free(f->spare_path);
+        }
+
         mmap_cache_unref(f->mmap);
 
         ordered_hashmap_free_free(f->chain_cache);
+        free(f->data_cache);
 
 #if HAVE_COMPRESSION
         free(f->compress_buffer);
 #endif
 
+#if HAVE_ZSTD
+        if (f->dictionary_thread_running) {
+                /* The file is going away, the dictionary is of no use anymore */
+                (void) pthread_join(f->dictionary_thread, NULL);
+                free(f->trained_dictionary);
+        }
+
+        compress_dictionary_free(f->compress_dictionary);
+        free(f->dictionary_samples);
+        free(f->dictionary_sample_sizes);
+#endif
+
 #if HAVE_GCRYPT
         if (f->fss_file)
                 munmap(f->fss_file, PAGE_ALIGN(f->fss_file_size));
@@ -430,10 +471,12 @@ static int journal_file_init_header(JournalFile *f, JournalFile *template) {
                 f->compress_xz * HEADER_INCOMPATIBLE_COMPRESSED_XZ |
                 f->compress_lz4 * HEADER_INCOMPATIBLE_COMPRESSED_LZ4 |
                 f->compress_zstd * HEADER_INCOMPATIBLE_COMPRESSED_ZSTD |
+                f->zstd_dictionary * HEADER_INCOMPATIBLE_ZSTD_DICTIONARY |
                 f->keyed_hash * HEADER_INCOMPATIBLE_KEYED_HASH);
 
         h.compatible_flags = htole32(
-                f->seal * HEADER_COMPATIBLE_SEALED);
+                f->seal * HEADER_COMPATIBLE_SEALED |
+                f->realtime_index * HEADER_COMPATIBLE_REALTIME_INDEX);
 
         r = sd_id128_randomize(&h.file_id);
         if (r < 0)
@@ -497,13 +540,15 @@ static bool warn_wrong_flags(const JournalFile *f, bool compatible) {
                                   f->path, type, flags & ~any);
                 flags = (flags & any) & ~supported;
                 if (flags) {
-                        const char* strv[5];
+                        const char* strv[6];
                         unsigned n = 0;
                         _cleanup_free_ char *t = NULL;
 
                         if (compatible) {
                                 if (flags & HEADER_COMPATIBLE_SEALED)
                                         strv[n++] = "sealed";
+                                if (flags & HEADER_COMPATIBLE_REALTIME_INDEX)
+                                        strv[n++] = "realtime-index";
                         } else {
                                 if (flags & HEADER_INCOMPATIBLE_COMPRESSED_XZ)
                                         strv[n++] = "xz-compressed";
@@ -511,6 +556,8 @@ static bool warn_wrong_flags(const JournalFile *f, bool compatible) {
                                         strv[n++] = "lz4-compressed";
                                 if (flags & HEADER_INCOMPATIBLE_COMPRESSED_ZSTD)
                                         strv[n++] = "zstd-compressed";
+                                if (flags & HEADER_INCOMPATIBLE_ZSTD_DICTIONARY)
+                                        strv[n++] = "zstd-dictionary";
                                 if (flags & HEADER_INCOMPATIBLE_KEYED_HASH)
                                         strv[n++] = "keyed-hash";
                         }
@@ -557,6 +604,9 @@ static int journal_file_verify_header(JournalFile *f) {
         if (JOURNAL_HEADER_SEALED(f->header) && !JOURNAL_HEADER_CONTAINS(f->header, n_entry_arrays))
                 return -EBADMSG;
 
+        if (JOURNAL_HEADER_ZSTD_DICTIONARY(f->header) && !JOURNAL_HEADER_CONTAINS(f->header, dictionary_offset))
+                return -EBADMSG;
+
         arena_size = le64toh(READ_NOW(f->header->arena_size));
 
         if (UINT64_MAX - header_size < arena_size || header_size + arena_size > (uint64_t) f->last_stat.st_size)
@@ -616,6 +666,10 @@ static int journal_file_verify_header(JournalFile *f) {
 
         f->keyed_hash = JOURNAL_HEADER_KEYED_HASH(f->header);
 
+        f->realtime_index = JOURNAL_HEADER_REALTIME_INDEX(f->header);
+
+        f->zstd_dictionary = JOURNAL_HEADER_ZSTD_DICTIONARY(f->header);
+
         return 0;
 }
 
@@ -635,8 +689,8 @@ int journal_file_fstat(JournalFile *f) {
         if (r < 0)
                 return r;
 
-        /* Refuse appending to files that are already deleted */
-        if (f->last_stat.st_nlink <= 0)
+        /* Refuse appending to files that are already deleted. Spare files aren't linked yet, of course. */
+        if (f->last_stat.st_nlink <= 0 && !f->spare)
                 return -EIDRM;
 
         return 0;
@@ -768,6 +822,8 @@ static uint64_t minimum_header_size(Object *o) {
                 [OBJECT_FIELD_HASH_TABLE] = sizeof(HashTableObject),
                 [OBJECT_ENTRY_ARRAY] = sizeof(EntryArrayObject),
                 [OBJECT_TAG] = sizeof(TagObject),
+                [OBJECT_REALTIME_INDEX] = sizeof(RealtimeIndexObject),
+                [OBJECT_DICTIONARY] = sizeof(DictionaryObject),
         };
 
         if (o->object.type >= ELEMENTSOF(table) || table[o->object.type] <= 0)
@@ -919,6 +975,36 @@ static int journal_file_check_object(JournalFile *f, uint64_t offset, Object *o)
                                                le64toh(o->tag.epoch), offset);
 
                 break;
+
+        case OBJECT_REALTIME_INDEX: {
+                uint64_t sz;
+
+                sz = le64toh(READ_NOW(o->object.size));
+                if (sz < offsetof(RealtimeIndexObject, items) ||
+                    (sz - offsetof(RealtimeIndexObject, items)) % sizeof(RealtimeIndexItem) != 0 ||
+                    (sz - offsetof(RealtimeIndexObject, items)) / sizeof(RealtimeIndexItem) <= 0)
+                        return log_debug_errno(SYNTHETIC_ERRNO(EBADMSG),
+                                               "Invalid object realtime index size: %" PRIu64 ": %" PRIu64,
+                                               sz,
+                                               offset);
+
+                if (!VALID64(le64toh(o->realtime_index.next_realtime_index_offset)))
+                        return log_debug_errno(SYNTHETIC_ERRNO(EBADMSG),
+                                               "Invalid object realtime index next_realtime_index_offset: " OFSfmt ": %" PRIu64,
+                                               le64toh(o->realtime_index.next_realtime_index_offset),
+                                               offset);
+
+                break;
+        }
+
+        case OBJECT_DICTIONARY:
+                if (le64toh(o->object.size) <= offsetof(DictionaryObject, payload))
+                        return log_debug_errno(SYNTHETIC_ERRNO(EBADMSG),
+                                               "Invalid object dictionary size: %" PRIu64 ": %" PRIu64,
+                                               le64toh(o->object.size),
+                                               offset);
+
+                break;
         }
 
         return 0;
@@ -1045,26 +1131,16 @@ static void journal_file_revert_entry_seqnum(
                 *seqnum = revert_seqnum - 1;
 }
 
-int journal_file_append_object(
-                JournalFile *f,
-                ObjectType type,
-                uint64_t size,
-                Object **ret,
-                uint64_t *ret_offset) {
-
-        int r;
+static int journal_file_tail_end(JournalFile *f, uint64_t *ret_offset) {
+        Object *tail;
         uint64_t p;
-        Object *tail, *o;
-        void *t;
+        int r;
 
         assert(f);
         assert(f->header);
-        assert(type > OBJECT_UNUSED && type < _OBJECT_TYPE_MAX);
-        assert(size >= sizeof(ObjectHeader));
+        assert(ret_offset);
 
-        r = journal_file_set_online(f);
-        if (r < 0)
-                return r;
+        /* Returns the offset where the next object will be appended */
 
         p = le64toh(f->header->tail_object_offset);
         if (p == 0)
@@ -1087,6 +1163,35 @@ int journal_file_append_object(
                 p += sz;
         }
 
+        *ret_offset = p;
+        return 0;
+}
+
+int journal_file_append_object(
+                JournalFile *f,
+                ObjectType type,
+                uint64_t size,
+                Object **ret,
+                uint64_t *ret_offset) {
+
+        int r;
+        uint64_t p;
+        Object *o;
+        void *t;
+
+        assert(f);
+        assert(f->header);
+        assert(type > OBJECT_UNUSED && type < _OBJECT_TYPE_MAX);
+        assert(size >= sizeof(ObjectHeader));
+
+        r = journal_file_set_online(f);
+        if (r < 0)
+                return r;
+
+        r = journal_file_tail_end(f, &p);
+        if (r < 0)
+                return r;
+
         r = journal_file_allocate(f, p, size);
         if (r < 0)
                 return r;
@@ -1443,204 +1548,596 @@ int journal_file_find_field_object(
                         ret, ret_offset);
 }
 
-int journal_file_find_data_object_with_hash(
-                JournalFile *f,
-                const void *data, uint64_t size, uint64_t hash,
-                Object **ret, uint64_t *ret_offset) {
-
-        uint64_t p, osize, h, m, depth = 0;
+#if HAVE_ZSTD
+static int journal_file_load_dictionary(JournalFile *f) {
+        uint64_t p, sz;
+        Object *o;
         int r;
 
         assert(f);
-        assert(f->header);
-        assert(data || size == 0);
 
-        /* If there's no data hash table, then there's no entry. */
-        if (le64toh(f->header->data_hash_table_size) <= 0)
+        /* Returns > 0 if the file has a compression dictionary and it is loaded, 0 if it has none (yet). */
+
+        if (f->compress_dictionary)
+                return 1;
+
+        if (!JOURNAL_HEADER_CONTAINS(f->header, dictionary_offset))
                 return 0;
 
-        /* Map the data hash table, if it isn't mapped yet. */
-        r = journal_file_map_data_hash_table(f);
+        p = le64toh(READ_NOW(f->header->dictionary_offset));
+        if (p == 0)
+                return 0;
+
+        r = journal_file_move_to_object(f, OBJECT_DICTIONARY, p, &o);
         if (r < 0)
                 return r;
 
-        osize = offsetof(Object, data.payload) + size;
+        sz = le64toh(READ_NOW(o->object.size)) - offsetof(Object, dictionary.payload);
 
-        m = le64toh(READ_NOW(f->header->data_hash_table_size)) / sizeof(HashItem);
-        if (m <= 0)
-                return -EBADMSG;
+        r = compress_dictionary_new(o->dictionary.payload, sz, &f->compress_dictionary);
+        if (r < 0)
+                return log_debug_errno(r, "Failed to load compression dictionary of %s: %m", f->path);
 
-        h = hash % m;
-        p = le64toh(f->data_hash_table[h].head_hash_offset);
+        return 1;
+}
 
-        while (p > 0) {
-                Object *o;
+static int journal_file_get_dictionary(JournalFile *f, uint32_t id, CompressDictionary **ret) {
+        int r;
 
-                r = journal_file_move_to_object(f, OBJECT_DATA, p, &o);
-                if (r < 0)
-                        return r;
+        assert(f);
+        assert(ret);
 
-                if (le64toh(o->data.hash) != hash)
-                        goto next;
+        r = journal_file_load_dictionary(f);
+        if (r < 0)
+                return r;
+        if (r == 0)
+                return log_debug_errno(SYNTHETIC_ERRNO(EBADMSG),
+                                       "Data object in %s needs compression dictionary %" PRIu32 ", but the file has none.",
+                                       f->path, id);
 
-                if (o->object.flags & OBJECT_COMPRESSION_MASK) {
-#if HAVE_COMPRESSION
-                        uint64_t l;
-                        size_t rsize = 0;
+        if (compress_dictionary_id(f->compress_dictionary) != id)
+                return log_debug_errno(SYNTHETIC_ERRNO(EBADMSG),
+                                       "Data object in %s needs compression dictionary %" PRIu32 ", but the file has %" PRIu32 ".",
+                                       f->path, id, compress_dictionary_id(f->compress_dictionary));
 
-                        l = le64toh(READ_NOW(o->object.size));
-                        if (l <= offsetof(Object, data.payload))
-                                return -EBADMSG;
+        *ret = f->compress_dictionary;
+        return 0;
+}
 
-                        l -= offsetof(Object, data.payload);
+static void journal_file_reset_dictionary_samples(JournalFile *f) {
+        assert(f);
 
-                        r = decompress_blob(o->object.flags & OBJECT_COMPRESSION_MASK,
-                                            o->data.payload, l, &f->compress_buffer, &rsize, 0);
-                        if (r < 0)
-                                return r;
+        f->dictionary_samples = mfree(f->dictionary_samples);
+        f->dictionary_sample_sizes = mfree(f->dictionary_sample_sizes);
+        f->dictionary_samples_size = f->n_dictionary_samples = 0;
+}
 
-                        if (rsize == size &&
-                            memcmp(f->compress_buffer, data, size) == 0) {
+static int journal_file_append_dictionary(JournalFile *f, const void *dict, size_t dict_size) {
+        _cleanup_(compress_dictionary_freep) CompressDictionary *d = NULL;
+        Object *o;
+        uint64_t p;
+        int r;
 
-                                if (ret)
-                                        *ret = o;
+        assert(f);
+        assert(f->zstd_dictionary);
+        assert(!f->compress_dictionary);
+        assert(dict);
 
-                                if (ret_offset)
-                                        *ret_offset = p;
+        if (!JOURNAL_HEADER_CONTAINS(f->header, dictionary_offset))
+                return -EOPNOTSUPP;
 
-                                return 1;
-                        }
-#else
-                        return -EPROTONOSUPPORT;
-#endif
-                } else if (le64toh(o->object.size) == osize &&
-                           memcmp(o->data.payload, data, size) == 0) {
+        /* Make sure the dictionary is usable before we write it to the file */
+        r = compress_dictionary_new(dict, dict_size, &d);
+        if (r < 0)
+                return r;
 
-                        if (ret)
-                                *ret = o;
+        r = journal_file_append_object(f, OBJECT_DICTIONARY, offsetof(Object, dictionary.payload) + dict_size, &o, &p);
+        if (r < 0)
+                return r;
 
-                        if (ret_offset)
-                                *ret_offset = p;
+        memcpy(o->dictionary.payload, dict, dict_size);
 
-                        return 1;
-                }
+#if HAVE_GCRYPT
+        r = journal_file_hmac_put_object(f, OBJECT_DICTIONARY, o, p);
+        if (r < 0)
+                return r;
+#endif
 
-        next:
-                r = next_hash_offset(
-                                f,
-                                &p,
-                                &o->data.next_hash_offset,
-                                &depth,
-                                JOURNAL_HEADER_CONTAINS(f->header, data_hash_chain_depth) ? &f->header->data_hash_chain_depth : NULL);
-                if (r < 0)
-                        return r;
-        }
+        f->header->dictionary_offset = htole64(p);
+        f->compress_dictionary = TAKE_PTR(d);
+
+        journal_file_reset_dictionary_samples(f);
 
         return 0;
 }
 
-int journal_file_find_data_object(
-                JournalFile *f,
-                const void *data, uint64_t size,
-                Object **ret, uint64_t *ret_offset) {
+static void *journal_file_train_dictionary_thread(void *arg) {
+        JournalFile *f = arg;
 
-        assert(f);
-        assert(data || size == 0);
+        (void) pthread_setname_np(pthread_self(), "journal-dict");
 
-        return journal_file_find_data_object_with_hash(
-                        f,
-                        data, size,
-                        journal_file_hash_data(f, data, size),
-                        ret, ret_offset);
+        f->trained_dictionary_result = compress_dictionary_train(
+                        f->dictionary_samples, f->dictionary_sample_sizes, f->n_dictionary_samples,
+                        DICTIONARY_SIZE_MAX,
+                        &f->trained_dictionary, &f->trained_dictionary_size);
+
+        __atomic_store_n(&f->dictionary_trained, true, __ATOMIC_RELEASE);
+        return NULL;
 }
 
-bool journal_field_valid(const char *p, size_t l, bool allow_protected) {
-        /* We kinda enforce POSIX syntax recommendations for
-           environment variables here, but make a couple of additional
-           requirements.
+static int journal_file_train_dictionary_start(JournalFile *f) {
+        sigset_t ss, saved_ss;
+        int r, k;
 
-           http://pubs.opengroup.org/onlinepubs/000095399/basedefs/xbd_chap08.html */
+        assert(f);
+        assert(!f->dictionary_thread_running);
 
-        if (l == SIZE_MAX)
-                l = strlen(p);
+        /* Training takes a while (about 60ms for the samples we collect), hence do it in a thread, so that
+         * appending entries doesn't stall. The thread doesn't access the file, hence block all signals. */
 
-        /* No empty field names */
-        if (l <= 0)
-                return false;
+        f->dictionary_trained = false;
 
-        /* Don't allow names longer than 64 chars */
-        if (l > 64)
-                return false;
+        assert_se(sigfillset(&ss) >= 0);
 
-        /* Variables starting with an underscore are protected */
-        if (!allow_protected && p[0] == '_')
-                return false;
+        r = pthread_sigmask(SIG_BLOCK, &ss, &saved_ss);
+        if (r > 0)
+                return -r;
 
-        /* Don't allow digits as first character */
-        if (p[0] >= '0' && p[0] <= '9')
-                return false;
+        r = pthread_create(&f->dictionary_thread, NULL, journal_file_train_dictionary_thread, f);
 
-        /* Only allow A-Z0-9 and '_' */
-        for (const char *a = p; a < p + l; a++)
-                if ((*a < 'A' || *a > 'Z') &&
-                    (*a < '0' || *a > '9') &&
-                    *a != '_')
-                        return false;
+        k = pthread_sigmask(SIG_SETMASK, &saved_ss, NULL);
+        if (r > 0)
+                return -r;
 
-        return true;
-}
+        f->dictionary_thread_running = true;
 
-static int journal_file_append_field(
-                JournalFile *f,
-                const void *field, uint64_t size,
-                Object **ret, uint64_t *ret_offset) {
+        if (k > 0)
+                return -k;
 
-        uint64_t hash, p;
-        uint64_t osize;
-        Object *o;
+        return 0;
+}
+
+static int journal_file_train_dictionary_finish(JournalFile *f) {
+        _cleanup_free_ void *dict = NULL;
+        size_t dict_size;
         int r;
 
         assert(f);
-        assert(field && size > 0);
 
-        if (!journal_field_valid(field, size, true))
-                return -EBADMSG;
+        /* Returns > 0 if the dictionary is trained and written to the file, 0 if training is still going
+         * on or there is none, and < 0 if training failed. */
 
-        hash = journal_file_hash_data(f, field, size);
+        if (!f->dictionary_thread_running)
+                return 0;
 
-        r = journal_file_find_field_object_with_hash(f, field, size, hash, &o, &p);
-        if (r < 0)
-                return r;
-        if (r > 0) {
+        if (!__atomic_load_n(&f->dictionary_trained, __ATOMIC_ACQUIRE))
+                return 0;
 
-                if (ret)
-                        *ret = o;
+        r = pthread_join(f->dictionary_thread, NULL);
+        if (r > 0)
+                return -r;
 
-                if (ret_offset)
-                        *ret_offset = p;
+        f->dictionary_thread_running = false;
+        dict = TAKE_PTR(f->trained_dictionary);
+        dict_size = f->trained_dictionary_size;
 
-                return 0;
+        r = f->trained_dictionary_result;
+        if (r >= 0)
+                r = journal_file_append_dictionary(f, dict, dict_size);
+        if (r < 0) {
+                /* Start over with a fresh set of samples, maybe they are more useful */
+                journal_file_reset_dictionary_samples(f);
+                return r;
         }
 
-        osize = offsetof(Object, field.payload) + size;
-        r = journal_file_append_object(f, OBJECT_FIELD, osize, &o, &p);
-        if (r < 0)
-                return r;
+        log_debug("Trained %zu byte compression dictionary for %s.", dict_size, f->path);
+        return 1;
+}
 
-        o->field.hash = htole64(hash);
-        memcpy(o->field.payload, field, size);
+static int journal_file_sample_dictionary(JournalFile *f, const void *data, uint64_t size) {
+        assert(f);
+        assert(data || size == 0);
 
-        r = journal_file_link_field(f, o, p, hash);
-        if (r < 0)
-                return r;
+        /* Collects the payload of a new data object, and trains a dictionary once we have enough of them.
+         * Larger payloads compress fine without a dictionary, hence we only look at the small ones. */
 
-        /* The linking might have altered the window, so let's
-         * refresh our pointer */
-        r = journal_file_move_to_object(f, OBJECT_FIELD, p, &o);
-        if (r < 0)
-                return r;
+        if (f->dictionary_thread_running)
+                return journal_file_train_dictionary_finish(f);
 
-#if HAVE_GCRYPT
+        if (size == 0 || size > DICTIONARY_SAMPLE_SIZE_MAX)
+                return 0;
+
+        if (!GREEDY_REALLOC(f->dictionary_sample_sizes, f->n_dictionary_samples + 1))
+                return -ENOMEM;
+
+        if (!greedy_realloc(&f->dictionary_samples, DICTIONARY_SAMPLES_SIZE + DICTIONARY_SAMPLE_SIZE_MAX, 1))
+                return -ENOMEM;
+
+        memcpy((uint8_t*) f->dictionary_samples + f->dictionary_samples_size, data, size);
+        f->dictionary_samples_size += size;
+        f->dictionary_sample_sizes[f->n_dictionary_samples++] = size;
+
+        if (f->dictionary_samples_size < DICTIONARY_SAMPLES_SIZE)
+                return 0;
+
+        return journal_file_train_dictionary_start(f);
+}
+
+static int journal_file_inherit_dictionary(JournalFile *f, JournalFile *template) {
+        uint64_t p;
+        Object *o;
+        int r;
+
+        assert(f);
+        assert(template);
+
+        if (!f->zstd_dictionary || !template->zstd_dictionary)
+                return 0;
+
+        if (!JOURNAL_HEADER_CONTAINS(template->header, dictionary_offset))
+                return 0;
+
+        p = le64toh(READ_NOW(template->header->dictionary_offset));
+        if (p == 0)
+                return 0;
+
+        r = journal_file_move_to_object(template, OBJECT_DICTIONARY, p, &o);
+        if (r < 0)
+                return r;
+
+        r = journal_file_append_dictionary(
+                        f,
+                        o->dictionary.payload,
+                        le64toh(READ_NOW(o->object.size)) - offsetof(Object, dictionary.payload));
+        if (r < 0)
+                return r;
+
+        return 1;
+}
+#endif
+
+int journal_file_decompress_blob(
+                JournalFile *f,
+                int compression,
+                const void *src, uint64_t src_size,
+                void **dst, size_t *dst_size, size_t dst_max) {
+
+        assert(f);
+
+#if HAVE_ZSTD
+        uint32_t id;
+
+        id = compressed_blob_dictionary_id(compression, src, src_size);
+        if (id != 0) {
+                CompressDictionary *d;
+                int r;
+
+                r = journal_file_get_dictionary(f, id, &d);
+                if (r < 0)
+                        return r;
+
+                return decompress_blob_zstd_dict(d, src, src_size, dst, dst_size, dst_max);
+        }
+#endif
+
+        return decompress_blob(compression, src, src_size, dst, dst_size, dst_max);
+}
+
+int journal_file_decompress_startswith(
+                JournalFile *f,
+                int compression,
+                const void *src, uint64_t src_size,
+                void **buffer,
+                const void *prefix, size_t prefix_len,
+                uint8_t extra) {
+
+        assert(f);
+
+#if HAVE_ZSTD
+        uint32_t id;
+
+        id = compressed_blob_dictionary_id(compression, src, src_size);
+        if (id != 0) {
+                CompressDictionary *d;
+                int r;
+
+                r = journal_file_get_dictionary(f, id, &d);
+                if (r < 0)
+                        return r;
+
+                return decompress_startswith_zstd_dict(d, src, src_size, buffer, prefix, prefix_len, extra);
+        }
+#endif
+
+        return decompress_startswith(compression, src, src_size, buffer, prefix, prefix_len, extra);
+}
+
+static DataCacheItem* data_cache_set(JournalFile *f, uint64_t hash) {
+        assert(f);
+        assert(f->data_cache);
+
+        return f->data_cache + (hash & (DATA_CACHE_SLOTS / DATA_CACHE_WAYS - 1)) * DATA_CACHE_WAYS;
+}
+
+static uint64_t data_cache_get(JournalFile *f, uint64_t hash) {
+        DataCacheItem *set;
+
+        assert(f);
+
+        if (!f->data_cache)
+                return 0;
+
+        set = data_cache_set(f, hash);
+
+        for (unsigned i = 0; i < DATA_CACHE_WAYS && set[i].offset > 0; i++) {
+                uint64_t p;
+
+                if (set[i].hash != hash)
+                        continue;
+
+                p = set[i].offset;
+
+                /* Move the item one step towards the front of its set, so that the items used most
+                 * frequently are the last ones to be dropped. */
+                if (i > 0)
+                        SWAP_TWO(set[i-1], set[i]);
+
+                return p;
+        }
+
+        return 0;
+}
+
+static void data_cache_put(JournalFile *f, uint64_t hash, uint64_t offset) {
+        DataCacheItem *set;
+
+        assert(f);
+        assert(offset > 0);
+
+        if (!f->data_cache)
+                return;
+
+        /* Insert at the front of the set, which drops the last item if the set is full */
+        set = data_cache_set(f, hash);
+        memmove(set + 1, set, (DATA_CACHE_WAYS - 1) * sizeof(DataCacheItem));
+        set[0] = (DataCacheItem) {
+                .hash = hash,
+                .offset = offset,
+        };
+}
+
+static int journal_file_data_object_matches(
+                JournalFile *f,
+                Object *o,
+                const void *data, uint64_t size, uint64_t hash) {
+
+        int r;
+
+        assert(f);
+        assert(o);
+        assert(data || size == 0);
+
+        if (le64toh(o->data.hash) != hash)
+                return 0;
+
+        if (o->object.flags & OBJECT_COMPRESSION_MASK) {
+#if HAVE_COMPRESSION
+                uint64_t l;
+                size_t rsize = 0;
+
+                l = le64toh(READ_NOW(o->object.size));
+                if (l <= offsetof(Object, data.payload))
+                        return -EBADMSG;
+
+                l -= offsetof(Object, data.payload);
+
+                r = journal_file_decompress_blob(f, o->object.flags & OBJECT_COMPRESSION_MASK,
+                                                 o->data.payload, l, &f->compress_buffer, &rsize, 0);
+                if (r < 0)
+                        return r;
+
+                return rsize == size &&
+                        memcmp(f->compress_buffer, data, size) == 0;
+#else
+                return -EPROTONOSUPPORT;
+#endif
+        }
+
+        return le64toh(o->object.size) == offsetof(Object, data.payload) + size &&
+                memcmp(o->data.payload, data, size) == 0;
+}
+
+int journal_file_find_data_object_with_hash(
+                JournalFile *f,
+                const void *data, uint64_t size, uint64_t hash,
+                Object **ret, uint64_t *ret_offset) {
+
+        uint64_t p, h, m, depth = 0;
+        Object *o;
+        int r;
+
+        assert(f);
+        assert(f->header);
+        assert(data || size == 0);
+
+        /* If there's no data hash table, then there's no entry. */
+        if (le64toh(f->header->data_hash_table_size) <= 0)
+                return 0;
+
+        /* Writers look up the same few field values over and over again. Check the objects found most
+         * recently first, which saves us from walking the hash chain in the file. */
+        p = data_cache_get(f, hash);
+        if (p > 0) {
+                r = journal_file_move_to_object(f, OBJECT_DATA, p, &o);
+                if (r < 0)
+                        return r;
+
+                r = journal_file_data_object_matches(f, o, data, size, hash);
+                if (r < 0)
+                        return r;
+                if (r > 0) {
+                        f->n_data_cache_hits++;
+
+                        if (ret)
+                                *ret = o;
+
+                        if (ret_offset)
+                                *ret_offset = p;
+
+                        return 1;
+                }
+        }
+
+        if (f->data_cache)
+                f->n_data_cache_misses++;
+
+        /* Map the data hash table, if it isn't mapped yet. */
+        r = journal_file_map_data_hash_table(f);
+        if (r < 0)
+                return r;
+
+        m = le64toh(READ_NOW(f->header->data_hash_table_size)) / sizeof(HashItem);
+        if (m <= 0)
+                return -EBADMSG;
+
+        h = hash % m;
+        p = le64toh(f->data_hash_table[h].head_hash_offset);
+
+        while (p > 0) {
+                r = journal_file_move_to_object(f, OBJECT_DATA, p, &o);
+                if (r < 0)
+                        return r;
+
+                r = journal_file_data_object_matches(f, o, data, size, hash);
+                if (r < 0)
+                        return r;
+                if (r > 0) {
+                        data_cache_put(f, hash, p);
+
+                        if (ret)
+                                *ret = o;
+
+                        if (ret_offset)
+                                *ret_offset = p;
+
+                        return 1;
+                }
+
+                r = next_hash_offset(
+                                f,
+                                &p,
+                                &o->data.next_hash_offset,
+                                &depth,
+                                JOURNAL_HEADER_CONTAINS(f->header, data_hash_chain_depth) ? &f->header->data_hash_chain_depth : NULL);
+                if (r < 0)
+                        return r;
+        }
+
+        return 0;
+}
+
+int journal_file_find_data_object(
+                JournalFile *f,
+                const void *data, uint64_t size,
+                Object **ret, uint64_t *ret_offset) {
+
+        assert(f);
+        assert(data || size == 0);
+
+        return journal_file_find_data_object_with_hash(
+                        f,
+                        data, size,
+                        journal_file_hash_data(f, data, size),
+                        ret, ret_offset);
+}
+
+bool journal_field_valid(const char *p, size_t l, bool allow_protected) {
+        /* We kinda enforce POSIX syntax recommendations for
+           environment variables here, but make a couple of additional
+           requirements.
+
+           http://pubs.opengroup.org/onlinepubs/000095399/basedefs/xbd_chap08.html */
+
+        if (l == SIZE_MAX)
+                l = strlen(p);
+
+        /* No empty field names */
+        if (l <= 0)
+                return false;
+
+        /* Don't allow names longer than 64 chars */
+        if (l > 64)
+                return false;
+
+        /* Variables starting with an underscore are protected */
+        if (!allow_protected && p[0] == '_')
+                return false;
+
+        /* Don't allow digits as first character */
+        if (p[0] >= '0' && p[0] <= '9')
+                return false;
+
+        /* Only allow A-Z0-9 and '_' */
+        for (const char *a = p; a < p + l; a++)
+                if ((*a < 'A' || *a > 'Z') &&
+                    (*a < '0' || *a > '9') &&
+                    *a != '_')
+                        return false;
+
+        return true;
+}
+
+static int journal_file_append_field(
+                JournalFile *f,
+                const void *field, uint64_t size,
+                Object **ret, uint64_t *ret_offset) {
+
+        uint64_t hash, p;
+        uint64_t osize;
+        Object *o;
+        int r;
+
+        assert(f);
+        assert(field && size > 0);
+
+        if (!journal_field_valid(field, size, true))
+                return -EBADMSG;
+
+        hash = journal_file_hash_data(f, field, size);
+
+        r = journal_file_find_field_object_with_hash(f, field, size, hash, &o, &p);
+        if (r < 0)
+                return r;
+        if (r > 0) {
+
+                if (ret)
+                        *ret = o;
+
+                if (ret_offset)
+                        *ret_offset = p;
+
+                return 0;
+        }
+
+        osize = offsetof(Object, field.payload) + size;
+        r = journal_file_append_object(f, OBJECT_FIELD, osize, &o, &p);
+        if (r < 0)
+                return r;
+
+        o->field.hash = htole64(hash);
+        memcpy(o->field.payload, field, size);
+
+        r = journal_file_link_field(f, o, p, hash);
+        if (r < 0)
+                return r;
+
+        /* The linking might have altered the window, so let's
+         * refresh our pointer */
+        r = journal_file_move_to_object(f, OBJECT_FIELD, p, &o);
+        if (r < 0)
+                return r;
+
+#if HAVE_GCRYPT
         r = journal_file_hmac_put_object(f, OBJECT_FIELD, o, p);
         if (r < 0)
                 return r;
@@ -1655,12 +2152,24 @@ static int journal_file_append_field(
         return 0;
 }
 
+static uint64_t journal_file_compress_threshold(JournalFile *f) {
+        assert(f);
+
+#if HAVE_ZSTD
+        if (f->compress_dictionary)
+                return MIN(f->compress_threshold_bytes, DICTIONARY_COMPRESS_THRESHOLD);
+#endif
+
+        return f->compress_threshold_bytes;
+}
+
 static int journal_file_append_data(
                 JournalFile *f,
                 const void *data, uint64_t size,
+                uint64_t hash,
                 Object **ret, uint64_t *ret_offset) {
 
-        uint64_t hash, p;
+        uint64_t p;
         uint64_t osize;
         Object *o;
         int r, compression = 0;
@@ -1669,7 +2178,9 @@ static int journal_file_append_data(
         assert(f);
         assert(data || size == 0);
 
-        hash = journal_file_hash_data(f, data, size);
+        /* The caller may pass in the hash of the data if it knows it already, or UINT64_MAX if it doesn't */
+        if (hash == UINT64_MAX)
+                hash = journal_file_hash_data(f, data, size);
 
         r = journal_file_find_data_object_with_hash(f, data, size, hash, &o, &p);
         if (r < 0)
@@ -1685,6 +2196,16 @@ static int journal_file_append_data(
                 return 0;
         }
 
+#if HAVE_ZSTD
+        if (f->zstd_dictionary && f->compress_zstd) {
+                r = journal_file_load_dictionary(f);
+                if (r == 0)
+                        r = journal_file_sample_dictionary(f, data, size);
+                if (r < 0)
+                        log_debug_errno(r, "Failed to set up compression dictionary for %s, ignoring: %m", f->path);
+        }
+#endif
+
         osize = offsetof(Object, data.payload) + size;
         r = journal_file_append_object(f, OBJECT_DATA, osize, &o, &p);
         if (r < 0)
@@ -1693,10 +2214,16 @@ static int journal_file_append_data(
         o->data.hash = htole64(hash);
 
 #if HAVE_COMPRESSION
-        if (JOURNAL_FILE_COMPRESS(f) && size >= f->compress_threshold_bytes) {
+        if (JOURNAL_FILE_COMPRESS(f) && size >= journal_file_compress_threshold(f)) {
                 size_t rsize = 0;
 
-                compression = compress_blob(data, size, o->data.payload, size - 1, &rsize);
+#if HAVE_ZSTD
+                if (f->compress_zstd && f->compress_dictionary) {
+                        r = compress_blob_zstd_dict(f->compress_dictionary, data, size, o->data.payload, size - 1, &rsize);
+                        compression = r < 0 ? r : OBJECT_COMPRESSED_ZSTD;
+                } else
+#endif
+                        compression = compress_blob(data, size, o->data.payload, size - 1, &rsize);
 
                 if (compression >= 0) {
                         o->object.size = htole64(offsetof(Object, data.payload) + rsize);
@@ -1717,6 +2244,8 @@ static int journal_file_append_data(
         if (r < 0)
                 return r;
 
+        data_cache_put(f, hash, p);
+
 #if HAVE_GCRYPT
         r = journal_file_hmac_put_object(f, OBJECT_DATA, o, p);
         if (r < 0)
@@ -1785,6 +2314,21 @@ uint64_t journal_file_entry_array_n_items(Object *o) {
         return (sz - offsetof(Object, entry_array.items)) / sizeof(uint64_t);
 }
 
+uint64_t journal_file_realtime_index_n_items(Object *o) {
+        uint64_t sz;
+
+        assert(o);
+
+        if (o->object.type != OBJECT_REALTIME_INDEX)
+                return 0;
+
+        sz = le64toh(READ_NOW(o->object.size));
+        if (sz < offsetof(Object, realtime_index.items))
+                return 0;
+
+        return (sz - offsetof(Object, realtime_index.items)) / sizeof(RealtimeIndexItem);
+}
+
 uint64_t journal_file_hash_table_n_items(Object *o) {
         uint64_t sz;
 
@@ -1803,7 +2347,9 @@ uint64_t journal_file_hash_table_n_items(Object *o) {
 static int link_entry_into_array(JournalFile *f,
                                  le64_t *first,
                                  le64_t *idx,
-                                 uint64_t p) {
+                                 uint64_t p,
+                                 uint64_t *ret_array,
+                                 uint64_t *ret_begin) {
         int r;
         uint64_t n = 0, ap = 0, q, i, a, hidx;
         Object *o;
@@ -1826,6 +2372,11 @@ static int link_entry_into_array(JournalFile *f,
                 if (i < n) {
                         o->entry_array.items[i] = htole64(p);
                         *idx = htole64(hidx + 1);
+
+                        if (ret_array)
+                                *ret_array = a;
+                        if (ret_begin)
+                                *ret_begin = hidx - i;
                         return 0;
                 }
 
@@ -1871,6 +2422,11 @@ static int link_entry_into_array(JournalFile *f,
 
         *idx = htole64(hidx + 1);
 
+        if (ret_array)
+                *ret_array = q;
+        if (ret_begin)
+                *ret_begin = hidx - i;
+
         return 0;
 }
 
@@ -1898,7 +2454,7 @@ static int link_entry_into_array_plus_one(JournalFile *f,
                 le64_t i;
 
                 i = htole64(hidx - 1);
-                r = link_entry_into_array(f, first, &i, p);
+                r = link_entry_into_array(f, first, &i, p, NULL, NULL);
                 if (r < 0)
                         return r;
         }
@@ -1927,8 +2483,87 @@ static int journal_file_link_entry_item(JournalFile *f, Object *o, uint64_t offs
                                               offset);
 }
 
+static int link_entry_into_realtime_index(
+                JournalFile *f,
+                uint64_t realtime,
+                uint64_t entry_index,
+                uint64_t entry_array,
+                uint64_t entry_array_begin) {
+
+        uint64_t n = 0, ap = 0, q, i, a, hidx;
+        Object *o;
+        int r;
+
+        assert(f);
+        assert(f->header);
+        assert(entry_array > 0);
+        assert(entry_array_begin <= entry_index);
+
+        /* Only every REALTIME_INDEX_INTERVAL'th entry is recorded, that's enough to narrow down the part
+         * of the entry array we need to bisect to a handful of neighbouring entries. */
+        if (entry_index % REALTIME_INDEX_INTERVAL != 0)
+                return 0;
+
+        a = le64toh(f->header->realtime_index_offset);
+        i = hidx = le64toh(READ_NOW(f->header->n_realtime_index));
+        while (a > 0) {
+
+                r = journal_file_move_to_object(f, OBJECT_REALTIME_INDEX, a, &o);
+                if (r < 0)
+                        return r;
+
+                n = journal_file_realtime_index_n_items(o);
+                if (i < n)
+                        goto found;
+
+                i -= n;
+                ap = a;
+                a = le64toh(o->realtime_index.next_realtime_index_offset);
+        }
+
+        n = MAX(n * 2, (uint64_t) REALTIME_INDEX_ITEMS_MIN);
+
+        r = journal_file_append_object(f, OBJECT_REALTIME_INDEX,
+                                       offsetof(Object, realtime_index.items) + n * sizeof(RealtimeIndexItem),
+                                       &o, &q);
+        if (r < 0)
+                return r;
+
+#if HAVE_GCRYPT
+        r = journal_file_hmac_put_object(f, OBJECT_REALTIME_INDEX, o, q);
+        if (r < 0)
+                return r;
+#endif
+
+        if (ap == 0)
+                f->header->realtime_index_offset = htole64(q);
+        else {
+                r = journal_file_move_to_object(f, OBJECT_REALTIME_INDEX, ap, &o);
+                if (r < 0)
+                        return r;
+
+                o->realtime_index.next_realtime_index_offset = htole64(q);
+
+                r = journal_file_move_to_object(f, OBJECT_REALTIME_INDEX, q, &o);
+                if (r < 0)
+                        return r;
+        }
+
+found:
+        o->realtime_index.items[i] = (RealtimeIndexItem) {
+                .realtime = htole64(realtime),
+                .entry_index = htole64(entry_index),
+                .entry_array_offset = htole64(entry_array),
+                .entry_array_begin = htole64(entry_array_begin),
+        };
+
+        f->header->n_realtime_index = htole64(hidx + 1);
+
+        return 0;
+}
+
 static int journal_file_link_entry(JournalFile *f, Object *o, uint64_t offset) {
-        uint64_t n;
+        uint64_t n, a, begin;
         int r;
 
         assert(f);
@@ -1945,10 +2580,19 @@ static int journal_file_link_entry(JournalFile *f, Object *o, uint64_t offset) {
         r = link_entry_into_array(f,
                                   &f->header->entry_array_offset,
                                   &f->header->n_entries,
-                                  offset);
+                                  offset,
+                                  &a, &begin);
         if (r < 0)
                 return r;
 
+        /* The entry is part of the main entry array now, hence don't fail from here on because of the
+         * realtime index. A missing index item only means seeking by time has to bisect a bit more. */
+        if (f->realtime_index) {
+                r = link_entry_into_realtime_index(f, le64toh(o->entry.realtime), le64toh(f->header->n_entries) - 1, a, begin);
+                if (r < 0)
+                        log_debug_errno(r, "Failed to link entry into realtime index of %s, ignoring: %m", f->path);
+        }
+
         /* log_debug("=> %s seqnr=%"PRIu64" n_entries=%"PRIu64, f->path, o->entry.seqnum, f->header->n_entries); */
 
         if (f->header->head_entry_realtime == 0)
@@ -2110,53 +2754,89 @@ static int entry_item_cmp(const EntryItem *a, const EntryItem *b) {
         return CMP(le64toh(a->object_offset), le64toh(b->object_offset));
 }
 
-int journal_file_append_entry(
+static int journal_file_validate_timestamp(const dual_timestamp *ts) {
+        assert(ts);
+
+        if (!VALID_REALTIME(ts->realtime))
+                return log_debug_errno(SYNTHETIC_ERRNO(EBADMSG),
+                                       "Invalid realtime timestamp %" PRIu64 ", refusing entry.",
+                                       ts->realtime);
+        if (!VALID_MONOTONIC(ts->monotonic))
+                return log_debug_errno(SYNTHETIC_ERRNO(EBADMSG),
+                                       "Invalid monotomic timestamp %" PRIu64 ", refusing entry.",
+                                       ts->monotonic);
+
+        return 0;
+}
+
+static bool find_previous_item(
+                const struct iovec *iovec,
+                unsigned i,
+                const struct iovec prev_iovec[],
+                const EntryItem prev_items[],
+                unsigned n_prev,
+                EntryItem *ret) {
+
+        assert(iovec);
+        assert(ret);
+
+        /* Entries written in one go usually come from the same client and thus carry the same fields, in
+         * the same order. Start looking at the same index and wrap around. */
+
+        for (unsigned k = 0; k < n_prev; k++) {
+                unsigned m = (i + k) % n_prev;
+
+                if (prev_iovec[m].iov_len == iovec->iov_len &&
+                    memcmp_safe(prev_iovec[m].iov_base, iovec->iov_base, iovec->iov_len) == 0) {
+                        *ret = prev_items[m];
+                        return true;
+                }
+        }
+
+        return false;
+}
+
+static int journal_file_append_entry_items(
                 JournalFile *f,
                 const dual_timestamp *ts,
                 const sd_id128_t *boot_id,
-                const struct iovec iovec[], unsigned n_iovec,
+                const struct iovec iovec[], const uint64_t hashes[], unsigned n_iovec,
+                const struct iovec prev_iovec[], const EntryItem prev_items[], unsigned n_prev,
+                EntryItem items[],
                 uint64_t *seqnum,
                 Object **ret, uint64_t *ret_offset) {
 
-        EntryItem *items;
-        int r;
+        EntryItem *sorted;
         uint64_t xor_hash = 0;
-        struct dual_timestamp _ts;
+        int r;
 
         assert(f);
         assert(f->header);
+        assert(ts);
         assert(iovec || n_iovec == 0);
+        assert(prev_items || n_prev == 0);
+        assert(items);
 
-        if (ts) {
-                if (!VALID_REALTIME(ts->realtime))
-                        return log_debug_errno(SYNTHETIC_ERRNO(EBADMSG),
-                                               "Invalid realtime timestamp %" PRIu64 ", refusing entry.",
-                                               ts->realtime);
-                if (!VALID_MONOTONIC(ts->monotonic))
-                        return log_debug_errno(SYNTHETIC_ERRNO(EBADMSG),
-                                               "Invalid monotomic timestamp %" PRIu64 ", refusing entry.",
-                                               ts->monotonic);
-        } else {
-                dual_timestamp_get(&_ts);
-                ts = &_ts;
-        }
+        /* On return, items[] contains the entry items in the order of iovec[], so that they may be passed
+         * as prev_items[] for the next entry. */
 
-#if HAVE_GCRYPT
-        r = journal_file_maybe_append_tag(f, ts->realtime);
-        if (r < 0)
-                return r;
-#endif
+        for (unsigned i = 0; i < n_iovec; i++) {
 
-        /* alloca() can't take 0, hence let's allocate at least one */
-        items = newa(EntryItem, MAX(1u, n_iovec));
+                if (!find_previous_item(iovec + i, i, prev_iovec, prev_items, n_prev, items + i)) {
+                        uint64_t p;
+                        Object *o;
 
-        for (unsigned i = 0; i < n_iovec; i++) {
-                uint64_t p;
-                Object *o;
+                        r = journal_file_append_data(f, iovec[i].iov_base, iovec[i].iov_len,
+                                                     hashes ? hashes[i] : UINT64_MAX,
+                                                     &o, &p);
+                        if (r < 0)
+                                return r;
 
-                r = journal_file_append_data(f, iovec[i].iov_base, iovec[i].iov_len, &o, &p);
-                if (r < 0)
-                        return r;
+                        items[i] = (EntryItem) {
+                                .object_offset = htole64(p),
+                                .hash = o->data.hash,
+                        };
+                }
 
                 /* When calculating the XOR hash field, we need to take special care if the "keyed-hash"
                  * journal file flag is on. We use the XOR hash field to quickly determine the identity of a
@@ -2170,17 +2850,22 @@ int journal_file_append_entry(
                 if (JOURNAL_HEADER_KEYED_HASH(f->header))
                         xor_hash ^= jenkins_hash64(iovec[i].iov_base, iovec[i].iov_len);
                 else
-                        xor_hash ^= le64toh(o->data.hash);
-
-                items[i].object_offset = htole64(p);
-                items[i].hash = o->data.hash;
+                        xor_hash ^= le64toh(items[i].hash);
         }
 
+        /* alloca() can't take 0, hence let's allocate at least one */
+        sorted = newa(EntryItem, MAX(1u, n_iovec));
+        memcpy_safe(sorted, items, n_iovec * sizeof(EntryItem));
+
         /* Order by the position on disk, in order to improve seek
          * times for rotating media. */
-        typesafe_qsort(items, n_iovec, entry_item_cmp);
+        typesafe_qsort(sorted, n_iovec, entry_item_cmp);
+
+        return journal_file_append_entry_internal(f, ts, boot_id, xor_hash, sorted, n_iovec, seqnum, ret, ret_offset);
+}
 
-        r = journal_file_append_entry_internal(f, ts, boot_id, xor_hash, items, n_iovec, seqnum, ret, ret_offset);
+static int journal_file_append_finish(JournalFile *f, int r) {
+        assert(f);
 
         /* If the memory mapping triggered a SIGBUS then we return an
          * IO error and ignore the error code passed down to us, since
@@ -2195,7 +2880,156 @@ int journal_file_append_entry(
         else
                 journal_file_post_change(f);
 
-        return r;
+        return r;
+}
+
+int journal_file_append_entry_full(
+                JournalFile *f,
+                const dual_timestamp *ts,
+                const sd_id128_t *boot_id,
+                const struct iovec iovec[], const uint64_t hashes[], unsigned n_iovec,
+                uint64_t *seqnum,
+                Object **ret, uint64_t *ret_offset) {
+
+        EntryItem *items;
+        int r;
+        struct dual_timestamp _ts;
+
+        assert(f);
+        assert(f->header);
+        assert(iovec || n_iovec == 0);
+
+        if (ts) {
+                r = journal_file_validate_timestamp(ts);
+                if (r < 0)
+                        return r;
+        } else {
+                dual_timestamp_get(&_ts);
+                ts = &_ts;
+        }
+
+#if HAVE_GCRYPT
+        r = journal_file_maybe_append_tag(f, ts->realtime);
+        if (r < 0)
+                return r;
+#endif
+
+        /* alloca() can't take 0, hence let's allocate at least one */
+        items = newa(EntryItem, MAX(1u, n_iovec));
+
+        r = journal_file_append_entry_items(f, ts, boot_id, iovec, hashes, n_iovec, NULL, NULL, 0, items, seqnum, ret, ret_offset);
+
+        return journal_file_append_finish(f, r);
+}
+
+static uint64_t journal_file_entries_size_max(const JournalFileEntry entries[], size_t n_entries) {
+        uint64_t sz = 0;
+
+        /* An upper bound for the space the passed entries take up on disk, assuming none of the DATA
+         * objects exist yet and none of them compress. Entry arrays and FIELD objects are not accounted
+         * for. */
+
+        for (size_t i = 0; i < n_entries; i++) {
+                sz += ALIGN64(offsetof(Object, entry.items) + entries[i].n_iovec * sizeof(EntryItem));
+
+                for (size_t k = 0; k < entries[i].n_iovec; k++)
+                        sz += ALIGN64(offsetof(Object, data.payload) + entries[i].iovec[k].iov_len);
+        }
+
+        return sz;
+}
+
+int journal_file_append_entries(
+                JournalFile *f,
+                const dual_timestamp *ts,
+                const JournalFileEntry entries[], size_t n_entries,
+                uint64_t *seqnum,
+                size_t *ret_n_appended) {
+
+        _cleanup_free_ EntryItem *items = NULL, *prev_items = NULL;
+        const struct iovec *prev_iovec = NULL;
+        size_t n_max = 1, n_appended = 0;
+        unsigned n_prev = 0;
+        uint64_t p;
+        int r;
+
+        assert(f);
+        assert(f->header);
+        assert(ts);
+        assert(entries || n_entries == 0);
+
+        /* Appends multiple entries with the same timestamp in one go. DATA objects shared between
+         * consecutive entries are looked up only once, the file is grown only once for the whole batch, and
+         * readers are notified only once at the end. Returns the number of entries appended in
+         * ret_n_appended, also on failure, so that callers may retry the remaining ones. */
+
+        r = journal_file_validate_timestamp(ts);
+        if (r < 0)
+                goto finish;
+
+        for (size_t i = 0; i < n_entries; i++) {
+                assert(entries[i].iovec || entries[i].n_iovec == 0);
+
+                if (entries[i].n_iovec > UINT_MAX) {
+                        r = -E2BIG;
+                        goto finish;
+                }
+
+                n_max = MAX(n_max, entries[i].n_iovec);
+        }
+
+        items = new(EntryItem, n_max);
+        prev_items = new(EntryItem, n_max);
+        if (!items || !prev_items) {
+                r = -ENOMEM;
+                goto finish;
+        }
+
+#if HAVE_GCRYPT
+        r = journal_file_maybe_append_tag(f, ts->realtime);
+        if (r < 0)
+                goto finish;
+#endif
+
+        r = journal_file_set_online(f);
+        if (r < 0)
+                goto finish;
+
+        /* Grow the file once for the whole batch. This is just an optimization: if the upper bound doesn't
+         * fit, the individual appends below will figure out whether the data that is actually new does. */
+        r = journal_file_tail_end(f, &p);
+        if (r < 0)
+                goto finish;
+
+        r = journal_file_allocate(f, p, journal_file_entries_size_max(entries, n_entries));
+        if (r < 0)
+                log_debug_errno(r, "%s: Failed to preallocate space for %zu entries, ignoring: %m", f->path, n_entries);
+
+        for (size_t i = 0; i < n_entries; i++) {
+                r = journal_file_append_entry_items(
+                                f, ts, NULL,
+                                entries[i].iovec, entries[i].hashes, entries[i].n_iovec,
+                                prev_iovec, prev_items, n_prev,
+                                items,
+                                seqnum, NULL, NULL);
+                if (r < 0)
+                        goto finish;
+
+                n_appended++;
+
+                SWAP_TWO(items, prev_items);
+                prev_iovec = entries[i].iovec;
+                n_prev = entries[i].n_iovec;
+        }
+
+        r = 0;
+
+finish:
+        if (ret_n_appended)
+                *ret_n_appended = n_appended;
+
+        /* Also when nothing was appended, as a SIGBUS might have hit the very first entry */
+        return journal_file_append_finish(f, r);
 }
 
 typedef struct ChainCacheItem {
@@ -2704,15 +3538,214 @@ static int test_object_realtime(JournalFile *f, uint64_t p, uint64_t needle) {
                 return TEST_RIGHT;
 }
 
+static bool realtime_index_item_is_left(const RealtimeIndexItem *item, uint64_t needle, direction_t direction) {
+        uint64_t rt;
+
+        assert(item);
+
+        /* Returns true if the entry referenced by this index item is left of what we are looking for, i.e.
+         * is strictly older for DIRECTION_DOWN, and older or equal for DIRECTION_UP. */
+
+        rt = le64toh(item->realtime);
+        return direction == DIRECTION_DOWN ? rt < needle : rt <= needle;
+}
+
+static int realtime_index_get_entry(
+                JournalFile *f,
+                const RealtimeIndexItem *from,
+                uint64_t i,
+                Object **ret,
+                uint64_t *ret_offset) {
+
+        uint64_t a, p;
+        Object *o;
+        int r;
+
+        assert(f);
+        assert(from);
+        assert(i >= le64toh(from->entry_array_begin));
+
+        /* Looks up the i-th entry of the main entry array, starting from the entry array referenced by the
+         * index item, rather than from the beginning of the chain. */
+
+        a = le64toh(from->entry_array_offset);
+        i -= le64toh(from->entry_array_begin);
+        while (a > 0) {
+                uint64_t k;
+
+                r = journal_file_move_to_object(f, OBJECT_ENTRY_ARRAY, a, &o);
+                if (r < 0)
+                        return r;
+
+                k = journal_file_entry_array_n_items(o);
+                if (i < k) {
+                        p = le64toh(o->entry_array.items[i]);
+                        if (p <= 0)
+                                return -EBADMSG;
+
+                        r = journal_file_move_to_object(f, OBJECT_ENTRY, p, &o);
+                        if (r < 0)
+                                return r;
+
+                        if (ret)
+                                *ret = o;
+                        if (ret_offset)
+                                *ret_offset = p;
+
+                        return 0;
+                }
+
+                i -= k;
+                a = le64toh(o->entry_array.next_entry_array_offset);
+        }
+
+        return -EBADMSG;
+}
+
+static int move_to_entry_by_realtime_index(
+                JournalFile *f,
+                uint64_t realtime,
+                direction_t direction,
+                Object **ret,
+                uint64_t *ret_offset) {
+
+        RealtimeIndexItem from = {}, to = {};
+        bool have_from = false, have_to = false;
+        uint64_t n_entries, n_index, a, i = 0, left, right;
+        Object *o;
+        int r;
+
+        assert(f);
+        assert(f->header);
+
+        /* Finds the entry the same way generic_array_bisect() with test_object_realtime() would, but
+         * first bisects the realtime index to find the two index items around the needle, and then only
+         * the entries between them. The index is small and only touched in a couple of places, and the
+         * entries between two index items are close to each other, hence this needs much fewer random
+         * reads than bisecting the whole entry array. Returns -ESRCH if the index cannot tell. */
+
+        n_entries = le64toh(READ_NOW(f->header->n_entries));
+        n_index = le64toh(READ_NOW(f->header->n_realtime_index));
+
+        a = le64toh(f->header->realtime_index_offset);
+        while (a > 0 && i < n_index) {
+                uint64_t k;
+
+                r = journal_file_move_to_object(f, OBJECT_REALTIME_INDEX, a, &o);
+                if (r < 0)
+                        return r;
+
+                k = MIN(journal_file_realtime_index_n_items(o), n_index - i);
+                if (k <= 0)
+                        return -EBADMSG;
+
+                if (!realtime_index_item_is_left(o->realtime_index.items + k - 1, realtime, direction)) {
+                        left = 0;
+                        right = k - 1;
+                        while (left < right) {
+                                uint64_t m = left + (right - left) / 2;
+
+                                if (realtime_index_item_is_left(o->realtime_index.items + m, realtime, direction))
+                                        left = m + 1;
+                                else
+                                        right = m;
+                        }
+
+                        to = o->realtime_index.items[left];
+                        have_to = true;
+
+                        if (left > 0) {
+                                from = o->realtime_index.items[left - 1];
+                                have_from = true;
+                        }
+
+                        break;
+                }
+
+                from = o->realtime_index.items[k - 1];
+                have_from = true;
+
+                i += k;
+                a = le64toh(o->realtime_index.next_realtime_index_offset);
+        }
+
+        /* The needle is at or before the first indexed entry, the regular bisection will find that quickly */
+        if (!have_from)
+                return -ESRCH;
+
+        if (le64toh(from.entry_index) >= n_entries ||
+            le64toh(from.entry_array_begin) > le64toh(from.entry_index) ||
+            (have_to && le64toh(to.entry_index) <= le64toh(from.entry_index)))
+                return -EBADMSG;
+
+        /* Everything up to and including 'from' is left of the needle, and, if we have it, everything
+         * starting with 'to' is right of it. */
+        if (direction == DIRECTION_DOWN) {
+                /* Look for the first entry that is not older than the needle */
+                left = le64toh(from.entry_index) + 1;
+                right = have_to ? le64toh(to.entry_index) : n_entries;
+
+                while (left < right) {
+                        uint64_t m = left + (right - left) / 2;
+
+                        r = realtime_index_get_entry(f, &from, m, &o, NULL);
+                        if (r < 0)
+                                return r;
+
+                        if (le64toh(o->entry.realtime) < realtime)
+                                left = m + 1;
+                        else
+                                right = m;
+                }
+
+                if (left >= n_entries)
+                        return 0;
+        } else {
+                /* Look for the last entry that is not newer than the needle */
+                left = le64toh(from.entry_index);
+                right = have_to ? le64toh(to.entry_index) - 1 : n_entries - 1;
+
+                while (left < right) {
+                        uint64_t m = left + (right - left + 1) / 2;
+
+                        r = realtime_index_get_entry(f, &from, m, &o, NULL);
+                        if (r < 0)
+                                return r;
+
+                        if (le64toh(o->entry.realtime) <= realtime)
+                                left = m;
+                        else
+                                right = m - 1;
+                }
+        }
+
+        r = realtime_index_get_entry(f, &from, left, ret, ret_offset);
+        if (r < 0)
+                return r;
+
+        return 1;
+}
+
 int journal_file_move_to_entry_by_realtime(
                 JournalFile *f,
                 uint64_t realtime,
                 direction_t direction,
                 Object **ret,
                 uint64_t *ret_offset) {
+        int r;
+
         assert(f);
         assert(f->header);
 
+        if (JOURNAL_HEADER_REALTIME_INDEX(f->header)) {
+                r = move_to_entry_by_realtime_index(f, realtime, direction, ret, ret_offset);
+                if (r >= 0)
+                        return r;
+                if (r != -ESRCH)
+                        log_debug_errno(r, "Failed to look up realtime timestamp in realtime index of %s, falling back to bisection: %m",
+                                        f->path);
+        }
+
         return generic_array_bisect(
                         f,
                         le64toh(f->header->entry_array_offset),
@@ -3249,6 +4282,14 @@ void journal_file_dump(JournalFile *f) {
                                le64toh(o->tag.epoch));
                         break;
 
+                case OBJECT_REALTIME_INDEX:
+                        printf("Type: OBJECT_REALTIME_INDEX\n");
+                        break;
+
+                case OBJECT_DICTIONARY:
+                        printf("Type: OBJECT_DICTIONARY\n");
+                        break;
+
                 default:
                         printf("Type: unknown (%i)\n", o->object.type);
                         break;
@@ -3284,8 +4325,8 @@ void journal_file_print_header(JournalFile *f) {
                "Boot ID: %s\n"
                "Sequential number ID: %s\n"
                "State: %s\n"
-               "Compatible flags:%s%s\n"
-               "Incompatible flags:%s%s%s%s%s\n"
+               "Compatible flags:%s%s%s\n"
+               "Incompatible flags:%s%s%s%s%s%s\n"
                "Header size: %"PRIu64"\n"
                "Arena size: %"PRIu64"\n"
                "Data hash table size: %"PRIu64"\n"
@@ -3307,10 +4348,12 @@ void journal_file_print_header(JournalFile *f) {
                f->header->state == STATE_ONLINE ? "ONLINE" :
                f->header->state == STATE_ARCHIVED ? "ARCHIVED" : "UNKNOWN",
                JOURNAL_HEADER_SEALED(f->header) ? " SEALED" : "",
+               JOURNAL_HEADER_REALTIME_INDEX(f->header) ? " REALTIME-INDEX" : "",
                (le32toh(f->header->compatible_flags) & ~HEADER_COMPATIBLE_ANY) ? " ???" : "",
                JOURNAL_HEADER_COMPRESSED_XZ(f->header) ? " COMPRESSED-XZ" : "",
                JOURNAL_HEADER_COMPRESSED_LZ4(f->header) ? " COMPRESSED-LZ4" : "",
                JOURNAL_HEADER_COMPRESSED_ZSTD(f->header) ? " COMPRESSED-ZSTD" : "",
+               JOURNAL_HEADER_ZSTD_DICTIONARY(f->header) ? " ZSTD-DICTIONARY" : "",
                JOURNAL_HEADER_KEYED_HASH(f->header) ? " KEYED-HASH" : "",
                (le32toh(f->header->incompatible_flags) & ~HEADER_INCOMPATIBLE_ANY) ? " ???" : "",
                le64toh(f->header->header_size),
@@ -3353,6 +4396,14 @@ void journal_file_print_header(JournalFile *f) {
                 printf("Deepest data hash chain: %" PRIu64"\n",
                        f->header->data_hash_chain_depth);
 
+        if (JOURNAL_HEADER_REALTIME_INDEX(f->header))
+                printf("Realtime index items: %" PRIu64"\n",
+                       le64toh(f->header->n_realtime_index));
+
+        if (JOURNAL_HEADER_ZSTD_DICTIONARY(f->header))
+                printf("Compression dictionary: %s\n",
+                       le64toh(f->header->dictionary_offset) != 0 ? "yes" : "not yet");
+
         if (fstat(f->fd, &st) >= 0)
                 printf("Disk usage: %s\n", FORMAT_BYTES((uint64_t) st.st_blocks * 512ULL));
 }
@@ -3392,7 +4443,7 @@ static int journal_file_warn_btrfs(JournalFile *f) {
         return 1;
 }
 
-int journal_file_open(
+static int journal_file_open_internal(
                 int fd,
                 const char *fname,
                 int flags,
@@ -3404,6 +4455,7 @@ int journal_file_open(
                 MMapCache *mmap_cache,
                 Set *deferred_closes,
                 JournalFile *template,
+                bool spare,
                 JournalFile **ret) {
 
         bool newly_created = false;
@@ -3430,6 +4482,7 @@ int journal_file_open(
 
                 .flags = flags,
                 .writable = (flags & O_ACCMODE) != O_RDONLY,
+                .spare = spare,
 
 #if HAVE_ZSTD
                 .compress_zstd = compress,
@@ -3456,6 +4509,41 @@ int journal_file_open(
         } else
                 f->keyed_hash = r;
 
+        /* Old versions can read files with a realtime index, but cannot write to them and refuse to verify
+         * them, hence unlike the above it has to be asked for explicitly */
+        r = getenv_bool("SYSTEMD_JOURNAL_REALTIME_INDEX");
+        if (r < 0) {
+                if (r != -ENXIO)
+                        log_debug_errno(r, "Failed to parse $SYSTEMD_JOURNAL_REALTIME_INDEX environment variable, ignoring.");
+                f->realtime_index = false;
+        } else
+                f->realtime_index = r;
+
+        /* Training a zstd dictionary for the data objects makes files unreadable for old versions, hence
+         * this has to be asked for explicitly too */
+        r = getenv_bool("SYSTEMD_JOURNAL_COMPRESS_DICTIONARY");
+        if (r < 0) {
+                if (r != -ENXIO)
+                        log_debug_errno(r, "Failed to parse $SYSTEMD_JOURNAL_COMPRESS_DICTIONARY environment variable, ignoring.");
+                f->zstd_dictionary = false;
+        } else
+                f->zstd_dictionary = f->compress_zstd && r;
+
+        /* The in-memory cache of data object offsets is only useful for writers, which look up the same
+         * data over and over again. It may be turned off for comparison. */
+        if (f->writable) {
+                r = getenv_bool("SYSTEMD_JOURNAL_DATA_CACHE");
+                if (r < 0 && r != -ENXIO)
+                        log_debug_errno(r, "Failed to parse $SYSTEMD_JOURNAL_DATA_CACHE environment variable, ignoring.");
+                if (r != 0) {
+                        f->data_cache = new0(DataCacheItem, DATA_CACHE_SLOTS);
+                        if (!f->data_cache) {
+                                r = -ENOMEM;
+                                goto fail;
+                        }
+                }
+        }
+
         if (DEBUG_LOGGING) {
                 static int last_seal = -1, last_compress = -1, last_keyed_hash = -1;
                 static uint64_t last_bytes = UINT64_MAX;
@@ -3634,6 +4722,17 @@ int journal_file_open(
                 if (r < 0)
                         goto fail;
 #endif
+
+#if HAVE_ZSTD
+                if (template) {
+                        /* Reuse the dictionary of the file we're replacing, rather than collecting samples
+                         * all over again. */
+                        r = journal_file_inherit_dictionary(f, template);
+                        if (r < 0)
+                                log_debug_errno(r, "Failed to copy compression dictionary from %s, ignoring: %m",
+                                                template->path);
+                }
+#endif
         }
 
         if (mmap_cache_got_sigbus(f->mmap, f->cache_fd)) {
@@ -3666,19 +4765,77 @@ fail:
         return r;
 }
 
-int journal_file_archive(JournalFile *f) {
-        _cleanup_free_ char *p = NULL;
+int journal_file_open(
+                int fd,
+                const char *fname,
+                int flags,
+                mode_t mode,
+                bool compress,
+                uint64_t compress_threshold_bytes,
+                bool seal,
+                JournalMetrics *metrics,
+                MMapCache *mmap_cache,
+                Set *deferred_closes,
+                JournalFile *template,
+                JournalFile **ret) {
 
-        assert(f);
+        return journal_file_open_internal(fd, fname, flags, mode, compress, compress_threshold_bytes, seal,
+                                          metrics, mmap_cache, deferred_closes, template, false, ret);
+}
 
-        if (!f->writable)
+int journal_file_open_spare(
+                JournalFile *template,
+                bool compress,
+                uint64_t compress_threshold_bytes,
+                bool seal,
+                JournalFile **ret) {
+
+        _cleanup_free_ char *tmp = NULL;
+        _cleanup_close_ int fd = -1;
+        JournalFile *f;
+        int r;
+
+        assert(template);
+        assert(ret);
+
+        /* Prepares a file to take the place of the specified one when that is rotated: the header is
+         * initialized, the hash tables are allocated and all of it is synced to disk, but the file isn't
+         * linked into the directory yet, so that nobody sees it. See journal_file_rotate_to_spare(). */
+
+        if (!template->writable)
                 return -EINVAL;
 
-        /* Is this a journal file that was passed to us as fd? If so, we synthesized a path name for it, and we refuse
-         * rotation, since we don't know the actual path, and couldn't rename the file hence. */
-        if (path_startswith(f->path, "/proc/self/fd"))
+        if (path_startswith(template->path, "/proc/self/fd"))
                 return -EINVAL;
 
+        fd = open_tmpfile_linkable(template->path, O_RDWR|O_CLOEXEC|O_NOCTTY, &tmp);
+        if (fd < 0)
+                return fd;
+
+        r = journal_file_open_internal(fd, template->path, template->flags, template->mode,
+                                       compress, compress_threshold_bytes, seal,
+                                       NULL, template->mmap, NULL, template, true, &f);
+        if (r < 0) {
+                if (tmp)
+                        (void) unlink(tmp);
+                return r;
+        }
+
+        TAKE_FD(fd); /* Donated to journal_file_open_internal() */
+        f->spare_path = TAKE_PTR(tmp);
+
+        *ret = f;
+        return 0;
+}
+
+int journal_file_archived_path(JournalFile *f, char **ret) {
+        char *p;
+
+        assert(f);
+        assert(ret);
+
+        /* Returns the path the file is renamed to when it is archived */
+
         if (!endswith(f->path, ".journal"))
                 return -EINVAL;
 
@@ -3689,19 +4846,38 @@ int journal_file_archive(JournalFile *f) {
                      le64toh(f->header->head_entry_realtime)) < 0)
                 return -ENOMEM;
 
+        *ret = p;
+        return 0;
+}
+
+int journal_file_archive(JournalFile *f) {
+        _cleanup_free_ char *p = NULL;
+        int r;
+
+        assert(f);
+
+        if (!f->writable)
+                return -EINVAL;
+
+        /* Is this a journal file that was passed to us as fd? If so, we synthesized a path name for it, and we refuse
+         * rotation, since we don't know the actual path, and couldn't rename the file hence. */
+        if (path_startswith(f->path, "/proc/self/fd"))
+                return -EINVAL;
+
+        r = journal_file_archived_path(f, &p);
+        if (r < 0)
+                return r;
+
         /* Try to rename the file to the archived version. If the file already was deleted, we'll get ENOENT, let's
          * ignore that case. */
         if (rename(f->path, p) < 0 && errno != ENOENT)
                 return -errno;
 
-        /* Sync the rename to disk */
-        (void) fsync_directory_of_file(f->fd);
-
         /* Set as archive so offlining commits w/state=STATE_ARCHIVED. Previously we would set old_file->header->state
          * to STATE_ARCHIVED directly here, but journal_file_set_offline() short-circuits when state != STATE_ONLINE,
          * which would result in the rotated journal never getting fsync() called before closing.  Now we simply queue
          * the archive state by setting an archive bit, leaving the state as STATE_ONLINE so proper offlining
-         * occurs. */
+         * occurs. The rename is synced to disk as part of that, too, so that it doesn't hold up the caller. */
         f->archive = true;
 
         /* Currently, btrfs is not very good with out write patterns and fragments heavily. Let's defrag our journal
@@ -3770,6 +4946,94 @@ int journal_file_rotate(
         return r;
 }
 
+static int journal_file_link_spare(JournalFile *f, JournalFile *template) {
+        int r;
+
+        assert(f);
+        assert(f->spare);
+        assert(template);
+
+        /* The spare may have been prepared a while ago, hence catch up with the file it replaces. It doesn't
+         * contain any entries yet, so this is safe. */
+        f->header->seqnum_id = template->header->seqnum_id;
+        f->header->tail_entry_seqnum = template->header->tail_entry_seqnum;
+
+#if HAVE_ZSTD
+        if (JOURNAL_HEADER_CONTAINS(f->header, dictionary_offset) && f->header->dictionary_offset == 0) {
+                r = journal_file_inherit_dictionary(f, template);
+                if (r < 0)
+                        log_debug_errno(r, "Failed to copy compression dictionary from %s, ignoring: %m",
+                                        template->path);
+        }
+#endif
+
+        r = link_tmpfile(f->fd, f->spare_path, f->path);
+        if (r < 0)
+                return r;
+
+        f->spare = false;
+        f->spare_path = mfree(f->spare_path);
+
+        /* The directory is synced when the file we replace is offlined */
+        (void) journal_file_fstat(f);
+
+        return 0;
+}
+
+int journal_file_rotate_to_spare(
+                JournalFile **f,
+                JournalFile **spare,
+                Set *deferred_closes) {
+
+        JournalFile *new_file = NULL;
+        int r;
+
+        assert(f);
+        assert(*f);
+        assert(spare);
+        assert(*spare);
+
+        /* Like journal_file_rotate(), but rather than creating a new file while the caller waits, puts the
+         * spare file prepared by journal_file_open_spare() in place of the archived one. If that doesn't
+         * work out, creates a new file after all, with the settings of the spare. */
+
+        if (!streq((*f)->path, (*spare)->path))
+                return -EINVAL;
+
+        r = journal_file_archive(*f);
+        if (r < 0)
+                return r;
+
+        r = journal_file_link_spare(*spare, *f);
+        if (r >= 0)
+                new_file = TAKE_PTR(*spare);
+        else {
+                log_debug_errno(r, "Failed to put spare journal file in place of %s, creating a new one: %m",
+                                (*f)->path);
+
+                r = journal_file_open(
+                                -1,
+                                (*f)->path,
+                                (*f)->flags,
+                                (*f)->mode,
+                                JOURNAL_FILE_COMPRESS(*spare),
+                                (*spare)->compress_threshold_bytes,
+                                (*spare)->seal,
+                                NULL,            /* metrics */
+                                (*f)->mmap,
+                                deferred_closes,
+                                *f,              /* template */
+                                &new_file);
+
+                *spare = journal_file_close(*spare);
+        }
+
+        journal_initiate_close(*f, deferred_closes);
+        *f = new_file;
+
+        return r;
+}
+
 int journal_file_dispose(int dir_fd, const char *fname) {
         _cleanup_free_ char *p = NULL;
         _cleanup_close_ int fd = -1;
@@ -3909,7 +5173,8 @@ int journal_file_copy_entry(JournalFile *from, JournalFile *to, Object *o, uint6
 #if HAVE_COMPRESSION
                         size_t rsize = 0;
 
-                        r = decompress_blob(
+                        r = journal_file_decompress_blob(
+                                        from,
                                         o->object.flags & OBJECT_COMPRESSION_MASK,
                                         o->data.payload, l,
                                         &from->compress_buffer, &rsize,
@@ -3925,7 +5190,7 @@ int journal_file_copy_entry(JournalFile *from, JournalFile *to, Object *o, uint6
                 } else
                         data = o->data.payload;
 
-                r = journal_file_append_data(to, data, l, &u, &h);
+                r = journal_file_append_data(to, data, l, UINT64_MAX, &u, &h);
                 if (r < 0)
                         return r;
 
@@ -4112,9 +5377,11 @@ bool journal_file_rotate_suggested(JournalFile *f, usec_t max_file_usec) {
         assert(f);
         assert(f->header);
 
-        /* If we gained new header fields we gained new features,
-         * hence suggest a rotation */
-        if (le64toh(f->header->header_size) < sizeof(Header)) {
+        /* If we gained new header fields we gained new features, hence suggest a rotation. The fields
+         * added after data_hash_chain_depth and field_hash_chain_depth are only used by opt-in features
+         * though, which are only enabled for newly created files anyway. Rotating every existing file
+         * just for them would be pointless. */
+        if (le64toh(f->header->header_size) < offsetof(Header, realtime_index_offset)) {
                 log_debug("%s uses an outdated header, suggesting rotation.", f->path);
                 return true;
         }
@@ -11,6 +11,7 @@
 #include "sd-event.h"
 #include "sd-id128.h"
 
+#include "compress.h"
 #include "hashmap.h"
 #include "journal-def.h"
 #include "mmap-cache.h"
@@ -56,6 +57,16 @@ typedef enum OfflineState {
         OFFLINE_DONE
 } OfflineState;
 
+/* Slots of the in-memory cache of recently looked up data objects, in sets of DATA_CACHE_WAYS slots each
+ * (i.e. one cache line). Both must be powers of two. */
+#define DATA_CACHE_SLOTS 4096U
+#define DATA_CACHE_WAYS 4U
+
+typedef struct DataCacheItem {
+        uint64_t hash;
+        uint64_t offset; /* 0 if unused */
+} DataCacheItem;
+
 typedef struct JournalFile {
         int fd;
         MMapFileDescriptor *cache_fd;
@@ -71,13 +82,17 @@ typedef struct JournalFile {
         bool defrag_on_close:1;
         bool close_fd:1;
         bool archive:1;
+        bool spare:1;
         bool keyed_hash:1;
+        bool realtime_index:1;
+        bool zstd_dictionary:1;
 
         direction_t last_direction;
         LocationType location_type;
         uint64_t last_n_entries;
 
         char *path;
+        char *spare_path; /* where a spare file lives until it is linked, unless it was created with O_TMPFILE */
         struct stat last_stat;
         usec_t last_stat_usec;
 
@@ -100,6 +115,11 @@ typedef struct JournalFile {
 
         OrderedHashmap *chain_cache;
 
+        /* Only allocated for writable files, maps data hashes to object offsets */
+        DataCacheItem *data_cache;
+        uint64_t n_data_cache_hits;
+        uint64_t n_data_cache_misses;
+
         pthread_t offline_thread;
         volatile OfflineState offline_state;
 
@@ -110,6 +130,25 @@ typedef struct JournalFile {
         void *compress_buffer;
 #endif
 
+#if HAVE_ZSTD
+        CompressDictionary *compress_dictionary;
+
+        /* Payloads collected for training the dictionary, while the file doesn't have one yet */
+        void *dictionary_samples;
+        size_t dictionary_samples_size;
+        size_t *dictionary_sample_sizes;
+        size_t n_dictionary_samples;
+
+        /* Training happens in a thread, which leaves its result here, and sets dictionary_trained when
+         * done. The samples must not be touched while it runs. */
+        pthread_t dictionary_thread;
+        bool dictionary_thread_running;
+        bool dictionary_trained;
+        void *trained_dictionary;
+        size_t trained_dictionary_size;
+        int trained_dictionary_result;
+#endif
+
 #if HAVE_GCRYPT
         gcry_md_hd_t hmac;
         bool hmac_running;
@@ -128,6 +167,12 @@ typedef struct JournalFile {
 #endif
 } JournalFile;
 
+typedef struct JournalFileEntry {
+        const struct iovec *iovec;
+        const uint64_t *hashes; /* optional, see journal_file_append_entry_full() */
+        size_t n_iovec;
+} JournalFileEntry;
+
 int journal_file_open(
                 int fd,
                 const char *fname,
@@ -189,6 +234,13 @@ static inline bool VALID_EPOCH(uint64_t u) {
 #define JOURNAL_HEADER_SEALED(h) \
         FLAGS_SET(le32toh((h)->compatible_flags), HEADER_COMPATIBLE_SEALED)
 
+#define JOURNAL_HEADER_REALTIME_INDEX(h) \
+        (FLAGS_SET(le32toh((h)->compatible_flags), HEADER_COMPATIBLE_REALTIME_INDEX) && \
+         JOURNAL_HEADER_CONTAINS(h, n_realtime_index))
+
+#define JOURNAL_HEADER_ZSTD_DICTIONARY(h) \
+        FLAGS_SET(le32toh((h)->incompatible_flags), HEADER_INCOMPATIBLE_ZSTD_DICTIONARY)
+
 #define JOURNAL_HEADER_COMPRESSED_XZ(h) \
         FLAGS_SET(le32toh((h)->incompatible_flags), HEADER_INCOMPATIBLE_COMPRESSED_XZ)
 
@@ -206,16 +258,49 @@ int journal_file_move_to_object(JournalFile *f, ObjectType type, uint64_t offset
 uint64_t journal_file_entry_n_items(Object *o) _pure_;
 uint64_t journal_file_entry_array_n_items(Object *o) _pure_;
 uint64_t journal_file_hash_table_n_items(Object *o) _pure_;
+uint64_t journal_file_realtime_index_n_items(Object *o) _pure_;
+
+int journal_file_decompress_blob(
+                JournalFile *f,
+                int compression,
+                const void *src, uint64_t src_size,
+                void **dst, size_t *dst_size, size_t dst_max);
+int journal_file_decompress_startswith(
+                JournalFile *f,
+                int compression,
+                const void *src, uint64_t src_size,
+                void **buffer,
+                const void *prefix, size_t prefix_len,
+                uint8_t extra);
 
 int journal_file_append_object(JournalFile *f, ObjectType type, uint64_t size, Object **ret, uint64_t *offset);
-int journal_file_append_entry(
+
+/* If hashes[] is passed, it contains the hash of each item of iovec[], as calculated by
+ * journal_file_hash_data() for this very file, or UINT64_MAX for items whose hash is not known. */
+int journal_file_append_entry_full(
                 JournalFile *f,
                 const dual_timestamp *ts,
                 const sd_id128_t *boot_id,
-                const struct iovec iovec[], unsigned n_iovec,
+                const struct iovec iovec[], const uint64_t hashes[], unsigned n_iovec,
                 uint64_t *seqno,
                 Object **ret,
                 uint64_t *offset);
+static inline int journal_file_append_entry(
+                JournalFile *f,
+                const dual_timestamp *ts,
+                const sd_id128_t *boot_id,
+                const struct iovec iovec[], unsigned n_iovec,
+                uint64_t *seqno,
+                Object **ret,
+                uint64_t *offset) {
+        return journal_file_append_entry_full(f, ts, boot_id, iovec, NULL, n_iovec, seqno, ret, offset);
+}
+int journal_file_append_entries(
+                JournalFile *f,
+                const dual_timestamp *ts,
+                const JournalFileEntry entries[], size_t n_entries,
+                uint64_t *seqno,
+                size_t *ret_n_appended);
 
 int journal_file_find_data_object(JournalFile *f, const void *data, uint64_t size, Object **ret, uint64_t *offset);
 int journal_file_find_data_object_with_hash(JournalFile *f, const void *data, uint64_t size, uint64_t hash, Object **ret, uint64_t *offset);
@@ -244,9 +329,12 @@ int journal_file_copy_entry(JournalFile *from, JournalFile *to, Object *o, uint6
 void journal_file_dump(JournalFile *f);
 void journal_file_print_header(JournalFile *f);
 
+int journal_file_archived_path(JournalFile *f, char **ret);
 int journal_file_archive(JournalFile *f);
 JournalFile* journal_initiate_close(JournalFile *f, Set *deferred_closes);
 int journal_file_rotate(JournalFile **f, bool compress, uint64_t compress_threshold_bytes, bool seal, Set *deferred_closes);
+int journal_file_open_spare(JournalFile *template, bool compress, uint64_t compress_threshold_bytes, bool seal, JournalFile **ret);
+int journal_file_rotate_to_spare(JournalFile **f, JournalFile **spare, Set *deferred_closes);
 
 int journal_file_dispose(int dir_fd, const char *fname);
 
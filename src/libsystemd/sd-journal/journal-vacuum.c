@@ -14,23 +14,12 @@
 #include "journal-def.h"
 #include "journal-file.h"
 #include "journal-vacuum.h"
-#include "sort-util.h"
+#include "path-util.h"
 #include "string-util.h"
 #include "time-util.h"
 #include "xattr-util.h"
 
-struct vacuum_info {
-        uint64_t usage;
-        char *filename;
-
-        uint64_t realtime;
-
-        sd_id128_t seqnum_id;
-        uint64_t seqnum;
-        bool have_seqnum;
-};
-
-static int vacuum_compare(const struct vacuum_info *a, const struct vacuum_info *b) {
+static int vacuum_compare(const JournalInventoryFile *a, const JournalInventoryFile *b) {
         int r;
 
         if (a->have_seqnum && b->have_seqnum &&
@@ -47,20 +36,21 @@ static int vacuum_compare(const struct vacuum_info *a, const struct vacuum_info
         return strcmp(a->filename, b->filename);
 }
 
+static int vacuum_compare_func(const void *a, const void *b) {
+        return vacuum_compare(a, b);
+}
+
 static void patch_realtime(
-                int fd,
-                const char *fn,
                 const struct stat *st,
-                unsigned long long *realtime) {
+                usec_t crtime,
+                usec_t *realtime) {
 
-        usec_t x, crtime = 0;
+        usec_t x;
 
         /* The timestamp was determined by the file name, but let's
          * see if the file might actually be older than the file name
          * suggested... */
 
-        assert(fd >= 0);
-        assert(fn);
         assert(st);
         assert(realtime);
 
@@ -76,27 +66,102 @@ static void patch_realtime(
         if (x > 0 && x != USEC_INFINITY && x < *realtime)
                 *realtime = x;
 
-        /* Let's read the original creation time, if possible. Ideally
-         * we'd just query the creation time the FS might provide, but
-         * unfortunately there's currently no sane API to query
-         * it. Hence let's implement this manually... */
+        /* Let's use the original creation time too, if we know it. Ideally we'd just query the creation time
+         * the FS might provide, but unfortunately there's currently no sane API to query it. Hence the caller
+         * reads what we store in an xattr manually... */
+
+        if (crtime < *realtime)
+                *realtime = crtime;
+}
+
+static int parse_filename(const char *name, JournalInventoryFile *f) {
+        unsigned long long seqnum, realtime, tmp;
+        char id[SD_ID128_STRING_MAX];
+        size_t q;
+
+        assert(name);
+        assert(f);
+
+        /* Returns > 0 for archived and corrupted files, which may be vacuumed, 0 for other journal files,
+         * and -EINVAL for files that aren't journal files. */
+
+        q = strlen(name);
+
+        if (endswith(name, ".journal")) {
+
+                /* Vacuum archived files. Active files are
+                 * left around */
+
+                if (q < 1 + 32 + 1 + 16 + 1 + 16 + 8)
+                        return 0;
+
+                if (name[q-8-16-1] != '-' ||
+                    name[q-8-16-1-16-1] != '-' ||
+                    name[q-8-16-1-16-1-32-1] != '@')
+                        return 0;
 
-        if (fd_getcrtime_at(fd, fn, &crtime, 0) >= 0) {
-                if (crtime < *realtime)
-                        *realtime = crtime;
+                memcpy(id, name + q-8-16-1-16-1-32, 32);
+                id[32] = 0;
+                if (sd_id128_from_string(id, &f->seqnum_id) < 0)
+                        return 0;
+
+                if (sscanf(name + q-8-16-1-16, "%16llx-%16llx.journal", &seqnum, &realtime) != 2)
+                        return 0;
+
+                f->seqnum = seqnum;
+                f->realtime = realtime;
+                f->have_seqnum = true;
+                return 1;
         }
+
+        if (endswith(name, ".journal~")) {
+
+                /* Vacuum corrupted files */
+
+                if (q < 1 + 16 + 1 + 16 + 8 + 1)
+                        return 0;
+
+                if (name[q-1-8-16-1] != '-' ||
+                    name[q-1-8-16-1-16-1] != '@')
+                        return 0;
+
+                if (sscanf(name + q-1-8-16-1-16, "%16llx-%16llx.journal~", &realtime, &tmp) != 2)
+                        return 0;
+
+                f->seqnum_id = SD_ID128_NULL;
+                f->realtime = realtime;
+                f->have_seqnum = false;
+                return 1;
+        }
+
+        return -EINVAL;
+}
+
+static void inventory_file_read_header(JournalInventoryFile *f, const Header *h) {
+        assert(f);
+        assert(h);
+
+        f->empty = le64toh(h->n_entries) <= 0;
+        f->boot_id = h->boot_id;
+        f->head_seqnum = le64toh(h->head_entry_seqnum);
+        f->tail_seqnum = le64toh(h->tail_entry_seqnum);
+        f->head_realtime = le64toh(h->head_entry_realtime);
+        f->tail_realtime = le64toh(h->tail_entry_realtime);
 }
 
-static int journal_file_empty(int dir_fd, const char *name) {
+static int inventory_file_load_header(int dir_fd, JournalInventoryFile *f) {
         _cleanup_close_ int fd = -1;
         struct stat st;
-        le64_t n_entries;
+        Header h;
         ssize_t n;
 
-        fd = openat(dir_fd, name, O_RDONLY|O_CLOEXEC|O_NOFOLLOW|O_NONBLOCK|O_NOATIME);
+        assert(dir_fd >= 0);
+        assert(f);
+
+        fd = openat(dir_fd, f->filename, O_RDONLY|O_CLOEXEC|O_NOFOLLOW|O_NONBLOCK|O_NOATIME);
         if (fd < 0) {
                 /* Maybe failed due to O_NOATIME and lack of privileges? */
-                fd = openat(dir_fd, name, O_RDONLY|O_CLOEXEC|O_NOFOLLOW|O_NONBLOCK);
+                fd = openat(dir_fd, f->filename, O_RDONLY|O_CLOEXEC|O_NOFOLLOW|O_NONBLOCK);
                 if (fd < 0)
                         return -errno;
         }
@@ -104,56 +169,174 @@ static int journal_file_empty(int dir_fd, const char *name) {
         if (fstat(fd, &st) < 0)
                 return -errno;
 
-        /* If an offline file doesn't even have a header we consider it empty */
-        if (st.st_size < (off_t) sizeof(Header))
-                return 1;
+        /* If an offline file doesn't even have a header we consider it empty. We only need the fields every
+         * version of the format has. */
+        if (st.st_size < (off_t) offsetof(Header, n_data)) {
+                f->empty = true;
+                return 0;
+        }
 
-        /* If the number of entries is empty, we consider it empty, too */
-        n = pread(fd, &n_entries, sizeof(n_entries), offsetof(Header, n_entries));
+        n = pread(fd, &h, offsetof(Header, n_data), 0);
         if (n < 0)
                 return -errno;
-        if (n != sizeof(n_entries))
+        if (n != offsetof(Header, n_data))
                 return -EIO;
 
-        return le64toh(n_entries) <= 0;
+        /* If the number of entries is empty, we consider it empty, too */
+        inventory_file_read_header(f, &h);
+        return 0;
 }
 
-int journal_directory_vacuum(
-                const char *directory,
-                uint64_t max_use,
-                uint64_t n_max_files,
-                usec_t max_retention_usec,
-                usec_t *oldest_usec,
-                bool verbose) {
+JournalInventoryFile* journal_inventory_file_free(JournalInventoryFile *file) {
+        if (!file)
+                return NULL;
 
-        uint64_t sum = 0, freed = 0, n_active_files = 0;
-        size_t n_list = 0, i;
-        _cleanup_closedir_ DIR *d = NULL;
-        struct vacuum_info *list = NULL;
-        usec_t retention_limit = 0;
-        struct dirent *de;
+        free(file->filename);
+        free(file->active_filename);
+        return mfree(file);
+}
+
+void journal_inventory_file_free_many(JournalInventoryFile **files, size_t n_files) {
+        for (size_t k = 0; k < n_files; k++)
+                journal_inventory_file_free(files[k]);
+
+        free(files);
+}
+
+static JournalInventoryFile* inventory_file_new(void) {
+        JournalInventoryFile *f;
+
+        f = new(JournalInventoryFile, 1);
+        if (!f)
+                return NULL;
+
+        *f = (JournalInventoryFile) {
+                .prioq_idx = PRIOQ_IDX_NULL,
+        };
+
+        return f;
+}
+
+static void inventory_remove(JournalInventory *i, JournalInventoryFile *f) {
+        assert(i);
+        assert(f);
+
+        assert_se(hashmap_remove(i->files, f->filename) == f);
+
+        if (!f->archived) {
+                LIST_REMOVE(files, i->active, f);
+                i->n_active--;
+        } else if (f->empty)
+                LIST_REMOVE(files, i->empty, f);
+        else {
+                assert_se(prioq_remove(i->archived, f, &f->prioq_idx) > 0);
+                i->usage_archived -= f->usage;
+        }
+
+        i->usage -= f->usage;
+}
+
+static int inventory_put(JournalInventory *i, JournalInventoryFile *f) {
+        JournalInventoryFile *existing;
         int r;
 
+        assert(i);
+        assert(f);
+        assert(f->filename);
+
+        existing = hashmap_get(i->files, f->filename);
+        if (existing) {
+                inventory_remove(i, existing);
+                journal_inventory_file_free(existing);
+        }
+
+        r = hashmap_ensure_put(&i->files, &string_hash_ops, f->filename, f);
+        if (r < 0)
+                return r;
+
+        if (f->archived && !f->empty) {
+                r = prioq_ensure_allocated(&i->archived, vacuum_compare_func);
+                if (r >= 0)
+                        r = prioq_put(i->archived, f, &f->prioq_idx);
+                if (r < 0) {
+                        (void) hashmap_remove(i->files, f->filename);
+                        return r;
+                }
+
+                i->usage_archived += f->usage;
+        } else if (f->archived)
+                LIST_PREPEND(files, i->empty, f);
+        else {
+                LIST_PREPEND(files, i->active, f);
+                i->n_active++;
+        }
+
+        i->usage += f->usage;
+        return 0;
+}
+
+static void inventory_flush(JournalInventory *i) {
+        JournalInventoryFile *f;
+
+        assert(i);
+
+        while ((f = hashmap_first(i->files))) {
+                inventory_remove(i, f);
+                journal_inventory_file_free(f);
+        }
+}
+
+int journal_inventory_new(const char *directory, JournalInventory **ret) {
+        _cleanup_(journal_inventory_freep) JournalInventory *i = NULL;
+
         assert(directory);
+        assert(ret);
 
-        if (max_use <= 0 && max_retention_usec <= 0 && n_max_files <= 0)
-                return 0;
+        i = new0(JournalInventory, 1);
+        if (!i)
+                return -ENOMEM;
 
-        if (max_retention_usec > 0)
-                retention_limit = usec_sub_unsigned(now(CLOCK_REALTIME), max_retention_usec);
+        i->directory = strdup(directory);
+        if (!i->directory)
+                return -ENOMEM;
+
+        i->need_scan = true;
+
+        *ret = TAKE_PTR(i);
+        return 0;
+}
+
+JournalInventory* journal_inventory_free(JournalInventory *i) {
+        if (!i)
+                return NULL;
+
+        inventory_flush(i);
+
+        hashmap_free(i->files);
+        prioq_free(i->archived);
+        free(i->directory);
 
-        d = opendir(directory);
+        return mfree(i);
+}
+
+int journal_inventory_scan(JournalInventory *i) {
+        _cleanup_closedir_ DIR *d = NULL;
+        struct dirent *de;
+        int r;
+
+        assert(i);
+
+        /* Forgets everything we know and enumerates the directory again */
+
+        d = opendir(i->directory);
         if (!d)
                 return -errno;
 
-        FOREACH_DIRENT_ALL(de, d, r = -errno; goto finish) {
-                unsigned long long seqnum = 0, realtime;
-                _cleanup_free_ char *p = NULL;
-                sd_id128_t seqnum_id;
-                bool have_seqnum;
-                uint64_t size;
+        inventory_flush(i);
+
+        FOREACH_DIRENT_ALL(de, d, return -errno) {
+                _cleanup_(journal_inventory_file_freep) JournalInventoryFile *f = NULL;
                 struct stat st;
-                size_t q;
 
                 if (fstatat(dirfd(d), de->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
                         log_debug_errno(errno, "Failed to stat file %s while vacuuming, ignoring: %m", de->d_name);
@@ -163,162 +346,368 @@ int journal_directory_vacuum(
                 if (!S_ISREG(st.st_mode))
                         continue;
 
-                q = strlen(de->d_name);
+                f = inventory_file_new();
+                if (!f)
+                        return -ENOMEM;
 
-                if (endswith(de->d_name, ".journal")) {
+                r = parse_filename(de->d_name, f);
+                if (r < 0) {
+                        /* We do not vacuum unknown files! */
+                        log_debug("Not vacuuming unknown file %s.", de->d_name);
+                        continue;
+                }
 
-                        /* Vacuum archived files. Active files are
-                         * left around */
+                f->archived = r > 0;
+                f->usage = 512UL * (uint64_t) st.st_blocks;
 
-                        if (q < 1 + 32 + 1 + 16 + 1 + 16 + 8) {
-                                n_active_files++;
-                                continue;
-                        }
+                f->filename = strdup(de->d_name);
+                if (!f->filename)
+                        return -ENOMEM;
+
+                if (f->archived) {
+                        usec_t crtime;
 
-                        if (de->d_name[q-8-16-1] != '-' ||
-                            de->d_name[q-8-16-1-16-1] != '-' ||
-                            de->d_name[q-8-16-1-16-1-32-1] != '@') {
-                                n_active_files++;
+                        r = inventory_file_load_header(dirfd(d), f);
+                        if (r < 0) {
+                                log_debug_errno(r, "Failed check if %s is empty, ignoring: %m", de->d_name);
                                 continue;
                         }
 
-                        p = strdup(de->d_name);
-                        if (!p) {
-                                r = -ENOMEM;
-                                goto finish;
-                        }
+                        if (fd_getcrtime_at(dirfd(d), de->d_name, &crtime, 0) < 0)
+                                crtime = USEC_INFINITY;
 
-                        de->d_name[q-8-16-1-16-1] = 0;
-                        if (sd_id128_from_string(de->d_name + q-8-16-1-16-1-32, &seqnum_id) < 0) {
-                                n_active_files++;
-                                continue;
-                        }
+                        patch_realtime(&st, crtime, &f->realtime);
+                }
 
-                        if (sscanf(de->d_name + q-8-16-1-16, "%16llx-%16llx.journal", &seqnum, &realtime) != 2) {
-                                n_active_files++;
-                                continue;
-                        }
+                r = inventory_put(i, f);
+                if (r < 0)
+                        return r;
 
-                        have_seqnum = true;
+                TAKE_PTR(f);
+        }
 
-                } else if (endswith(de->d_name, ".journal~")) {
-                        unsigned long long tmp;
+        i->need_scan = false;
+        i->n_scans++;
 
-                        /* seqnum_id won't be initialised before use below, so set to 0 */
-                        seqnum_id = SD_ID128_NULL;
+        return 0;
+}
 
-                        /* Vacuum corrupted files */
+int journal_inventory_ensure_scanned(JournalInventory *i) {
+        assert(i);
 
-                        if (q < 1 + 16 + 1 + 16 + 8 + 1) {
-                                n_active_files++;
-                                continue;
-                        }
+        if (!i->need_scan)
+                return 0;
 
-                        if (de->d_name[q-1-8-16-1] != '-' ||
-                            de->d_name[q-1-8-16-1-16-1] != '@') {
-                                n_active_files++;
-                                continue;
-                        }
+        return journal_inventory_scan(i);
+}
 
-                        p = strdup(de->d_name);
-                        if (!p) {
-                                r = -ENOMEM;
-                                goto finish;
-                        }
+int journal_inventory_update(JournalInventory *i, JournalFile *jf) {
+        _cleanup_(journal_inventory_file_freep) JournalInventoryFile *f = NULL;
+        JournalInventoryFile *existing;
+        const char *fn;
+        struct stat st;
+        uint64_t usage;
+        int r;
 
-                        if (sscanf(de->d_name + q-1-8-16-1-16, "%16llx-%16llx.journal~", &realtime, &tmp) != 2) {
-                                n_active_files++;
-                                continue;
-                        }
+        assert(i);
+        assert(jf);
 
-                        have_seqnum = false;
-                } else {
-                        /* We do not vacuum unknown files! */
-                        log_debug("Not vacuuming unknown file %s.", de->d_name);
-                        continue;
-                }
+        /* Records the current size of a journal file that is in use. Returns 0 if the file is not located
+         * in our directory. */
 
-                size = 512UL * (uint64_t) st.st_blocks;
+        fn = path_startswith(jf->path, i->directory);
+        if (!fn || !filename_is_valid(fn))
+                return 0;
 
-                r = journal_file_empty(dirfd(d), p);
-                if (r < 0) {
-                        log_debug_errno(r, "Failed check if %s is empty, ignoring: %m", p);
-                        continue;
+        if (fstat(jf->fd, &st) < 0)
+                return -errno;
+
+        usage = 512UL * (uint64_t) st.st_blocks;
+
+        existing = hashmap_get(i->files, fn);
+        if (existing && !existing->archived) {
+                i->usage = i->usage - existing->usage + usage;
+                existing->usage = usage;
+                return 1;
+        }
+
+        f = inventory_file_new();
+        if (!f)
+                return -ENOMEM;
+
+        f->filename = strdup(fn);
+        if (!f->filename)
+                return -ENOMEM;
+
+        f->usage = usage;
+
+        r = inventory_put(i, f);
+        if (r < 0)
+                return r;
+
+        TAKE_PTR(f);
+        return 1;
+}
+
+int journal_inventory_forget(JournalInventory *i, const char *filename) {
+        JournalInventoryFile *f;
+
+        assert(i);
+        assert(filename);
+
+        f = hashmap_get(i->files, filename);
+        if (!f)
+                return 0;
+
+        inventory_remove(i, f);
+        journal_inventory_file_free(f);
+        return 1;
+}
+
+int journal_inventory_file_new_archived(JournalInventory *i, JournalFile *jf, JournalInventoryFile **ret) {
+        _cleanup_(journal_inventory_file_freep) JournalInventoryFile *f = NULL;
+        _cleanup_free_ char *p = NULL;
+        const char *fn;
+        usec_t crtime;
+        struct stat st;
+        int r;
+
+        assert(i);
+        assert(jf);
+        assert(ret);
+
+        /* Describes a journal file the way it will look like once it is archived, so that it can be added
+         * to the inventory after journal_file_archive() succeeded. Returns 0 if the file is not located in
+         * our directory. */
+
+        fn = path_startswith(jf->path, i->directory);
+        if (!fn || !filename_is_valid(fn)) {
+                *ret = NULL;
+                return 0;
+        }
+
+        r = journal_file_archived_path(jf, &p);
+        if (r < 0)
+                return r;
+
+        if (fstat(jf->fd, &st) < 0)
+                return -errno;
+
+        f = inventory_file_new();
+        if (!f)
+                return -ENOMEM;
+
+        r = path_extract_filename(p, &f->filename);
+        if (r < 0)
+                return r;
+
+        f->active_filename = strdup(fn);
+        if (!f->active_filename)
+                return -ENOMEM;
+
+        f->archived = true;
+        f->usage = 512UL * (uint64_t) st.st_blocks;
+        inventory_file_read_header(f, jf->header);
+
+        /* Like the file name does */
+        f->seqnum_id = jf->header->seqnum_id;
+        f->seqnum = f->head_seqnum;
+        f->have_seqnum = true;
+        f->realtime = f->head_realtime;
+
+        if (fd_getcrtime(jf->fd, &crtime) < 0)
+                crtime = USEC_INFINITY;
+
+        patch_realtime(&st, crtime, &f->realtime);
+
+        *ret = TAKE_PTR(f);
+        return 1;
+}
+
+int journal_inventory_add_archived(JournalInventory *i, JournalInventoryFile *file) {
+        int r;
+
+        assert(i);
+        assert(file);
+        assert(file->archived);
+
+        /* Takes possession of the file object in any case */
+
+        if (file->active_filename) {
+                (void) journal_inventory_forget(i, file->active_filename);
+                file->active_filename = mfree(file->active_filename);
+        }
+
+        r = inventory_put(i, file);
+        if (r < 0) {
+                journal_inventory_file_free(file);
+                i->need_scan = true;
+        }
+
+        return r;
+}
+
+int journal_inventory_vacuum(
+                JournalInventory *i,
+                uint64_t max_use,
+                uint64_t n_max_files,
+                usec_t max_retention_usec,
+                usec_t *oldest_usec,
+                JournalInventoryFile ***ret_victims,
+                size_t *ret_n_victims) {
+
+        JournalInventoryFile **victims = NULL, *f;
+        _cleanup_close_ int dir_fd = -1;
+        usec_t retention_limit = 0;
+        uint64_t n_scans = i->n_scans;
+        size_t n_victims = 0;
+        bool rescanned;
+        int r;
+
+        assert(i);
+        assert(ret_victims);
+        assert(ret_n_victims);
+
+        /* Picks the files to delete and removes them from the inventory. This is O(files picked), as long as
+         * the directory was not modified behind our back. The caller deletes them with
+         * journal_vacuum_delete(), possibly in a different thread. */
+
+        if (max_retention_usec > 0)
+                retention_limit = usec_sub_unsigned(now(CLOCK_REALTIME), max_retention_usec);
+
+        dir_fd = open(i->directory, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+        if (dir_fd < 0)
+                return -errno;
+
+        r = journal_inventory_ensure_scanned(i);
+        if (r < 0)
+                return r;
+        rescanned = i->n_scans > n_scans;
+
+        for (;;) {
+                struct stat st;
+
+                /* Always vacuum empty non-online files. */
+                f = i->empty;
+                if (!f) {
+                        f = prioq_peek(i->archived);
+                        if (!f)
+                                break;
+
+                        if ((max_retention_usec <= 0 || f->realtime >= retention_limit) &&
+                            (max_use <= 0 || i->usage_archived <= max_use) &&
+                            (n_max_files <= 0 || i->n_active + prioq_size(i->archived) <= n_max_files))
+                                break;
                 }
-                if (r > 0) {
-                        /* Always vacuum empty non-online files. */
 
-                        r = unlinkat_deallocate(dirfd(d), p, 0);
-                        if (r >= 0) {
+                if (fstatat(dir_fd, f->filename, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+                        if (errno == ENOENT && !rescanned) {
+                                /* Somebody else deleted files in the directory, hence what we know about the
+                                 * other files might be out of date too. Let's start over. */
+                                log_debug("%s/%s vanished, rescanning directory.", i->directory, f->filename);
 
-                                log_full(verbose ? LOG_INFO : LOG_DEBUG,
-                                         "Deleted empty archived journal %s/%s (%s).", directory, p, FORMAT_BYTES(size));
+                                journal_inventory_file_free_many(victims, n_victims);
+                                victims = NULL;
+                                n_victims = 0;
 
-                                freed += size;
-                        } else if (r != -ENOENT)
-                                log_warning_errno(r, "Failed to delete empty archived journal %s/%s: %m", directory, p);
+                                r = journal_inventory_scan(i);
+                                if (r < 0)
+                                        return r;
 
+                                rescanned = true;
+                                continue;
+                        }
+
+                        log_debug_errno(errno, "Failed to stat %s/%s, forgetting about it: %m", i->directory, f->filename);
+                        (void) journal_inventory_forget(i, f->filename);
                         continue;
                 }
 
-                patch_realtime(dirfd(d), p, &st, &realtime);
+                inventory_remove(i, f);
+                f->usage = 512UL * (uint64_t) st.st_blocks;
 
-                if (!GREEDY_REALLOC(list, n_list + 1)) {
-                        r = -ENOMEM;
-                        goto finish;
+                if (!GREEDY_REALLOC(victims, n_victims + 1)) {
+                        journal_inventory_file_free(f);
+                        journal_inventory_file_free_many(victims, n_victims);
+                        return -ENOMEM;
                 }
 
-                list[n_list++] = (struct vacuum_info) {
-                        .filename = TAKE_PTR(p),
-                        .usage = size,
-                        .seqnum = seqnum,
-                        .realtime = realtime,
-                        .seqnum_id = seqnum_id,
-                        .have_seqnum = have_seqnum,
-                };
-
-                sum += size;
+                victims[n_victims++] = f;
         }
 
-        typesafe_qsort(list, n_list, vacuum_compare);
-
-        for (i = 0; i < n_list; i++) {
-                uint64_t left;
+        f = prioq_peek(i->archived);
+        if (oldest_usec && f && (*oldest_usec == 0 || f->realtime < *oldest_usec))
+                *oldest_usec = f->realtime;
 
-                left = n_active_files + n_list - i;
+        *ret_victims = victims;
+        *ret_n_victims = n_victims;
+        return 0;
+}
 
-                if ((max_retention_usec <= 0 || list[i].realtime >= retention_limit) &&
-                    (max_use <= 0 || sum <= max_use) &&
-                    (n_max_files <= 0 || left <= n_max_files))
-                        break;
+uint64_t journal_vacuum_delete(const char *directory, JournalInventoryFile **victims, size_t n_victims, bool verbose) {
+        _cleanup_close_ int dir_fd = -1;
+        uint64_t freed = 0;
+        int r;
 
-                r = unlinkat_deallocate(dirfd(d), list[i].filename, 0);
-                if (r >= 0) {
-                        log_full(verbose ? LOG_INFO : LOG_DEBUG, "Deleted archived journal %s/%s (%s).",
-                                 directory, list[i].filename, FORMAT_BYTES(list[i].usage));
-                        freed += list[i].usage;
+        assert(directory);
+        assert(victims || n_victims == 0);
 
-                        if (list[i].usage < sum)
-                                sum -= list[i].usage;
-                        else
-                                sum = 0;
+        /* Deletes the files picked by journal_inventory_vacuum(), and frees them. Returns how much space was
+         * freed. */
 
-                } else if (r != -ENOENT)
-                        log_warning_errno(r, "Failed to delete archived journal %s/%s: %m", directory, list[i].filename);
+        if (n_victims > 0) {
+                dir_fd = open(directory, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+                if (dir_fd < 0)
+                        log_warning_errno(errno, "Failed to open %s for vacuuming: %m", directory);
         }
 
-        if (oldest_usec && i < n_list && (*oldest_usec == 0 || list[i].realtime < *oldest_usec))
-                *oldest_usec = list[i].realtime;
+        for (size_t k = 0; dir_fd >= 0 && k < n_victims; k++) {
+                JournalInventoryFile *f = victims[k];
 
-        r = 0;
+                r = unlinkat_deallocate(dir_fd, f->filename, 0);
+                if (r >= 0) {
+                        log_full(verbose ? LOG_INFO : LOG_DEBUG, "Deleted %sarchived journal %s/%s (%s).",
+                                 f->empty ? "empty " : "", directory, f->filename, FORMAT_BYTES(f->usage));
+                        freed += f->usage;
+                } else if (r != -ENOENT)
+                        log_warning_errno(r, "Failed to delete %sarchived journal %s/%s: %m",
+                                          f->empty ? "empty " : "", directory, f->filename);
+        }
 
-finish:
-        for (i = 0; i < n_list; i++)
-                free(list[i].filename);
-        free(list);
+        journal_inventory_file_free_many(victims, n_victims);
 
         log_full(verbose ? LOG_INFO : LOG_DEBUG, "Vacuuming done, freed %s of archived journals from %s.",
                  FORMAT_BYTES(freed), directory);
 
-        return r;
+        return freed;
+}
+
+int journal_directory_vacuum(
+                const char *directory,
+                uint64_t max_use,
+                uint64_t n_max_files,
+                usec_t max_retention_usec,
+                usec_t *oldest_usec,
+                bool verbose) {
+
+        _cleanup_(journal_inventory_freep) JournalInventory *i = NULL;
+        JournalInventoryFile **victims = NULL;
+        size_t n_victims = 0;
+        int r;
+
+        assert(directory);
+
+        if (max_use <= 0 && max_retention_usec <= 0 && n_max_files <= 0)
+                return 0;
+
+        r = journal_inventory_new(directory, &i);
+        if (r < 0)
+                return r;
+
+        r = journal_inventory_vacuum(i, max_use, n_max_files, max_retention_usec, oldest_usec, &victims, &n_victims);
+        if (r < 0)
+                return r;
+
+        (void) journal_vacuum_delete(directory, victims, n_victims, verbose);
+        return 0;
 }
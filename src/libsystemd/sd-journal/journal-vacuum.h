@@ -4,6 +4,87 @@
 #include <inttypes.h>
 #include <stdbool.h>
 
+#include "sd-id128.h"
+
+#include "hashmap.h"
+#include "journal-file.h"
+#include "list.h"
+#include "prioq.h"
 #include "time-util.h"
 
+typedef struct JournalInventoryFile JournalInventoryFile;
+
+struct JournalInventoryFile {
+        char *filename;
+        uint64_t usage;
+
+        /* Archived and corrupted files may be deleted, all others are left alone */
+        bool archived;
+        bool empty;
+
+        /* The position of the file in the order of deletion, see vacuum_compare() */
+        usec_t realtime;
+        sd_id128_t seqnum_id;
+        uint64_t seqnum;
+        bool have_seqnum;
+
+        /* What the file contains, as recorded in its header */
+        sd_id128_t boot_id;
+        uint64_t head_seqnum, tail_seqnum;
+        usec_t head_realtime, tail_realtime;
+
+        /* The name of the file before it was archived */
+        char *active_filename;
+
+        unsigned prioq_idx;
+        LIST_FIELDS(JournalInventoryFile, files);
+};
+
+/* Keeps track of all journal files in a directory, so that usage can be determined and files to vacuum can be
+ * picked without enumerating the directory each time. It is populated by journal_inventory_scan() and then
+ * kept up-to-date by the owner of the directory as it archives files. */
+typedef struct JournalInventory {
+        char *directory;
+
+        Hashmap *files;                               /* filename → JournalInventoryFile, all files */
+        Prioq *archived;                              /* non-empty archived files, oldest first */
+        LIST_HEAD(JournalInventoryFile, empty);       /* empty archived files, always deleted */
+        LIST_HEAD(JournalInventoryFile, active);      /* files that are not deleted */
+
+        uint64_t usage;                               /* of all files */
+        uint64_t usage_archived;                      /* of the files in 'archived' */
+        uint64_t n_active;
+
+        bool need_scan;                               /* set when we lost track */
+        uint64_t n_scans;
+} JournalInventory;
+
+int journal_inventory_new(const char *directory, JournalInventory **ret);
+JournalInventory* journal_inventory_free(JournalInventory *i);
+DEFINE_TRIVIAL_CLEANUP_FUNC(JournalInventory*, journal_inventory_free);
+
+int journal_inventory_scan(JournalInventory *i);
+int journal_inventory_ensure_scanned(JournalInventory *i);
+
+int journal_inventory_update(JournalInventory *i, JournalFile *f);
+int journal_inventory_forget(JournalInventory *i, const char *filename);
+
+int journal_inventory_file_new_archived(JournalInventory *i, JournalFile *f, JournalInventoryFile **ret);
+int journal_inventory_add_archived(JournalInventory *i, JournalInventoryFile *file);
+
+JournalInventoryFile* journal_inventory_file_free(JournalInventoryFile *file);
+DEFINE_TRIVIAL_CLEANUP_FUNC(JournalInventoryFile*, journal_inventory_file_free);
+
+int journal_inventory_vacuum(
+                JournalInventory *i,
+                uint64_t max_use,
+                uint64_t n_max_files,
+                usec_t max_retention_usec,
+                usec_t *oldest_usec,
+                JournalInventoryFile ***ret_victims,
+                size_t *ret_n_victims);
+
+uint64_t journal_vacuum_delete(const char *directory, JournalInventoryFile **victims, size_t n_victims, bool verbose);
+void journal_inventory_file_free_many(JournalInventoryFile **files, size_t n_files);
+
 int journal_directory_vacuum(const char *directory, uint64_t max_use, uint64_t n_max_files, usec_t max_retention_usec, usec_t *oldest_usec, bool verbose);
@@ -1,6 +1,7 @@
 /* SPDX-License-Identifier: LGPL-2.1-or-later */
 
 #include <fcntl.h>
+#include <pthread.h>
 #include <stddef.h>
 #include <sys/mman.h>
 #include <unistd.h>
@@ -16,6 +17,8 @@
 #include "journal-verify.h"
 #include "lookup3.h"
 #include "macro.h"
+#include "parse-util.h"
+#include "siphash24.h"
 #include "terminal-util.h"
 #include "tmpfile-util.h"
 #include "util.h"
@@ -110,7 +113,7 @@ static void flush_progress(void) {
                 log_error_errno(error, OFSfmt": " _fmt, (uint64_t)_offset, ##__VA_ARGS__); \
         } while (0)
 
-static int journal_file_object_verify(JournalFile *f, uint64_t offset, Object *o) {
+static int journal_file_object_verify(JournalFile *f, uint64_t offset, Object *o, bool check_data_hash) {
         uint64_t i;
 
         assert(f);
@@ -119,7 +122,9 @@ static int journal_file_object_verify(JournalFile *f, uint64_t offset, Object *o
 
         /* This does various superficial tests about the length an
          * possible field values. It does not follow any references to
-         * other objects. */
+         * other objects. The hash of data objects is only checked if
+         * check_data_hash is set, as that may be done separately by
+         * verify_data_hashes(). */
 
         if ((o->object.flags & OBJECT_COMPRESSED_XZ) &&
             o->object.type != OBJECT_DATA) {
@@ -148,6 +153,21 @@ static int journal_file_object_verify(JournalFile *f, uint64_t offset, Object *o
                         return -EBADMSG;
                 }
 
+                if (!VALID64(le64toh(o->data.next_hash_offset)) ||
+                    !VALID64(le64toh(o->data.next_field_offset)) ||
+                    !VALID64(le64toh(o->data.entry_offset)) ||
+                    !VALID64(le64toh(o->data.entry_array_offset))) {
+                        error(offset, "Invalid offset (next_hash_offset="OFSfmt", next_field_offset="OFSfmt", entry_offset="OFSfmt", entry_array_offset="OFSfmt,
+                              le64toh(o->data.next_hash_offset),
+                              le64toh(o->data.next_field_offset),
+                              le64toh(o->data.entry_offset),
+                              le64toh(o->data.entry_array_offset));
+                        return -EBADMSG;
+                }
+
+                if (!check_data_hash)
+                        break;
+
                 h1 = le64toh(o->data.hash);
 
                 compression = o->object.flags & OBJECT_COMPRESSION_MASK;
@@ -155,10 +175,11 @@ static int journal_file_object_verify(JournalFile *f, uint64_t offset, Object *o
                         _cleanup_free_ void *b = NULL;
                         size_t b_size;
 
-                        r = decompress_blob(compression,
-                                            o->data.payload,
-                                            le64toh(o->object.size) - offsetof(Object, data.payload),
-                                            &b, &b_size, 0);
+                        r = journal_file_decompress_blob(
+                                        f, compression,
+                                        o->data.payload,
+                                        le64toh(o->object.size) - offsetof(Object, data.payload),
+                                        &b, &b_size, 0);
                         if (r < 0) {
                                 error_errno(offset, r, "%s decompression failed: %m",
                                             object_compressed_to_string(compression));
@@ -174,18 +195,6 @@ static int journal_file_object_verify(JournalFile *f, uint64_t offset, Object *o
                         return -EBADMSG;
                 }
 
-                if (!VALID64(le64toh(o->data.next_hash_offset)) ||
-                    !VALID64(le64toh(o->data.next_field_offset)) ||
-                    !VALID64(le64toh(o->data.entry_offset)) ||
-                    !VALID64(le64toh(o->data.entry_array_offset))) {
-                        error(offset, "Invalid offset (next_hash_offset="OFSfmt", next_field_offset="OFSfmt", entry_offset="OFSfmt", entry_array_offset="OFSfmt,
-                              le64toh(o->data.next_hash_offset),
-                              le64toh(o->data.next_field_offset),
-                              le64toh(o->data.entry_offset),
-                              le64toh(o->data.entry_array_offset));
-                        return -EBADMSG;
-                }
-
                 break;
         }
 
@@ -346,12 +355,320 @@ static int journal_file_object_verify(JournalFile *f, uint64_t offset, Object *o
                         return -EBADMSG;
                 }
 
+                break;
+
+        case OBJECT_REALTIME_INDEX:
+                if ((le64toh(o->object.size) - offsetof(RealtimeIndexObject, items)) % sizeof(RealtimeIndexItem) != 0 ||
+                    (le64toh(o->object.size) - offsetof(RealtimeIndexObject, items)) / sizeof(RealtimeIndexItem) <= 0) {
+                        error(offset,
+                              "Invalid object realtime index size: %"PRIu64,
+                              le64toh(o->object.size));
+                        return -EBADMSG;
+                }
+
+                if (!VALID64(le64toh(o->realtime_index.next_realtime_index_offset))) {
+                        error(offset,
+                              "Invalid object realtime index next_realtime_index_offset: "OFSfmt,
+                              le64toh(o->realtime_index.next_realtime_index_offset));
+                        return -EBADMSG;
+                }
+
+                break;
+
+        case OBJECT_DICTIONARY:
+                if (le64toh(o->object.size) <= offsetof(DictionaryObject, payload)) {
+                        error(offset,
+                              "Invalid object dictionary size: %"PRIu64,
+                              le64toh(o->object.size));
+                        return -EBADMSG;
+                }
+
                 break;
         }
 
         return 0;
 }
 
+/* Checking the hashes of data objects, which requires decompressing them, is the most expensive part of
+ * the first pass over the file. It is hence split off, and done by several threads in parallel, each
+ * taking care of a contiguous range of the data objects. */
+#define VERIFY_THREADS_MAX 16U
+#define VERIFY_DATA_PER_THREAD_MIN 4096U
+
+typedef struct VerifyShard {
+        pthread_t thread;
+        bool thread_started;
+
+        /* The shards read the objects with pread() rather than through the mmap cache, which is not
+         * thread-safe. Everything they need from the header is copied here before they are started. */
+        int fd;
+        uint64_t arena_end;
+        bool keyed_hash;
+        sd_id128_t file_id;
+        uint64_t dictionary_offset;
+        const void *dictionary;
+        size_t dictionary_size;
+
+        const uint64_t *offsets;
+        uint64_t n_offsets;
+
+        uint64_t error_offset;
+        int error;
+} VerifyShard;
+
+static unsigned verify_n_threads(JournalFile *f) {
+        uint64_t n_data;
+        const char *e;
+        unsigned n;
+        long k;
+
+        assert(f);
+
+        if (!JOURNAL_HEADER_CONTAINS(f->header, n_data))
+                return 1;
+
+        /* An explicitly configured number of threads is used regardless of the size of the file */
+        e = getenv("SYSTEMD_JOURNAL_VERIFY_THREADS");
+        if (e) {
+                if (safe_atou(e, &n) >= 0 && n > 0)
+                        return MIN(n, VERIFY_THREADS_MAX);
+
+                log_debug("Failed to parse $SYSTEMD_JOURNAL_VERIFY_THREADS, ignoring: %s", e);
+        }
+
+        k = sysconf(_SC_NPROCESSORS_ONLN);
+        n = MIN(k > 0 ? (unsigned) k : 1U, VERIFY_THREADS_MAX);
+
+        /* Don't bother for small files */
+        n_data = le64toh(f->header->n_data);
+        return (unsigned) CLAMP(n_data / VERIFY_DATA_PER_THREAD_MIN, 1U, (uint64_t) n);
+}
+
+static int verify_shard_data_hash(VerifyShard *s, CompressDictionary *d, uint8_t **buf, uint64_t offset) {
+        _cleanup_free_ void *b = NULL;
+        const void *payload;
+        ObjectHeader h;
+        uint64_t size, hash;
+        int compression, r;
+        ssize_t l;
+        Object *o;
+
+        assert(s);
+        assert(buf);
+
+        /* Like the data object part of journal_file_object_verify(), but doesn't log, so that this can be
+         * called from several threads at once. The structure of the objects was already checked by the
+         * first pass. */
+
+        l = pread(s->fd, &h, sizeof(h), offset);
+        if (l < 0)
+                return -errno;
+        if (l != sizeof(h))
+                return -EIO;
+
+        size = le64toh(h.size);
+        if (h.type != OBJECT_DATA ||
+            size < offsetof(Object, data.payload) ||
+            size > s->arena_end - MIN(offset, s->arena_end) ||
+            size > SIZE_MAX)
+                return -EBADMSG;
+
+        if (!GREEDY_REALLOC(*buf, size))
+                return -ENOMEM;
+
+        l = pread(s->fd, *buf, size, offset);
+        if (l < 0)
+                return -errno;
+        if ((uint64_t) l != size)
+                return -EIO;
+
+        o = (Object*) *buf;
+        payload = o->data.payload;
+        size -= offsetof(Object, data.payload);
+
+        compression = o->object.flags & OBJECT_COMPRESSION_MASK;
+        if (compression) {
+                size_t b_size;
+
+#if HAVE_ZSTD
+                uint32_t id;
+
+                id = compressed_blob_dictionary_id(compression, payload, size);
+                if (id != 0) {
+                        if (!d || compress_dictionary_id(d) != id)
+                                return -EBADMSG;
+
+                        r = decompress_blob_zstd_dict(d, payload, size, &b, &b_size, 0);
+                } else
+#endif
+                        r = decompress_blob(compression, payload, size, &b, &b_size, 0);
+                if (r < 0)
+                        return r;
+
+                payload = b;
+                size = b_size;
+        }
+
+        /* Same as journal_file_hash_data() */
+        hash = s->keyed_hash ? siphash24(payload, size, s->file_id.bytes) : jenkins_hash64(payload, size);
+
+        return hash == le64toh(o->data.hash) ? 0 : -EBADMSG;
+}
+
+static void* verify_shard_thread(void *userdata) {
+        _cleanup_(compress_dictionary_freep) CompressDictionary *d = NULL;
+        _cleanup_free_ uint8_t *buf = NULL;
+        VerifyShard *s = userdata;
+        int r;
+
+        assert(s);
+
+        /* Each shard needs its own dictionary, as the decompression context is not thread-safe */
+        if (s->dictionary) {
+                r = compress_dictionary_new(s->dictionary, s->dictionary_size, &d);
+                if (r < 0) {
+                        s->error_offset = s->dictionary_offset;
+                        s->error = r;
+                        return NULL;
+                }
+        }
+
+        for (uint64_t i = 0; i < s->n_offsets; i++) {
+                r = verify_shard_data_hash(s, d, &buf, s->offsets[i]);
+                if (r < 0) {
+                        s->error_offset = s->offsets[i];
+                        s->error = r;
+                        break;
+                }
+        }
+
+        return NULL;
+}
+
+static int verify_data_hashes(
+                JournalFile *f,
+                int data_fd, uint64_t n_data,
+                unsigned n_threads,
+                uint64_t *ret_offset) {
+
+        _cleanup_free_ VerifyShard *shards = NULL;
+        const uint64_t *offsets = MAP_FAILED;
+        _cleanup_free_ void *dictionary = NULL;
+        uint64_t per_shard, dictionary_size = 0, first_error = UINT64_MAX;
+        int r = 0;
+
+        assert(f);
+        assert(data_fd >= 0);
+        assert(n_threads > 1);
+        assert(ret_offset);
+
+        /* Returns 0 if the hashes of all data objects are valid. Otherwise returns the error of the data
+         * object with the lowest offset, and that offset in ret_offset, so that the result doesn't depend
+         * on the number of threads. */
+
+        if (n_data == 0)
+                return 0;
+
+        if (n_data > SIZE_MAX / sizeof(uint64_t))
+                return -EFBIG;
+
+        offsets = mmap(NULL, n_data * sizeof(uint64_t), PROT_READ, MAP_SHARED, data_fd, 0);
+        if (offsets == MAP_FAILED)
+                return -errno;
+
+        if (JOURNAL_HEADER_CONTAINS(f->header, dictionary_offset) &&
+            le64toh(f->header->dictionary_offset) != 0) {
+                uint64_t p = le64toh(f->header->dictionary_offset);
+                Object *o;
+
+                r = journal_file_move_to_object(f, OBJECT_DICTIONARY, p, &o);
+                if (r < 0) {
+                        *ret_offset = p;
+                        goto finish;
+                }
+
+                /* Copied, since the window it is in might go away while the shards use it */
+                dictionary_size = le64toh(o->object.size) - offsetof(Object, dictionary.payload);
+                dictionary = memdup(o->dictionary.payload, dictionary_size);
+                if (!dictionary) {
+                        r = -ENOMEM;
+                        goto finish;
+                }
+        }
+
+        shards = new0(VerifyShard, n_threads);
+        if (!shards) {
+                r = -ENOMEM;
+                goto finish;
+        }
+
+        per_shard = DIV_ROUND_UP(n_data, n_threads);
+        for (unsigned i = 0; i < n_threads; i++) {
+                uint64_t start = MIN(i * per_shard, n_data);
+
+                shards[i] = (VerifyShard) {
+                        .fd = f->fd,
+                        .arena_end = le64toh(f->header->header_size) + le64toh(f->header->arena_size),
+                        .keyed_hash = JOURNAL_HEADER_KEYED_HASH(f->header),
+                        .file_id = f->header->file_id,
+                        .dictionary_offset = le64toh(f->header->dictionary_offset),
+                        .dictionary = dictionary,
+                        .dictionary_size = dictionary_size,
+                        .offsets = offsets + start,
+                        .n_offsets = MIN(per_shard, n_data - start),
+                };
+        }
+
+        /* The first shard is taken care of by the calling thread */
+        for (unsigned i = 1; i < n_threads; i++) {
+                sigset_t ss, saved_ss;
+                int k;
+
+                assert_se(sigfillset(&ss) >= 0);
+
+                k = pthread_sigmask(SIG_BLOCK, &ss, &saved_ss);
+                if (k > 0) {
+                        log_debug_errno(k, "Failed to block signals, verifying remaining data objects in a single thread: %m");
+                        break;
+                }
+
+                k = pthread_create(&shards[i].thread, NULL, verify_shard_thread, shards + i);
+                assert_se(pthread_sigmask(SIG_SETMASK, &saved_ss, NULL) == 0);
+                if (k > 0) {
+                        log_debug_errno(k, "Failed to start thread, verifying remaining data objects in a single thread: %m");
+                        break;
+                }
+
+                shards[i].thread_started = true;
+        }
+
+        (void) verify_shard_thread(shards);
+
+        /* Merge the results. Shards whose thread couldn't be started are verified here too. */
+        for (unsigned i = 0; i < n_threads; i++) {
+                if (i > 0) {
+                        if (shards[i].thread_started)
+                                assert_se(pthread_join(shards[i].thread, NULL) == 0);
+                        else
+                                (void) verify_shard_thread(shards + i);
+                }
+
+                if (shards[i].error < 0 && shards[i].error_offset < first_error) {
+                        first_error = shards[i].error_offset;
+                        r = shards[i].error;
+                }
+        }
+
+        if (first_error != UINT64_MAX)
+                *ret_offset = first_error;
+        else
+                r = 0;
+
+finish:
+        (void) munmap((void*) offsets, n_data * sizeof(uint64_t));
+        return r;
+}
+
 static int write_uint64(int fd, uint64_t p) {
         ssize_t k;
 
@@ -801,6 +1118,105 @@ static int verify_entry_array(
         return 0;
 }
 
+static int verify_realtime_index(JournalFile *f) {
+        uint64_t i = 0, a, n, n_entries, last_index = 0, array, array_begin = 0;
+        bool last_index_set = false;
+        int r;
+
+        assert(f);
+
+        /* Checks that each item of the realtime index points to the right place in the main entry array,
+         * and that the entry there has the recorded timestamp. The entry array chain has been verified
+         * already, we walk it along with the index. */
+
+        n = le64toh(f->header->n_realtime_index);
+        n_entries = le64toh(f->header->n_entries);
+        a = le64toh(f->header->realtime_index_offset);
+        array = le64toh(f->header->entry_array_offset);
+        while (i < n) {
+                uint64_t next, m, j;
+                Object *o;
+
+                if (a == 0) {
+                        error(a, "Realtime index chain too short at %"PRIu64" of %"PRIu64, i, n);
+                        return -EBADMSG;
+                }
+
+                r = journal_file_move_to_object(f, OBJECT_REALTIME_INDEX, a, &o);
+                if (r < 0)
+                        return r;
+
+                next = le64toh(o->realtime_index.next_realtime_index_offset);
+                if (next != 0 && next <= a) {
+                        error(a, "Realtime index chain has cycle at %"PRIu64" of %"PRIu64" (jumps back from to "OFSfmt")", i, n, next);
+                        return -EBADMSG;
+                }
+
+                m = journal_file_realtime_index_n_items(o);
+                for (j = 0; i < n && j < m; i++, j++) {
+                        RealtimeIndexItem item;
+                        uint64_t k, p;
+
+                        item = o->realtime_index.items[j];
+
+                        if (last_index_set && le64toh(item.entry_index) <= last_index) {
+                                error(a, "Realtime index not sorted at %"PRIu64" of %"PRIu64, i, n);
+                                return -EBADMSG;
+                        }
+                        last_index = le64toh(item.entry_index);
+                        last_index_set = true;
+
+                        if (last_index >= n_entries) {
+                                error(a, "Realtime index item at %"PRIu64" of %"PRIu64" points beyond the last entry", i, n);
+                                return -EBADMSG;
+                        }
+
+                        for (;;) {
+                                if (array == 0) {
+                                        error(a, "Realtime index item at %"PRIu64" of %"PRIu64" points beyond the entry array chain", i, n);
+                                        return -EBADMSG;
+                                }
+
+                                r = journal_file_move_to_object(f, OBJECT_ENTRY_ARRAY, array, &o);
+                                if (r < 0)
+                                        return r;
+
+                                k = journal_file_entry_array_n_items(o);
+                                if (last_index < array_begin + k)
+                                        break;
+
+                                array_begin += k;
+                                array = le64toh(o->entry_array.next_entry_array_offset);
+                        }
+
+                        if (le64toh(item.entry_array_offset) != array ||
+                            le64toh(item.entry_array_begin) != array_begin) {
+                                error(a, "Realtime index item at %"PRIu64" of %"PRIu64" points to wrong entry array", i, n);
+                                return -EBADMSG;
+                        }
+
+                        p = le64toh(o->entry_array.items[last_index - array_begin]);
+                        r = journal_file_move_to_object(f, OBJECT_ENTRY, p, &o);
+                        if (r < 0)
+                                return r;
+
+                        if (le64toh(o->entry.realtime) != le64toh(item.realtime)) {
+                                error(p, "Realtime index item at %"PRIu64" of %"PRIu64" does not match its entry", i, n);
+                                return -EBADMSG;
+                        }
+
+                        /* Pointer might have moved, reposition */
+                        r = journal_file_move_to_object(f, OBJECT_REALTIME_INDEX, a, &o);
+                        if (r < 0)
+                                return r;
+                }
+
+                a = next;
+        }
+
+        return 0;
+}
+
 int journal_file_verify(
                 JournalFile *f,
                 const char *key,
@@ -812,12 +1228,12 @@ int journal_file_verify(
 
         uint64_t entry_seqnum = 0, entry_monotonic = 0, entry_realtime = 0;
         sd_id128_t entry_boot_id;
-        bool entry_seqnum_set = false, entry_monotonic_set = false, entry_realtime_set = false, found_main_entry_array = false;
+        bool entry_seqnum_set = false, entry_monotonic_set = false, entry_realtime_set = false, found_main_entry_array = false, found_dictionary = false;
         uint64_t n_weird = 0, n_objects = 0, n_entries = 0, n_data = 0, n_fields = 0, n_data_hash_tables = 0, n_field_hash_tables = 0, n_entry_arrays = 0, n_tags = 0;
         usec_t last_usec = 0;
         int data_fd = -1, entry_fd = -1, entry_array_fd = -1;
         MMapFileDescriptor *cache_data_fd = NULL, *cache_entry_fd = NULL, *cache_entry_array_fd = NULL;
-        unsigned i;
+        unsigned i, n_threads;
         bool found_last = false;
         const char *tmp_dir = NULL;
 
@@ -895,8 +1311,12 @@ int journal_file_verify(
                         goto fail;
                 }
 
+        n_threads = verify_n_threads(f);
+
         /* First iteration: we go through all objects, verify the
-         * superficial structure, headers, hashes. */
+         * superficial structure, headers, hashes. If several threads
+         * are used, the hashes of data objects are checked after this
+         * iteration. */
 
         p = le64toh(f->header->header_size);
         for (;;) {
@@ -921,7 +1341,7 @@ int journal_file_verify(
 
                 n_objects++;
 
-                r = journal_file_object_verify(f, p, o);
+                r = journal_file_object_verify(f, p, o, n_threads <= 1);
                 if (r < 0) {
                         error_errno(p, r, "Invalid object contents: %m");
                         goto fail;
@@ -1166,6 +1586,31 @@ int journal_file_verify(
                         n_tags++;
                         break;
 
+                case OBJECT_REALTIME_INDEX:
+                        if (!JOURNAL_HEADER_REALTIME_INDEX(f->header)) {
+                                error(p, "Realtime index object in file without realtime index");
+                                r = -EBADMSG;
+                                goto fail;
+                        }
+
+                        break;
+
+                case OBJECT_DICTIONARY:
+                        if (!JOURNAL_HEADER_ZSTD_DICTIONARY(f->header)) {
+                                error(p, "Dictionary object in file without dictionary support");
+                                r = -EBADMSG;
+                                goto fail;
+                        }
+
+                        if (found_dictionary || le64toh(f->header->dictionary_offset) != p) {
+                                error(p, "More than one dictionary object, or header field for dictionary invalid");
+                                r = -EBADMSG;
+                                goto fail;
+                        }
+
+                        found_dictionary = true;
+                        break;
+
                 default:
                         n_weird++;
                 }
@@ -1230,6 +1675,14 @@ int journal_file_verify(
                 goto fail;
         }
 
+        if (!found_dictionary &&
+            JOURNAL_HEADER_CONTAINS(f->header, dictionary_offset) &&
+            le64toh(f->header->dictionary_offset) != 0) {
+                error(0, "Missing dictionary");
+                r = -EBADMSG;
+                goto fail;
+        }
+
         if (entry_seqnum_set &&
             entry_seqnum != le64toh(f->header->tail_entry_seqnum)) {
                 error(offsetof(Header, tail_entry_seqnum), "Invalid tail seqnum");
@@ -1251,6 +1704,32 @@ int journal_file_verify(
                 goto fail;
         }
 
+        if (n_threads > 1) {
+                uint64_t q = 0;
+
+                r = verify_data_hashes(f, data_fd, n_data, n_threads, &q);
+                if (r < 0 && q == 0) {
+                        log_error_errno(r, "Failed to verify data objects: %m");
+                        goto fail;
+                }
+                if (r < 0) {
+                        int k;
+
+                        p = q;
+
+                        /* Redo the check of the offending object, to log the precise problem */
+                        k = journal_file_move_to_object(f, OBJECT_UNUSED, p, &o);
+                        if (k >= 0)
+                                k = journal_file_object_verify(f, p, o, true);
+                        if (k < 0)
+                                r = k;
+                        else
+                                error_errno(p, r, "Object failed verification: %m");
+
+                        goto fail;
+                }
+        }
+
         /* Second iteration: we follow all objects referenced from the
          * two entry points: the object hash table and the entry
          * array. We also check that everything referenced (directly
@@ -1277,6 +1756,12 @@ int journal_file_verify(
         if (r < 0)
                 goto fail;
 
+        if (JOURNAL_HEADER_REALTIME_INDEX(f->header)) {
+                r = verify_realtime_index(f);
+                if (r < 0)
+                        goto fail;
+        }
+
         if (show_progress)
                 flush_progress();
 
@@ -3,6 +3,7 @@
 #include <errno.h>
 #include <stdlib.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
 
 #include "alloc-util.h"
 #include "errno-util.h"
@@ -24,6 +25,7 @@ struct Window {
         bool invalidated:1;
         bool keep_always:1;
         bool in_unused:1;
+        bool sequential:1;
 
         void *ptr;
         uint64_t offset;
@@ -42,6 +44,12 @@ struct Context {
         unsigned id;
         Window *window;
 
+        /* The last window this context was attached to, to detect sequential access */
+        MMapFileDescriptor *last_fd;
+        uint64_t last_offset;
+        uint64_t last_end;
+        unsigned n_sequential;
+
         LIST_FIELDS(Context, by_window);
 };
 
@@ -58,6 +66,9 @@ struct MMapCache {
         unsigned n_windows;
 
         unsigned n_context_cache_hit, n_window_list_hit, n_missed;
+        unsigned n_sequential, n_dropped;
+
+        struct rusage rusage_start;
 
         Hashmap *fds;
         Context *contexts[MMAP_CACHE_MAX_CONTEXTS];
@@ -75,6 +86,12 @@ struct MMapCache {
 # define WINDOW_SIZE (8ULL*1024ULL*1024ULL)
 #endif
 
+/* When a context keeps moving forward through a file, every new window is twice as large as the previous
+ * one, up to WINDOW_SIZE_SEQUENTIAL_MAX. On 32-bit archs address space is scarce, hence stick to the regular
+ * window size there. */
+#define WINDOW_SIZE_SHIFT_MAX 3U
+#define WINDOW_SIZE_SEQUENTIAL_MAX (sizeof(void*) > 4 ? WINDOW_SIZE << WINDOW_SIZE_SHIFT_MAX : WINDOW_SIZE)
+
 MMapCache* mmap_cache_new(void) {
         MMapCache *m;
 
@@ -83,6 +100,7 @@ MMapCache* mmap_cache_new(void) {
                 return NULL;
 
         m->n_ref = 1;
+        (void) getrusage(RUSAGE_SELF, &m->rusage_start);
         return m;
 }
 
@@ -199,6 +217,14 @@ static void context_detach_window(Context *c) {
 
         if (!w->contexts && !w->keep_always) {
                 /* Not used anymore? */
+
+                if (w->sequential && !w->invalidated) {
+                        /* A sequential scan moved past this window, so it's unlikely we'll need it again
+                         * soon. Drop the pages from our address space, they stay in the page cache. */
+                        (void) madvise(w->ptr, w->size, MADV_DONTNEED);
+                        c->cache->n_dropped++;
+                }
+
 #if ENABLE_DEBUG_MMAP_CACHE
                 /* Unmap unused windows immediately to expose use-after-unmap
                  * by SIGSEGV. */
@@ -233,6 +259,24 @@ static void context_attach_window(Context *c, Window *w) {
 
         c->window = w;
         LIST_PREPEND(by_window, w->contexts, c);
+
+        c->last_fd = w->fd;
+        c->last_offset = w->offset;
+        c->last_end = w->offset + w->size;
+}
+
+static bool context_is_sequential(Context *c, MMapFileDescriptor *f, uint64_t offset, size_t size) {
+        assert(c);
+        assert(f);
+
+        /* Returns true if the requested range continues right after the last window this context used,
+         * i.e. if the context walks through the file front to back */
+
+        return
+                c->last_fd == f &&
+                offset >= c->last_offset &&
+                offset + size > c->last_end &&
+                offset < c->last_end + WINDOW_SIZE;
 }
 
 static Context *context_add(MMapCache *m, unsigned id) {
@@ -430,11 +474,24 @@ static int add_mmap(
         assert(size > 0);
         assert(ret);
 
+        c = context_add(m, context);
+        if (!c)
+                return -ENOMEM;
+
+        if (context_is_sequential(c, f, offset, size))
+                c->n_sequential = MIN(c->n_sequential + 1, WINDOW_SIZE_SHIFT_MAX);
+        else
+                c->n_sequential = 0;
+
         woffset = offset & ~((uint64_t) page_size() - 1ULL);
         wsize = size + (offset - woffset);
         wsize = PAGE_ALIGN(wsize);
 
-        if (wsize < WINDOW_SIZE) {
+        if (c->n_sequential > 0)
+                /* For sequential access, place the window ahead of the requested offset rather than
+                 * around it, and make it larger the longer the scan goes on */
+                wsize = MAX(wsize, MIN(WINDOW_SIZE << c->n_sequential, WINDOW_SIZE_SEQUENTIAL_MAX));
+        else if (wsize < WINDOW_SIZE) {
                 uint64_t delta;
 
                 delta = PAGE_ALIGN((WINDOW_SIZE - wsize) / 2);
@@ -463,14 +520,20 @@ static int add_mmap(
         if (r < 0)
                 return r;
 
-        c = context_add(m, context);
-        if (!c)
-                goto outofmem;
-
         w = window_add(m, f, keep_always, woffset, wsize, d);
         if (!w)
                 goto outofmem;
 
+        if (c->n_sequential > 0) {
+                /* Let the kernel read ahead aggressively, and start reading in the whole window right
+                 * away, instead of taking a fault per page */
+                (void) madvise(d, wsize, MADV_SEQUENTIAL);
+                (void) madvise(d, wsize, MADV_WILLNEED);
+
+                w->sequential = true;
+                m->n_sequential++;
+        }
+
         context_attach_window(c, w);
 
         *ret = (uint8_t*) w->ptr + (offset - w->offset);
@@ -522,9 +585,19 @@ int mmap_cache_get(
 }
 
 void mmap_cache_stats_log_debug(MMapCache *m) {
+        struct rusage ru;
+
         assert(m);
 
-        log_debug("mmap cache statistics: %u context cache hit, %u window list hit, %u miss", m->n_context_cache_hit, m->n_window_list_hit, m->n_missed);
+        log_debug("mmap cache statistics: %u context cache hit, %u window list hit, %u miss, %u sequential, %u dropped",
+                  m->n_context_cache_hit, m->n_window_list_hit, m->n_missed, m->n_sequential, m->n_dropped);
+
+        /* Page faults are only accounted per process (or thread), not per mapping, hence this includes
+         * any other activity of the process since the cache was created */
+        if (getrusage(RUSAGE_SELF, &ru) >= 0)
+                log_debug("page faults since mmap cache creation: %li minor, %li major",
+                          ru.ru_minflt - m->rusage_start.ru_minflt,
+                          ru.ru_majflt - m->rusage_start.ru_majflt);
 }
 
 static void mmap_cache_process_sigbus(MMapCache *m) {
@@ -641,6 +714,10 @@ void mmap_cache_free_fd(MMapCache *m, MMapFileDescriptor *f) {
         while (f->windows)
                 window_free(f->windows);
 
+        for (unsigned i = 0; i < MMAP_CACHE_MAX_CONTEXTS; i++)
+                if (m->contexts[i] && m->contexts[i]->last_fd == f)
+                        m->contexts[i]->last_fd = NULL;
+
         if (f->cache)
                 assert_se(hashmap_remove(f->cache->fds, FD_TO_PTR(f->fd)));
 
@@ -2315,10 +2315,11 @@ _public_ int sd_journal_get_data(sd_journal *j, const char *field, const void **
                 compression = o->object.flags & OBJECT_COMPRESSION_MASK;
                 if (compression) {
 #if HAVE_COMPRESSION
-                        r = decompress_startswith(compression,
-                                                  o->data.payload, l,
-                                                  &f->compress_buffer,
-                                                  field, field_length, '=');
+                        r = journal_file_decompress_startswith(
+                                        f, compression,
+                                        o->data.payload, l,
+                                        &f->compress_buffer,
+                                        field, field_length, '=');
                         if (r < 0)
                                 log_debug_errno(r, "Cannot decompress %s object of length %"PRIu64" at offset "OFSfmt": %m",
                                                 object_compressed_to_string(compression), l, p);
@@ -2326,10 +2327,11 @@ _public_ int sd_journal_get_data(sd_journal *j, const char *field, const void **
 
                                 size_t rsize;
 
-                                r = decompress_blob(compression,
-                                                    o->data.payload, l,
-                                                    &f->compress_buffer, &rsize,
-                                                    j->data_threshold);
+                                r = journal_file_decompress_blob(
+                                                f, compression,
+                                                o->data.payload, l,
+                                                &f->compress_buffer, &rsize,
+                                                j->data_threshold);
                                 if (r < 0)
                                         return r;
 
@@ -2394,8 +2396,8 @@ static int return_data(
                 size_t rsize;
                 int r;
 
-                r = decompress_blob(
-                                compression,
+                r = journal_file_decompress_blob(
+                                f, compression,
                                 o->data.payload, l,
                                 &f->compress_buffer, &rsize,
                                 j->data_threshold);
@@ -138,6 +138,115 @@ static void test_compress_decompress(const char* label, const char* type,
                  100 - compressed * 100. / total,
                  skipped);
 }
+
+#if HAVE_ZSTD
+#define N_RECORDS 20000U
+
+static char* make_record(unsigned i) {
+        unsigned a = random_u64_range(1000), b = random_u64_range(100000);
+        char *r;
+        int k;
+
+        /* Short fields, the way they show up in journal data objects */
+        switch (i % 5) {
+        case 0:
+                k = asprintf(&r, "MESSAGE=Started Session %u of user user%u.", b, a);
+                break;
+        case 1:
+                k = asprintf(&r, "_SYSTEMD_UNIT=session-%u.scope", b);
+                break;
+        case 2:
+                k = asprintf(&r, "MESSAGE=Accepted publickey for user%u from 10.0.%u.%u port %u ssh2",
+                             a, a % 256, b % 256, b);
+                break;
+        case 3:
+                k = asprintf(&r, "_CMDLINE=/usr/lib/systemd/systemd-logind --instance %u", b);
+                break;
+        default:
+                k = asprintf(&r, "MESSAGE=pam_unix(sshd:session): session opened for user user%u(uid=%u) by (uid=0)",
+                             a, a + 1000);
+        }
+
+        assert_se(k >= 0);
+        return r;
+}
+
+static void test_dictionary(void) {
+        _cleanup_free_ char *samples = NULL, *buf = NULL;
+        _cleanup_free_ size_t *sizes = NULL;
+        _cleanup_free_ void *dict = NULL, *buf2 = NULL;
+        _cleanup_(compress_dictionary_freep) CompressDictionary *d = NULL;
+        size_t samples_size = 0, dict_size;
+        int r;
+
+        samples = new(char, N_RECORDS * LINE_MAX);
+        sizes = new(size_t, N_RECORDS);
+        buf = new(char, LINE_MAX);
+        assert_se(samples && sizes && buf);
+
+        for (unsigned i = 0; i < N_RECORDS; i++) {
+                _cleanup_free_ char *record = make_record(i);
+
+                sizes[i] = strlen(record);
+                memcpy(samples + samples_size, record, sizes[i]);
+                samples_size += sizes[i];
+        }
+
+        /* Train on the first half, and measure the second half */
+        r = compress_dictionary_train(samples, sizes, N_RECORDS / 2, 16 * 1024, &dict, &dict_size);
+        assert_se(r >= 0);
+        assert_se(compress_dictionary_new(dict, dict_size, &d) >= 0);
+
+        for (int with_dict = 0; with_dict <= 1; with_dict++) {
+                size_t total = 0, compressed = 0, offset = 0;
+                usec_t n, n2;
+                float dt;
+
+                for (unsigned i = 0; i < N_RECORDS / 2; i++)
+                        offset += sizes[i];
+
+                n = now(CLOCK_MONOTONIC);
+
+                for (unsigned i = N_RECORDS / 2; i < N_RECORDS; i++) {
+                        const char *text = samples + offset;
+                        size_t j = 0, k = 0;
+
+                        offset += sizes[i];
+                        total += sizes[i];
+
+                        if (with_dict)
+                                r = compress_blob_zstd_dict(d, text, sizes[i], buf, sizes[i] - 1, &j);
+                        else
+                                r = compress_blob_zstd(text, sizes[i], buf, sizes[i] - 1, &j);
+                        if (r == -ENOBUFS) {
+                                /* Stored uncompressed */
+                                compressed += sizes[i];
+                                continue;
+                        }
+                        assert_se(r == 0);
+                        compressed += j;
+
+                        if (with_dict)
+                                r = decompress_blob_zstd_dict(d, buf, j, &buf2, &k, 0);
+                        else
+                                r = decompress_blob_zstd(buf, j, &buf2, &k, 0);
+                        assert_se(r == 0);
+                        assert_se(k == sizes[i]);
+                        assert_se(memcmp(text, buf2, k) == 0);
+                }
+
+                n2 = now(CLOCK_MONOTONIC);
+                dt = (n2 - n) / 1e6;
+
+                log_info("ZSTD/records%s: compressed & decompressed %zu bytes in %.2fs (%.2fMiB/s), "
+                         "mean compression %.2f%%",
+                         with_dict ? "+dictionary" : "",
+                         total, dt,
+                         total / 1024. / 1024 / dt,
+                         100 - compressed * 100. / total);
+        }
+}
+#endif
 #endif
 
 int main(int argc, char *argv[]) {
@@ -170,6 +279,10 @@ int main(int argc, char *argv[]) {
                 test_compress_decompress("ZSTD", i, compress_blob_zstd, decompress_blob_zstd);
 #endif
         }
+
+#if HAVE_ZSTD
+        test_dictionary();
+#endif
         return 0;
 #else
         return log_tests_skipped("No compression feature is enabled");
@@ -0,0 +1,111 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "chattr-util.h"
+#include "io-util.h"
+#include "journal-file.h"
+#include "log.h"
+#include "parse-util.h"
+#include "path-util.h"
+#include "rm-rf.h"
+#include "stdio-util.h"
+#include "string-util.h"
+#include "tests.h"
+#include "tmpfile-util.h"
+
+/* Appends entries shaped like the ones journald writes to a journal file, once with and once without the
+ * in-memory cache of data object offsets, and reports the append throughput of both.
+ *
+ * Usage: test-journal-append-benchmark [ENTRIES [UNITS]] */
+
+static unsigned arg_entries = 50000;
+static unsigned arg_units = 64;
+
+#define FIELD_MAX 64
+
+static void benchmark(bool cache) {
+        _cleanup_(rm_rf_physical_and_freep) char *t = NULL;
+        JournalMetrics metrics;
+        JournalFile *f;
+        dual_timestamp ts;
+        uint64_t hits, misses, n_data;
+        usec_t begin, elapsed;
+
+        assert_se(setenv("SYSTEMD_JOURNAL_DATA_CACHE", one_zero(cache), 1) >= 0);
+
+        assert_se(mkdtemp_malloc(access("/dev/shm", W_OK) >= 0 ? "/dev/shm/journal-XXXXXX" : "/var/tmp/journal-XXXXXX", &t) >= 0);
+        (void) chattr_path(t, FS_NOCOW_FL, FS_NOCOW_FL, NULL);
+
+        /* Size the data hash table like journald would for a file of this size */
+        journal_reset_metrics(&metrics);
+        metrics.max_size = 1024ULL * 1024ULL * 1024ULL;
+        metrics.keep_free = 0;
+
+        assert_se(journal_file_open(-1, prefix_roota(t, "test.journal"), O_RDWR|O_CREAT, 0666, true, UINT64_MAX, false,
+                                    &metrics, NULL, NULL, NULL, &f) == 0);
+        assert_se(!!f->data_cache == cache);
+
+        assert_se(dual_timestamp_get(&ts));
+
+        begin = now(CLOCK_MONOTONIC);
+
+        for (unsigned i = 0; i < arg_entries; i++) {
+                char message[FIELD_MAX], priority[FIELD_MAX], identifier[FIELD_MAX], unit[FIELD_MAX], pid[FIELD_MAX];
+                struct iovec iovec[8];
+                size_t n = 0;
+
+                /* Only the message is different for every entry, the rest of the fields recur, just like
+                 * they do for real clients */
+                xsprintf(message, "MESSAGE=Benchmark message %u", i);
+                xsprintf(priority, "PRIORITY=%u", i % 8);
+                xsprintf(identifier, "SYSLOG_IDENTIFIER=benchmark%u", i % arg_units);
+                xsprintf(unit, "_SYSTEMD_UNIT=benchmark%u.service", i % arg_units);
+                xsprintf(pid, "_PID=%u", 1000 + i % arg_units);
+
+                iovec[n++] = IOVEC_MAKE_STRING(message);
+                iovec[n++] = IOVEC_MAKE_STRING(priority);
+                iovec[n++] = IOVEC_MAKE_STRING(identifier);
+                iovec[n++] = IOVEC_MAKE_STRING(unit);
+                iovec[n++] = IOVEC_MAKE_STRING(pid);
+                iovec[n++] = IOVEC_MAKE_STRING("_UID=0");
+                iovec[n++] = IOVEC_MAKE_STRING("_TRANSPORT=journal");
+                iovec[n++] = IOVEC_MAKE_STRING("_HOSTNAME=benchmark");
+
+                assert_se(journal_file_append_entry(f, &ts, NULL, iovec, n, NULL, NULL, NULL) == 0);
+        }
+
+        elapsed = MAX(usec_sub_unsigned(now(CLOCK_MONOTONIC), begin), (usec_t) 1);
+
+        hits = f->n_data_cache_hits;
+        misses = f->n_data_cache_misses;
+        n_data = le64toh(f->header->n_data);
+
+        (void) journal_file_close(f);
+
+        printf("%-20s %u entries in %s, %" PRIu64 " entries/s, %" PRIu64 " data objects\n",
+               cache ? "With data cache:" : "Without data cache:",
+               arg_entries, FORMAT_TIMESPAN(elapsed, USEC_PER_MSEC),
+               (uint64_t) arg_entries * USEC_PER_SEC / elapsed, n_data);
+        if (cache)
+                printf("%-20s %" PRIu64 " hits, %" PRIu64 " misses\n", "", hits, misses);
+}
+
+int main(int argc, char *argv[]) {
+        test_setup_logging(LOG_INFO);
+
+        if (argc > 1)
+                assert_se(safe_atou(argv[1], &arg_entries) >= 0);
+        if (argc > 2)
+                assert_se(safe_atou(argv[2], &arg_units) >= 0 && arg_units > 0);
+
+        /* journal_file_open requires a valid machine id */
+        if (access("/etc/machine-id", F_OK) != 0)
+                return log_tests_skipped("/etc/machine-id not found");
+
+        benchmark(false);
+        benchmark(true);
+
+        return 0;
+}
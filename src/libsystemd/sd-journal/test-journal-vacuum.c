@@ -0,0 +1,150 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "chattr-util.h"
+#include "io-util.h"
+#include "journal-file.h"
+#include "journal-vacuum.h"
+#include "log.h"
+#include "path-util.h"
+#include "rm-rf.h"
+#include "stdio-util.h"
+#include "tests.h"
+#include "tmpfile-util.h"
+
+#define N_ARCHIVED 8U
+
+static void append_entry(JournalFile *f, unsigned i) {
+        char message[STRLEN("MESSAGE=") + DECIMAL_STR_MAX(unsigned)];
+        struct iovec iovec;
+        dual_timestamp ts;
+
+        xsprintf(message, "MESSAGE=%u", i);
+        iovec = IOVEC_MAKE_STRING(message);
+
+        assert_se(dual_timestamp_get(&ts));
+        assert_se(journal_file_append_entry(f, &ts, NULL, &iovec, 1, NULL, NULL, NULL) == 0);
+}
+
+static void rotate(JournalInventory *i, JournalFile **f) {
+        _cleanup_(journal_inventory_file_freep) JournalInventoryFile *archived = NULL;
+
+        /* Does what journald does when rotating */
+        assert_se(journal_inventory_file_new_archived(i, *f, &archived) == 1);
+        assert_se(journal_file_rotate(f, true, UINT64_MAX, false, NULL) >= 0);
+        assert_se(journal_inventory_add_archived(i, TAKE_PTR(archived)) >= 0);
+        assert_se(journal_inventory_update(i, *f) == 1);
+}
+
+static void assert_inventories_equal(JournalInventory *a, JournalInventory *b) {
+        JournalInventoryFile *x, *y;
+
+        assert_se(hashmap_size(a->files) == hashmap_size(b->files));
+        assert_se(a->n_active == b->n_active);
+        assert_se(prioq_size(a->archived) == prioq_size(b->archived));
+
+        HASHMAP_FOREACH(x, a->files) {
+                assert_se(y = hashmap_get(b->files, x->filename));
+
+                assert_se(x->archived == y->archived);
+                assert_se(x->empty == y->empty);
+                assert_se(x->have_seqnum == y->have_seqnum);
+                assert_se(sd_id128_equal(x->seqnum_id, y->seqnum_id));
+                assert_se(x->seqnum == y->seqnum);
+
+                if (!x->archived)
+                        continue;
+
+                assert_se(sd_id128_equal(x->boot_id, y->boot_id));
+                assert_se(x->head_seqnum == y->head_seqnum);
+                assert_se(x->tail_seqnum == y->tail_seqnum);
+                assert_se(x->head_realtime == y->head_realtime);
+                assert_se(x->tail_realtime == y->tail_realtime);
+        }
+}
+
+static void test_inventory(void) {
+        _cleanup_(journal_inventory_freep) JournalInventory *incremental = NULL, *scanned = NULL;
+        _cleanup_(rm_rf_physical_and_freep) char *t = NULL;
+        JournalInventoryFile **victims, *oldest;
+        size_t n_victims;
+        JournalFile *f;
+
+        log_info("/* %s */", __func__);
+
+        assert_se(mkdtemp_malloc("/var/tmp/journal-vacuum-XXXXXX", &t) >= 0);
+        (void) chattr_path(t, FS_NOCOW_FL, FS_NOCOW_FL, NULL);
+
+        assert_se(journal_inventory_new(t, &incremental) >= 0);
+
+        assert_se(journal_file_open(-1, prefix_roota(t, "system.journal"), O_RDWR|O_CREAT, 0640, true, UINT64_MAX, false,
+                                    NULL, NULL, NULL, NULL, &f) == 0);
+
+        assert_se(journal_inventory_ensure_scanned(incremental) >= 0);
+        assert_se(incremental->n_active == 1);
+        assert_se(incremental->n_scans == 1);
+
+        /* Archive a couple of files with two entries each, and finally one without any */
+        for (unsigned k = 0; k < N_ARCHIVED; k++) {
+                append_entry(f, 2*k);
+                append_entry(f, 2*k + 1);
+                rotate(incremental, &f);
+        }
+
+        rotate(incremental, &f);
+
+        assert_se(incremental->n_scans == 1);
+        assert_se(incremental->n_active == 1);
+        assert_se(prioq_size(incremental->archived) == N_ARCHIVED);
+        assert_se(incremental->empty && !incremental->empty->files_next);
+
+        /* Keeping track of the files must yield the same as looking at the directory */
+        assert_se(journal_inventory_new(t, &scanned) >= 0);
+        assert_se(journal_inventory_scan(scanned) >= 0);
+        assert_inventories_equal(incremental, scanned);
+
+        /* Leave 6 files: the empty file and the three oldest ones go, without looking at the directory */
+        assert_se(journal_inventory_vacuum(incremental, 0, 6, 0, NULL, &victims, &n_victims) >= 0);
+        assert_se(n_victims == 4);
+        assert_se(victims[0]->empty);
+        for (size_t k = 1; k < n_victims; k++)
+                assert_se(victims[k]->seqnum == 1 + 2 * (k - 1));
+        assert_se(incremental->n_scans == 1);
+
+        (void) journal_vacuum_delete(t, victims, n_victims, true);
+
+        /* Somebody else deletes the oldest remaining file behind our back, which makes us look at the
+         * directory again */
+        assert_se(oldest = prioq_peek(incremental->archived));
+        assert_se(oldest->seqnum == 1 + 2 * 3);
+        assert_se(unlink(prefix_roota(t, oldest->filename)) >= 0);
+
+        assert_se(journal_inventory_vacuum(incremental, 0, 4, 0, NULL, &victims, &n_victims) >= 0);
+        assert_se(incremental->n_scans == 2);
+        assert_se(n_victims == 1);
+        assert_se(victims[0]->seqnum == 1 + 2 * 4);
+
+        (void) journal_vacuum_delete(t, victims, n_victims, true);
+
+        scanned = journal_inventory_free(scanned);
+        assert_se(journal_inventory_new(t, &scanned) >= 0);
+        assert_se(journal_inventory_scan(scanned) >= 0);
+        assert_se(scanned->n_active + prioq_size(scanned->archived) == 4);
+        assert_inventories_equal(incremental, scanned);
+
+        (void) journal_file_close(f);
+}
+
+int main(int argc, char *argv[]) {
+        test_setup_logging(LOG_INFO);
+
+        /* journal_file_open requires a valid machine id */
+        if (access("/etc/machine-id", F_OK) != 0)
+                return log_tests_skipped("/etc/machine-id not found");
+
+        test_inventory();
+
+        return 0;
+}
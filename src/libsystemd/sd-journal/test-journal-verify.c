@@ -108,6 +108,25 @@ int main(int argc, char *argv[]) {
 
         (void) journal_file_close(f);
 
+        log_info("Verifying with several threads...");
+
+        assert_se(setenv("SYSTEMD_JOURNAL_VERIFY_THREADS", "4", 1) >= 0);
+        assert_se(raw_verify("test.journal", verification_key) >= 0);
+
+        /* Corrupt the payload of a data object, which must be detected both with and without threads */
+        assert_se(journal_file_open(-1, "test.journal", O_RDONLY, 0666, true, UINT64_MAX, !!verification_key, NULL, NULL, NULL, NULL, &f) == 0);
+        assert_se(journal_file_find_data_object(f, "RANDOM=1", STRLEN("RANDOM=1"), NULL, &p) > 0);
+        p += offsetof(Object, data.payload) + STRLEN("RANDOM=");
+        (void) journal_file_close(f);
+
+        bit_toggle("test.journal", p * 8);
+        assert_se(raw_verify("test.journal", verification_key) == -EBADMSG);
+        assert_se(setenv("SYSTEMD_JOURNAL_VERIFY_THREADS", "1", 1) >= 0);
+        assert_se(raw_verify("test.journal", verification_key) == -EBADMSG);
+        bit_toggle("test.journal", p * 8);
+
+        assert_se(unsetenv("SYSTEMD_JOURNAL_VERIFY_THREADS") >= 0);
+
         if (verification_key) {
                 log_info("Toggling bits...");
 
@@ -4,12 +4,18 @@
 #include <unistd.h>
 
 #include "chattr-util.h"
+#include "dirent-util.h"
+#include "fd-util.h"
 #include "io-util.h"
 #include "journal-authenticate.h"
 #include "journal-file.h"
 #include "journal-vacuum.h"
+#include "journal-verify.h"
 #include "log.h"
+#include "path-util.h"
 #include "rm-rf.h"
+#include "stdio-util.h"
+#include "string-util.h"
 #include "tests.h"
 
 static bool arg_keep = false;
@@ -116,6 +122,300 @@ static void test_non_empty(void) {
         puts("------------------------------------------------------------");
 }
 
+static void test_append_entries(void) {
+        static const char a[] = "TEST=a", b[] = "TEST=b", c[] = "TEST=c", common[] = "COMMON=1";
+        const struct iovec iovec1[] = { IOVEC_MAKE_STRING(common), IOVEC_MAKE_STRING(a) },
+                           iovec2[] = { IOVEC_MAKE_STRING(b), IOVEC_MAKE_STRING(common) },
+                           iovec3[] = { IOVEC_MAKE_STRING(a), IOVEC_MAKE_STRING(common) },
+                           iovec4[] = { IOVEC_MAKE_STRING(common), IOVEC_MAKE_STRING(c) };
+        const JournalFileEntry entries[] = {
+                { .iovec = iovec1, .n_iovec = ELEMENTSOF(iovec1) },
+                { .iovec = iovec2, .n_iovec = ELEMENTSOF(iovec2) },
+                { .iovec = iovec3, .n_iovec = ELEMENTSOF(iovec3) },
+        };
+        char t[] = "/var/tmp/journal-XXXXXX";
+        uint64_t hashes4[ELEMENTSOF(iovec4)];
+        dual_timestamp ts;
+        JournalFile *f;
+        size_t n;
+        Object *o;
+        uint64_t p;
+
+        test_setup_logging(LOG_DEBUG);
+
+        mkdtemp_chdir_chattr(t);
+
+        assert_se(journal_file_open(-1, "test.journal", O_RDWR|O_CREAT, 0666, true, UINT64_MAX, false, NULL, NULL, NULL, NULL, &f) == 0);
+
+        assert_se(dual_timestamp_get(&ts));
+        assert_se(journal_file_append_entries(f, &ts, entries, ELEMENTSOF(entries), NULL, &n) == 0);
+        assert_se(n == ELEMENTSOF(entries));
+
+        /* Each field value is stored only once */
+        assert_se(le64toh(f->header->n_data) == 3);
+        assert_se(le64toh(f->header->n_entries) == 3);
+
+        assert_se(journal_file_find_data_object(f, common, strlen(common), NULL, &p) == 1);
+        assert_se(journal_file_next_entry_for_data(f, NULL, 0, p, DIRECTION_DOWN, &o, NULL) == 1);
+        assert_se(le64toh(o->entry.seqnum) == 1);
+        assert_se(journal_file_next_entry_for_data(f, NULL, 0, p, DIRECTION_UP, &o, NULL) == 1);
+        assert_se(le64toh(o->entry.seqnum) == 3);
+
+        assert_se(journal_file_find_data_object(f, a, strlen(a), NULL, &p) == 1);
+        assert_se(journal_file_move_to_entry_by_offset_for_data(f, p, 0, DIRECTION_DOWN, &o, NULL) == 1);
+        assert_se(le64toh(o->entry.seqnum) == 1);
+        assert_se(journal_file_next_entry_for_data(f, NULL, 0, p, DIRECTION_UP, &o, NULL) == 1);
+        assert_se(le64toh(o->entry.seqnum) == 3);
+
+        assert_se(journal_file_find_data_object(f, b, strlen(b), NULL, &p) == 1);
+        assert_se(journal_file_next_entry_for_data(f, NULL, 0, p, DIRECTION_DOWN, &o, NULL) == 1);
+        assert_se(le64toh(o->entry.seqnum) == 2);
+
+        /* Precalculated hashes are used where passed, and calculated where not */
+        hashes4[0] = journal_file_hash_data(f, common, strlen(common));
+        hashes4[1] = UINT64_MAX;
+
+        assert_se(journal_file_append_entry_full(f, &ts, NULL, iovec4, hashes4, ELEMENTSOF(iovec4), NULL, NULL, NULL) == 0);
+        assert_se(le64toh(f->header->n_data) == 4);
+        assert_se(le64toh(f->header->n_entries) == 4);
+
+        assert_se(journal_file_find_data_object(f, c, strlen(c), NULL, &p) == 1);
+        assert_se(journal_file_next_entry_for_data(f, NULL, 0, p, DIRECTION_DOWN, &o, NULL) == 1);
+        assert_se(le64toh(o->entry.seqnum) == 4);
+
+        (void) journal_file_close(f);
+
+        if (arg_keep)
+                log_info("Not removing %s", t);
+        else
+                assert_se(rm_rf(t, REMOVE_ROOT|REMOVE_PHYSICAL) >= 0);
+
+        puts("------------------------------------------------------------");
+}
+
+#define N_DATA_CACHE_VALUES (2U * DATA_CACHE_SLOTS)
+
+static void test_data_cache(void) {
+        static const char common[] = "COMMON=1";
+        char t[] = "/var/tmp/journal-XXXXXX";
+        JournalFile *f, *g;
+        dual_timestamp ts;
+        uint64_t hits;
+
+        test_setup_logging(LOG_DEBUG);
+
+        mkdtemp_chdir_chattr(t);
+
+        assert_se(journal_file_open(-1, "test.journal", O_RDWR|O_CREAT, 0666, true, UINT64_MAX, false, NULL, NULL, NULL, NULL, &f) == 0);
+        assert_se(f->data_cache);
+
+        /* More distinct values than fit into the cache, so that items get dropped from it */
+        assert_se(dual_timestamp_get(&ts));
+        for (unsigned i = 0; i < N_DATA_CACHE_VALUES; i++) {
+                char value[STRLEN("VALUE=") + DECIMAL_STR_MAX(unsigned)];
+                struct iovec iovec[2];
+
+                xsprintf(value, "VALUE=%u", i);
+                iovec[0] = IOVEC_MAKE_STRING(common);
+                iovec[1] = IOVEC_MAKE_STRING(value);
+                assert_se(journal_file_append_entry(f, &ts, NULL, iovec, ELEMENTSOF(iovec), NULL, NULL, NULL) == 0);
+        }
+
+        assert_se(le64toh(f->header->n_data) == N_DATA_CACHE_VALUES + 1);
+        assert_se(f->n_data_cache_hits >= N_DATA_CACHE_VALUES - 1);
+
+        /* Readers don't get a cache, and must find the same objects */
+        assert_se(journal_file_open(-1, "test.journal", O_RDONLY, 0, false, UINT64_MAX, false, NULL, NULL, NULL, NULL, &g) == 0);
+        assert_se(!g->data_cache);
+
+        hits = f->n_data_cache_hits;
+        for (unsigned i = 0; i < N_DATA_CACHE_VALUES; i++) {
+                char value[STRLEN("VALUE=") + DECIMAL_STR_MAX(unsigned)];
+                uint64_t p, q;
+
+                xsprintf(value, "VALUE=%u", i);
+                assert_se(journal_file_find_data_object(f, value, strlen(value), NULL, &p) == 1);
+                assert_se(journal_file_find_data_object(g, value, strlen(value), NULL, &q) == 1);
+                assert_se(p == q);
+        }
+
+        /* The most recently used values are still cached */
+        assert_se(f->n_data_cache_hits > hits);
+
+        (void) journal_file_close(g);
+
+        /* Values that were dropped from the cache are not added again */
+        for (unsigned i = 0; i < N_DATA_CACHE_VALUES; i++) {
+                char value[STRLEN("VALUE=") + DECIMAL_STR_MAX(unsigned)];
+                struct iovec iovec;
+
+                xsprintf(value, "VALUE=%u", i);
+                iovec = IOVEC_MAKE_STRING(value);
+                assert_se(journal_file_append_entry(f, &ts, NULL, &iovec, 1, NULL, NULL, NULL) == 0);
+        }
+
+        assert_se(le64toh(f->header->n_data) == N_DATA_CACHE_VALUES + 1);
+        assert_se(le64toh(f->header->n_entries) == 2 * N_DATA_CACHE_VALUES);
+        assert_se(journal_file_verify(f, NULL, NULL, NULL, NULL, false) >= 0);
+
+        (void) journal_file_close(f);
+
+        if (arg_keep)
+                log_info("Not removing %s", t);
+        else
+                assert_se(rm_rf(t, REMOVE_ROOT|REMOVE_PHYSICAL) >= 0);
+
+        puts("------------------------------------------------------------");
+}
+
+#define N_REALTIME_ENTRIES 5000U
+
+static void test_realtime_index(void) {
+        static const char test[] = "TEST=realtime";
+        char t[] = "/var/tmp/journal-XXXXXX";
+        struct iovec iovec = IOVEC_MAKE_STRING(test);
+        usec_t base;
+        JournalFile *f;
+        Object *o;
+
+        test_setup_logging(LOG_DEBUG);
+
+        mkdtemp_chdir_chattr(t);
+
+        /* The index is opt-in */
+        assert_se(unsetenv("SYSTEMD_JOURNAL_REALTIME_INDEX") >= 0);
+        assert_se(journal_file_open(-1, "plain.journal", O_RDWR|O_CREAT, 0666, true, UINT64_MAX, false, NULL, NULL, NULL, NULL, &f) == 0);
+        assert_se(!JOURNAL_HEADER_REALTIME_INDEX(f->header));
+        (void) journal_file_close(f);
+
+        assert_se(setenv("SYSTEMD_JOURNAL_REALTIME_INDEX", "1", 1) >= 0);
+        assert_se(journal_file_open(-1, "test.journal", O_RDWR|O_CREAT, 0666, true, UINT64_MAX, false, NULL, NULL, NULL, NULL, &f) == 0);
+        assert_se(JOURNAL_HEADER_REALTIME_INDEX(f->header));
+
+        /* Every timestamp is used by two entries in a row, to check that we find the first or last of
+         * them, depending on the direction */
+        base = now(CLOCK_REALTIME) - N_REALTIME_ENTRIES * USEC_PER_SEC;
+        for (unsigned i = 0; i < N_REALTIME_ENTRIES; i++) {
+                dual_timestamp ts = {
+                        .realtime = base + i / 2 * 10,
+                        .monotonic = i + 1,
+                };
+
+                assert_se(journal_file_append_entry(f, &ts, NULL, &iovec, 1, NULL, NULL, NULL) == 0);
+        }
+
+        assert_se(le64toh(f->header->n_realtime_index) == DIV_ROUND_UP(N_REALTIME_ENTRIES, 64U));
+        assert_se(journal_file_verify(f, NULL, NULL, NULL, NULL, false) >= 0);
+
+        for (usec_t needle = base - 7; needle < base + N_REALTIME_ENTRIES / 2 * 10 + 7; needle += 3) {
+                uint64_t first = UINT64_MAX, last = UINT64_MAX;
+
+                for (unsigned i = 0; i < N_REALTIME_ENTRIES; i++) {
+                        usec_t rt = base + i / 2 * 10;
+
+                        if (rt >= needle && first == UINT64_MAX)
+                                first = i + 1;
+                        if (rt <= needle)
+                                last = i + 1;
+                }
+
+                if (first == UINT64_MAX)
+                        assert_se(journal_file_move_to_entry_by_realtime(f, needle, DIRECTION_DOWN, &o, NULL) == 0);
+                else {
+                        assert_se(journal_file_move_to_entry_by_realtime(f, needle, DIRECTION_DOWN, &o, NULL) == 1);
+                        assert_se(le64toh(o->entry.seqnum) == first);
+                }
+
+                if (last == UINT64_MAX)
+                        assert_se(journal_file_move_to_entry_by_realtime(f, needle, DIRECTION_UP, &o, NULL) == 0);
+                else {
+                        assert_se(journal_file_move_to_entry_by_realtime(f, needle, DIRECTION_UP, &o, NULL) == 1);
+                        assert_se(le64toh(o->entry.seqnum) == last);
+                }
+        }
+
+        (void) journal_file_close(f);
+        assert_se(unsetenv("SYSTEMD_JOURNAL_REALTIME_INDEX") >= 0);
+
+        if (arg_keep)
+                log_info("Not removing %s", t);
+        else
+                assert_se(rm_rf(t, REMOVE_ROOT|REMOVE_PHYSICAL) >= 0);
+
+        puts("------------------------------------------------------------");
+}
+
+static void test_rotate_to_spare(void) {
+        _cleanup_closedir_ DIR *d = NULL;
+        JournalFile *f, *spare;
+        dual_timestamp ts;
+        struct iovec iovec;
+        struct dirent *de;
+        struct stat st;
+        unsigned n = 0;
+        Object *o;
+        uint64_t p;
+        ino_t ino;
+        char t[] = "/var/tmp/journal-XXXXXX";
+
+        test_setup_logging(LOG_DEBUG);
+
+        mkdtemp_chdir_chattr(t);
+
+        assert_se(journal_file_open(-1, "test.journal", O_RDWR|O_CREAT, 0666, true, UINT64_MAX, false, NULL, NULL, NULL, NULL, &f) == 0);
+
+        assert_se(dual_timestamp_get(&ts));
+
+        iovec = IOVEC_MAKE_STRING("TEST1=1");
+        assert_se(journal_file_append_entry(f, &ts, NULL, &iovec, 1, NULL, NULL, NULL) == 0);
+
+        /* The spare is prepared ahead of time, but isn't visible yet */
+        assert_se(journal_file_open_spare(f, true, UINT64_MAX, false, &spare) == 0);
+        assert_se(fstat(spare->fd, &st) >= 0);
+        ino = st.st_ino;
+        assert_se(stat("test.journal", &st) >= 0);
+        assert_se(st.st_ino != ino);
+
+        /* The spare catches up with entries written in the meantime when it is put in place */
+        assert_se(journal_file_append_entry(f, &ts, NULL, &iovec, 1, NULL, NULL, NULL) == 0);
+
+        assert_se(journal_file_rotate_to_spare(&f, &spare, NULL) == 0);
+        assert_se(!spare);
+        assert_se(stat("test.journal", &st) >= 0);
+        assert_se(st.st_ino == ino);
+
+        iovec = IOVEC_MAKE_STRING("TEST2=2");
+        assert_se(journal_file_append_entry(f, &ts, NULL, &iovec, 1, NULL, NULL, NULL) == 0);
+        assert_se(journal_file_next_entry(f, 0, DIRECTION_DOWN, &o, &p) == 1);
+        assert_se(le64toh(o->entry.seqnum) == 3);
+
+        /* A spare that is never used leaves nothing behind */
+        assert_se(journal_file_open_spare(f, true, UINT64_MAX, false, &spare) == 0);
+        spare = journal_file_close(spare);
+
+        (void) journal_file_close(f);
+
+        /* Just the active file and the archived one */
+        assert_se(d = opendir("."));
+        FOREACH_DIRENT_ALL(de, d, assert_not_reached()) {
+                if (dot_or_dot_dot(de->d_name))
+                        continue;
+
+                assert_se(endswith(de->d_name, ".journal"));
+                n++;
+        }
+        assert_se(n == 2);
+
+        log_info("Done...");
+
+        if (arg_keep)
+                log_info("Not removing %s", t);
+        else
+                assert_se(rm_rf(t, REMOVE_ROOT|REMOVE_PHYSICAL) >= 0);
+
+        puts("------------------------------------------------------------");
+}
+
 static void test_empty(void) {
         JournalFile *f1, *f2, *f3, *f4;
         char t[] = "/var/tmp/journal-XXXXXX";
@@ -240,6 +540,95 @@ static void test_min_compress_size(void) {
 }
 #endif
 
+#if HAVE_ZSTD
+#define N_DICTIONARY_ENTRIES 4000U
+
+static void dictionary_message(unsigned i, char *buf, size_t size) {
+        assert_se(snprintf(buf, size, "MESSAGE=Started session %u of user user%u on seat%u, see the session log for details.", i, i % 97, i % 5) < (int) size);
+}
+
+static void append_dictionary_entry(JournalFile *f, unsigned i) {
+        char message[LINE_MAX], pid[DECIMAL_STR_MAX(unsigned) + 5], cursor[64];
+        struct iovec iovec[3];
+        dual_timestamp ts;
+
+        dictionary_message(i, message, sizeof(message));
+        xsprintf(pid, "_PID=%u", i + 100);
+        xsprintf(cursor, "SESSION_CURSOR=s=%08x;i=%x;b=%x", i * 7919, i, i % 13);
+
+        iovec[0] = IOVEC_MAKE_STRING(message);
+        iovec[1] = IOVEC_MAKE_STRING(pid);
+        iovec[2] = IOVEC_MAKE_STRING(cursor);
+
+        dual_timestamp_get(&ts);
+        assert_se(journal_file_append_entry(f, &ts, NULL, iovec, ELEMENTSOF(iovec), NULL, NULL, NULL) == 0);
+}
+
+static void test_compress_dictionary(void) {
+        char t[] = "/var/tmp/journal-XXXXXX", message[LINE_MAX];
+        JournalFile *f, *f2;
+        unsigned n = 0;
+        Object *o;
+
+        test_setup_logging(LOG_DEBUG);
+
+        mkdtemp_chdir_chattr(t);
+
+        /* Off by default, as older versions can't read such files */
+        assert_se(unsetenv("SYSTEMD_JOURNAL_COMPRESS_DICTIONARY") >= 0);
+        assert_se(journal_file_open(-1, "test0.journal", O_RDWR|O_CREAT, 0666, true, UINT64_MAX, false, NULL, NULL, NULL, NULL, &f) == 0);
+        assert_se(!JOURNAL_HEADER_ZSTD_DICTIONARY(f->header));
+        (void) journal_file_close(f);
+
+        assert_se(setenv("SYSTEMD_JOURNAL_COMPRESS_DICTIONARY", "1", 1) >= 0);
+        assert_se(journal_file_open(-1, "test.journal", O_RDWR|O_CREAT, 0666, true, UINT64_MAX, false, NULL, NULL, NULL, NULL, &f) == 0);
+        assert_se(JOURNAL_HEADER_ZSTD_DICTIONARY(f->header));
+        assert_se(f->header->dictionary_offset == 0);
+
+        for (; n < N_DICTIONARY_ENTRIES; n++)
+                append_dictionary_entry(f, n);
+
+        /* By now enough samples were collected. Training happens in a thread, and the result is written
+         * to the file by one of the appends after it finished. */
+        for (unsigned i = 0; f->header->dictionary_offset == 0; i++) {
+                assert_se(i < 10000);
+                append_dictionary_entry(f, n++);
+                (void) usleep(USEC_PER_MSEC);
+        }
+
+        /* Short payloads written afterwards are compressed with it */
+        append_dictionary_entry(f, n++);
+        dictionary_message(n - 1, message, sizeof(message));
+        assert_se(journal_file_find_data_object(f, message, strlen(message), &o, NULL) == 1);
+        assert_se(o->object.flags & OBJECT_COMPRESSED_ZSTD);
+
+        assert_se(journal_file_verify(f, NULL, NULL, NULL, NULL, false) >= 0);
+
+        /* A file opened with this one as template starts out with the same dictionary */
+        assert_se(journal_file_open(-1, "test2.journal", O_RDWR|O_CREAT, 0666, true, UINT64_MAX, false, NULL, NULL, NULL, f, &f2) == 0);
+        assert_se(f2->header->dictionary_offset != 0);
+        (void) journal_file_close(f2);
+        (void) journal_file_close(f);
+
+        /* Reading everything back, from a fresh instance that has to load the dictionary first */
+        assert_se(journal_file_open(-1, "test.journal", O_RDONLY, 0666, true, UINT64_MAX, false, NULL, NULL, NULL, NULL, &f) == 0);
+        for (unsigned i = 0; i < n; i++) {
+                dictionary_message(i, message, sizeof(message));
+                assert_se(journal_file_find_data_object(f, message, strlen(message), NULL, NULL) == 1);
+        }
+        (void) journal_file_close(f);
+
+        assert_se(unsetenv("SYSTEMD_JOURNAL_COMPRESS_DICTIONARY") >= 0);
+
+        if (arg_keep)
+                log_info("Not removing %s", t);
+        else
+                assert_se(rm_rf(t, REMOVE_ROOT|REMOVE_PHYSICAL) >= 0);
+
+        puts("------------------------------------------------------------");
+}
+#endif
+
 int main(int argc, char *argv[]) {
         arg_keep = argc > 1;
 
@@ -250,10 +639,17 @@ int main(int argc, char *argv[]) {
                 return log_tests_skipped("/etc/machine-id not found");
 
         test_non_empty();
+        test_append_entries();
+        test_data_cache();
+        test_realtime_index();
+        test_rotate_to_spare();
         test_empty();
 #if HAVE_COMPRESSION
         test_min_compress_size();
 #endif
+#if HAVE_ZSTD
+        test_compress_dictionary();
+#endif
 
         return 0;
 }
@@ -11,6 +11,55 @@
 #include "tmpfile-util.h"
 #include "util.h"
 
+static void test_sequential(void) {
+        _cleanup_close_ int fd = -1;
+        char path[] = "/tmp/testmmapSXXXXXX";
+        MMapFileDescriptor *f;
+        struct stat st;
+        MMapCache *m;
+        uint8_t *p, *q;
+        uint64_t offset;
+
+        assert_se(m = mmap_cache_new());
+
+        fd = mkostemp_safe(path);
+        assert_se(fd >= 0);
+        (void) unlink(path);
+
+        assert_se(ftruncate(fd, 64ULL*1024ULL*1024ULL) >= 0);
+        assert_se(pwrite(fd, "x", 1, 12ULL*1024ULL*1024ULL) == 1);
+        assert_se(fstat(fd, &st) >= 0);
+
+        assert_se(f = mmap_cache_add_fd(m, fd, PROT_READ));
+
+        /* Walk through the file front to back, the window we get once we leave the first one should start
+         * where we asked for, and be larger than the default, except on 32-bit archs */
+        for (offset = 0; offset < 10ULL*1024ULL*1024ULL; offset += 4096)
+                assert_se(mmap_cache_get(m, f, 0, false, offset, 64, &st, (void**) &p) > 0);
+
+        assert_se(mmap_cache_get(m, f, 0, false, 8ULL*1024ULL*1024ULL, 64, &st, (void**) &p) > 0);
+        if (sizeof(void*) > 4) {
+                assert_se(mmap_cache_get(m, f, 1, false, 23ULL*1024ULL*1024ULL, 64, &st, (void**) &q) > 0);
+                assert_se(p + 15ULL*1024ULL*1024ULL == q);
+        } else {
+                assert_se(mmap_cache_get(m, f, 1, false, 15ULL*1024ULL*1024ULL, 64, &st, (void**) &q) > 0);
+                assert_se(p + 7ULL*1024ULL*1024ULL == q);
+        }
+
+        assert_se(mmap_cache_get(m, f, 0, false, 12ULL*1024ULL*1024ULL, 1, &st, (void**) &p) > 0);
+        assert_se(*p == 'x');
+
+        /* Random access goes back to regular windows */
+        assert_se(mmap_cache_get(m, f, 0, false, 40ULL*1024ULL*1024ULL, 64, &st, (void**) &p) > 0);
+        assert_se(mmap_cache_get(m, f, 1, false, 44ULL*1024ULL*1024ULL + 4096, 64, &st, (void**) &q) > 0);
+        assert_se(p + 4ULL*1024ULL*1024ULL + 4096 != q);
+
+        mmap_cache_stats_log_debug(m);
+
+        mmap_cache_free_fd(m, f);
+        mmap_cache_unref(m);
+}
+
 int main(int argc, char *argv[]) {
         MMapFileDescriptor *fx;
         int x, y, z, r;
@@ -62,5 +111,7 @@ int main(int argc, char *argv[]) {
         safe_close(y);
         safe_close(z);
 
+        test_sequential();
+
         return 0;
 }
@@ -0,0 +1,321 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+
+#include <errno.h>
+
+#if HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "alloc-util.h"
+#include "hash-funcs.h"
+#include "io-util.h"
+#include "journal-binary-encoder.h"
+#include "journal-importer.h"
+#include "log.h"
+#include "memory-util.h"
+#include "siphash24.h"
+#include "unaligned.h"
+
+static void iovec_hash_func(const struct iovec *v, struct siphash *state) {
+        siphash24_compress(v->iov_base, v->iov_len, state);
+}
+
+static int iovec_compare_func(const struct iovec *a, const struct iovec *b) {
+        int r;
+
+        r = CMP(a->iov_len, b->iov_len);
+        if (r != 0)
+                return r;
+
+        return memcmp_safe(a->iov_base, b->iov_base, a->iov_len);
+}
+
+DEFINE_PRIVATE_HASH_OPS(iovec_hash_ops, struct iovec, iovec_hash_func, iovec_compare_func);
+
+static void forget_values(JournalBinaryEncoder *e) {
+        assert(e);
+
+        hashmap_clear(e->slots);
+
+        if (e->values)
+                for (size_t i = 0; i < MIN(e->n_values, (size_t) JOURNAL_BINARY_SLOTS); i++)
+                        free(e->values[i].iov_base);
+
+        e->n_values = 0;
+}
+
+JournalBinaryEncoder* journal_binary_encoder_free(JournalBinaryEncoder *e) {
+        if (!e)
+                return NULL;
+
+        forget_values(e);
+        hashmap_free(e->slots);
+        free(e->values);
+        free(e->frame);
+        free(e->output);
+#if HAVE_ZSTD
+        ZSTD_freeCCtx(e->compressor);
+#endif
+
+        return mfree(e);
+}
+
+int journal_binary_encoder_new(JournalBinaryEncoder **ret) {
+#if HAVE_ZSTD
+        _cleanup_(journal_binary_encoder_freep) JournalBinaryEncoder *e = NULL;
+
+        assert(ret);
+
+        e = new0(JournalBinaryEncoder, 1);
+        if (!e)
+                return -ENOMEM;
+
+        e->values = new(struct iovec, JOURNAL_BINARY_SLOTS);
+        if (!e->values)
+                return -ENOMEM;
+
+        e->slots = hashmap_new(&iovec_hash_ops);
+        if (!e->slots)
+                return -ENOMEM;
+
+        e->compressor = ZSTD_createCCtx();
+        if (!e->compressor)
+                return -ENOMEM;
+
+        *ret = TAKE_PTR(e);
+        return 0;
+#else
+        return -EOPNOTSUPP;
+#endif
+}
+
+int journal_binary_encoder_reset(JournalBinaryEncoder *e) {
+#if HAVE_ZSTD
+        size_t k;
+
+        assert(e);
+
+        /* The receiver starts with an empty table for each stream */
+        forget_values(e);
+
+        e->frame_size = e->n_fields = 0;
+        e->output_offset = e->output_filled = 0;
+        e->bytes_in = e->bytes_out = 0;
+
+        k = ZSTD_CCtx_reset(e->compressor, ZSTD_reset_session_only);
+        if (ZSTD_isError(k))
+                return -EIO;
+
+        return 0;
+#else
+        assert_not_reached();
+#endif
+}
+
+#if HAVE_ZSTD
+static int compress_data(JournalBinaryEncoder *e, const void *data, size_t size, ZSTD_EndDirective mode) {
+        ZSTD_inBuffer input = {
+                .src = data,
+                .size = size,
+        };
+
+        assert(e);
+
+        for (;;) {
+                ZSTD_outBuffer output;
+                size_t k;
+
+                if (e->output_offset == e->output_filled)
+                        e->output_offset = e->output_filled = 0;
+
+                if (e->output_size - e->output_filled < ZSTD_CStreamOutSize()) {
+                        if (!GREEDY_REALLOC(e->output, e->output_filled + ZSTD_CStreamOutSize()))
+                                return -ENOMEM;
+
+                        e->output_size = MALLOC_SIZEOF_SAFE(e->output);
+                }
+
+                output = (ZSTD_outBuffer) {
+                        .dst = e->output + e->output_filled,
+                        .size = e->output_size - e->output_filled,
+                };
+
+                k = ZSTD_compressStream2(e->compressor, &output, &input, mode);
+                if (ZSTD_isError(k))
+                        return log_debug_errno(SYNTHETIC_ERRNO(EIO),
+                                               "Failed to compress entry: %s", ZSTD_getErrorName(k));
+
+                e->output_filled += output.pos;
+                e->bytes_out += output.pos;
+
+                /* With ZSTD_e_continue the input is always consumed, otherwise k is what is left to flush */
+                if (input.pos >= input.size && (mode == ZSTD_e_continue || k == 0))
+                        break;
+        }
+
+        e->bytes_in += size;
+        return 0;
+}
+#endif
+
+static void* frame_append(JournalBinaryEncoder *e, size_t size) {
+        void *p;
+
+        assert(e);
+
+        if (!GREEDY_REALLOC(e->frame, e->frame_size + size))
+                return NULL;
+
+        p = e->frame + e->frame_size;
+        e->frame_size += size;
+        return p;
+}
+
+int journal_binary_encoder_begin_entry(JournalBinaryEncoder *e, const dual_timestamp *ts, sd_id128_t boot_id) {
+        uint8_t *p;
+
+        assert(e);
+        assert(ts);
+
+        e->frame_size = e->n_fields = 0;
+
+        /* The size and the number of fields are filled in when the entry is complete */
+        p = frame_append(e, sizeof(uint32_t) + JOURNAL_BINARY_HEADER_SIZE);
+        if (!p)
+                return -ENOMEM;
+
+        p += sizeof(uint32_t);
+        unaligned_write_le64(p, ts->realtime);
+        p += sizeof(uint64_t);
+        unaligned_write_le64(p, ts->monotonic);
+        p += sizeof(uint64_t);
+        memcpy(p, &boot_id, sizeof(boot_id));
+
+        return 0;
+}
+
+static int remember_value(JournalBinaryEncoder *e, const void *data, size_t size) {
+        struct iovec *slot;
+        unsigned index;
+        void *copy;
+        int r;
+
+        assert(e);
+
+        copy = memdup(data, size);
+        if (!copy)
+                return -ENOMEM;
+
+        /* Reuse slots in the same order as the receiver does */
+        index = e->n_values % JOURNAL_BINARY_SLOTS;
+        slot = e->values + index;
+        if (e->n_values >= JOURNAL_BINARY_SLOTS) {
+                hashmap_remove_value(e->slots, slot, UINT_TO_PTR(index + 1));
+                free(slot->iov_base);
+        }
+
+        *slot = IOVEC_MAKE(copy, size);
+
+        r = hashmap_put(e->slots, slot, UINT_TO_PTR(index + 1));
+        if (r < 0) {
+                /* Keep the slot in sync with the receiver, even if we will never refer to it */
+                log_debug_errno(r, "Failed to remember value, ignoring: %m");
+                *slot = (struct iovec) {};
+                free(copy);
+        }
+
+        e->n_values++;
+        return 0;
+}
+
+int journal_binary_encoder_add_field(JournalBinaryEncoder *e, const void *data, size_t size) {
+        uint32_t ref = JOURNAL_BINARY_LITERAL;
+        uint8_t *p;
+        int r;
+
+        assert(e);
+        assert(data || size == 0);
+        assert(e->frame_size > 0);
+
+        if (size > DATA_SIZE_MAX)
+                return -E2BIG;
+
+        if (size <= JOURNAL_BINARY_VALUE_SIZE_MAX) {
+                unsigned slot;
+
+                slot = PTR_TO_UINT(hashmap_get(e->slots, &IOVEC_MAKE((void*) data, size)));
+                if (slot > 0) {
+                        p = frame_append(e, sizeof(uint32_t));
+                        if (!p)
+                                return -ENOMEM;
+
+                        unaligned_write_le32(p, slot - 1 + _JOURNAL_BINARY_REF_FIRST);
+                        e->n_fields++;
+                        return 0;
+                }
+
+                r = remember_value(e, data, size);
+                if (r < 0)
+                        return r;
+
+                ref = JOURNAL_BINARY_LITERAL_REMEMBER;
+        }
+
+        p = frame_append(e, sizeof(uint32_t) * 2 + size);
+        if (!p)
+                return -ENOMEM;
+
+        unaligned_write_le32(p, ref);
+        unaligned_write_le32(p + sizeof(uint32_t), size);
+        memcpy_safe(p + sizeof(uint32_t) * 2, data, size);
+        e->n_fields++;
+
+        return 0;
+}
+
+int journal_binary_encoder_end_entry(JournalBinaryEncoder *e) {
+#if HAVE_ZSTD
+        int r;
+
+        assert(e);
+        assert(e->frame_size > 0);
+
+        if (e->frame_size > ENTRY_SIZE_MAX)
+                return -E2BIG;
+
+        unaligned_write_le32(e->frame, e->frame_size - sizeof(uint32_t));
+        unaligned_write_le32(e->frame + sizeof(uint32_t) + JOURNAL_BINARY_HEADER_SIZE - sizeof(uint32_t), e->n_fields);
+
+        r = compress_data(e, e->frame, e->frame_size, ZSTD_e_continue);
+        if (r < 0)
+                return r;
+
+        e->frame_size = e->n_fields = 0;
+        return 0;
+#else
+        assert_not_reached();
+#endif
+}
+
+int journal_binary_encoder_end(JournalBinaryEncoder *e) {
+#if HAVE_ZSTD
+        assert(e);
+
+        return compress_data(e, NULL, 0, ZSTD_e_end);
+#else
+        assert_not_reached();
+#endif
+}
+
+size_t journal_binary_encoder_read(JournalBinaryEncoder *e, void *buf, size_t size) {
+        size_t n;
+
+        assert(e);
+        assert(buf || size == 0);
+
+        n = MIN(size, e->output_filled - e->output_offset);
+        memcpy_safe(buf, e->output + e->output_offset, n);
+        e->output_offset += n;
+
+        return n;
+}
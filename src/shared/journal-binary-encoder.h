@@ -0,0 +1,45 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#include "sd-id128.h"
+
+#include "hashmap.h"
+#include "time-util.h"
+
+/* Produces the binary format described in journal-importer.h. Entries are added field by field, so that the
+ * data does not need to stay valid until the entry is complete, and the compressed output is read back in
+ * pieces of arbitrary size. */
+typedef struct JournalBinaryEncoder {
+        struct iovec *values;   /* our copy of the receiver's table */
+        size_t n_values;        /* total number of values remembered so far */
+        Hashmap *slots;         /* value → slot + 1 */
+
+        char *frame;            /* the entry being built */
+        size_t frame_size;
+        size_t n_fields;
+
+        char *output;           /* compressed data not read yet */
+        size_t output_size;
+        size_t output_offset, output_filled;
+
+        void *compressor;
+
+        uint64_t bytes_in, bytes_out;
+} JournalBinaryEncoder;
+
+int journal_binary_encoder_new(JournalBinaryEncoder **ret);
+JournalBinaryEncoder* journal_binary_encoder_free(JournalBinaryEncoder *e);
+DEFINE_TRIVIAL_CLEANUP_FUNC(JournalBinaryEncoder*, journal_binary_encoder_free);
+
+int journal_binary_encoder_reset(JournalBinaryEncoder *e);
+
+int journal_binary_encoder_begin_entry(JournalBinaryEncoder *e, const dual_timestamp *ts, sd_id128_t boot_id);
+int journal_binary_encoder_add_field(JournalBinaryEncoder *e, const void *data, size_t size);
+int journal_binary_encoder_end_entry(JournalBinaryEncoder *e);
+int journal_binary_encoder_end(JournalBinaryEncoder *e);
+
+size_t journal_binary_encoder_read(JournalBinaryEncoder *e, void *buf, size_t size);
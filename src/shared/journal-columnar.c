@@ -0,0 +1,714 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+
+#include <errno.h>
+
+#include "alloc-util.h"
+#include "errno-util.h"
+#include "fileio.h"
+#include "journal-columnar.h"
+#include "journal-internal.h"
+#include "log.h"
+#include "memory-util.h"
+#include "random-util.h"
+#include "siphash24.h"
+#include "sparse-endian.h"
+#include "strv.h"
+
+#define COLUMNAR_STREAM_SIGNATURE ((const char[]) { 'S', 'D', 'J', 'C', 'O', 'L', 'S', '1' })
+#define COLUMNAR_BATCH_SIGNATURE  ((const char[]) { 'S', 'D', 'J', 'C', 'O', 'L', 'B', '1' })
+
+/* A batch is written out once it has this many rows, or its values take up this many bytes */
+#define COLUMNAR_BATCH_ROWS 4096U
+#define COLUMNAR_BATCH_BYTES (4U * 1024U * 1024U)
+
+/* The hash table used for deduplicating the values of a column within a batch, never more than half full */
+#define COLUMNAR_TABLE_SIZE (COLUMNAR_BATCH_ROWS * 2U)
+assert_cc((COLUMNAR_TABLE_SIZE & (COLUMNAR_TABLE_SIZE - 1)) == 0);
+
+/* Limits enforced when reading a stream */
+#define COLUMNAR_COLUMNS_MAX 1024U
+#define COLUMNAR_NAME_MAX 1024U
+#define COLUMNAR_BATCH_SIZE_MAX (1024U * 1024U * 1024U)
+
+/* Row index of a column that the entry doesn't have a value for */
+#define COLUMNAR_NULL UINT32_MAX
+
+/* Used if no fields are explicitly selected */
+static const char *const default_fields[] = {
+        "_BOOT_ID",
+        "PRIORITY",
+        "SYSLOG_IDENTIFIER",
+        "_PID",
+        "_SYSTEMD_UNIT",
+        "_HOSTNAME",
+        "MESSAGE",
+        NULL
+};
+
+typedef struct WriterColumn {
+        char *name;
+        size_t name_len;
+
+        /* The distinct values of the current batch, back to back */
+        uint8_t *data;
+        size_t data_size;
+        le32_t *offsets; /* n_values + 1 entries, value i is at data[offsets[i]] up to data[offsets[i+1]] */
+        uint32_t *hashes;
+        size_t n_values;
+
+        le32_t *indices; /* The value index of each row, or COLUMNAR_NULL */
+        uint32_t *table; /* Hash table of value index + 1, or 0 for empty buckets */
+} WriterColumn;
+
+struct ColumnarWriter {
+        FILE *f;
+
+        WriterColumn *columns;
+        size_t n_columns;
+
+        le64_t *realtime;
+        le64_t *monotonic;
+        size_t n_rows;
+        size_t n_skipped; /* Entries we couldn't read, whose values might still take up space in the batch */
+        size_t data_size;
+
+        uint8_t hash_key[16];
+        bool header_written;
+};
+
+typedef struct ReaderColumn {
+        uint32_t n_values;
+        const le32_t *offsets;
+        const uint8_t *data;
+        const le32_t *indices;
+} ReaderColumn;
+
+struct ColumnarReader {
+        FILE *f;
+
+        char **names;
+        ReaderColumn *columns;
+        size_t n_columns;
+
+        void *buffer;
+        size_t n_rows;
+        const le64_t *realtime;
+        const le64_t *monotonic;
+};
+
+static void writer_column_reset(WriterColumn *c) {
+        assert(c);
+
+        c->data_size = 0;
+        c->n_values = 0;
+        c->offsets[0] = 0;
+        memzero(c->table, COLUMNAR_TABLE_SIZE * sizeof(uint32_t));
+}
+
+static void writer_column_done(WriterColumn *c) {
+        assert(c);
+
+        free(c->name);
+        free(c->data);
+        free(c->offsets);
+        free(c->hashes);
+        free(c->indices);
+        free(c->table);
+}
+
+int columnar_writer_new(FILE *f, char **fields, ColumnarWriter **ret) {
+        _cleanup_(columnar_writer_freep) ColumnarWriter *w = NULL;
+        _cleanup_strv_free_ char **l = NULL;
+        char **field;
+
+        assert(f);
+        assert(ret);
+
+        l = strv_copy(strv_isempty(fields) ? (char**) default_fields : fields);
+        if (!l)
+                return -ENOMEM;
+
+        strv_uniq(l);
+
+        w = new(ColumnarWriter, 1);
+        if (!w)
+                return -ENOMEM;
+
+        *w = (ColumnarWriter) {
+                .f = f,
+        };
+
+        w->columns = new0(WriterColumn, strv_length(l));
+        w->realtime = new(le64_t, COLUMNAR_BATCH_ROWS);
+        w->monotonic = new(le64_t, COLUMNAR_BATCH_ROWS);
+        if (!w->columns || !w->realtime || !w->monotonic)
+                return -ENOMEM;
+
+        /* Everything a batch needs is allocated upfront, except for the value data, which is reused
+         * between batches. Adding an entry hence doesn't allocate anything in the common case. */
+        STRV_FOREACH(field, l) {
+                WriterColumn *c = w->columns + w->n_columns++;
+
+                c->name = strdup(*field);
+                c->name_len = strlen(*field);
+                c->offsets = new(le32_t, COLUMNAR_BATCH_ROWS + 1);
+                c->hashes = new(uint32_t, COLUMNAR_BATCH_ROWS);
+                c->indices = new(le32_t, COLUMNAR_BATCH_ROWS);
+                c->table = new(uint32_t, COLUMNAR_TABLE_SIZE);
+                if (!c->name || !c->offsets || !c->hashes || !c->indices || !c->table)
+                        return -ENOMEM;
+
+                writer_column_reset(c);
+        }
+
+        random_bytes(w->hash_key, sizeof(w->hash_key));
+
+        *ret = TAKE_PTR(w);
+        return 0;
+}
+
+ColumnarWriter* columnar_writer_free(ColumnarWriter *w) {
+        if (!w)
+                return NULL;
+
+        for (size_t i = 0; i < w->n_columns; i++)
+                writer_column_done(w->columns + i);
+
+        free(w->columns);
+        free(w->realtime);
+        free(w->monotonic);
+
+        return mfree(w);
+}
+
+static WriterColumn* writer_find_column(ColumnarWriter *w, const char *name, size_t name_len) {
+        assert(w);
+
+        /* Only a handful of columns are usually selected, a linear search is fastest for those */
+        for (size_t i = 0; i < w->n_columns; i++)
+                if (w->columns[i].name_len == name_len && memcmp(w->columns[i].name, name, name_len) == 0)
+                        return w->columns + i;
+
+        return NULL;
+}
+
+static int writer_column_add(ColumnarWriter *w, WriterColumn *c, const void *value, size_t size, uint32_t *ret) {
+        uint32_t h;
+
+        assert(w);
+        assert(c);
+        assert(value || size == 0);
+        assert(ret);
+
+        h = (uint32_t) siphash24(value, size, w->hash_key);
+
+        for (size_t i = h & (COLUMNAR_TABLE_SIZE - 1);; i = (i + 1) & (COLUMNAR_TABLE_SIZE - 1)) {
+                uint32_t v = c->table[i];
+
+                if (v == 0) {
+                        /* Not seen in this batch yet, append it */
+                        if (size > UINT32_MAX - c->data_size)
+                                return -E2BIG;
+
+                        if (!GREEDY_REALLOC(c->data, c->data_size + size))
+                                return -ENOMEM;
+
+                        memcpy_safe(c->data + c->data_size, value, size);
+                        c->data_size += size;
+                        w->data_size += size;
+
+                        v = c->n_values++;
+                        c->hashes[v] = h;
+                        c->offsets[v + 1] = htole32(c->data_size);
+                        c->table[i] = v + 1;
+
+                        *ret = v;
+                        return 0;
+                }
+
+                v--;
+                if (c->hashes[v] == h) {
+                        uint32_t start = le32toh(c->offsets[v]), end = le32toh(c->offsets[v + 1]);
+
+                        if (end - start == size && memcmp_safe(c->data + start, value, size) == 0) {
+                                *ret = v;
+                                return 0;
+                        }
+                }
+        }
+}
+
+int columnar_writer_add_entry(ColumnarWriter *w, sd_journal *j) {
+        usec_t realtime, monotonic;
+        const void *data;
+        size_t length, row;
+        int r;
+
+        assert(w);
+        assert(j);
+
+        /* Each entry adds at most one value to each column, hence this bounds the number of values too */
+        assert(w->n_rows + w->n_skipped < COLUMNAR_BATCH_ROWS);
+
+        r = sd_journal_get_realtime_usec(j, &realtime);
+        if (r < 0)
+                return log_error_errno(r, "Failed to get realtime timestamp: %m");
+
+        r = sd_journal_get_monotonic_usec(j, &monotonic, NULL);
+        if (r < 0)
+                return log_error_errno(r, "Failed to get monotonic timestamp: %m");
+
+        row = w->n_rows;
+        for (size_t i = 0; i < w->n_columns; i++)
+                w->columns[i].indices[row] = htole32(COLUMNAR_NULL);
+
+        JOURNAL_FOREACH_DATA_RETVAL(j, data, length, r) {
+                WriterColumn *c;
+                const char *eq;
+                uint32_t idx;
+                size_t n;
+
+                eq = memchr(data, '=', length);
+                if (!eq)
+                        continue;
+
+                n = eq - (const char*) data;
+
+                c = writer_find_column(w, data, n);
+                if (!c)
+                        continue;
+
+                /* Only the first value of fields that are set more than once is stored */
+                if (c->indices[row] != htole32(COLUMNAR_NULL))
+                        continue;
+
+                r = writer_column_add(w, c, eq + 1, length - n - 1, &idx);
+                if (r < 0)
+                        return log_error_errno(r, "Failed to add value of field %s: %m", c->name);
+
+                c->indices[row] = htole32(idx);
+        }
+        if (r == -EBADMSG) {
+                /* The values added so far stay unreferenced in the batch, that's fine */
+                log_debug_errno(r, "Skipping message we can't read: %m");
+                w->n_skipped++;
+        } else if (r < 0)
+                return log_error_errno(r, "Failed to get journal fields: %m");
+        else {
+                w->realtime[row] = htole64(realtime);
+                w->monotonic[row] = htole64(monotonic);
+                w->n_rows++;
+        }
+
+        if (w->n_rows + w->n_skipped >= COLUMNAR_BATCH_ROWS || w->data_size >= COLUMNAR_BATCH_BYTES)
+                return columnar_writer_flush(w);
+
+        return 0;
+}
+
+static void write_padding(FILE *f, size_t n) {
+        static const uint8_t zeros[8] = {};
+
+        assert(f);
+
+        fwrite(zeros, 1, ALIGN_TO(n, 8) - n, f);
+}
+
+static void writer_write_header(ColumnarWriter *w) {
+        le32_t v[2];
+        size_t n;
+
+        assert(w);
+
+        fwrite(COLUMNAR_STREAM_SIGNATURE, 1, sizeof(COLUMNAR_STREAM_SIGNATURE), w->f);
+
+        v[0] = htole32(w->n_columns);
+        v[1] = 0;
+        fwrite(v, sizeof(le32_t), 2, w->f);
+
+        n = sizeof(COLUMNAR_STREAM_SIGNATURE) + sizeof(v);
+        for (size_t i = 0; i < w->n_columns; i++) {
+                le32_t l = htole32(w->columns[i].name_len);
+
+                fwrite(&l, sizeof(l), 1, w->f);
+                fwrite(w->columns[i].name, 1, w->columns[i].name_len, w->f);
+                n += sizeof(l) + w->columns[i].name_len;
+        }
+
+        write_padding(w->f, n);
+}
+
+int columnar_writer_flush(ColumnarWriter *w) {
+        uint64_t size;
+        le32_t v[2];
+        le64_t s;
+        int r;
+
+        assert(w);
+
+        if (!w->header_written) {
+                writer_write_header(w);
+                w->header_written = true;
+        }
+
+        if (w->n_rows > 0) {
+                size = 2 * sizeof(le64_t) * w->n_rows;
+                for (size_t i = 0; i < w->n_columns; i++) {
+                        WriterColumn *c = w->columns + i;
+
+                        size += sizeof(v) +
+                                ALIGN_TO(sizeof(le32_t) * (c->n_values + 1) + c->data_size, 8) +
+                                ALIGN_TO(sizeof(le32_t) * w->n_rows, 8);
+                }
+
+                fwrite(COLUMNAR_BATCH_SIGNATURE, 1, sizeof(COLUMNAR_BATCH_SIGNATURE), w->f);
+                v[0] = htole32(w->n_rows);
+                v[1] = 0;
+                fwrite(v, sizeof(le32_t), 2, w->f);
+                s = htole64(size);
+                fwrite(&s, sizeof(s), 1, w->f);
+
+                fwrite(w->realtime, sizeof(le64_t), w->n_rows, w->f);
+                fwrite(w->monotonic, sizeof(le64_t), w->n_rows, w->f);
+
+                for (size_t i = 0; i < w->n_columns; i++) {
+                        WriterColumn *c = w->columns + i;
+
+                        v[0] = htole32(c->n_values);
+                        v[1] = htole32(c->data_size);
+                        fwrite(v, sizeof(le32_t), 2, w->f);
+
+                        fwrite(c->offsets, sizeof(le32_t), c->n_values + 1, w->f);
+                        fwrite(c->data, 1, c->data_size, w->f);
+                        write_padding(w->f, sizeof(le32_t) * (c->n_values + 1) + c->data_size);
+
+                        fwrite(c->indices, sizeof(le32_t), w->n_rows, w->f);
+                        write_padding(w->f, sizeof(le32_t) * w->n_rows);
+                }
+        }
+
+        if (w->n_rows > 0 || w->n_skipped > 0)
+                for (size_t i = 0; i < w->n_columns; i++)
+                        writer_column_reset(w->columns + i);
+
+        w->n_rows = 0;
+        w->n_skipped = 0;
+        w->data_size = 0;
+
+        r = fflush_and_check(w->f);
+        if (r < 0)
+                return log_error_errno(r, "Failed to write columnar output: %m");
+
+        return 0;
+}
+
+int columnar_reader_new(FILE *f, ColumnarReader **ret) {
+        ColumnarReader *r;
+
+        assert(f);
+        assert(ret);
+
+        r = new(ColumnarReader, 1);
+        if (!r)
+                return -ENOMEM;
+
+        *r = (ColumnarReader) {
+                .f = f,
+        };
+
+        *ret = r;
+        return 0;
+}
+
+ColumnarReader* columnar_reader_free(ColumnarReader *r) {
+        if (!r)
+                return NULL;
+
+        strv_free(r->names);
+        free(r->columns);
+        free(r->buffer);
+
+        return mfree(r);
+}
+
+static int read_exact(FILE *f, void *buf, size_t n, bool eof_ok) {
+        size_t k;
+
+        assert(f);
+        assert(buf || n == 0);
+
+        /* Returns 0 on EOF before anything was read if eof_ok is set, and 1 if all n bytes were read */
+
+        k = fread(buf, 1, n, f);
+        if (k == n)
+                return 1;
+        if (ferror(f))
+                return errno_or_else(EIO);
+        if (k == 0 && eof_ok)
+                return 0;
+
+        return -EBADMSG; /* Truncated */
+}
+
+static int reader_read_schema(ColumnarReader *r) {
+        _cleanup_strv_free_ char **names = NULL;
+        _cleanup_free_ ReaderColumn *columns = NULL;
+        uint8_t padding[8];
+        size_t n_columns, n;
+        le32_t v[2];
+        int k;
+
+        assert(r);
+
+        k = read_exact(r->f, v, sizeof(v), false);
+        if (k < 0)
+                return k;
+
+        n_columns = le32toh(v[0]);
+        if (n_columns > COLUMNAR_COLUMNS_MAX)
+                return -EBADMSG;
+
+        names = new0(char*, n_columns + 1);
+        columns = new0(ReaderColumn, n_columns);
+        if (!names || !columns)
+                return -ENOMEM;
+
+        n = sizeof(COLUMNAR_STREAM_SIGNATURE) + sizeof(v);
+        for (size_t i = 0; i < n_columns; i++) {
+                le32_t l;
+                size_t m;
+
+                k = read_exact(r->f, &l, sizeof(l), false);
+                if (k < 0)
+                        return k;
+
+                m = le32toh(l);
+                if (m == 0 || m > COLUMNAR_NAME_MAX)
+                        return -EBADMSG;
+
+                names[i] = new(char, m + 1);
+                if (!names[i])
+                        return -ENOMEM;
+
+                k = read_exact(r->f, names[i], m, false);
+                if (k < 0)
+                        return k;
+                if (memchr(names[i], 0, m))
+                        return -EBADMSG;
+                names[i][m] = 0;
+
+                n += sizeof(l) + m;
+        }
+
+        k = read_exact(r->f, padding, ALIGN_TO(n, 8) - n, false);
+        if (k < 0)
+                return k;
+
+        strv_free_and_replace(r->names, names);
+        free_and_replace(r->columns, columns);
+        r->n_columns = n_columns;
+        r->n_rows = 0;
+
+        return 0;
+}
+
+static void reader_reset_batch(ColumnarReader *r) {
+        assert(r);
+
+        r->n_rows = 0;
+        r->realtime = r->monotonic = NULL;
+
+        for (size_t i = 0; i < r->n_columns; i++)
+                r->columns[i] = (ReaderColumn) {};
+}
+
+static int reader_parse_batch(ColumnarReader *r, size_t n_rows, uint64_t size) {
+        _cleanup_free_ ReaderColumn *columns = NULL;
+        const uint8_t *p = r->buffer;
+        uint64_t offset = 0;
+
+        assert(r);
+
+        /* All sections are 8 byte aligned, and the buffer itself is too, hence we can point right into it.
+         * Nothing is published before the whole batch has been validated though, so that we never leave
+         * pointers into a buffer with rejected (and later reallocated) contents behind. */
+
+        if (n_rows > size / (2 * sizeof(le64_t)))
+                return -EBADMSG;
+
+        columns = new0(ReaderColumn, r->n_columns);
+        if (!columns && r->n_columns > 0)
+                return -ENOMEM;
+
+        offset = 2 * sizeof(le64_t) * n_rows;
+
+        for (size_t i = 0; i < r->n_columns; i++) {
+                ReaderColumn *c = columns + i;
+                uint32_t data_size;
+                uint64_t l;
+
+                if (size - offset < 2 * sizeof(le32_t))
+                        return -EBADMSG;
+
+                c->n_values = le32toh(((const le32_t*) (p + offset))[0]);
+                data_size = le32toh(((const le32_t*) (p + offset))[1]);
+                offset += 2 * sizeof(le32_t);
+
+                l = sizeof(le32_t) * ((uint64_t) c->n_values + 1) + data_size;
+                if (size - offset < ALIGN_TO(l, 8))
+                        return -EBADMSG;
+
+                c->offsets = (const le32_t*) (p + offset);
+                c->data = p + offset + sizeof(le32_t) * ((uint64_t) c->n_values + 1);
+                offset += ALIGN_TO(l, 8);
+
+                if (le32toh(c->offsets[0]) != 0 || le32toh(c->offsets[c->n_values]) != data_size)
+                        return -EBADMSG;
+                for (uint32_t v = 0; v < c->n_values; v++)
+                        if (le32toh(c->offsets[v]) > le32toh(c->offsets[v + 1]))
+                                return -EBADMSG;
+
+                l = sizeof(le32_t) * n_rows;
+                if (size - offset < ALIGN_TO(l, 8))
+                        return -EBADMSG;
+
+                c->indices = (const le32_t*) (p + offset);
+                offset += ALIGN_TO(l, 8);
+
+                for (size_t row = 0; row < n_rows; row++) {
+                        uint32_t idx = le32toh(c->indices[row]);
+
+                        if (idx != COLUMNAR_NULL && idx >= c->n_values)
+                                return -EBADMSG;
+                }
+        }
+
+        if (offset != size)
+                return -EBADMSG;
+
+        memcpy_safe(r->columns, columns, sizeof(ReaderColumn) * r->n_columns);
+        r->realtime = (const le64_t*) p;
+        r->monotonic = (const le64_t*) (p + sizeof(le64_t) * n_rows);
+        r->n_rows = n_rows;
+        return 0;
+}
+
+int columnar_reader_next_batch(ColumnarReader *r) {
+        int k;
+
+        assert(r);
+
+        /* Returns > 0 if a batch was read, and 0 on EOF. The stream header may show up again in the
+         * middle of the stream, for example when the output of several writers is concatenated, in which
+         * case the columns may change between batches. */
+
+        /* Whatever happens below, the previous batch is gone, and the buffer might be reallocated */
+        reader_reset_batch(r);
+
+        for (;;) {
+                char signature[8];
+                le32_t v[2];
+                le64_t s;
+                uint64_t size;
+
+                k = read_exact(r->f, signature, sizeof(signature), true);
+                if (k <= 0)
+                        return k;
+
+                if (memcmp(signature, COLUMNAR_STREAM_SIGNATURE, sizeof(signature)) == 0) {
+                        k = reader_read_schema(r);
+                        if (k < 0)
+                                return k;
+
+                        continue;
+                }
+
+                if (memcmp(signature, COLUMNAR_BATCH_SIGNATURE, sizeof(signature)) != 0)
+                        return -EBADMSG;
+
+                /* A batch without a preceding schema */
+                if (!r->names)
+                        return -EBADMSG;
+
+                k = read_exact(r->f, v, sizeof(v), false);
+                if (k < 0)
+                        return k;
+
+                k = read_exact(r->f, &s, sizeof(s), false);
+                if (k < 0)
+                        return k;
+
+                size = le64toh(s);
+                if (size > COLUMNAR_BATCH_SIZE_MAX || size % 8 != 0)
+                        return -EBADMSG;
+
+                if (!greedy_realloc(&r->buffer, size, 1))
+                        return -ENOMEM;
+
+                k = read_exact(r->f, r->buffer, size, false);
+                if (k < 0)
+                        return k;
+
+                k = reader_parse_batch(r, le32toh(v[0]), size);
+                if (k < 0)
+                        return k;
+
+                return 1;
+        }
+}
+
+size_t columnar_reader_n_columns(ColumnarReader *r) {
+        assert(r);
+
+        return r->n_columns;
+}
+
+const char* columnar_reader_column_name(ColumnarReader *r, size_t column) {
+        assert(r);
+        assert(column < r->n_columns);
+
+        return r->names[column];
+}
+
+size_t columnar_reader_n_rows(ColumnarReader *r) {
+        assert(r);
+
+        return r->n_rows;
+}
+
+void columnar_reader_get_timestamps(ColumnarReader *r, size_t row, usec_t *ret_realtime, usec_t *ret_monotonic) {
+        assert(r);
+        assert(row < r->n_rows);
+
+        if (ret_realtime)
+                *ret_realtime = le64toh(r->realtime[row]);
+        if (ret_monotonic)
+                *ret_monotonic = le64toh(r->monotonic[row]);
+}
+
+int columnar_reader_get_value(ColumnarReader *r, size_t row, size_t column, const void **ret_data, size_t *ret_size) {
+        const ReaderColumn *c;
+        uint32_t idx, start;
+
+        assert(r);
+        assert(row < r->n_rows);
+        assert(column < r->n_columns);
+        assert(ret_data);
+        assert(ret_size);
+
+        /* Returns 0 if the entry has no value for the column, and 1 otherwise. The value points into the
+         * current batch and remains valid until the next batch is read. */
+
+        c = r->columns + column;
+        idx = le32toh(c->indices[row]);
+        if (idx == COLUMNAR_NULL) {
+                *ret_data = NULL;
+                *ret_size = 0;
+                return 0;
+        }
+
+        start = le32toh(c->offsets[idx]);
+        *ret_data = c->data + start;
+        *ret_size = le32toh(c->offsets[idx + 1]) - start;
+        return 1;
+}
@@ -0,0 +1,37 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "sd-journal.h"
+
+#include "macro.h"
+#include "time-util.h"
+
+/* A columnar, dictionary encoded binary stream of selected journal fields, for bulk ingestion by analytics
+ * tooling. See docs/JOURNAL_COLUMNAR_FORMAT.md for the format. */
+
+typedef struct ColumnarWriter ColumnarWriter;
+
+int columnar_writer_new(FILE *f, char **fields, ColumnarWriter **ret);
+ColumnarWriter* columnar_writer_free(ColumnarWriter *w);
+DEFINE_TRIVIAL_CLEANUP_FUNC(ColumnarWriter*, columnar_writer_free);
+
+int columnar_writer_add_entry(ColumnarWriter *w, sd_journal *j);
+int columnar_writer_flush(ColumnarWriter *w);
+
+typedef struct ColumnarReader ColumnarReader;
+
+int columnar_reader_new(FILE *f, ColumnarReader **ret);
+ColumnarReader* columnar_reader_free(ColumnarReader *r);
+DEFINE_TRIVIAL_CLEANUP_FUNC(ColumnarReader*, columnar_reader_free);
+
+int columnar_reader_next_batch(ColumnarReader *r);
+
+size_t columnar_reader_n_columns(ColumnarReader *r);
+const char* columnar_reader_column_name(ColumnarReader *r, size_t column);
+size_t columnar_reader_n_rows(ColumnarReader *r);
+
+void columnar_reader_get_timestamps(ColumnarReader *r, size_t row, usec_t *ret_realtime, usec_t *ret_monotonic);
+int columnar_reader_get_value(ColumnarReader *r, size_t row, size_t column, const void **ret_data, size_t *ret_size);
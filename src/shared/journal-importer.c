@@ -4,6 +4,10 @@
 #include <malloc.h>
 #include <unistd.h>
 
+#if HAVE_ZSTD
+#include <zstd.h>
+#endif
+
 #include "alloc-util.h"
 #include "errno-util.h"
 #include "escape.h"
@@ -21,9 +25,18 @@ enum {
         IMPORTER_STATE_DATA_START,  /* reading binary data header */
         IMPORTER_STATE_DATA,        /* reading binary data */
         IMPORTER_STATE_DATA_FINISH, /* expecting newline */
+        IMPORTER_STATE_BINARY_SIZE, /* reading the size of a binary frame */
+        IMPORTER_STATE_BINARY,      /* reading a binary frame */
         IMPORTER_STATE_EOF,         /* done */
 };
 
+static void free_dropped_values(JournalImporter *imp) {
+        for (size_t i = 0; i < imp->n_dropped; i++)
+                free(imp->dropped[i]);
+
+        imp->n_dropped = 0;
+}
+
 void journal_importer_cleanup(JournalImporter *imp) {
         if (imp->fd >= 0 && !imp->passive_fd) {
                 log_debug("Closing %s (fd=%d)", imp->name ?: "importer", imp->fd);
@@ -33,6 +46,43 @@ void journal_importer_cleanup(JournalImporter *imp) {
         free(imp->name);
         free(imp->buf);
         iovw_free_contents(&imp->iovw, false);
+
+        if (imp->values)
+                for (size_t i = 0; i < JOURNAL_BINARY_SLOTS; i++)
+                        free(imp->values[i].iov_base);
+        free(imp->values);
+
+        free_dropped_values(imp);
+        free(imp->dropped);
+
+#if HAVE_ZSTD
+        ZSTD_freeDCtx(imp->decompressor);
+#endif
+        free(imp->compressed);
+}
+
+int journal_importer_set_binary(JournalImporter *imp) {
+        assert(imp);
+        assert(imp->passive_fd);
+        assert(imp->state == IMPORTER_STATE_LINE);
+        assert(imp->filled == 0);
+
+#if HAVE_ZSTD
+        imp->values = new0(struct iovec, JOURNAL_BINARY_SLOTS);
+        if (!imp->values)
+                return -ENOMEM;
+
+        imp->decompressor = ZSTD_createDCtx();
+        if (!imp->decompressor)
+                return -ENOMEM;
+
+        imp->binary = true;
+        imp->state = IMPORTER_STATE_BINARY_SIZE;
+
+        return 0;
+#else
+        return -EOPNOTSUPP;
+#endif
 }
 
 static char* realloc_buffer(JournalImporter *imp, size_t size) {
@@ -110,11 +160,64 @@ static int get_line(JournalImporter *imp, char **line, size_t *size) {
         return 1;
 }
 
+static int inflate_pending(JournalImporter *imp, size_t target) {
+#if HAVE_ZSTD
+        ZSTD_inBuffer input = {
+                .src = imp->compressed,
+                .size = imp->compressed_filled,
+                .pos = imp->compressed_offset,
+        };
+
+        assert(imp);
+        assert(imp->decompressor);
+        assert(target <= ENTRY_SIZE_MAX);
+
+        /* Inflate the received input only until the buffer holds target bytes, so that a small but highly
+         * compressible upload cannot make us allocate more than one frame. Whatever space is allocated
+         * already may be filled up though, that saves calls for small frames. */
+
+        if (MALLOC_SIZEOF_SAFE(imp->buf) < target &&
+            !realloc_buffer(imp, target))
+                return log_oom();
+
+        while (imp->filled < target) {
+                ZSTD_outBuffer output = {
+                        .dst = imp->buf + imp->filled,
+                        .size = MALLOC_SIZEOF_SAFE(imp->buf) - imp->filled,
+                };
+                size_t k;
+
+                k = ZSTD_decompressStream(imp->decompressor, &output, &input);
+                if (ZSTD_isError(k))
+                        return log_warning_errno(SYNTHETIC_ERRNO(EBADMSG),
+                                                 "Failed to decompress received data: %s",
+                                                 ZSTD_getErrorName(k));
+
+                imp->filled += output.pos;
+
+                /* If the output buffer was filled up, there might be more to flush */
+                if (input.pos >= input.size && output.pos < output.size)
+                        break;
+        }
+
+        if (input.pos >= input.size)
+                imp->compressed_offset = imp->compressed_filled = 0;
+        else
+                imp->compressed_offset = input.pos;
+
+        return 0;
+#else
+        assert_not_reached();
+#endif
+}
+
 static int fill_fixed_size(JournalImporter *imp, void **data, size_t size) {
+        int r;
 
         assert(imp);
-        assert(IN_SET(imp->state, IMPORTER_STATE_DATA_START, IMPORTER_STATE_DATA, IMPORTER_STATE_DATA_FINISH));
-        assert(size <= DATA_SIZE_MAX);
+        assert(IN_SET(imp->state, IMPORTER_STATE_DATA_START, IMPORTER_STATE_DATA, IMPORTER_STATE_DATA_FINISH,
+                      IMPORTER_STATE_BINARY_SIZE, IMPORTER_STATE_BINARY));
+        assert(size <= ENTRY_SIZE_MAX);
         assert(imp->offset <= imp->filled);
         assert(imp->filled <= MALLOC_SIZEOF_SAFE(imp->buf));
         assert(imp->fd >= 0);
@@ -123,6 +226,14 @@ static int fill_fixed_size(JournalImporter *imp, void **data, size_t size) {
         while (imp->filled - imp->offset < size) {
                 int n;
 
+                if (imp->decompressor) {
+                        r = inflate_pending(imp, imp->offset + size);
+                        if (r < 0)
+                                return r;
+                        if (imp->filled - imp->offset >= size)
+                                break;
+                }
+
                 if (imp->passive_fd)
                         /* we have to wait for some data to come to us */
                         return -EAGAIN;
@@ -278,9 +389,194 @@ static int process_special_field(JournalImporter *imp, char *line) {
         return 0;
 }
 
+static int remember_value(JournalImporter *imp, struct iovec *v) {
+        struct iovec *slot;
+        void *copy;
+
+        assert(imp);
+        assert(v);
+
+        if (v->iov_len > JOURNAL_BINARY_VALUE_SIZE_MAX)
+                return log_warning_errno(SYNTHETIC_ERRNO(EBADMSG),
+                                         "Value of %zu bytes is too large to be remembered.", v->iov_len);
+
+        copy = memdup(v->iov_base, v->iov_len);
+        if (!copy)
+                return log_oom();
+
+        slot = imp->values + imp->n_values % JOURNAL_BINARY_SLOTS;
+        if (slot->iov_base) {
+                /* The current entry might still refer to the old value, hence free it together with the
+                 * entry. */
+                if (!GREEDY_REALLOC(imp->dropped, imp->n_dropped + 1)) {
+                        free(copy);
+                        return log_oom();
+                }
+
+                imp->dropped[imp->n_dropped++] = slot->iov_base;
+        }
+
+        *slot = IOVEC_MAKE(copy, v->iov_len);
+        imp->n_values++;
+
+        *v = *slot;
+        return 0;
+}
+
+static int process_binary_entry(JournalImporter *imp, const uint8_t *p, size_t size) {
+        uint64_t realtime, monotonic;
+        uint32_t n_fields;
+        int r = 0;
+
+        assert(imp);
+        assert(p);
+        assert(size >= JOURNAL_BINARY_HEADER_SIZE);
+
+        realtime = unaligned_read_le64(p);
+        monotonic = unaligned_read_le64(p + sizeof(uint64_t));
+        memcpy(&imp->boot_id, p + sizeof(uint64_t) * 2, sizeof(sd_id128_t));
+        n_fields = unaligned_read_le32(p + sizeof(uint64_t) * 2 + sizeof(sd_id128_t));
+
+        p += JOURNAL_BINARY_HEADER_SIZE;
+        size -= JOURNAL_BINARY_HEADER_SIZE;
+
+        /* Even if we cannot use the entry, all fields need to be looked at, so that the table of values stays
+         * the same as the sender's. */
+        for (uint32_t i = 0; i < n_fields; i++) {
+                struct iovec v;
+                const char *sep;
+                uint32_t ref;
+                int k;
+
+                if (size < sizeof(uint32_t))
+                        goto truncated;
+
+                ref = unaligned_read_le32(p);
+                p += sizeof(uint32_t);
+                size -= sizeof(uint32_t);
+
+                if (ref >= _JOURNAL_BINARY_REF_FIRST) {
+                        ref -= _JOURNAL_BINARY_REF_FIRST;
+                        if (ref >= JOURNAL_BINARY_SLOTS || !imp->values[ref].iov_base)
+                                return log_warning_errno(SYNTHETIC_ERRNO(EBADMSG),
+                                                         "Reference to unknown value %" PRIu32 ".", ref);
+
+                        v = imp->values[ref];
+                } else {
+                        uint32_t len;
+
+                        if (size < sizeof(uint32_t))
+                                goto truncated;
+
+                        len = unaligned_read_le32(p);
+                        p += sizeof(uint32_t);
+                        size -= sizeof(uint32_t);
+
+                        if (len > size)
+                                goto truncated;
+
+                        v = IOVEC_MAKE((void*) p, len);
+                        p += len;
+                        size -= len;
+
+                        if (ref == JOURNAL_BINARY_LITERAL_REMEMBER) {
+                                k = remember_value(imp, &v);
+                                if (k < 0)
+                                        return k;
+                        }
+                }
+
+                sep = memchr(v.iov_base, '=', v.iov_len);
+                if (!sep || !journal_field_valid(v.iov_base, sep - (const char*) v.iov_base, true)) {
+                        log_debug("Ignoring invalid field in binary entry.");
+                        continue;
+                }
+
+                if (r < 0)
+                        continue;
+
+                r = iovw_put(&imp->iovw, v.iov_base, v.iov_len);
+        }
+
+        if (size > 0)
+                return log_warning_errno(SYNTHETIC_ERRNO(EBADMSG),
+                                         "Binary entry has %zu bytes of trailing garbage.", size);
+        if (r < 0)
+                return r;
+
+        if (!VALID_REALTIME(realtime)) {
+                log_warning("Realtime timestamp out of range, ignoring: %" PRIu64, realtime);
+                return -ERANGE;
+        }
+        if (!VALID_MONOTONIC(monotonic)) {
+                log_warning("Monotonic timestamp out of range, ignoring: %" PRIu64, monotonic);
+                return -ERANGE;
+        }
+
+        imp->ts.realtime = realtime;
+        imp->ts.monotonic = monotonic;
+
+        return 1;
+
+truncated:
+        return log_warning_errno(SYNTHETIC_ERRNO(EBADMSG), "Truncated binary entry.");
+}
+
+static int process_binary_data(JournalImporter *imp) {
+        void *data;
+        int r;
+
+        assert(imp);
+
+        switch (imp->state) {
+
+        case IMPORTER_STATE_BINARY_SIZE:
+                assert(imp->data_size == 0);
+
+                r = fill_fixed_size(imp, &data, sizeof(uint32_t));
+                if (r <= 0)
+                        return r;
+
+                imp->data_size = unaligned_read_le32(data);
+                if (imp->data_size < JOURNAL_BINARY_HEADER_SIZE || imp->data_size > ENTRY_SIZE_MAX)
+                        return log_warning_errno(SYNTHETIC_ERRNO(EBADMSG),
+                                                 "Stream declares binary entry with invalid size %zu.",
+                                                 imp->data_size);
+
+                imp->state = IMPORTER_STATE_BINARY;
+                _fallthrough_;
+
+        case IMPORTER_STATE_BINARY:
+                r = fill_fixed_size(imp, &data, imp->data_size);
+                if (r <= 0)
+                        return r;
+
+                r = process_binary_entry(imp, data, imp->data_size);
+
+                imp->data_size = 0;
+                imp->state = IMPORTER_STATE_BINARY_SIZE;
+
+                if (r < 0)
+                        /* Drop whatever we collected of this entry, the next one starts afresh */
+                        journal_importer_drop_iovw(imp);
+
+                return r;
+
+        default:
+                assert_not_reached();
+        }
+}
+
 int journal_importer_process_data(JournalImporter *imp) {
         int r;
 
+        if (imp->binary) {
+                r = process_binary_data(imp);
+                if (r == 0)
+                        imp->state = IMPORTER_STATE_EOF;
+                return r;
+        }
+
         switch(imp->state) {
         case IMPORTER_STATE_LINE: {
                 char *line, *sep;
@@ -421,10 +717,46 @@ int journal_importer_process_data(JournalImporter *imp) {
         }
 }
 
+static int push_data_compressed(JournalImporter *imp, const char *data, size_t size) {
+        size_t pending;
+
+        assert(imp);
+        assert(imp->decompressor);
+
+        /* The received input is only stored here, and inflated as the frames are processed, see
+         * fill_fixed_size(). */
+
+        pending = imp->compressed_filled - imp->compressed_offset;
+        if (size > ENTRY_SIZE_MAX - pending)
+                return log_warning_errno(SYNTHETIC_ERRNO(ENOBUFS),
+                                         "Compressed data is bigger than %u bytes.", ENTRY_SIZE_MAX);
+
+        if (imp->compressed_offset > 0) {
+                memmove(imp->compressed, imp->compressed + imp->compressed_offset, pending);
+                imp->compressed_offset = 0;
+                imp->compressed_filled = pending;
+        }
+
+        if (!GREEDY_REALLOC(imp->compressed, pending + size))
+                return log_oom();
+
+        memcpy(imp->compressed + pending, data, size);
+        imp->compressed_filled += size;
+
+        /* Inflate the beginning of the next frame right away, so that garbage is refused early */
+        if (imp->state == IMPORTER_STATE_BINARY_SIZE && imp->filled - imp->offset < sizeof(uint32_t))
+                return inflate_pending(imp, imp->offset + sizeof(uint32_t));
+
+        return 0;
+}
+
 int journal_importer_push_data(JournalImporter *imp, const char *data, size_t size) {
         assert(imp);
         assert(imp->state != IMPORTER_STATE_EOF);
 
+        if (imp->decompressor)
+                return push_data_compressed(imp, data, size);
+
         if (!realloc_buffer(imp, imp->filled + size))
                 return log_error_errno(SYNTHETIC_ERRNO(ENOMEM),
                                        "Failed to store received data of size %zu "
@@ -444,6 +776,7 @@ void journal_importer_drop_iovw(JournalImporter *imp) {
         /* This function drops processed data that along with the iovw that points at it */
 
         iovw_free_contents(&imp->iovw, false);
+        free_dropped_values(imp);
 
         /* possibly reset buffer position */
         remain = imp->filled - imp->offset;
@@ -25,6 +25,29 @@
 /* The maximum number of fields in an entry */
 #define ENTRY_FIELD_COUNT_MAX 1024
 
+/* Besides the export format, entries may be sent in a binary format, which is always compressed as one zstd
+ * stream. After decompression, each entry is a frame that starts with its size, not including the size
+ * itself. Then follow the realtime and monotonic timestamps, the boot ID, the number of fields, and the
+ * fields. All integers are little endian:
+ *
+ *     le32 size, le64 realtime, le64 monotonic, 16 bytes boot ID, le32 n_fields, fields...
+ *
+ * Each field starts with a reference. 0 introduces a literal, 1 introduces a literal that is also remembered
+ * in the next slot of a table of values, and n >= 2 refers to the value remembered in slot n - 2. Literals
+ * consist of le32 size and the data "FIELD=value". The table has JOURNAL_BINARY_SLOTS slots, which are reused
+ * in order, and only values of up to JOURNAL_BINARY_VALUE_SIZE_MAX bytes may be remembered. The table lives
+ * as long as the stream, i.e. one upload. */
+#define JOURNAL_BINARY_CONTENT_TYPE "application/vnd.fdo.journal.binary"
+#define JOURNAL_BINARY_SLOTS 4096U
+#define JOURNAL_BINARY_VALUE_SIZE_MAX 1024U
+#define JOURNAL_BINARY_HEADER_SIZE (sizeof(uint64_t) * 2 + sizeof(sd_id128_t) + sizeof(uint32_t))
+
+enum {
+        JOURNAL_BINARY_LITERAL = 0,
+        JOURNAL_BINARY_LITERAL_REMEMBER = 1,
+        _JOURNAL_BINARY_REF_FIRST = 2,
+};
+
 typedef struct JournalImporter {
         int fd;
         bool passive_fd;
@@ -43,12 +66,24 @@ typedef struct JournalImporter {
         int state;
         dual_timestamp ts;
         sd_id128_t boot_id;
+
+        /* Only used for the binary format */
+        bool binary;
+        struct iovec *values;   /* the remembered values */
+        size_t n_values;        /* total number of values remembered so far */
+        void **dropped;         /* values pushed out of the table by the current entry */
+        size_t n_dropped;
+        void *decompressor;
+        char *compressed;         /* received input that was not inflated yet */
+        size_t compressed_offset; /* offset to the beginning of that input in the buffer */
+        size_t compressed_filled; /* total number of bytes in the buffer */
 } JournalImporter;
 
 #define JOURNAL_IMPORTER_INIT(_fd) { .fd = (_fd), .iovw = {} }
 #define JOURNAL_IMPORTER_MAKE(_fd) (JournalImporter) JOURNAL_IMPORTER_INIT(_fd)
 
 void journal_importer_cleanup(JournalImporter *);
+int journal_importer_set_binary(JournalImporter *);
 int journal_importer_process_data(JournalImporter *);
 int journal_importer_push_data(JournalImporter *, const char *data, size_t size);
 void journal_importer_drop_iovw(JournalImporter *);
@@ -19,6 +19,7 @@
 #include "hostname-util.h"
 #include "id128-util.h"
 #include "io-util.h"
+#include "journal-columnar.h"
 #include "journal-internal.h"
 #include "journal-util.h"
 #include "json.h"
@@ -1269,6 +1270,12 @@ int show_journal_entry(
         assert(mode >= 0);
         assert(mode < _OUTPUT_MODE_MAX);
 
+        /* The columnar format is a stream with a header that applies to all entries, it has to be written
+         * with one ColumnarWriter for the whole stream, see show_journal() */
+        if (mode == OUTPUT_COLUMNAR)
+                return log_error_errno(SYNTHETIC_ERRNO(EOPNOTSUPP),
+                                       "Columnar output can only be written for a stream of entries.");
+
         if (n_columns <= 0)
                 n_columns = columns();
 
@@ -1307,8 +1314,10 @@ int show_journal(
                 usec_t not_before,
                 unsigned how_many,
                 OutputFlags flags,
+                char **output_fields,
                 bool *ellipsized) {
 
+        _cleanup_(columnar_writer_freep) ColumnarWriter *columnar = NULL;
         int r;
         unsigned line = 0;
         bool need_seek = false;
@@ -1318,6 +1327,12 @@ int show_journal(
         assert(mode >= 0);
         assert(mode < _OUTPUT_MODE_MAX);
 
+        if (mode == OUTPUT_COLUMNAR) {
+                r = columnar_writer_new(f, output_fields, &columnar);
+                if (r < 0)
+                        return log_error_errno(r, "Failed to allocate columnar writer: %m");
+        }
+
         if (how_many == UINT_MAX)
                 need_seek = true;
         else {
@@ -1359,9 +1374,19 @@ int show_journal(
                 }
 
                 line++;
-                maybe_print_begin_newline(f, &flags);
 
-                r = show_journal_entry(f, j, mode, n_columns, flags, NULL, NULL, ellipsized);
+                if (columnar)
+                        r = columnar_writer_add_entry(columnar, j);
+                else {
+                        maybe_print_begin_newline(f, &flags);
+                        r = show_journal_entry(f, j, mode, n_columns, flags, output_fields, NULL, ellipsized);
+                }
+                if (r < 0)
+                        return r;
+        }
+
+        if (columnar) {
+                r = columnar_writer_flush(columnar);
                 if (r < 0)
                         return r;
         }
@@ -1655,5 +1680,5 @@ int show_journal_by_unit(
                 log_debug("Journal filter: %s", filter);
         }
 
-        return show_journal(f, j, mode, n_columns, not_before, how_many, flags, ellipsized);
+        return show_journal(f, j, mode, n_columns, not_before, how_many, flags, NULL, ellipsized);
 }
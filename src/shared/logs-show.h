@@ -30,6 +30,7 @@ int show_journal(
                 usec_t not_before,
                 unsigned how_many,
                 OutputFlags flags,
+                char **output_fields,
                 bool *ellipsized);
 
 int add_match_this_boot(sd_journal *j, const char *machine);
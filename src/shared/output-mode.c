@@ -36,6 +36,7 @@ static const char *const output_mode_table[_OUTPUT_MODE_MAX] = {
         [OUTPUT_JSON_SSE] = "json-sse",
         [OUTPUT_JSON_SEQ] = "json-seq",
         [OUTPUT_CAT] = "cat",
+        [OUTPUT_COLUMNAR] = "columnar",
         [OUTPUT_WITH_UNIT] = "with-unit",
 };
 
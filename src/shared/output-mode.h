@@ -19,6 +19,7 @@ typedef enum OutputMode {
         OUTPUT_JSON_SSE,
         OUTPUT_JSON_SEQ,
         OUTPUT_CAT,
+        OUTPUT_COLUMNAR,
         OUTPUT_WITH_UNIT,
         _OUTPUT_MODE_MAX,
         _OUTPUT_MODE_INVALID = -EINVAL,
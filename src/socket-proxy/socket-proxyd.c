@@ -15,6 +15,7 @@
 
 #include "alloc-util.h"
 #include "errno-util.h"
+#include "event-pool.h"
 #include "fd-util.h"
 #include "log.h"
 #include "main-func.h"
@@ -32,15 +33,28 @@
 static unsigned arg_connections_max = 256;
 static const char *arg_remote_host = NULL;
 static usec_t arg_exit_idle_time = USEC_INFINITY;
+static unsigned arg_threads = 0;
 
-typedef struct Context {
+typedef struct Context Context;
+
+struct Context {
         sd_event *event;
         sd_resolve *resolve;
         sd_event_source *idle_time;
 
         Set *listen;
         Set *connections;
-} Context;
+
+        /* With --threads=, accepted connections are handed to the worker contexts, one for each event loop
+         * of the pool. The connection limit and the idle timer apply to all of them together, hence the
+         * connections are counted here. */
+        EventPool *pool;
+        Context *workers;
+        unsigned n_workers;
+        unsigned n_connections; /* accessed atomically */
+
+        Context *parent; /* for worker contexts, the main context */
+};
 
 typedef struct Connection {
         Context *context;
@@ -57,11 +71,30 @@ typedef struct Connection {
         sd_resolve_query *resolve_query;
 } Connection;
 
+static unsigned context_n_connections(Context *context) {
+        assert(context);
+
+        if (context->pool)
+                return __atomic_load_n(&context->n_connections, __ATOMIC_ACQUIRE);
+
+        return set_size(context->connections);
+}
+
+static void context_forget_connection(Context *context) {
+        assert(context);
+
+        /* Connections of worker contexts were counted by the main context when it handed them over */
+        if (context->parent)
+                (void) __atomic_sub_fetch(&context->parent->n_connections, 1, __ATOMIC_RELEASE);
+}
+
 static void connection_free(Connection *c) {
         assert(c);
 
-        if (c->context)
+        if (c->context) {
                 set_remove(c->context->connections, c);
+                context_forget_connection(c->context);
+        }
 
         sd_event_source_unref(c->server_event_source);
         sd_event_source_unref(c->client_event_source);
@@ -81,7 +114,7 @@ static int idle_time_cb(sd_event_source *s, uint64_t usec, void *userdata) {
         Context *c = userdata;
         int r;
 
-        if (!set_isempty(c->connections)) {
+        if (context_n_connections(c) > 0) {
                 log_warning("Idle timer fired even though there are connections, ignoring");
                 return 0;
         }
@@ -94,28 +127,53 @@ static int idle_time_cb(sd_event_source *s, uint64_t usec, void *userdata) {
         return 0;
 }
 
+static int context_arm_idle_timer(Context *context) {
+        int r;
+
+        assert(context);
+
+        if (arg_exit_idle_time == USEC_INFINITY || context_n_connections(context) > 0)
+                return 0;
+
+        if (context->idle_time) {
+                r = sd_event_source_set_time_relative(context->idle_time, arg_exit_idle_time);
+                if (r < 0)
+                        return log_error_errno(r, "Error while setting idle time: %m");
+
+                r = sd_event_source_set_enabled(context->idle_time, SD_EVENT_ONESHOT);
+                if (r < 0)
+                        return log_error_errno(r, "Error while enabling idle time: %m");
+        } else {
+                r = sd_event_add_time_relative(
+                                context->event, &context->idle_time, CLOCK_MONOTONIC,
+                                arg_exit_idle_time, 0, idle_time_cb, context);
+                if (r < 0)
+                        return log_error_errno(r, "Failed to create idle timer: %m");
+        }
+
+        return 0;
+}
+
+static int idle_timer_closure(sd_event *e, void *userdata) {
+        /* Runs in the main event loop, which might have accepted another connection in the meantime, but
+         * context_arm_idle_timer() checks for that. */
+        return context_arm_idle_timer(userdata);
+}
+
 static int connection_release(Connection *c) {
         Context *context = c->context;
         int r;
 
         connection_free(c);
 
-        if (arg_exit_idle_time < USEC_INFINITY && set_isempty(context->connections)) {
-                if (context->idle_time) {
-                        r = sd_event_source_set_time_relative(context->idle_time, arg_exit_idle_time);
-                        if (r < 0)
-                                return log_error_errno(r, "Error while setting idle time: %m");
+        if (!context->parent)
+                return context_arm_idle_timer(context);
 
-                        r = sd_event_source_set_enabled(context->idle_time, SD_EVENT_ONESHOT);
-                        if (r < 0)
-                                return log_error_errno(r, "Error while enabling idle time: %m");
-                } else {
-                        r = sd_event_add_time_relative(
-                                        context->event, &context->idle_time, CLOCK_MONOTONIC,
-                                        arg_exit_idle_time, 0, idle_time_cb, context);
-                        if (r < 0)
-                                return log_error_errno(r, "Failed to create idle timer: %m");
-                }
+        /* The idle timer belongs to the main event loop, hence let it arm it */
+        if (arg_exit_idle_time < USEC_INFINITY && context_n_connections(context->parent) == 0) {
+                r = sd_event_post_to(context->parent->event, idle_timer_closure, context->parent, NULL);
+                if (r < 0)
+                        return log_error_errno(r, "Failed to arm idle timer: %m");
         }
 
         return 0;
@@ -124,6 +182,12 @@ static int connection_release(Connection *c) {
 static void context_clear(Context *context) {
         assert(context);
 
+        /* Stop the worker threads first, afterwards their contexts may be released from this thread */
+        context->pool = event_pool_free(context->pool);
+        for (unsigned i = 0; i < context->n_workers; i++)
+                context_clear(context->workers + i);
+        context->workers = mfree(context->workers);
+
         set_free_with_destructor(context->listen, sd_event_source_unref);
         set_free_with_destructor(context->connections, connection_free);
 
@@ -459,27 +523,17 @@ fail:
         return 0; /* ignore errors, continue serving */
 }
 
-static int add_connection_socket(Context *context, int fd) {
+static int context_add_connection(Context *context, int fd) {
         Connection *c;
         int r;
 
         assert(context);
         assert(fd >= 0);
 
-        if (set_size(context->connections) > arg_connections_max) {
-                log_warning("Hit connection limit, refusing connection.");
-                safe_close(fd);
-                return 0;
-        }
-
-        if (context->idle_time) {
-                r = sd_event_source_set_enabled(context->idle_time, SD_EVENT_OFF);
-                if (r < 0)
-                        log_warning_errno(r, "Unable to disable idle timer, continuing: %m");
-        }
-
         c = new(Connection, 1);
         if (!c) {
+                safe_close(fd);
+                context_forget_connection(context);
                 log_oom();
                 return 0;
         }
@@ -494,7 +548,7 @@ static int add_connection_socket(Context *context, int fd) {
 
         r = set_ensure_put(&context->connections, NULL, c);
         if (r < 0) {
-                free(c);
+                connection_free(c);
                 log_oom();
                 return 0;
         }
@@ -502,6 +556,80 @@ static int add_connection_socket(Context *context, int fd) {
         return resolve_remote(c);
 }
 
+static int worker_add_connection(sd_event *e, int fd, void *userdata) {
+        Context *context = userdata, *w = NULL;
+        int r;
+
+        assert(e);
+        assert(fd >= 0);
+        assert(context);
+
+        /* Runs in the thread of the event loop the connection was handed to */
+
+        for (unsigned i = 0; i < context->n_workers; i++)
+                if (event_pool_get(context->pool, i) == e) {
+                        w = context->workers + i;
+                        break;
+                }
+        assert(w);
+
+        if (!w->event) {
+                /* Not sd_resolve_default(), which is per thread, and the worker contexts are released from
+                 * the main thread */
+                r = sd_resolve_new(&w->resolve);
+                if (r < 0)
+                        goto fail;
+
+                r = sd_resolve_attach_event(w->resolve, e, 0);
+                if (r < 0) {
+                        w->resolve = sd_resolve_unref(w->resolve);
+                        goto fail;
+                }
+
+                w->event = sd_event_ref(e);
+        }
+
+        return context_add_connection(w, fd);
+
+fail:
+        safe_close(fd);
+        context_forget_connection(w);
+        return log_error_errno(r, "Failed to set up resolver for worker thread: %m");
+}
+
+static int add_connection_socket(Context *context, int fd) {
+        int r;
+
+        assert(context);
+        assert(fd >= 0);
+
+        if (context_n_connections(context) > arg_connections_max) {
+                log_warning("Hit connection limit, refusing connection.");
+                safe_close(fd);
+                return 0;
+        }
+
+        if (context->idle_time) {
+                r = sd_event_source_set_enabled(context->idle_time, SD_EVENT_OFF);
+                if (r < 0)
+                        log_warning_errno(r, "Unable to disable idle timer, continuing: %m");
+        }
+
+        if (!context->pool)
+                return context_add_connection(context, fd);
+
+        /* Count the connection before handing it over, the worker might be done with it right away */
+        (void) __atomic_add_fetch(&context->n_connections, 1, __ATOMIC_RELEASE);
+
+        r = event_pool_dispatch_fd(context->pool, fd, worker_add_connection, context);
+        if (r < 0) {
+                (void) __atomic_sub_fetch(&context->n_connections, 1, __ATOMIC_RELEASE);
+                return r;
+        }
+
+        return 0;
+}
+
 static int accept_cb(sd_event_source *s, int fd, uint32_t revents, void *userdata) {
         _cleanup_free_ char *peer = NULL;
         Context *context = userdata;
@@ -593,6 +721,7 @@ static int help(void) {
                "  -c --connections-max=  Set the maximum number of connections to be accepted\n"
                "     --exit-idle-time=   Exit when without a connection for this duration. See\n"
                "                         the %3$s for time span format\n"
+               "     --threads=          Serve connections from this number of worker threads\n"
                "  -h --help              Show this help\n"
                "     --version           Show package version\n"
                "\nSee the %2$s for details.\n",
@@ -608,12 +737,14 @@ static int parse_argv(int argc, char *argv[]) {
         enum {
                 ARG_VERSION = 0x100,
                 ARG_EXIT_IDLE,
-                ARG_IGNORE_ENV
+                ARG_IGNORE_ENV,
+                ARG_THREADS,
         };
 
         static const struct option options[] = {
                 { "connections-max", required_argument, NULL, 'c'           },
                 { "exit-idle-time",  required_argument, NULL, ARG_EXIT_IDLE },
+                { "threads",         required_argument, NULL, ARG_THREADS   },
                 { "help",            no_argument,       NULL, 'h'           },
                 { "version",         no_argument,       NULL, ARG_VERSION   },
                 {}
@@ -653,6 +784,12 @@ static int parse_argv(int argc, char *argv[]) {
                                 return log_error_errno(r, "Failed to parse --exit-idle-time= argument: %s", optarg);
                         break;
 
+                case ARG_THREADS:
+                        r = safe_atou(optarg, &arg_threads);
+                        if (r < 0)
+                                return log_error_errno(r, "Failed to parse --threads= argument: %s", optarg);
+                        break;
+
                 case '?':
                         return -EINVAL;
 
@@ -697,6 +834,25 @@ static int run(int argc, char *argv[]) {
 
         sd_event_set_watchdog(context.event, true);
 
+        if (arg_threads > 0) {
+                context.workers = new0(Context, arg_threads);
+                if (!context.workers)
+                        return log_oom();
+
+                context.n_workers = arg_threads;
+                for (unsigned i = 0; i < context.n_workers; i++)
+                        context.workers[i].parent = &context;
+
+                /* Workers arm the idle timer through this */
+                r = sd_event_add_post_to_queue(context.event, NULL);
+                if (r < 0)
+                        return log_error_errno(r, "Failed to set up event loop queue: %m");
+
+                r = event_pool_new(arg_threads, /* pin_cpus= */ false, &context.pool);
+                if (r < 0)
+                        return log_error_errno(r, "Failed to start worker threads: %m");
+        }
+
         r = sd_listen_fds(1);
         if (r < 0)
                 return log_error_errno(r, "Failed to receive sockets from parent.");
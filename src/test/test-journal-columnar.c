@@ -0,0 +1,257 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "sd-journal.h"
+
+#include "alloc-util.h"
+#include "fd-util.h"
+#include "fileio.h"
+#include "io-util.h"
+#include "journal-columnar.h"
+#include "journal-file.h"
+#include "log.h"
+#include "logs-show.h"
+#include "memory-util.h"
+#include "parse-util.h"
+#include "path-util.h"
+#include "rm-rf.h"
+#include "stdio-util.h"
+#include "string-util.h"
+#include "strv.h"
+#include "tests.h"
+#include "tmpfile-util.h"
+
+#define N_ENTRIES 10000U
+
+static void make_journal(const char *path) {
+        JournalFile *f;
+        dual_timestamp ts = {
+                .realtime = 1000000,
+                .monotonic = 1000,
+        };
+
+        assert_se(journal_file_open(-1, path, O_RDWR|O_CREAT, 0666, true, UINT64_MAX, false, NULL, NULL, NULL, NULL, &f) == 0);
+
+        for (unsigned i = 0; i < N_ENTRIES; i++) {
+                char number[STRLEN("NUMBER=") + DECIMAL_STR_MAX(unsigned)];
+                struct iovec iovec[3];
+                size_t n = 0;
+
+                xsprintf(number, "NUMBER=%u", i);
+                iovec[n++] = IOVEC_MAKE_STRING(number);
+
+                /* Only every third entry has a MAGIC field */
+                if (i % 3 == 0) {
+                        const char *magic = i % 2 == 0 ? "MAGIC=quux" : "MAGIC=waldo";
+
+                        iovec[n++] = IOVEC_MAKE_STRING(magic);
+                }
+
+                iovec[n++] = IOVEC_MAKE_STRING("MESSAGE=hello");
+
+                ts.realtime++;
+                ts.monotonic++;
+
+                assert_se(journal_file_append_entry(f, &ts, NULL, iovec, n, NULL, NULL, NULL) == 0);
+        }
+
+        (void) journal_file_close(f);
+}
+
+static void write_stream(sd_journal *j, char **fields, FILE *f) {
+        _cleanup_(columnar_writer_freep) ColumnarWriter *w = NULL;
+
+        assert_se(columnar_writer_new(f, fields, &w) >= 0);
+
+        SD_JOURNAL_FOREACH(j)
+                assert_se(columnar_writer_add_entry(w, j) >= 0);
+
+        assert_se(columnar_writer_flush(w) >= 0);
+}
+
+static void check_stream(FILE *f, unsigned n_streams) {
+        _cleanup_(columnar_reader_freep) ColumnarReader *r = NULL;
+        unsigned n = 0, n_batches = 0;
+        int k;
+
+        assert_se(columnar_reader_new(f, &r) >= 0);
+
+        while ((k = columnar_reader_next_batch(r)) > 0) {
+                assert_se(columnar_reader_n_columns(r) == 3);
+                assert_se(streq(columnar_reader_column_name(r, 0), "NUMBER"));
+                assert_se(streq(columnar_reader_column_name(r, 1), "MAGIC"));
+                assert_se(streq(columnar_reader_column_name(r, 2), "NOPE"));
+
+                for (size_t row = 0; row < columnar_reader_n_rows(r); row++) {
+                        unsigned i = n % N_ENTRIES, u;
+                        usec_t realtime, monotonic;
+                        _cleanup_free_ char *s = NULL;
+                        const void *data;
+                        size_t size;
+
+                        columnar_reader_get_timestamps(r, row, &realtime, &monotonic);
+                        assert_se(realtime == 1000000 + i + 1);
+                        assert_se(monotonic == 1000 + i + 1);
+
+                        assert_se(columnar_reader_get_value(r, row, 0, &data, &size) == 1);
+                        assert_se(s = strndup(data, size));
+                        assert_se(safe_atou(s, &u) >= 0);
+                        assert_se(u == i);
+
+                        if (i % 3 == 0) {
+                                const char *magic = i % 2 == 0 ? "quux" : "waldo";
+
+                                assert_se(columnar_reader_get_value(r, row, 1, &data, &size) == 1);
+                                assert_se(memcmp_nn(data, size, magic, strlen(magic)) == 0);
+                        } else
+                                assert_se(columnar_reader_get_value(r, row, 1, &data, &size) == 0);
+
+                        assert_se(columnar_reader_get_value(r, row, 2, &data, &size) == 0);
+
+                        n++;
+                }
+
+                n_batches++;
+        }
+        assert_se(k == 0);
+        assert_se(n == N_ENTRIES * n_streams);
+
+        /* Entries are written in batches, not one by one */
+        assert_se(n_batches < n / 1000);
+}
+
+static void test_columnar(const char *path) {
+        _cleanup_(sd_journal_closep) sd_journal *j = NULL;
+        _cleanup_fclose_ FILE *f = NULL;
+        _cleanup_strv_free_ char **fields = NULL;
+        const char *paths[] = { path, NULL };
+
+        log_info("/* %s */", __func__);
+
+        assert_se(sd_journal_open_files(&j, paths, 0) >= 0);
+        assert_se(fields = strv_new("NUMBER", "MAGIC", "NOPE", "MAGIC"));
+
+        assert_se(f = tmpfile());
+        write_stream(j, fields, f);
+        rewind(f);
+        check_stream(f, 1);
+
+        /* Concatenated streams are valid streams too */
+        assert_se(fseeko(f, 0, SEEK_END) == 0);
+        write_stream(j, fields, f);
+        rewind(f);
+        check_stream(f, 2);
+}
+
+static void test_show_journal(const char *path) {
+        _cleanup_(sd_journal_closep) sd_journal *j = NULL;
+        _cleanup_fclose_ FILE *f = NULL;
+        _cleanup_strv_free_ char **fields = NULL;
+        const char *paths[] = { path, NULL };
+
+        log_info("/* %s */", __func__);
+
+        assert_se(sd_journal_open_files(&j, paths, 0) >= 0);
+        assert_se(fields = strv_new("NUMBER", "MAGIC", "NOPE"));
+
+        /* One stream for all entries, with the requested fields */
+        assert_se(f = tmpfile());
+        assert_se(show_journal(f, j, OUTPUT_COLUMNAR, 0, 0, UINT_MAX, 0, fields, NULL) >= 0);
+        rewind(f);
+        check_stream(f, 1);
+
+        /* Single entries can't be written as columnar stream */
+        assert_se(sd_journal_seek_head(j) >= 0);
+        assert_se(sd_journal_next(j) > 0);
+        assert_se(show_journal_entry(f, j, OUTPUT_COLUMNAR, 0, 0, fields, NULL, NULL) == -EOPNOTSUPP);
+}
+
+static void test_truncated(const char *path) {
+        _cleanup_(columnar_reader_freep) ColumnarReader *r = NULL;
+        _cleanup_(sd_journal_closep) sd_journal *j = NULL;
+        _cleanup_fclose_ FILE *f = NULL, *g = NULL;
+        _cleanup_free_ char *buf = NULL;
+        const char *paths[] = { path, NULL };
+        size_t size;
+        int k;
+
+        log_info("/* %s */", __func__);
+
+        assert_se(sd_journal_open_files(&j, paths, 0) >= 0);
+
+        assert_se(f = open_memstream_unlocked(&buf, &size));
+        write_stream(j, NULL, f);
+        f = safe_fclose(f);
+        assert_se(size > 0);
+
+        assert_se(g = fmemopen(buf, size - 1, "r"));
+        assert_se(columnar_reader_new(g, &r) >= 0);
+
+        while ((k = columnar_reader_next_batch(r)) > 0)
+                ;
+        assert_se(k == -EBADMSG);
+}
+
+static void test_corrupted(const char *path) {
+        _cleanup_(columnar_reader_freep) ColumnarReader *r = NULL;
+        _cleanup_(sd_journal_closep) sd_journal *j = NULL;
+        _cleanup_fclose_ FILE *f = NULL, *g = NULL;
+        _cleanup_free_ char *buf = NULL;
+        const char *paths[] = { path, NULL };
+        char *batch = NULL, *p;
+        size_t size;
+        int k;
+
+        log_info("/* %s */", __func__);
+
+        assert_se(sd_journal_open_files(&j, paths, 0) >= 0);
+
+        assert_se(f = open_memstream_unlocked(&buf, &size));
+        write_stream(j, NULL, f);
+        write_stream(j, NULL, f);
+        f = safe_fclose(f);
+
+        /* Claim an impossible number of rows in the last batch */
+        for (p = buf; (p = memmem(p, buf + size - p, "SDJCOLB1", 8)); p += 8)
+                batch = p;
+        assert_se(batch && batch != buf);
+        memset(batch + 8, 0xff, 4);
+
+        assert_se(g = fmemopen(buf, size, "r"));
+        assert_se(columnar_reader_new(g, &r) >= 0);
+
+        assert_se(columnar_reader_next_batch(r) > 0);
+        assert_se(columnar_reader_n_rows(r) > 0);
+
+        while ((k = columnar_reader_next_batch(r)) > 0)
+                ;
+        assert_se(k == -EBADMSG);
+
+        /* Nothing of the rejected batch may be accessible */
+        assert_se(columnar_reader_n_rows(r) == 0);
+}
+
+int main(int argc, char *argv[]) {
+        _cleanup_(rm_rf_physical_and_freep) char *t = NULL;
+        _cleanup_free_ char *path = NULL;
+
+        test_setup_logging(LOG_INFO);
+
+        /* journal_file_open requires a valid machine id */
+        if (access("/etc/machine-id", F_OK) != 0)
+                return log_tests_skipped("/etc/machine-id not found");
+
+        assert_se(mkdtemp_malloc("/var/tmp/journal-columnar-XXXXXX", &t) >= 0);
+        assert_se(path = path_join(t, "test.journal"));
+
+        make_journal(path);
+
+        test_columnar(path);
+        test_show_journal(path);
+        test_truncated(path);
+        test_corrupted(path);
+
+        return 0;
+}
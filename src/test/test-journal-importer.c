@@ -5,9 +5,12 @@
 #include <fcntl.h>
 
 #include "alloc-util.h"
+#include "fd-util.h"
 #include "log.h"
+#include "journal-binary-encoder.h"
 #include "journal-importer.h"
 #include "path-util.h"
+#include "stdio-util.h"
 #include "string-util.h"
 #include "tests.h"
 
@@ -68,11 +71,220 @@ static void test_bad_input(void) {
         assert_se(journal_importer_eof(&imp));
 }
 
+#if HAVE_ZSTD
+#define N_ENTRIES (JOURNAL_BINARY_SLOTS + 1000U)
+
+static const sd_id128_t test_boot_id = SD_ID128_MAKE(15,31,fd,22,ec,84,42,9e,85,ae,88,8b,12,fa,db,91);
+
+static void make_message(unsigned i, char *buf, size_t size) {
+        assert_se(snprintf(buf, size, "MESSAGE=entry %u", i) < (int) size);
+}
+
+static void check_entries(JournalImporter *imp, unsigned *n_read, const char *binary_field) {
+        int r;
+
+        for (;;) {
+                char message[STRLEN("MESSAGE=entry ") + DECIMAL_STR_MAX(unsigned)];
+                unsigned i = *n_read;
+
+                r = journal_importer_process_data(imp);
+                if (r == -EAGAIN)
+                        return;
+                assert_se(r == 1);
+
+                assert_se(imp->ts.realtime == 1000 + i);
+                assert_se(imp->ts.monotonic == 2000 + i);
+                assert_se(sd_id128_equal(imp->boot_id, test_boot_id));
+
+                make_message(i, message, sizeof(message));
+
+                assert_se(imp->iovw.count == (i % 100 == 0 ? 5 : 4));
+                assert_iovec_entry(&imp->iovw.iovec[0], "_TRANSPORT=journal");
+                assert_iovec_entry(&imp->iovw.iovec[1], message);
+                assert_iovec_entry(&imp->iovw.iovec[2], "PRIORITY=6");
+                assert_iovec_entry(&imp->iovw.iovec[3], "_TRANSPORT=journal");
+                if (i % 100 == 0)
+                        assert_iovec_entry(&imp->iovw.iovec[4], binary_field);
+
+                journal_importer_drop_iovw(imp);
+                (*n_read)++;
+        }
+}
+
+static void transfer(JournalBinaryEncoder *e, JournalImporter *imp, unsigned *n_read, const char *binary_field) {
+        char buf[7];
+        size_t n;
+
+        /* Feed the importer in small pieces, so that entries are split at arbitrary points */
+        while ((n = journal_binary_encoder_read(e, buf, sizeof(buf))) > 0) {
+                assert_se(journal_importer_push_data(imp, buf, n) >= 0);
+                check_entries(imp, n_read, binary_field);
+        }
+}
+
+static void test_binary(void) {
+        _cleanup_(journal_importer_cleanup) JournalImporter imp = JOURNAL_IMPORTER_INIT(-1);
+        _cleanup_close_ int fd = -1;
+        _cleanup_(journal_binary_encoder_freep) JournalBinaryEncoder *e = NULL;
+        _cleanup_free_ char *binary_field = NULL;
+        unsigned n_read = 0;
+
+        log_info("/* %s */", __func__);
+
+        /* The importer never reads from or closes a passive fd, the data is pushed */
+        imp.fd = fd = open("/dev/null", O_RDONLY|O_CLOEXEC);
+        assert_se(imp.fd >= 0);
+        imp.passive_fd = true;
+        assert_se(journal_importer_set_binary(&imp) >= 0);
+
+        assert_se(journal_binary_encoder_new(&e) >= 0);
+        assert_se(journal_binary_encoder_reset(e) >= 0);
+
+        /* Too large to be remembered, and with newlines */
+        binary_field = malloc(JOURNAL_BINARY_VALUE_SIZE_MAX + 100);
+        assert_se(binary_field);
+        memset(binary_field, '\n', JOURNAL_BINARY_VALUE_SIZE_MAX + 99);
+        memcpy(binary_field, "BINARY=", STRLEN("BINARY="));
+        binary_field[JOURNAL_BINARY_VALUE_SIZE_MAX + 99] = 0;
+
+        for (unsigned i = 0; i < N_ENTRIES; i++) {
+                char message[STRLEN("MESSAGE=entry ") + DECIMAL_STR_MAX(unsigned)];
+                dual_timestamp ts = {
+                        .realtime = 1000 + i,
+                        .monotonic = 2000 + i,
+                };
+
+                make_message(i, message, sizeof(message));
+
+                assert_se(journal_binary_encoder_begin_entry(e, &ts, test_boot_id) >= 0);
+                assert_se(journal_binary_encoder_add_field(e, "_TRANSPORT=journal", STRLEN("_TRANSPORT=journal")) >= 0);
+                assert_se(journal_binary_encoder_add_field(e, message, strlen(message)) >= 0);
+                assert_se(journal_binary_encoder_add_field(e, "PRIORITY=6", STRLEN("PRIORITY=6")) >= 0);
+                assert_se(journal_binary_encoder_add_field(e, "_TRANSPORT=journal", STRLEN("_TRANSPORT=journal")) >= 0);
+                if (i % 100 == 0)
+                        assert_se(journal_binary_encoder_add_field(e, binary_field, strlen(binary_field)) >= 0);
+                assert_se(journal_binary_encoder_end_entry(e) >= 0);
+
+                transfer(e, &imp, &n_read, binary_field);
+        }
+
+        assert_se(journal_binary_encoder_end(e) >= 0);
+        transfer(e, &imp, &n_read, binary_field);
+
+        assert_se(n_read == N_ENTRIES);
+        assert_se(journal_importer_bytes_remaining(&imp) == 0);
+
+        log_info("%u entries, %" PRIu64 " bytes encoded, %" PRIu64 " bytes compressed",
+                 N_ENTRIES, e->bytes_in, e->bytes_out);
+        assert_se(e->bytes_out < e->bytes_in);
+}
+
+#define N_BOMB_ENTRIES 64U
+#define BOMB_FIELD_SIZE (1024U*1024U)
+
+static void test_binary_bomb(void) {
+        _cleanup_(journal_importer_cleanup) JournalImporter imp = JOURNAL_IMPORTER_INIT(-1);
+        _cleanup_close_ int fd = -1;
+        _cleanup_(journal_binary_encoder_freep) JournalBinaryEncoder *e = NULL;
+        _cleanup_free_ char *field = NULL, *compressed = NULL;
+        size_t n, n_compressed = 0, max_size = 0;
+        unsigned n_read = 0;
+        int r;
+
+        log_info("/* %s */", __func__);
+
+        imp.fd = fd = open("/dev/null", O_RDONLY|O_CLOEXEC);
+        assert_se(imp.fd >= 0);
+        imp.passive_fd = true;
+        assert_se(journal_importer_set_binary(&imp) >= 0);
+
+        assert_se(journal_binary_encoder_new(&e) >= 0);
+        assert_se(journal_binary_encoder_reset(e) >= 0);
+
+        field = malloc(BOMB_FIELD_SIZE + 1);
+        assert_se(field);
+        memset(field, 'x', BOMB_FIELD_SIZE);
+        memcpy(field, "BOMB=", STRLEN("BOMB="));
+        field[BOMB_FIELD_SIZE] = 0;
+
+        /* Many large entries that compress to almost nothing */
+        for (unsigned i = 0; i < N_BOMB_ENTRIES; i++) {
+                dual_timestamp ts = {
+                        .realtime = 1000 + i,
+                        .monotonic = 2000 + i,
+                };
+
+                assert_se(journal_binary_encoder_begin_entry(e, &ts, test_boot_id) >= 0);
+                assert_se(journal_binary_encoder_add_field(e, field, BOMB_FIELD_SIZE) >= 0);
+                assert_se(journal_binary_encoder_end_entry(e) >= 0);
+
+                do {
+                        assert_se(GREEDY_REALLOC(compressed, n_compressed + 4096));
+                        n = journal_binary_encoder_read(e, compressed + n_compressed, 4096);
+                        n_compressed += n;
+                } while (n > 0);
+        }
+
+        assert_se(journal_binary_encoder_end(e) >= 0);
+        do {
+                assert_se(GREEDY_REALLOC(compressed, n_compressed + 4096));
+                n = journal_binary_encoder_read(e, compressed + n_compressed, 4096);
+                n_compressed += n;
+        } while (n > 0);
+
+        log_info("%u entries of %u bytes compressed to %zu bytes",
+                 N_BOMB_ENTRIES, BOMB_FIELD_SIZE, n_compressed);
+        assert_se(n_compressed < N_BOMB_ENTRIES * BOMB_FIELD_SIZE / 100);
+
+        /* Push everything at once, nothing but the beginning of the first frame may be inflated */
+        assert_se(journal_importer_push_data(&imp, compressed, n_compressed) >= 0);
+        assert_se(MALLOC_SIZEOF_SAFE(imp.buf) < 2 * BOMB_FIELD_SIZE);
+
+        /* And while processing, not more than about one frame may be kept around */
+        while ((r = journal_importer_process_data(&imp)) != -EAGAIN) {
+                assert_se(r == 1);
+                assert_se(imp.iovw.count == 1);
+                assert_se(imp.iovw.iovec[0].iov_len == BOMB_FIELD_SIZE);
+                assert_se(imp.ts.realtime == 1000 + n_read);
+
+                max_size = MAX(max_size, MALLOC_SIZEOF_SAFE(imp.buf));
+                assert_se(max_size < 4 * BOMB_FIELD_SIZE);
+
+                journal_importer_drop_iovw(&imp);
+                n_read++;
+        }
+
+        log_info("Buffer size was at most %zu bytes", max_size);
+        assert_se(n_read == N_BOMB_ENTRIES);
+        assert_se(journal_importer_bytes_remaining(&imp) == 0);
+}
+
+static void test_binary_bad_input(void) {
+        _cleanup_(journal_importer_cleanup) JournalImporter imp = JOURNAL_IMPORTER_INIT(-1);
+        _cleanup_close_ int fd = -1;
+
+        log_info("/* %s */", __func__);
+
+        imp.fd = fd = open("/dev/null", O_RDONLY|O_CLOEXEC);
+        assert_se(imp.fd >= 0);
+        imp.passive_fd = true;
+        assert_se(journal_importer_set_binary(&imp) >= 0);
+
+        /* Not a zstd stream */
+        assert_se(journal_importer_push_data(&imp, "__CURSOR=x\n", STRLEN("__CURSOR=x\n")) == -EBADMSG);
+}
+#endif
+
 int main(int argc, char **argv) {
         test_setup_logging(LOG_DEBUG);
 
         test_basic_parsing();
         test_bad_input();
+#if HAVE_ZSTD
+        test_binary();
+        test_binary_bomb();
+        test_binary_bad_input();
+#endif
 
         return 0;
 }
@@ -0,0 +1,142 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+
+#include "alloc-util.h"
+#include "random-util.h"
+#include "sort-util.h"
+#include "tests.h"
+#include "timer-wheel.h"
+
+#define N_NODES 4096U
+
+static uint64_t random_key(uint64_t base) {
+        /* Mix keys close to each other with keys far apart, and a few extreme ones */
+        switch (random_u64_range(5)) {
+        case 0:
+                return base + random_u64_range(1024 * 64);
+        case 1:
+                return base + random_u64_range(UINT64_C(1) << 32);
+        case 2:
+                return random_u64();
+        case 3:
+                return random_u64_range(2) ? 0 : UINT64_MAX;
+        default:
+                return base;
+        }
+}
+
+static TimerWheelNode *find_min(TimerWheelNode *nodes, size_t n) {
+        TimerWheelNode *min = NULL;
+
+        for (size_t i = 0; i < n; i++)
+                if (nodes[i].position > 0 && (!min || nodes[i].key < min->key))
+                        min = nodes + i;
+
+        return min;
+}
+
+static int node_compare(TimerWheelNode * const *a, TimerWheelNode * const *b) {
+        return CMP((*a)->key, (*b)->key);
+}
+
+static void test_basic(void) {
+        _cleanup_(timer_wheel_freep) TimerWheel *w = NULL;
+        TimerWheelNode a = {}, b = {}, c = {};
+
+        log_info("/* %s */", __func__);
+
+        assert_se(w = timer_wheel_new());
+        assert_se(!timer_wheel_peek(w));
+
+        timer_wheel_put(w, &a, 5000000);
+        timer_wheel_put(w, &b, 70);
+        timer_wheel_put(w, &c, UINT64_MAX);
+        assert_se(timer_wheel_size(w) == 3);
+        assert_se(timer_wheel_peek(w) == &b);
+
+        timer_wheel_remove(w, &b);
+        timer_wheel_remove(w, &b);
+        assert_se(timer_wheel_size(w) == 2);
+        assert_se(b.position == 0);
+        assert_se(timer_wheel_peek(w) == &a);
+
+        /* Keys before the base, after it moved ahead */
+        timer_wheel_put(w, &b, 3);
+        assert_se(timer_wheel_peek(w) == &b);
+        timer_wheel_put(w, &b, 6000000);
+        assert_se(timer_wheel_peek(w) == &a);
+
+        timer_wheel_put(w, &a, UINT64_MAX);
+        assert_se(timer_wheel_peek(w) == &b);
+        timer_wheel_remove(w, &b);
+        assert_se(timer_wheel_peek(w) == &a || timer_wheel_peek(w) == &c);
+        assert_se(timer_wheel_peek(w)->key == UINT64_MAX);
+
+        timer_wheel_remove(w, &a);
+        timer_wheel_remove(w, &c);
+        assert_se(timer_wheel_size(w) == 0);
+        assert_se(!timer_wheel_peek(w));
+}
+
+static void test_random(void) {
+        _cleanup_(timer_wheel_freep) TimerWheel *w = NULL;
+        _cleanup_free_ TimerWheelNode *nodes = NULL;
+        _cleanup_free_ TimerWheelNode **sorted = NULL;
+        uint64_t base = random_u64_range(UINT64_C(1) << 52);
+        size_t n;
+
+        log_info("/* %s */", __func__);
+
+        assert_se(w = timer_wheel_new());
+        assert_se(nodes = new0(TimerWheelNode, N_NODES));
+        assert_se(sorted = new(TimerWheelNode*, N_NODES));
+
+        for (unsigned i = 0; i < 50 * N_NODES; i++) {
+                TimerWheelNode *x = nodes + random_u64_range(N_NODES), *min, *expected;
+
+                if (random_u64_range(4) == 0)
+                        timer_wheel_remove(w, x);
+                else
+                        timer_wheel_put(w, x, random_key(base));
+
+                /* Time passes, and expired nodes get removed */
+                if (random_u64_range(64) == 0) {
+                        base += random_u64_range(UINT64_C(1) << 24);
+
+                        while ((min = timer_wheel_peek(w)) && min->key <= base)
+                                timer_wheel_remove(w, min);
+                }
+
+                min = timer_wheel_peek(w);
+                expected = find_min(nodes, N_NODES);
+                assert_se(min ? expected && min->key == expected->key : !expected);
+        }
+
+        /* Popping everything returns the nodes in order */
+        n = 0;
+        for (unsigned i = 0; i < N_NODES; i++)
+                if (nodes[i].position > 0)
+                        sorted[n++] = nodes + i;
+        assert_se(timer_wheel_size(w) == n);
+
+        typesafe_qsort(sorted, n, node_compare);
+
+        for (size_t i = 0; i < n; i++) {
+                TimerWheelNode *min;
+
+                assert_se(min = timer_wheel_peek(w));
+                assert_se(min->key == sorted[i]->key);
+                timer_wheel_remove(w, min);
+        }
+
+        assert_se(timer_wheel_size(w) == 0);
+        assert_se(!timer_wheel_peek(w));
+}
+
+int main(int argc, char *argv[]) {
+        test_setup_logging(LOG_INFO);
+
+        test_basic();
+        test_random();
+
+        return 0;
+}
@@ -118,6 +118,32 @@ systemctl start silent-success
 journalctl --sync
 [[ -z `journalctl -b -q -u silent-success.service` ]]
 
+# Upload a journal to journal-remote over loopback, which uses the binary format if both sides support it
+if [[ -x /usr/lib/systemd/systemd-journal-remote && -x /usr/lib/systemd/systemd-journal-upload ]]; then
+    ID=$(journalctl --new-id128 | sed -n 2p)
+    seq 1000 | systemd-cat -t "$ID"
+    journalctl --sync
+
+    rm -rf /tmp/upload
+    mkdir /tmp/upload
+    journalctl -t "$ID" -o export | /usr/lib/systemd/systemd-journal-remote -o /tmp/upload/src.journal -
+
+    /usr/lib/systemd/systemd-journal-remote --listen-http=127.0.0.1:19532 --split-mode=none --output=/tmp/upload/dst.journal &
+    REMOTE=$!
+    for _ in {1..10}; do
+        /usr/lib/systemd/systemd-journal-upload --file=/tmp/upload/src.journal --url=http://127.0.0.1:19532 --follow=no && break
+        sleep 1
+    done
+    kill "$REMOTE"
+    wait "$REMOTE" || :
+
+    # Fields of an entry are not necessarily exported in the same order, hence compare sorted lines
+    cmp <(journalctl --file=/tmp/upload/src.journal -o export | grep -av "^__CURSOR=" | sort) \
+        <(journalctl --file=/tmp/upload/dst.journal -o export | grep -av "^__CURSOR=" | sort)
+    [[ $(journalctl --file=/tmp/upload/dst.journal -o cat | wc -l) -eq 1000 ]]
+    rm -rf /tmp/upload
+fi
+
 # Add new tests before here, the journald restarts below
 # may make tests flappy.
 